@@ -256,7 +256,7 @@ struct i386_general_purpose_registers {
 };
 typedef  struct i386_general_purpose_registers  i386_gp_regs;
 
-static uint8_t i386_current_privlevel(void) {
+static inline uint8_t i386_current_privlevel(void) {
     uint16_t cs_sel;
     asm("movw %%cs, %0 \n" : "=r"(cs_sel));
     return cs_sel & 0x0003;
@@ -279,6 +279,10 @@ int i386_sema_up(int semcounter, int release_callback(int, void *));
  ***/
 extern void i386_switch_pagedir(void *new_pagedir);
 
+static inline void i386_invlpg(void *vaddr) {
+    asm volatile ("invlpg (%0)  \n\t" :: "r"(vaddr) : "memory");
+}
+
 /***
   *     Task-related definitions
  ***/
@@ -323,7 +327,7 @@ uintptr_t cpu_stack(void);
 #define intrs_disable()        i386_intrs_disable()
 #define cpu_halt()             i386_halt()
 
-static void __noreturn cpu_hang(void) { for (;;) i386_halt(); }
+static inline void __noreturn cpu_hang(void) { for (;;) i386_halt(); }
 
 #define inb(port, value)       i386_inb(port, value)
 #define outb(port, value)      i386_outb(port, value)
@@ -21,6 +21,9 @@
 # define likely(x)   __builtin_expect(!!(x), 1)
 # define unlikely(x) __builtin_expect(!!(x), 0)
 # define FALLTHROUGH __attribute__((fallthrough))
+
+/* keeps the compiler from reordering memory accesses across it */
+# define barrier()   asm volatile ("" ::: "memory")
 #else
 # define __constf
 # define __pure
@@ -33,6 +36,7 @@
 # define likely(x)
 # define unlikely(x)
 # define FALLTHROUGH
+# define barrier()
 #endif
 
 #endif // __LANGEXTS__
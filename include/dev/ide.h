@@ -0,0 +1,19 @@
+#ifndef __COSEC_IDE_H__
+#define __COSEC_IDE_H__
+
+#include <fs/devices.h>
+
+/*
+ *  ATA disks on the two IDE channels, block devices BLK_IDE:N
+ *  where N is 0 for the primary master, 1 for the primary slave,
+ *  2 and 3 for the secondary channel.
+ */
+#define IDE_NCHANNELS   2
+#define IDE_NDRIVES     (2 * IDE_NCHANNELS)
+
+#define IDE_SECTOR      512
+
+struct devclass;
+struct devclass * get_ide_devclass(void);
+
+#endif // __COSEC_IDE_H__
@@ -31,6 +31,7 @@ static inline bool irq_enabled(uint irqnum) {
 void intrs_setup(void);
 
 void irq_set_handler(irqnum_t irq_num, intr_handler_f handler);
+intr_handler_f irq_get_handler(irqnum_t irq_num);
 
 void * intr_stack_ret_addr(void);
 
@@ -0,0 +1,29 @@
+#ifndef __COSEC_LOOP_H__
+#define __COSEC_LOOP_H__
+
+#include <fs/devices.h>
+
+/*
+ *  Loop devices, block devices BLK_LOOPBACK:N (/dev/loopN):
+ *  the blocks of a regular file, through its pages in the page cache
+ *  (or the pages of its filesystem, e.g. ramfs). A detached device
+ *  has no blocks.
+ */
+#define LOOP_MAX        8
+#define LOOP_BLOCK      512
+
+struct devclass;
+struct devclass * get_loop_devclass(void);
+
+/**
+ * \brief  backs the loop device `minor` with the file at `path`
+ */
+int loop_attach(mindev_t minor, const char *path, bool readonly);
+
+/**
+ * \brief  writes the blocks back and releases the file;
+ *         EBUSY if the device is mounted
+ */
+int loop_detach(mindev_t minor);
+
+#endif // __COSEC_LOOP_H__
@@ -2,6 +2,7 @@
 #define __PCI_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <attrs.h>
 
@@ -62,6 +63,29 @@ typedef struct pci_config {
     uint8_t   pci_max_latency;
 } pci_config_t;
 
+/* PCI configuration space offsets */
+#define PCI_CONF_COMMAND        0x04
+#define PCI_CONF_CLASS          0x08
+#define PCI_CONF_BAR0           0x10
+#define PCI_CONF_CAPS           0x34
+#define PCI_CONF_INTR           0x3c
+
+#define PCI_COMMAND_IO          0x0001
+#define PCI_COMMAND_MEMORY      0x0002
+#define PCI_COMMAND_MASTER      0x0004
+#define PCI_STATUS_CAPS         0x0010  /* in the upper half of PCI_CONF_COMMAND */
+
+#define PCI_CAP_VENDOR          0x09
+
+uint pci_config_read_dword(uint bus, uint slot, uint func, uint offset);
+void pci_config_write_dword(uint bus, uint slot, uint func, uint offset, uint value);
+
+/**
+ * \brief  finds the first function of class `clss`:`subclass`
+ * \return false if there is none
+ */
+bool pci_find_class(uint8_t clss, uint8_t subclass, uint *bus, uint *slot, uint *func);
+
 void pci_list(uint32_t bus);
 void pci_info(uint32_t bus, int slot);
 
@@ -0,0 +1,35 @@
+#ifndef __COSEC_RAMDISK_H__
+#define __COSEC_RAMDISK_H__
+
+#include <fs/devices.h>
+
+/*
+ *  RAM disks, block devices BLK_RAM:N (/dev/ramN).
+ *  A disk is an array of pages: new zeroed ones from ramdisk_create()
+ *  or the pages of memory that is already there, e.g. a boot module.
+ *  Blocks are handed out in place by .dev_get_roblock/.dev_get_rwblock.
+ */
+#define RAMDISK_MAX     8
+#define RAMDISK_BLOCK   512
+
+struct devclass;
+struct devclass * get_ramdisk_devclass(void);
+
+/**
+ * \brief  a RAM disk of `size` bytes (rounded up to a page) of new zeroed pages
+ * @param minor     set to the minor of the new device
+ */
+int ramdisk_create(size_t size, mindev_t *minor);
+
+/**
+ * \brief  a RAM disk over `size` bytes at `mem`, a page-aligned address
+ *         that stays valid for the kernel lifetime
+ */
+int ramdisk_attach(char *mem, size_t size, bool readonly, mindev_t *minor);
+
+/**
+ * \brief  boot modules named *.img become RAM disks
+ */
+void ramdisk_setup_modules(void);
+
+#endif // __COSEC_RAMDISK_H__
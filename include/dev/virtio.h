@@ -0,0 +1,224 @@
+#ifndef __COSEC_VIRTIO_H__
+#define __COSEC_VIRTIO_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "attrs.h"
+#include "arch/i386.h"
+#include "mem/paging.h"
+#include "dev/pci.h"
+
+/*
+ *  The virtio core.
+ *  A device is driven through the legacy PCI transport (registers in
+ *  an I/O port range) or the virtio 1.0 one (structures in memory
+ *  BARs found through vendor PCI capabilities); the modern one is
+ *  preferred. Drivers see the same calls for both:
+ *      virtio_pci_init(), virtio_negotiate(), virtio_queue_setup()...,
+ *      virtio_driver_ok(), virtio_irq_register()
+ *  and then fill virtqueues with virtioq_enqueue() and virtioq_kick(),
+ *  taking the used entries back with virtioq_pop_used(). With
+ *  VIRTIO_F_RING_EVENT_IDX negotiated, the device is notified and
+ *  interrupts only when the other side has caught up with the last
+ *  batch; every virtio device gets this from here.
+ */
+
+/* virtio registers offsets from `portbase` */
+#define VIO_DEV_FEATURE       0   /* 32, R  */
+#define VIO_DRV_FEATURE       4   /* 32, RW */
+#define VIO_Q_ADDR            8   /* 32, RW */
+#define VIO_Q_SIZE           12   /* 16, R  */
+#define VIO_Q_SELECT         14   /* 16, RW */
+#define VIO_Q_NOTIFY         16   /* 16, RW */
+#define VIO_DEV_STA          18   /*  8, RW */
+#define VIO_ISR_STA          19   /*  8, R  */
+#define VIO_DEVICE_SPECIFIC_OFFSET    20
+
+#define VIO_MSIX_CONF_VECT   20   /* 16, RW */
+#define VIO_MSIX_Q_VECT      23   /* 16, RW */
+#define VIO_DEVICE_SPECIFIC_OFFSET_WITH_MSIX  24
+
+/* may be written into VIO_MSIX_CONF_VECT */
+#define VIRTIO_MSI_NO_VECTOR  0xffff
+
+/* VIO_DEV_STA register */
+enum vio_dev_sta {
+    STA_ACK           = 0x01,
+    STA_DRV           = 0x02,
+    STA_DRV_OK        = 0x04,
+    STA_FEATURES_OK   = 0x08,   /* virtio 1.0 */
+    STA_FAILED        = 0x80,
+};
+
+/* VIO_ISR_STA register */
+enum vio_isr_sta {
+    VIRTIO_ISR_QUEUE  = 0x01,
+    VIRTIO_ISR_CONFIG = 0x02,
+};
+
+/* VIO_Dxx_FEATURE register */
+enum vio_features {
+    /* notify on empty avail_ring even if supppressed */
+    VIRTIO_F_NOTIFY_ON_EMPTY  = (1u << 24),
+    /* enable VIRTQ_DESC_F_INDIR */
+    VIRTIO_F_RING_INDIR_DESC  = (1u << 28),
+    /* enable `used_event` and `avail_event` */
+    VIRTIO_F_RING_EVENT_IDX   = (1u << 29),
+};
+/* feature bit 32: VIRTIO_F_VERSION_1, the modern transport sets it itself */
+
+enum vring_desc_flags {
+    VIRTQ_DESC_F_NEXT  = 1,
+    VIRTQ_DESC_F_WRITE = 2,
+    VIRTQ_DESC_F_INDIR = 4,
+};
+
+struct __packed vring_desc {
+    uint64_t addr;
+    uint32_t len;
+
+    uint16_t flags; /* see: enum vring_desc_flags */
+    uint16_t next;  /* if:  flags & VIRTQ_DESC_F_NEXT */
+};
+
+#define VIRTQ_AVAIL_F_NOINTR  1
+struct __packed vring_avail {
+    uint16_t flags; // 1: AVAIL_F_NO_INTERRUPT
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem {
+    uint32_t id;    // not uint16_t for padding
+    uint32_t len;
+};
+
+#define VIRTQ_USED_F_NO_NOTIFY  1
+struct __packed vring_used {
+    uint16_t flags; // 1: USED_F_NO_NOTIFY
+    uint16_t idx;   // can increase beyond q->size (?), wraps around.
+    struct vring_used_elem ring[];
+};
+
+/* the virtio 1.0 common configuration structure */
+struct __packed virtio_pci_common_cfg {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t  device_status;
+    uint8_t  config_generation;
+
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;
+    uint32_t queue_driver_hi;
+    uint32_t queue_device_lo;
+    uint32_t queue_device_hi;
+};
+
+struct virtio_device {
+    uint16_t    iobase;     /* legacy: the registers */
+    uint16_t    intr;
+    uint32_t    features;   /* offered, then negotiated */
+
+    bool        modern;
+    volatile struct virtio_pci_common_cfg *common;
+    volatile uint8_t *isr;
+    volatile uint8_t *devcfg;
+    volatile uint8_t *notify;
+    uint32_t    notify_mult;
+
+    void      (*on_intr)(struct virtio_device *dev, uint8_t isr);
+    void *      priv;       /* the driver's */
+    struct virtio_device *next_intr;
+};
+
+struct virtioq {
+    uint16_t size; // the number of descriptors
+    size_t npages; // the combined size of desc+avail+used in pages
+
+    uint16_t last_used; // must wrap around
+    uint16_t last_kick; // avail->idx when the device was notified last
+    uint16_t index;     // the queue number
+
+    struct vring_desc   *desc;
+    struct vring_avail  *avail;
+    struct vring_used   *used;
+
+    struct virtio_device *dev;
+    volatile uint16_t   *notify;    // modern: the notification register
+};
+
+/**
+ * \brief  finds the transport of the virtio PCI function at bus:slot,
+ *         resets the device and acknowledges it
+ * \return 0 or a negative error
+ */
+int virtio_pci_init(struct virtio_device *dev, pci_config_t *conf, uint bus, uint slot);
+
+/**
+ * \brief  accepts the `wanted` features of those offered, dev->features
+ *         are the negotiated ones then
+ */
+int virtio_negotiate(struct virtio_device *dev, uint32_t wanted);
+
+/**
+ * \brief  allocates the virtqueue `index` of up to `maxsize` (0: any)
+ *         descriptors and gives it to the device
+ */
+int virtio_queue_setup(struct virtio_device *dev, struct virtioq *q, uint16_t index, uint16_t maxsize);
+
+void virtio_driver_ok(struct virtio_device *dev);
+void virtio_reset(struct virtio_device *dev);
+
+/**
+ * \brief  calls dev->on_intr() from the interrupt of the device,
+ *         any number of devices may share an IRQ line
+ */
+void virtio_irq_register(struct virtio_device *dev);
+
+/* the device-specific configuration */
+uint8_t  virtio_config_read8(struct virtio_device *dev, uint off);
+uint16_t virtio_config_read16(struct virtio_device *dev, uint off);
+uint32_t virtio_config_read32(struct virtio_device *dev, uint off);
+
+/**
+ * \brief  notifies the device about the entries enqueued since
+ *         the last kick, unless it has asked not to
+ */
+void virtioq_kick(struct virtioq *q);
+
+/**
+ * \brief  takes the next used entry
+ * \return false if there is none
+ */
+bool virtioq_pop_used(struct virtioq *q, struct vring_used_elem *elem);
+
+/* makes descriptor `desc` an indirect one for `n` descriptors of `table` */
+static inline void virtioq_set_indirect(struct virtioq *q, uint16_t desc,
+                                        struct vring_desc *table, uint16_t n)
+{
+    q->desc[desc].addr = (uint64_t)(uint32_t)__pa(table);
+    q->desc[desc].len = n * sizeof(struct vring_desc);
+    q->desc[desc].flags = VIRTQ_DESC_F_INDIR;
+    q->desc[desc].next = 0;
+}
+
+static inline uint16_t virtioq_enqueue(struct virtioq *q, uint16_t desc) {
+    uint16_t idx = q->avail->idx;
+    q->avail->ring[idx % q->size] = desc;
+    barrier();  /* the device must see the entry before the index */
+    q->avail->idx += 1;
+    return idx;
+};
+
+#endif // __COSEC_VIRTIO_H__
@@ -0,0 +1,101 @@
+#ifndef __COSEC_FS_BIO_H__
+#define __COSEC_FS_BIO_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs/devices.h"
+#include "tasks.h"
+
+/*
+ *  Block I/O requests.
+ *  A bio is a run of contiguous device blocks and the memory segments
+ *  they are read into or written from, in order. A driver gets the
+ *  whole run at once through .dev_submit and may turn it into a single
+ *  command; it calls bio_endio() when the transfer is over, maybe from
+ *  an interrupt. Devices without .dev_submit are served block by block
+ *  through .dev_get_roblock/.dev_get_rwblock.
+ */
+
+enum bio_op {
+    BIO_READ    = 0,
+    BIO_WRITE   = 1,
+};
+
+struct bio_vec {
+    char *      bv_data;        /* a kernel address */
+    size_t      bv_len;         /* a multiple of the block size */
+};
+
+struct bio {
+    device *    bi_dev;
+    enum bio_op bi_op;
+    off_t       bi_block;       /* the first block */
+    struct bio_vec *bi_io_vec;
+    count_t     bi_vcnt;
+
+    int         bi_error;       /* valid when bi_done */
+    volatile bool bi_done;
+
+    void      (*bi_end_io)(struct bio *bio);    /* optional */
+    void *      bi_private;     /* for bi_end_io */
+    wait_queue_t bi_wait;       /* bio_submit_wait() sleeps here */
+
+    struct bio *bi_next;        /* in a struct request */
+};
+
+/*
+ *  A batch of bios submitted together and waited for once,
+ *  so that a request queue may merge them.
+ */
+struct bio_batch {
+    volatile count_t bb_pending;
+    int         bb_error;       /* the first error */
+    wait_queue_t bb_wait;
+};
+
+struct bio_stats {
+    count_t submitted;          /* requests */
+    count_t blocks;             /* blocks transferred by them */
+    count_t emulated;           /* requests served block by block */
+};
+
+void bio_init(struct bio *bio, device *dev, enum bio_op op, off_t block,
+              struct bio_vec *vecs, count_t vcnt);
+
+/* the length of the transfer in bytes */
+size_t bio_size(const struct bio *bio);
+
+/**
+ * \brief  hands `bio` to its device,
+ *         an error here means that bio_endio() will not be called
+ */
+int bio_submit(struct bio *bio);
+
+/**
+ * \brief  submits `bio` and sleeps until it is complete
+ */
+int bio_submit_wait(struct bio *bio);
+
+/**
+ * \brief  completes `bio`, for drivers
+ */
+void bio_endio(struct bio *bio, int error);
+
+void bio_get_stats(struct bio_stats *stats);
+
+void bio_batch_init(struct bio_batch *batch);
+
+/**
+ * \brief  submits `bio` as a part of `batch`, takes over its bi_end_io
+ */
+int bio_batch_submit(struct bio_batch *batch, struct bio *bio);
+
+/**
+ * \brief  sleeps until all bios of `batch` are complete
+ * \return the first error of them
+ */
+int bio_batch_wait(struct bio_batch *batch);
+
+#endif // __COSEC_FS_BIO_H__
@@ -0,0 +1,101 @@
+#ifndef __COSEC_FS_BLKQUEUE_H__
+#define __COSEC_FS_BLKQUEUE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs/devices.h"
+#include "fs/bio.h"
+
+/*
+ *  Block request queues.
+ *  A driver that sets `dev_queue` gets its bios merged into requests:
+ *  a bio that continues or precedes a queued request of the same
+ *  direction joins it, up to q_max_blocks and q_max_segments. Requests
+ *  are dispatched to q_request_fn, up to q_depth of them at a time,
+ *  by a deadline elevator: in ascending
+ *  block order from the last dispatched one (wrapping around), unless
+ *  the oldest request of a direction is past its deadline; reads are
+ *  preferred, but writes are not passed over more than BLKQ_WRITES_STARVED
+ *  times in a row. While a queue is plugged, submissions only queue bios,
+ *  so that a burst of them can merge before the first one is dispatched.
+ */
+
+#define BLKQ_MAX_BLOCKS         256     /* the default merging limits */
+#define BLKQ_MAX_SEGMENTS       128
+#define BLKQ_READ_EXPIRE_MS     500
+#define BLKQ_WRITE_EXPIRE_MS    5000
+#define BLKQ_WRITES_STARVED     2
+
+struct request_queue;
+
+struct request {
+    enum bio_op rq_op;
+    off_t       rq_block;       /* the first block */
+    count_t     rq_nblocks;
+    count_t     rq_nsegs;       /* bio_vecs in all bios */
+    struct bio *rq_bio;         /* in block order, linked through bi_next */
+    struct bio *rq_biotail;
+    ulong       rq_deadline;    /* a timer tick */
+    struct request *rq_next;    /* by block, in the list of its direction */
+    struct request *rq_fifo;    /* by arrival, in the list of its direction */
+};
+
+struct blkq_stats {
+    count_t dispatched;         /* requests given to the driver */
+    count_t merged;             /* bios that joined a request */
+    count_t expired;            /* dispatched because of their deadline */
+};
+
+struct request_queue {
+    device *    q_dev;
+
+    /**
+     * \brief  starts the transfer of `rq`, the driver calls
+     *         blk_end_request() when it is over, maybe from an interrupt.
+     *         An error means that the request has not been started.
+     *         It is called while fewer than q_depth requests are in flight.
+     */
+    int       (*q_request_fn)(struct request_queue *q, struct request *rq);
+    void *      q_data;         /* the driver's */
+
+    count_t     q_max_blocks;
+    count_t     q_max_segments;
+    count_t     q_depth;        /* requests the driver takes at once, 1 by default */
+    struct request *q_sorted[2];    /* by bio_op */
+    struct request *q_fifo[2];
+    count_t     q_inflight;     /* dispatched and not ended yet */
+    off_t       q_next_block;   /* where the last dispatched request ended */
+    count_t     q_starved;      /* read dispatches while writes were waiting */
+    count_t     q_plugged;
+    bool        q_running;
+    struct blkq_stats q_stats;
+};
+
+void blk_queue_init(struct request_queue *q, device *dev,
+                    int (*request_fn)(struct request_queue *, struct request *));
+
+/**
+ * \brief  queues `bio`, called by bio_submit() for devices with a queue
+ */
+int blk_queue_bio(struct request_queue *q, struct bio *bio);
+
+/**
+ * \brief  dispatches requests while the driver has room, plugged or not
+ */
+void blk_queue_run(struct request_queue *q);
+
+/**
+ * \brief  for drivers: completes all bios of `rq` and frees it
+ */
+void blk_end_request(struct request_queue *q, struct request *rq, int error);
+
+/**
+ * \brief  holds back dispatching of submitted bios until the last unplug;
+ *         no-ops for devices without a queue
+ */
+void bdev_plug(device *dev);
+void bdev_unplug(device *dev);
+
+#endif // __COSEC_FS_BLKQUEUE_H__
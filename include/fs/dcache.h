@@ -0,0 +1,63 @@
+#ifndef __COSEC_FS_DCACHE_H__
+#define __COSEC_FS_DCACHE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs/vfs.h"
+
+#define DCACHE_BUCKETS  256     /* a power of 2 */
+#define DCACHE_MAX      1024    /* least recently used leaves are evicted above this */
+
+/*
+ *  The directory entry cache.
+ *  A dentry is keyed by its parent dentry and the hash of its name, so
+ *  resolving a path is a hash probe per component. A dentry may be
+ *  negative (d_ino == 0, the name does not exist) or it may cross a
+ *  mount point (d_sb is the mounted filesystem, d_ino is its root).
+ *  A dentry with cached children is never evicted, so a parent pointer
+ *  used as a key always stays valid.
+ */
+struct dentry {
+    struct dentry * d_parent;
+    struct dentry * d_hnext;        /* the hash bucket chain */
+    struct dentry * d_lru_prev;     /* the most recently used first */
+    struct dentry * d_lru_next;
+    count_t         d_nchildren;    /* cached dentries with this parent */
+
+    mountnode *     d_sb;
+    inode_t         d_ino;          /* 0 for a negative dentry */
+
+    uint32_t        d_hash;
+    size_t          d_namelen;
+    char            d_name[0];      /* not null-terminated */
+};
+
+struct dcache_stats {
+    count_t hits;
+    count_t misses;
+    count_t evictions;
+    count_t entries;
+};
+
+/**
+ * \brief  resolves an absolute `path`, filling the cache on misses
+ * @param mntnode   if not NULL, set to the filesystem the inode is on
+ * @param ino       if not NULL, set to the inode index
+ */
+int dcache_lookup(const char *path, mountnode **mntnode, inode_t *ino);
+
+/**
+ * \brief  forgets the cached dentry for `path`, if any;
+ *         must be called after `path` has been created or removed
+ */
+void dcache_invalidate(const char *path);
+
+/**
+ * \brief  forgets all cached dentries, e.g. after a mount
+ */
+void dcache_flush(void);
+
+void dcache_get_stats(struct dcache_stats *stats);
+
+#endif // __COSEC_FS_DCACHE_H__
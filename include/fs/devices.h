@@ -33,6 +33,7 @@ enum char_device_family {
 enum char_virtual_devices {
     CHR0_UNSPECIFIED = 0,
     CHR0_SYSFS       = 1,
+    CHR0_PROCFS      = 2,
 };
 
 /* chrdev maj=1 */
@@ -57,6 +58,7 @@ enum block_device_family {
     BLK_LOOPBACK    = 7,
     BLK_SCSI_DISK   = 8,
     BLK_RAID        = 9,
+    BLK_VIRTIO      = 10,   /* not the Linux one, its majors are dynamic */
     BLK_SCSI_CDROM  = 11,
 };
 
@@ -66,6 +68,11 @@ typedef index_t     majdev_t, mindev_t;
 typedef struct devclass  devclass;
 typedef struct device    device;
 
+struct page_mapping;
+struct readahead;
+struct bio;
+struct request_queue;
+
 struct devclass {
     devicetype_e  dev_type;
     majdev_t      dev_maj;
@@ -99,6 +106,14 @@ struct device_operations {
     /** \brief returns (block) device size in blocks */
     off_t       (*dev_size_in_blocks)(device *dev);
 
+    /**
+     * \brief  starts the transfer of a run of blocks, see fs/bio.h;
+     *         the device calls bio_endio() when it is over.
+     *         If it's NULL, the blocks are copied one by one
+     *         through `dev_get_roblock()`/`dev_get_rwblock()`.
+     */
+    int         (*dev_submit)(device *dev, struct bio *bio);
+
     /* mostly character devices operations */
     /**
      * \brief   non-blocking read from (mostly character) devices
@@ -137,18 +152,33 @@ struct device {
     void *          dev_data;   // 
 
     struct device_operations  *dev_ops;  // yep, devopses should care about devices
+
+    struct page_mapping *dev_pages;     // block devices: cached pages, see fs/pagecache.h
+    struct request_queue *dev_queue;    // block devices: optional, see fs/blkqueue.h
 };
 
 /**
- * \brief  blocking read from a block device at `pos`
+ * \brief  blocking read from a block device at `pos` through the page cache
+ * @param ra        read-ahead state of the reader, may be NULL
  */
-int bdev_blocking_read(device *dev, off_t pos, char *buf, size_t buflen, size_t *written);
+int bdev_blocking_read(device *dev, struct readahead *ra, off_t pos,
+                       char *buf, size_t buflen, size_t *written);
+
+/**
+ * \brief  writes to the page cache of a block device,
+ *         dirty pages go to the device on reclaim or sync
+ */
+int bdev_blocking_write(device *dev, off_t pos, const char *buf, size_t buflen, size_t *written);
 
 /**
  * \brief  get device structure
  */
 device * device_by_devno(devicetype_e  ty, dev_t devno);
 
+/**
+ * \brief  makes a device family known, for drivers found after dev_setup()
+ */
+void devclass_register(devclass *dclss);
 
 void dev_setup(void);
 
@@ -0,0 +1,22 @@
+#ifndef __COSEC_EXT2_H__
+#define __COSEC_EXT2_H__
+
+#include <fs/vfs.h>
+
+/* ASCII "EXT2" */
+#define EXT2_ID  0x32545845
+
+/*
+ *  The second extended filesystem on a block device.
+ *  Metadata (the superblock, group descriptors, bitmaps, inodes,
+ *  indirect and directory blocks) is read and written through the
+ *  page cache of the device; file data goes through the page cache
+ *  of the inode and reaches the device as one bio per run of blocks.
+ *  A new inode is placed in the group of its directory, a new
+ *  directory in a group with more free inodes than average;
+ *  data blocks are allocated at writeback next to the previous
+ *  block of the file or near the inode.
+ */
+fsdriver * ext2_fs_driver(void);
+
+#endif //__COSEC_EXT2_H__
@@ -0,0 +1,24 @@
+#ifndef __COSEC_FAT_H__
+#define __COSEC_FAT_H__
+
+#include <fs/vfs.h>
+
+/* ASCII "FAT" */
+#define FAT_ID  0x00544146
+
+/*
+ *  FAT12/16/32 on a block device, with long (VFAT) names.
+ *  The FAT itself is not kept in memory: a bitmap of used clusters
+ *  is built at mount and free clusters are searched in it next-fit;
+ *  the cluster chain of a file is read once into a map of extents
+ *  (runs of consecutive clusters), so a page of data is one bio per run.
+ *  FAT entries, directories and the FSInfo sector go through the page
+ *  cache of the device and are written to every copy of the FAT.
+ *  Inodes are in-core, numbered by the position of their directory
+ *  entries on the device; the root is FAT_ROOT_INO.
+ */
+#define FAT_ROOT_INO    1
+
+fsdriver * fat_fs_driver(void);
+
+#endif //__COSEC_FAT_H__
@@ -0,0 +1,79 @@
+#ifndef __COSEC_FS_FILE_H__
+#define __COSEC_FS_FILE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs/vfs.h"
+#include "fs/devices.h"
+#include "fs/pagecache.h"
+
+typedef struct file  file_t;
+typedef struct file_operations  file_ops;
+
+/*
+ *  An open file: shared by all file descriptors dup()'ed from it
+ */
+struct file {
+    count_t     f_refs;         /* how many file descriptors hold it */
+    uint        f_flags;        /* O_* flags it was opened with */
+    off_t       f_pos;          /* -1 if not seekable */
+
+    mountnode  *f_sb;
+    inode_t     f_ino;
+    struct inode *f_inode;      /* pinned by vfs_iget() while the file is open */
+    mode_t      f_mode;         /* inode type and permissions at open() */
+
+    device     *f_dev;          /* for S_IFCHR/S_IFBLK */
+    void       *f_data;         /* type-specific data */
+    struct readahead f_ra;      /* for S_IFREG in the page cache */
+
+    const file_ops *f_ops;      /* chosen by f_mode at open() */
+};
+
+struct file_operations {
+    /**
+     * \brief  reads/writes at f->f_pos, does not move it
+     * @param done      the number of actually copied bytes;
+     */
+    int (*read)(file_t *f, char *buf, size_t buflen, size_t *done);
+    int (*write)(file_t *f, const char *buf, size_t buflen, size_t *done);
+
+    /**
+     * \brief  gives the data at f->f_pos to be read in place, for splicing;
+     *         may block like .read, `*len` = 0 means EOF
+     * @param len       limits the data, set to what is available at once
+     * @param cookie    to be passed to .unmap_data()
+     */
+    int (*map_data)(file_t *f, const char **data, size_t *len, void **cookie);
+
+    /**
+     * \brief  releases the mapped data, `consumed` bytes of it were used
+     */
+    void (*unmap_data)(file_t *f, void *cookie, size_t consumed);
+
+    /**
+     * \brief  called when the last reference is dropped
+     */
+    void (*release)(file_t *f);
+};
+
+/**
+ * \brief  creates a file object with one reference for inode `ino`
+ */
+int file_open(mountnode *sb, inode_t ino, int flags, file_t **result);
+
+file_t * file_get(file_t *f);
+void file_put(file_t *f);
+
+int file_read(file_t *f, char *buf, size_t buflen, size_t *done);
+int file_write(file_t *f, const char *buf, size_t buflen, size_t *done);
+
+/**
+ * \brief  moves up to `count` bytes from `in` to `out` at their positions
+ *         and advances them; the data are copied once, from the source
+ *         page or ring straight into `out`, without a bounce buffer
+ */
+int file_splice(file_t *in, file_t *out, size_t count, size_t *done);
+
+#endif // __COSEC_FS_FILE_H__
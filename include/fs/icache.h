@@ -0,0 +1,45 @@
+#ifndef __COSEC_FS_ICACHE_H__
+#define __COSEC_FS_ICACHE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs/vfs.h"
+
+#define ICACHE_BUCKETS  64      /* a power of 2 */
+#define ICACHE_LRU_MAX  32      /* unreferenced inodes kept per superblock */
+
+/*
+ *  The in-core inode cache.
+ *  vfs_iget() returns a pinned inode that stays valid until vfs_iput().
+ *  If a filesystem keeps inodes in memory (.inode_incore), that is its
+ *  own inode; otherwise it is a cached copy that is written back by
+ *  .inode_set() when it is dirty and evicted or synced.
+ *  Unreferenced copies stay on a per-superblock LRU list.
+ */
+
+/**
+ * \brief  pins the inode `ino` of `sb`
+ * @param result    set to the in-core inode
+ */
+int vfs_iget(mountnode *sb, inode_t ino, struct inode **result);
+
+/**
+ * \brief  drops a reference; an inode without links is freed
+ *         when its last reference is dropped
+ */
+void vfs_iput(struct inode *idata);
+
+/**
+ * \brief  an inode changed: it must be written back before eviction
+ */
+static inline void vfs_inode_dirty(struct inode *idata) {
+    idata->i_state.dirty = true;
+}
+
+/**
+ * \brief  writes all dirty cached inodes of `sb` and their pages back
+ */
+int vfs_sync_inodes(mountnode *sb);
+
+#endif // __COSEC_FS_ICACHE_H__
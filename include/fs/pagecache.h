@@ -0,0 +1,152 @@
+#ifndef __COSEC_FS_PAGECACHE_H__
+#define __COSEC_FS_PAGECACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PAGECACHE_MAX_PAGES     256     /* unpinned page frames the cache may take */
+#define PAGECACHE_DIRTY_MAX     (PAGECACHE_MAX_PAGES / 2)   /* then writers sync */
+
+#define READAHEAD_MIN   4       /* the first read-ahead window, pages */
+#define READAHEAD_MAX   32
+
+#define WRITEBACK_BATCH 32      /* dirty pages given to one .writepages */
+
+#define RADIX_SHIFT     6
+#define RADIX_SLOTS     (1 << RADIX_SHIFT)
+
+typedef struct page_mapping     page_mapping;
+typedef struct cached_page      cached_page;
+
+/*
+ *  The page cache.
+ *  Pages of an inode or a block device are kept in its `page_mapping`,
+ *  a radix tree indexed by page number. All cached pages are on one
+ *  CLOCK ring: a page that was used since the hand passed it gets a
+ *  second chance, a dirty victim is written back before its frame
+ *  is reused. Frames are never returned to pmem, they are recycled.
+ *  Pinned pages (e.g. mapped into memory) can't be reclaimed, so their
+ *  frames are taken beyond PAGECACHE_MAX_PAGES.
+ */
+
+struct page_mapping_ops {
+    /**
+     * \brief  fills `page` (PAGE_BYTES) with the data of page `index`;
+     *         holes and the tail after the end must be zeroed
+     */
+    int (*readpage)(page_mapping *m, index_t index, char *page);
+
+    /**
+     * \brief  optional, fills the run of pages [index, index + npages)
+     *         at once, e.g. with one device request; used by read-ahead
+     */
+    int (*readpages)(page_mapping *m, index_t index, char **pages, count_t npages);
+
+    /**
+     * \brief  stores the dirty page `index` back
+     */
+    int (*writepage)(page_mapping *m, index_t index, const char *page);
+
+    /**
+     * \brief  optional, stores the pinned dirty `pages` (in no particular
+     *         order) back at once, so that their writes may be merged;
+     *         used by pagecache_sync()
+     */
+    int (*writepages)(page_mapping *m, cached_page **pages, count_t npages);
+};
+
+struct radix_node {
+    void *      rn_slots[RADIX_SLOTS];
+    count_t     rn_count;       /* non-NULL slots */
+};
+
+struct page_mapping {
+    void *      pm_host;        /* the inode or the device */
+    const struct page_mapping_ops *pm_ops;
+
+    struct radix_node *pm_root;
+    uint        pm_height;      /* 0 if there is no pm_root */
+    count_t     pm_npages;
+    count_t     pm_ndirty;
+};
+
+struct cached_page {
+    page_mapping *cp_mapping;
+    index_t     cp_index;
+    char *      cp_data;        /* a PAGE_BYTES frame */
+    count_t     cp_refs;        /* pinned pages are never reclaimed */
+    struct {
+        bool dirty :1 ;
+        bool referenced :1 ;    /* used since the CLOCK hand passed */
+    } cp_flags;
+    cached_page *cp_prev;       /* the CLOCK ring */
+    cached_page *cp_next;
+};
+
+/*
+ *  Read-ahead state of an open file.
+ *  A sequential reader gets the window [ra_start, ra_start + ra_size)
+ *  prefetched; when it reaches the second half of the window, the next
+ *  one, twice as large, is prefetched. A random read resets it.
+ */
+struct readahead {
+    index_t     ra_start;
+    count_t     ra_size;        /* 0 if the access is not sequential */
+    index_t     ra_next;        /* the page a sequential read would start at */
+};
+
+struct pagecache_stats {
+    count_t hits;
+    count_t misses;
+    count_t readahead;          /* pages prefetched */
+    count_t writebacks;
+    count_t reclaims;
+    count_t pages;
+    count_t dirty;
+    count_t pinned;
+};
+
+void pagecache_init_mapping(page_mapping *m, void *host, const struct page_mapping_ops *ops);
+
+/**
+ * \brief  pins the page `index` of `m`
+ * @param fill      if false, a missing page is zeroed instead of read,
+ *                  e.g. when it is going to be overwritten completely
+ */
+int pagecache_get(page_mapping *m, index_t index, bool fill, cached_page **result);
+void pagecache_put(cached_page *pg);
+
+/**
+ * \brief  the cached page `index` of `m` or NULL, without pinning it
+ */
+cached_page * pagecache_find(page_mapping *m, index_t index);
+void pagecache_set_dirty(cached_page *pg);
+
+/**
+ * \brief  buffered I/O, `pos + buflen` must be already limited by the caller
+ */
+int pagecache_read(page_mapping *m, off_t pos, char *buf, size_t buflen, size_t *done);
+int pagecache_write(page_mapping *m, off_t pos, const char *buf, size_t buflen, size_t *done);
+
+/**
+ * \brief  updates `ra` with a read of `buflen` bytes at `pos` and
+ *         prefetches its window, not beyond page `maxindex`
+ */
+void pagecache_readahead(page_mapping *m, struct readahead *ra,
+                         off_t pos, size_t buflen, index_t maxindex);
+
+/**
+ * \brief  writes dirty pages of `m` back
+ */
+int pagecache_sync(page_mapping *m);
+int pagecache_sync_all(void);
+
+/**
+ * \brief  drops pages from `start` on without writing them back
+ */
+void pagecache_truncate(page_mapping *m, index_t start);
+
+void pagecache_get_stats(struct pagecache_stats *stats);
+
+#endif // __COSEC_FS_PAGECACHE_H__
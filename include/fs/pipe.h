@@ -0,0 +1,76 @@
+#ifndef __COSEC_FS_PIPE_H__
+#define __COSEC_FS_PIPE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "conf.h"
+#include "tasks.h"
+#include "fs/vfs.h"
+#include "fs/file.h"
+
+#define PIPE_BUF_SIZE   PAGE_BYTES
+
+typedef struct pipe  pipe_t;
+
+/*
+ *  A single-producer/single-consumer ring of PIPE_BUF_SIZE bytes.
+ *  p_head is moved only by the reader, p_tail only by the writer;
+ *  both are free-running, so (p_tail - p_head) is the number of bytes
+ *  in the ring. The fast path takes no locks, the slow path sleeps on
+ *  p_rwait/p_wwait.
+ *  Tasks sharing an end (after fork(), dup() or opening a FIFO twice)
+ *  take turns with p_rlocked/p_wlocked, so a write is never interleaved
+ *  with another one. A lone reader or writer never sleeps on these.
+ */
+struct pipe {
+    volatile uint32_t p_head;       /* total bytes read */
+    volatile uint32_t p_tail;       /* total bytes written */
+    char *      p_buf;
+
+    count_t     p_readers;          /* open files reading from the pipe */
+    count_t     p_writers;          /* open files writing to the pipe */
+
+    wait_queue_t p_rwait;           /* readers waiting for data */
+    wait_queue_t p_wwait;           /* writers waiting for space */
+
+    bool        p_rlocked;          /* a task is reading */
+    bool        p_wlocked;          /* a task is writing */
+    wait_queue_t p_rlockq;          /* other readers waiting for it */
+    wait_queue_t p_wlockq;          /* other writers waiting for it */
+
+    /* named FIFOs only */
+    mountnode * p_sb;
+    inode_t     p_ino;
+    pipe_t *    p_next;
+};
+
+pipe_t * pipe_new(void);
+void pipe_free(pipe_t *p);
+
+/**
+ * \brief  blocks until some data is available or there are no writers
+ * @param done      the number of bytes read, 0 means EOF
+ */
+int pipe_read(pipe_t *p, char *buf, size_t buflen, size_t *done);
+
+/**
+ * \brief  blocks until all of `buf` is written
+ * @return EPIPE if there are no readers
+ */
+int pipe_write(pipe_t *p, const char *buf, size_t buflen, size_t *done);
+
+/**
+ * \brief  attaches a file to a named FIFO `(f->f_sb, f->f_ino)`;
+ *         blocks until the other end is opened unless O_RDWR or O_NONBLOCK
+ */
+int pipe_fifo_open(file_t *f);
+
+/**
+ * \brief  creates an anonymous pipe and its two ends
+ */
+int pipe_open_files(file_t **rf, file_t **wf);
+
+extern const file_ops pipe_file_ops;
+
+#endif // __COSEC_FS_PIPE_H__
@@ -0,0 +1,18 @@
+#ifndef __COSEC_PROCFS_H__
+#define __COSEC_PROCFS_H__
+
+#include <fs/vfs.h>
+
+/* ASCII "PROC" */
+#define PROCFS_ID  0x434f5250
+
+/*
+ *  A synthetic filesystem with per-process accounting:
+ *      /proc/uptime            ticks since boot and the timer frequency
+ *      /proc/<pid>/stat        CPU time, switches, faults, I/O, memory
+ *      /proc/<pid>/syscalls    "<number> <count>" for every used syscall
+ *  File contents are generated on each read.
+ */
+fsdriver * procfs_fs_driver(void);
+
+#endif //__COSEC_PROCFS_H__
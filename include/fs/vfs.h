@@ -2,7 +2,9 @@
 #define __VFS_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/dirent.h>
 #include <sys/types.h>
@@ -18,6 +20,7 @@ typedef struct superblock   mountnode;
 typedef struct inode        inode;
 typedef struct filesystem_driver        fsdriver;
 typedef struct filesystem_operations    fs_ops;
+typedef struct mount_opts_t             mount_opts_t;
 
 
 struct superblock {
@@ -28,6 +31,7 @@ struct superblock {
     struct {
         bool dirty :1 ;
         bool ro :1 ;
+        bool nodcache :1 ;      /* names and inodes change by themselves */
     } sb_flags;
 
     inode_t     sb_root_ino;      /* index of the root inode */
@@ -38,6 +42,9 @@ struct superblock {
     mountnode  *sb_brother;       /* the next superblock in the list of childs of parent */
     mountnode  *sb_parent;
     mountnode  *sb_children;      /* list of this superblock child blocks */
+
+    struct inode *sb_inode_lru;   /* unreferenced cached inodes, most recent first */
+    count_t     sb_inode_lru_len;
 };
 
 
@@ -48,7 +55,7 @@ struct inode {
     index_t i_no;               /* inode index */
     mode_t  i_mode;             /* inode type + unix permissions */
     count_t i_nlinks;           /* how many dentries reference this inode */
-    count_t i_nfds;             /* how many filedescriptors hold this inode */
+    count_t i_nfds;             /* how many open files hold this inode */
     off_t   i_size;             /* data size if any */
     void   *i_data;             /* fs- and type-specific info */
 
@@ -69,8 +76,25 @@ struct inode {
             char short_symlink[ MAX_SHORT_SYMLINK_SIZE ];
         } symlink;
     } as;
+
+    /* in-core state, owned by the inode cache, see fs/icache.h */
+    mountnode *i_sb;
+    count_t i_refs;             /* how many vfs_iget() callers hold this inode */
+    struct {
+        bool dirty :1 ;         /* a cached copy to be written back by .inode_set() */
+        bool incore :1 ;        /* the filesystem's own inode, not a cached copy */
+    } i_state;
+    struct page_mapping *i_pages;   /* cached data if the fs has .readpage */
+    struct inode *i_hnext;      /* the inode cache hash chain */
+    struct inode *i_lru_prev;   /* sb_inode_lru links */
+    struct inode *i_lru_next;
 };
 
+/* copies what a filesystem stores, not the in-core state */
+static inline void inode_copy(struct inode *dst, const struct inode *src) {
+    memcpy(dst, src, offsetof(struct inode, i_sb));
+}
+
 static inline dev_t inode_devno(struct inode *idata) {
     return gnu_dev_makedev(idata->as.dev.maj, idata->as.dev.min);
 }
@@ -88,12 +112,34 @@ struct filesystem_driver {
 
 
 
+struct mount_opts_t {
+    uint fs_id;
+    bool readonly:1;
+    bool noindex:1;             /* ext2: no directory indexes */
+    size_t size;                /* data limit in bytes, 0 if none */
+    count_t nr_inodes;          /* inodes limit, 0 if none */
+};
+
+/* what a mounted filesystem takes, limits are 0 if there are none */
+struct fs_usage {
+    count_t fu_blocks;          /* sb_blksz blocks */
+    count_t fu_max_blocks;
+    count_t fu_inodes;
+    count_t fu_max_inodes;
+};
+
 struct filesystem_operations {
     /**
      * \brief  probes the superblock on sb->sb_dev,
      * @param mountnode     the superblock to initialize
+     * @param opts          mount options, e.g. limits
+     */
+    int (*read_superblock)(mountnode *sb, const mount_opts_t *opts);
+
+    /**
+     * \brief  reports how much of its limits the filesystem uses
      */
-    int (*read_superblock)(mountnode *sb);
+    int (*get_usage)(mountnode *sb, struct fs_usage *usage);
 
     /**
      * \brief  creates a directory at local `path`
@@ -127,6 +173,13 @@ struct filesystem_operations {
      */
     int (*inode_set)(mountnode *sb, inode_t ino, struct inode *idata);
 
+    /**
+     * \brief  returns the inode itself if the filesystem keeps its inodes in memory;
+     *         if NULL, the inode cache keeps copies made by .inode_get()
+     *         and writes the dirty ones back by .inode_set()
+     */
+    struct inode * (*inode_incore)(mountnode *sb, inode_t ino);
+
     /**
      * \brief  reads/writes data from an inode blocks
      * @param pos       position (in bytes) to read from/write to
@@ -140,6 +193,24 @@ struct filesystem_operations {
     int (*write_inode)(mountnode *sb, inode_t ino, off_t pos,
                        const char *buf, size_t buflen, size_t *written);
 
+    /**
+     * \brief  reads/writes the page `index` of a regular file;
+     *         if .readpage is set, file data go through the page cache
+     *         instead of .read_inode/.write_inode
+     * @param page      PAGE_BYTES; a hole or the tail after i_size is zeroed
+     */
+    int (*readpage)(mountnode *sb, struct inode *idata, index_t index, char *page);
+    int (*writepage)(mountnode *sb, struct inode *idata, index_t index, const char *page);
+
+    /**
+     * \brief  gives the page `index` of a regular file that the filesystem
+     *         keeps in memory itself, to be used in place
+     * @param create    allocate a hole, e.g. to be written through mmap()
+     * @param page      set to NULL for a hole that is not created
+     */
+    int (*inode_page)(mountnode *sb, struct inode *idata, index_t index,
+                      bool create, char **page);
+
     /**
      * \brief  truncates inode `ino` to the `length`
      */
@@ -179,13 +250,6 @@ struct filesystem_operations {
 };
 
 
-typedef struct mount_opts_t  mount_opts_t;
-
-struct mount_opts_t {
-    uint fs_id;
-    bool readonly:1;
-};
-
 extern struct inode theInvalidInode;
 
 void vfs_register_filesystem(fsdriver *fs);
@@ -208,6 +272,38 @@ int vfs_inode_set(mountnode *sb, inode_t ino, struct inode *idata);
 
 int vfs_inode_stat(mountnode *sb, inode_t ino, struct stat *stat);
 
+struct readahead;
+
+/**
+ * \brief  buffered I/O on a pinned regular file of a filesystem with .readpage
+ * @param ra        read-ahead state of the open file or NULL
+ */
+int vfs_pagecache_read(struct inode *idata, struct readahead *ra, off_t pos,
+                       char *buf, size_t buflen, size_t *written);
+int vfs_pagecache_write(struct inode *idata, off_t pos,
+                        const char *buf, size_t buflen, size_t *written);
+void vfs_inode_drop_pages(struct inode *idata);
+
+/**
+ * \brief  pins the page `index` of a regular file for using it in place,
+ *         from the page cache or from the filesystem (.inode_page)
+ * @param create    a hole gets its own page, otherwise it is a shared
+ *                  page of zeroes that must not be written
+ * @param cookie    to be passed to vfs_inode_unmap_page()
+ */
+int vfs_inode_map_page(struct inode *idata, index_t index, bool create,
+                       char **page, void **cookie);
+void vfs_inode_unmap_page(void *cookie);
+
+/**
+ * \brief  for pages that stay pinned by vfs_inode_map_page() while
+ *         their cookie is gone, e.g. mapped into a process: marks
+ *         the page dirty, drops the pin or writes all such pages back
+ */
+void vfs_inode_dirty_page(struct inode *idata, index_t index);
+void vfs_inode_release_page(struct inode *idata, index_t index);
+int vfs_inode_sync_pages(struct inode *idata);
+
 int vfs_inode_read(mountnode *sb, inode_t ino, off_t pos,
                    char *buf, size_t buflen, size_t *written);
 
@@ -217,6 +313,17 @@ int vfs_inode_trunc(mountnode *sb, inode_t ino, off_t length);
 
 void print_ls(const char *path);
 void print_mount(void);
+
+/**
+ * \brief  true if a filesystem is mounted from `dev`
+ */
+bool vfs_device_mounted(dev_t dev);
+
+/**
+ * \brief  writes back cached inodes and pages of all mounted filesystems
+ */
+int vfs_sync(void);
+
 void vfs_setup(void);
 
 #endif // __VFS_H__
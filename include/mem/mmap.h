@@ -0,0 +1,55 @@
+#ifndef __COSEC_MEM_MMAP_H__
+#define __COSEC_MEM_MMAP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "mem/pmem.h"
+#include "fs/file.h"
+#include "process.h"
+
+/*
+ *  A mmap()'ed region of a process, pages are mapped in on faults
+ */
+struct vm_area {
+    uintptr_t   va_start;
+    uintptr_t   va_end;         /* exclusive, both are page-aligned */
+    int         va_prot;        /* PROT_* */
+    int         va_flags;       /* MAP_SHARED or MAP_PRIVATE, MAP_ANONYMOUS */
+    file_t *    va_file;        /* NULL for anonymous memory */
+    index_t     va_pgoff;       /* the file page at va_start */
+    struct vm_area *va_next;    /* sorted by va_start */
+};
+
+/**
+ * \brief  maps `len` bytes of `file` from `offset` or anonymous memory
+ * @param addr      a hint, the exact address with MAP_FIXED
+ * @param result    the start of the new mapping
+ */
+int process_mmap(process_t *proc, uintptr_t addr, size_t len, int prot, int flags,
+                 file_t *file, off_t offset, uintptr_t *result);
+
+int process_munmap(process_t *proc, uintptr_t addr, size_t len);
+
+/**
+ * \brief  passes the pages written through shared file mappings
+ *         to the page cache, MS_SYNC also writes them back
+ */
+int process_msync(process_t *proc, uintptr_t addr, size_t len, int flags);
+
+vm_area_t * process_find_vma(process_t *proc, uintptr_t addr);
+
+/* true if no mapping intersects [start, end) */
+bool process_vm_range_free(process_t *proc, uintptr_t start, uintptr_t end);
+
+/**
+ * \brief  maps the page at `addr` in if it belongs to a vm_area
+ * @param err       the page fault error code
+ * @returns 0 if the access may be retried, ENOENT if there is no
+ *          vm_area, ENXIO beyond the end of a file, other errors
+ */
+int process_vm_fault(process_t *proc, uintptr_t addr, err_t err);
+
+#endif // __COSEC_MEM_MMAP_H__
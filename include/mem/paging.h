@@ -102,6 +102,13 @@ pde_t * pagedir_alloc(void);
 void pagedir_free(pde_t *pagedir);
 
 void* pagedir_get_or_new(pde_t *pagedir, void *vaddr, uint32_t pte_mask);
+int pagedir_map(pde_t *pagedir, void *vaddr, void *paddr, uint32_t pte_mask);
+
+/* maps device memory at the same address, e.g. a PCI BAR; in the kernel space only */
+void * iomem_map(uintptr_t paddr, size_t len);
+
+pte_t * pagedir_lookup(pde_t *pagedir, void *vaddr);
+pte_t pagedir_unmap(pde_t *pagedir, void *vaddr);
 
 #endif // NOT_CC
 #endif //__PAGING_H__
@@ -0,0 +1,51 @@
+#ifndef __COSEC_BITMAP_H__
+#define __COSEC_BITMAP_H__
+
+/*
+ *  Word-sized bit arrays: used for PIDs, file descriptors, etc.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint32_t bitmap_word_t;
+
+#define BITMAP_WORD_BITS    32
+#define BITMAP_WORDS(nbits) (((nbits) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+#define BITMAP_BYTES(nbits) (BITMAP_WORDS(nbits) * sizeof(bitmap_word_t))
+
+static inline bool bitmap_test(const bitmap_word_t *map, size_t bit) {
+    return map[bit / BITMAP_WORD_BITS] & (1u << (bit % BITMAP_WORD_BITS));
+}
+
+static inline void bitmap_set(bitmap_word_t *map, size_t bit) {
+    map[bit / BITMAP_WORD_BITS] |= (1u << (bit % BITMAP_WORD_BITS));
+}
+
+static inline void bitmap_clear(bitmap_word_t *map, size_t bit) {
+    map[bit / BITMAP_WORD_BITS] &= ~(1u << (bit % BITMAP_WORD_BITS));
+}
+
+/*
+ *  Finds the first zero bit in [from, nbits), skipping full words.
+ *  @returns its index or `nbits` if there is none.
+ */
+static inline size_t bitmap_find_zero(const bitmap_word_t *map, size_t nbits, size_t from) {
+    size_t i = from / BITMAP_WORD_BITS;
+    if (from >= nbits)
+        return nbits;
+
+    bitmap_word_t w = ~map[i] & (~0u << (from % BITMAP_WORD_BITS));
+    for (;;) {
+        if (w) {
+            size_t bit = i * BITMAP_WORD_BITS + __builtin_ctz(w);
+            return (bit < nbits) ? bit : nbits;
+        }
+        if (++i >= BITMAP_WORDS(nbits))
+            return nbits;
+        w = ~map[i];
+    }
+}
+
+#endif // __COSEC_BITMAP_H__
@@ -10,5 +10,12 @@ void test_userspace(void);
 void test_usleep(void);
 void test_init(void);
 void test_acpi(void);
+void test_pipe(void);
+void test_dcache(void);
+void test_ramdir(const char *);
+void test_bigdir(const char *);
+void test_readdir(void);
+void test_splice(void);
+void test_ramlimit(void);
 
 #endif //__TEST_H__
@@ -4,16 +4,27 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <signal.h>
 
 #include "mem/paging.h"
 #include "fs/vfs.h"
+#include "fs/file.h"
 #include "tasks.h"
+#include "misc/bitmap.h"
 
-/* should be 65536 */
-#define NPROC_MAX       10
+#define PID_MAX         65536
 
-/* temporary value */
-#define N_PROCESS_FDS   20
+/* fd tables start small and double up to N_PROCESS_FDS_MAX */
+#define N_PROCESS_FDS_MIN   16
+#define N_PROCESS_FDS_MAX   4096
+
+/* the user stack grows down from here, the vDSO page is above it */
+#define USER_STACK_TOP  (KERN_OFF - PAGE_BYTES)
+#define USER_VDSO_ADDR  USER_STACK_TOP
+#define USER_STACK_GROW_MAX (10 * PAGE_BYTES)
+
+/* mmap() places mappings top-down from here, below the room for the stack */
+#define USER_MMAP_TOP   (USER_STACK_TOP - 0x1000000)
 
 #define PID_INIT    1
 #define PID_COSECD  2
@@ -23,11 +34,8 @@ typedef struct process  process;
 typedef struct filedesc filedescr;
 
 typedef struct filedesc {
-    mountnode  *fd_sb;
-    inode_t     fd_ino;
-
-    uint        fd_flags;
-    off_t       fd_pos;
+    file_t     *fd_file;        /* shared with dup()'ed descriptors */
+    uint        fd_flags;       /* per-descriptor flags */
 } filedescr_t;
 
 typedef struct process {
@@ -43,16 +51,43 @@ typedef struct process {
     mode_t      ps_umask;       /* umask */
     char *      ps_cwd;         /* current directory */
 
-    filedescr   ps_fds[N_PROCESS_FDS];
+    struct vm_area *ps_vmas;    /* mmap()'ed regions sorted by address */
+
+    filedescr *     ps_fds;     /* fd table, grows on demand */
+    bitmap_word_t * ps_fdmap;   /* used fds */
+    int             ps_nfds;    /* capacity of ps_fds */
+
+    sigset_t    ps_sigpending;  /* raised, not delivered yet */
+    sigset_t    ps_sigblocked;  /* not delivered while set */
+    struct sigaction ps_sigactions[SIGMAX];
+
+    /* accounting, see also ps_task.stats and procfs */
+    uint32_t    ps_nfaults;     /* page faults, including stack growth */
+    uint32_t    ps_rchar;       /* bytes read, modulo 2^32 */
+    uint32_t    ps_wchar;       /* bytes written, modulo 2^32 */
+    uint32_t    ps_nsyscalls[N_SYSCALLS];   /* by syscall number */
+
+    struct process *ps_hnext;   /* next in the same PID hash bucket */
 } process_t;
 
 pid_t current_pid(void);
 process * current_proc(void);
+process * task_process(task_struct *task);
 process * proc_by_pid(pid_t pid);
+pid_t proc_next_pid(pid_t pid);
+
+int proc_register(process_t *proc, pid_t pid);
+void proc_unregister(process_t *proc);
 
 int process_grow_stack(process_t *, void *faultaddr);
 
+int process_alloc_fd(process_t *proc, int minfd);
+int process_reserve_fd(process_t *proc, int fd);
+void process_free_fd(process_t *proc, int fd);
+int process_copy_fds(process_t *to, const process_t *from);
+
 int alloc_fd_for_pid(pid_t pid);
+void free_fd_for_pid(pid_t pid, int fd);
 filedescr * get_filedescr_for_pid(pid_t pid, int fd);
 
 void run_init(void);
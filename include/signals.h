@@ -0,0 +1,65 @@
+#ifndef __COSEC_SIGNALS_H__
+#define __COSEC_SIGNALS_H__
+
+#include <stdint.h>
+#include <signal.h>
+
+#include "arch/intr.h"
+#include "process.h"
+
+#define sigbit(sig)     (1u << ((sig) - 1))
+
+/* the default action of signals not listed here is termination */
+#define SIGMASK_DFL_IGNORE  \
+    (sigbit(SIGCHLD) | sigbit(SIGURG) | sigbit(SIGWINCH) | sigbit(SIGCONT))
+#define SIGMASK_DFL_STOP    \
+    (sigbit(SIGSTOP) | sigbit(SIGTSTP) | sigbit(SIGTTIN) | sigbit(SIGTTOU))
+
+/* cannot be caught, ignored or blocked */
+#define SIGMASK_UNCATCHABLE (sigbit(SIGKILL) | sigbit(SIGSTOP))
+
+/*
+ *  Pushed onto the user stack before a handler is called.
+ *  The handler returns into the vDSO trampoline with
+ *  %esp pointing at sf_signum, which calls sys_sigreturn().
+ */
+struct sigframe {
+    uint32_t    sf_retaddr;     /* vdso_sigreturn in user space */
+    int         sf_signum;      /* the handler argument */
+    struct interrupt_context sf_regs;
+    uint32_t    sf_eip;
+    uint32_t    sf_eflags;
+    uint32_t    sf_esp;
+    sigset_t    sf_blocked;     /* the mask to restore */
+};
+
+/**
+ * \brief  marks `sig` pending for `proc`, delivered on its return to user mode
+ */
+int signal_send(process_t *proc, int sig);
+
+/**
+ * \brief  a user-mode fault in the current process:
+ *         delivers `sig` even if it is blocked or ignored
+ * @param iret      the faulting iret frame: eip, cs, eflags, esp, ss
+ */
+void signal_fault(int sig, uint32_t *iret);
+
+/**
+ * \brief  called right before an interrupt returns;
+ *         a single compare if nothing is pending
+ * @param ctx   the context to use if a nested interrupt has reset
+ *              intr_context_esp() (e.g. a syscall that slept)
+ */
+void signal_return_hook(struct interrupt_context *ctx);
+
+/**
+ * \brief  maps the sigreturn trampoline page into `pagedir`
+ */
+int signal_map_vdso(pde_t *pagedir);
+
+void signal_setup(void);
+
+int sys_sigreturn(void);
+
+#endif // __COSEC_SIGNALS_H__
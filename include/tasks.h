@@ -1,6 +1,7 @@
 #ifndef __TASKS_H__
 #define __TASKS_H__
 
+#include <stdbool.h>
 #include <arch/i386.h>
 
 #define TASK_KERNSTACK_SIZE   0x800
@@ -12,6 +13,16 @@ enum taskstate {
     TS_EXITED   = 3,
 };
 
+/*
+ *  Per-task accounting, updated on timer ticks and task switches
+ */
+struct task_stats {
+    uint32_t    utime;          /* timer ticks in user mode */
+    uint32_t    stime;          /* timer ticks in kernel mode */
+    uint32_t    nvcsw;          /* switches away while blocked or yielding */
+    uint32_t    nivcsw;         /* preemptions by the timer */
+};
+
 struct task {
     tss_t           tss;
     uint32_t        tss_index;
@@ -19,11 +30,15 @@ struct task {
 
     enum taskstate  state;
     struct task *   next;
+    struct task *   wq_next;    /* next task in the same wait queue */
 
     void *          kstack;
     size_t          kstack_size;
 
     void *          entry;
+
+    struct task_stats stats;
+    bool            is_process; /* embedded in a registered process_t */
 };
 
 typedef  struct task  task_struct;
@@ -50,4 +65,31 @@ int sched_add_task(task_struct *task);
 
 void task_yield(task_struct *task);
 
+/*
+ *  Wait queues: tasks blocked until some condition becomes true
+ */
+typedef struct wait_queue {
+    task_struct *wq_head;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT     { .wq_head = NULL }
+
+/* must be called with interrupts disabled, returns with them disabled */
+void wait_queue_sleep(wait_queue_t *wq);
+
+void wait_queue_wake_all(wait_queue_t *wq);
+
+/*
+ *  Blocks the current task until `condition` is true.
+ *  Interrupts are disabled while `condition` is checked,
+ *  so a wakeup between the check and sleeping is not lost.
+ */
+#define wait_event(wq, condition) \
+    do {                                \
+        intrs_disable();                \
+        while (!(condition))            \
+            wait_queue_sleep(wq);       \
+        intrs_enable();                 \
+    } while (0)
+
 #endif // __TASKS_H__
@@ -40,11 +40,23 @@
 #define SYS_ioctl       0x36
 
 #define SYS_setpgid     0x39
+#define SYS_dup2        0x3f
 #define SYS_setsid      0x42
 #define SYS_sigaction   0x43
 
+#define SYS_mmap        0x5a
+#define SYS_munmap      0x5b
+
 #define SYS_fstat       0x6c
 
+#define SYS_sigreturn   0x77
+#define SYS_sigprocmask 0x7e
+
+#define SYS_msync       0x90
+
+#define SYS_sendfile    0xbb
+#define SYS_splice      0xbc
+
 #define SYS_print       0xff
 
 #endif
@@ -9,6 +9,7 @@
 #define O_TRUNC     0x0020
 #define O_NOCTTY    0x0040
 #define O_NOFOLLOW  0x0080
+#define O_NONBLOCK  0x0100
 
 enum file_search_mode_t {
     SEEK_SET,
@@ -2,8 +2,8 @@
 #define __COSEC_LIBC_SIGNAL__
 
 #include <stdint.h>
-#define SIG_IGN     ((void *)0)
-#define SIG_DFL     ((void *)1)
+#define SIG_DFL     ((void *)0)
+#define SIG_IGN     ((void *)1)
 #define SIG_ERR     ((void *)-1)
 
 /* ISO C99 signals.  */
@@ -77,5 +77,17 @@ struct sigaction {
 
 int sigaction(int signum, const struct sigaction *act, struct sigaction *oldact);
 
+#define SIG_BLOCK       0
+#define SIG_UNBLOCK     1
+#define SIG_SETMASK     2
+
+int sigprocmask(int how, const sigset_t *set, sigset_t *oldset);
+
+#define sigemptyset(set)        (*(set) = 0, 0)
+#define sigfillset(set)         (*(set) = ~(sigset_t)0, 0)
+#define sigaddset(set, sig)     (*(set) |= (1u << ((sig) - 1)), 0)
+#define sigdelset(set, sig)     (*(set) &= ~(1u << ((sig) - 1)), 0)
+#define sigismember(set, sig)   (!!(*(set) & (1u << ((sig) - 1))))
+
 #endif  // NOT_CC
 #endif  // __COSEC_LIBC_SIGNAL__
@@ -0,0 +1,40 @@
+#ifndef __COSEC_SYS_MMAN_H__
+#define __COSEC_SYS_MMAN_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* these are part of Linux ABI too */
+
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10
+#define MAP_ANONYMOUS   0x20
+#define MAP_ANON        MAP_ANONYMOUS
+
+#define MAP_FAILED      ((void *)-1)
+
+#define MS_ASYNC        1
+#define MS_INVALIDATE   2
+#define MS_SYNC         4
+
+/* the syscall takes them by pointer, like the old i386 mmap() of Linux */
+struct mmap_args {
+    uintptr_t   addr;
+    size_t      length;
+    int         prot;
+    int         flags;
+    int         fd;
+    off_t       offset;
+};
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t length);
+int msync(void *addr, size_t length, int flags);
+
+#endif  // __COSEC_SYS_MMAN_H__
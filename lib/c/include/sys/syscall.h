@@ -84,6 +84,11 @@ int sys_open(const char *pathname, int flags);
 int sys_read(int fd, void *buf, size_t count);
 int sys_write(int fd, const void *buf, size_t count);
 int sys_close(int fd);
+int sys_dup(int oldfd);
+int sys_dup2(int oldfd, int newfd);
+int sys_pipe(int pipefd[2]);
+int sys_sendfile(int out_fd, int in_fd, size_t count);
+int sys_splice(int fd_in, int fd_out, size_t len);
 
 off_t sys_lseek(int fd, off_t offset, int whence);
 int sys_ftruncate(int fd, off_t length);
@@ -96,10 +101,16 @@ pid_t sys_waitpid(pid_t pid, int *wstatus, int flags);
 int sys_kill(pid_t pid, int sig);
 
 intptr_t sys_brk(void *addr);
+struct mmap_args;
+intptr_t sys_mmap(const struct mmap_args *args);
+int sys_munmap(void *addr, size_t length);
+int sys_msync(void *addr, size_t length, int flags);
 pid_t sys_fork(void);
 int sys_execve(const char *pathname, char *const argv[], char *const envp[]);
 void sys_exit(int status);
 sighandler_t sys_signal(int signum, sighandler_t handler);
+int sys_sigaction(int signum, const struct sigaction *act, struct sigaction *oldact);
+int sys_sigprocmask(int how, const sigset_t *set, sigset_t *oldset);
 
 int sys_ioctl(int fd, unsigned long request, void *argp);
 
@@ -36,6 +36,13 @@ int unlink(const char *path);
 off_t lseek(int fd, off_t offset, int whence);
 
 ssize_t write(int fd, const void *buf, size_t count);
+ssize_t read(int fd, void *buf, size_t count);
+int close(int fd);
+
+int pipe(int pipefd[2]);
+
+int dup(int oldfd);
+int dup2(int oldfd, int newfd);
 
 /* processes */
 pid_t fork(void);
@@ -56,6 +56,21 @@ inline int sys_write(int fd, const void *buf, size_t count) {
 inline int sys_close(int fd) {
     return __syscall1(SYS_close, fd);
 }
+inline int sys_dup(int oldfd) {
+    return __syscall1(SYS_dup, oldfd);
+}
+inline int sys_dup2(int oldfd, int newfd) {
+    return __syscall2(SYS_dup2, oldfd, newfd);
+}
+inline int sys_pipe(int pipefd[2]) {
+    return __syscall1(SYS_pipe, (intptr_t)pipefd);
+}
+inline int sys_sendfile(int out_fd, int in_fd, size_t count) {
+    return __syscall3(SYS_sendfile, out_fd, in_fd, count);
+}
+inline int sys_splice(int fd_in, int fd_out, size_t len) {
+    return __syscall3(SYS_splice, fd_in, fd_out, len);
+}
 
 inline pid_t sys_fork(void) {
     return __syscall0(SYS_fork);
@@ -69,6 +84,12 @@ inline int sys_kill(pid_t pid, int sig) {
 inline pid_t sys_waitpid(pid_t pid, int *wstatus, int flags) {
     return __syscall3(SYS_waitpid, pid, (intptr_t)wstatus, flags);
 }
+inline int sys_sigaction(int signum, const struct sigaction *act, struct sigaction *oldact) {
+    return __syscall3(SYS_sigaction, signum, (intptr_t)act, (intptr_t)oldact);
+}
+inline int sys_sigprocmask(int how, const sigset_t *set, sigset_t *oldset) {
+    return __syscall3(SYS_sigprocmask, how, (intptr_t)set, (intptr_t)oldset);
+}
 inline sighandler_t sys_signal(int signum, sighandler_t handler) {
     struct sigaction sigact = {
         .sa_handler = handler,
@@ -76,9 +97,11 @@ inline sighandler_t sys_signal(int signum, sighandler_t handler) {
         .sa_mask = 0,
         .sa_flags = 0,
     };
-    return (sighandler_t)__syscall3(
-            SYS_sigaction, signum, (intptr_t)&sigact, 0
-    );
+    struct sigaction oldact;
+    int ret = sys_sigaction(signum, &sigact, &oldact);
+    if (ret < 0)
+        return (sighandler_t)ret;
+    return oldact.sa_handler;
 }
 inline off_t sys_lseek(int fd, off_t offset, int whence) {
     return __syscall3(SYS_lseek, fd, offset, whence);
@@ -96,6 +119,15 @@ inline time_t sys_time(time_t *tloc) {
 inline intptr_t sys_brk(void *addr) {
     return (intptr_t)__syscall1(SYS_brk, (intptr_t)addr);
 }
+inline intptr_t sys_mmap(const struct mmap_args *args) {
+    return (intptr_t)__syscall1(SYS_mmap, (intptr_t)args);
+}
+inline int sys_munmap(void *addr, size_t length) {
+    return __syscall2(SYS_munmap, (intptr_t)addr, length);
+}
+inline int sys_msync(void *addr, size_t length, int flags) {
+    return __syscall3(SYS_msync, (intptr_t)addr, length, flags);
+}
 inline void sys_exit(int status) {
     __syscall1(SYS_exit, status);
 }
@@ -27,6 +27,15 @@ int sys_fstat(int fd, struct stat *stat) {
 int sys_close(int fd) {
     return __syscall1(SYS_close, fd);
 }
+int sys_dup(int oldfd) {
+    return __syscall1(SYS_dup, oldfd);
+}
+int sys_dup2(int oldfd, int newfd) {
+    return __syscall2(SYS_dup2, oldfd, newfd);
+}
+int sys_pipe(int pipefd[2]) {
+    return __syscall1(SYS_pipe, (intptr_t)pipefd);
+}
 pid_t sys_getpid(void) {
     return __syscall0(SYS_getpid);
 }
@@ -72,14 +81,48 @@ clock_t sys_times(struct tms *tms) {
 intptr_t sys_brk(void *addr) {
     return __syscall1(SYS_brk, (intptr_t)addr);
 }
+intptr_t sys_mmap(const struct mmap_args *args) {
+    /* the i386 old_mmap() takes the same struct */
+    return __syscall1(SYS_mmap, (intptr_t)args);
+}
+int sys_munmap(void *addr, size_t length) {
+    return __syscall2(SYS_munmap, (intptr_t)addr, length);
+}
+int sys_msync(void *addr, size_t length, int flags) {
+    return __syscall3(SYS_msync, (intptr_t)addr, length, flags);
+}
 sighandler_t sys_signal(int signum, sighandler_t handler) {
-    struct sigaction sigact = {
-        .sa_handler = handler,
-        .sa_sigaction = NULL,
-        .sa_mask = 0,
-        .sa_flags = 0,
-    };
-    return (sighandler_t)__syscall3(SYS_signal, signum, (intptr_t)&sigact, 0);
+    return (sighandler_t)__syscall2(SYS_signal, signum, (intptr_t)handler);
+}
+
+/* the i386 `struct old_sigaction` of Linux */
+struct linux_sigaction {
+    void (*handler)(int);
+    uint32_t mask;
+    uint32_t flags;
+    void (*restorer)(void);
+};
+
+int sys_sigaction(int signum, const struct sigaction *act, struct sigaction *oldact) {
+    struct linux_sigaction lact, loldact;
+    if (act) {
+        lact.handler = act->sa_handler;
+        lact.mask = act->sa_mask;
+        lact.flags = act->sa_flags;
+        lact.restorer = NULL;
+    }
+    int ret = __syscall3(SYS_sigaction, signum,
+            (intptr_t)(act ? &lact : NULL), (intptr_t)(oldact ? &loldact : NULL));
+    if (!ret && oldact) {
+        oldact->sa_handler = loldact.handler;
+        oldact->sa_sigaction = NULL;
+        oldact->sa_mask = loldact.mask;
+        oldact->sa_flags = loldact.flags;
+    }
+    return ret;
+}
+int sys_sigprocmask(int how, const sigset_t *set, sigset_t *oldset) {
+    return __syscall3(SYS_sigprocmask, how, (intptr_t)set, (intptr_t)oldset);
 }
 pid_t sys_fork(void) {
     return __syscall0(SYS_fork);
@@ -102,7 +145,8 @@ void sys_exit(int status) {
  *  Time
  */
 inline time_t time(time_t *tloc) {
-    int32_t epoch = __syscall0(SYS_time);
+    /* time(2) stores through %ebx too, it must not be left over */
+    int32_t epoch = __syscall1(SYS_time, 0);
     if (tloc) *tloc = (time_t)epoch;
     return (time_t)epoch;
 }
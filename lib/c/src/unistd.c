@@ -5,6 +5,7 @@
 #include <termios.h>
 #include <unistd.h>
 #include <sys/errno.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -40,6 +41,52 @@ ssize_t write(int fd, const void *buf, size_t count) {
     return sys_write(fd, buf, count);
 }
 
+ssize_t read(int fd, void *buf, size_t count) {
+    return negative_to_errno(sys_read(fd, buf, count));
+}
+
+int close(int fd) {
+    return negative_to_errno(sys_close(fd));
+}
+
+int pipe(int pipefd[2]) {
+    return negative_to_errno(sys_pipe(pipefd));
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    struct mmap_args args = {
+        .addr = (uintptr_t)addr,
+        .length = length,
+        .prot = prot,
+        .flags = flags,
+        .fd = fd,
+        .offset = offset,
+    };
+    intptr_t ret = sys_mmap(&args);
+    /* mappings may be above 2G, errors are the last page */
+    if ((uintptr_t)ret >= (uintptr_t)-4095) {
+        theErrNo = -ret;
+        return MAP_FAILED;
+    }
+    return (void *)ret;
+}
+
+int munmap(void *addr, size_t length) {
+    return negative_to_errno(sys_munmap(addr, length));
+}
+
+int msync(void *addr, size_t length, int flags) {
+    return negative_to_errno(sys_msync(addr, length, flags));
+}
+
+int dup(int oldfd) {
+    return negative_to_errno(sys_dup(oldfd));
+}
+
+int dup2(int oldfd, int newfd) {
+    return negative_to_errno(sys_dup2(oldfd, newfd));
+}
+
 /*
 int stat(const char *pathname, struct stat *statbuf) { return sys_stat(pathname, statbuf); }
 int lstat(const char *pathname, struct stat *statbuf) { return sys_lstat(pathname, statbuf); }
@@ -93,6 +140,18 @@ int kill(pid_t pid, int sig) {
     );
 }
 
+int sigaction(int signum, const struct sigaction *act, struct sigaction *oldact) {
+    return negative_to_errno(
+        sys_sigaction(signum, act, oldact)
+    );
+}
+
+int sigprocmask(int how, const sigset_t *set, sigset_t *oldset) {
+    return negative_to_errno(
+        sys_sigprocmask(how, set, oldset)
+    );
+}
+
 pid_t getpid(void) {
     // TODO: cache it? but forks.
     return negative_to_errno(sys_getpid());
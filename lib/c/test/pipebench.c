@@ -0,0 +1,109 @@
+/*
+ *  Pipe throughput and ping-pong latency between two processes.
+ *  The same numbers are measured in-kernel by `test pipe` in kshell.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#define TOTAL_BYTES     (64 * 1024 * 1024)
+#define CHUNK           4096
+#define ROUNDS          100000
+
+char buf[CHUNK];
+
+/* monotonic time in microseconds, wraps around; libc has no 64-bit division */
+static uint32_t now_usec(void) {
+#ifdef LINUX
+    struct { int32_t tv_sec; int32_t tv_nsec; } ts;
+    __syscall2(SYS_clock_gettime, 1 /* CLOCK_MONOTONIC */, (intptr_t)&ts);
+    return (uint32_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return (uint32_t)time(NULL) * 1000000;
+#endif
+}
+
+static void readall(int fd, char *p, size_t len) {
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) {
+            perror("read");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void bench_throughput(void) {
+    int fds[2];
+    if (pipe(fds)) { perror("pipe"); exit(1); }
+
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); exit(1); }
+    if (pid == 0) {
+        close(fds[1]);
+        while (read(fds[0], buf, CHUNK) > 0)
+            ;
+        exit(0);
+    }
+
+    close(fds[0]);
+    memset(buf, 'x', CHUNK);
+
+    uint32_t t0 = now_usec();
+    size_t i;
+    for (i = 0; i < TOTAL_BYTES; i += CHUNK)
+        write(fds[1], buf, CHUNK);
+    close(fds[1]);
+    waitpid(pid, NULL, 0);
+    uint32_t dt = now_usec() - t0;
+    if (dt < 1000) dt = 1000;
+
+    printf("throughput: %d MB in %d ms, %d MB/s\n",
+            TOTAL_BYTES >> 20, dt / 1000, (TOTAL_BYTES >> 20) * 1000 / (dt / 1000));
+}
+
+static void bench_pingpong(void) {
+    int ping[2], pong[2];
+    if (pipe(ping) || pipe(pong)) { perror("pipe"); exit(1); }
+
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); exit(1); }
+    if (pid == 0) {
+        char c;
+        close(ping[1]);
+        close(pong[0]);
+        while (read(ping[0], &c, 1) == 1)
+            write(pong[1], &c, 1);
+        exit(0);
+    }
+
+    close(ping[0]);
+    close(pong[1]);
+
+    char c = 'x';
+    uint32_t t0 = now_usec();
+    int i;
+    for (i = 0; i < ROUNDS; ++i) {
+        write(ping[1], &c, 1);
+        readall(pong[0], &c, 1);
+    }
+    uint32_t dt = now_usec() - t0;
+    close(ping[1]);
+    waitpid(pid, NULL, 0);
+
+    printf("ping-pong: %d rounds in %d ms, %d ns/round\n",
+            ROUNDS, dt / 1000, dt / (ROUNDS / 1000));
+}
+
+int main() {
+    bench_throughput();
+    bench_pingpong();
+    return 0;
+}
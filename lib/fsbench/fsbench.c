@@ -0,0 +1,443 @@
+/*
+ *  Throughput of the ext2 and FAT drivers on images in memory.
+ *
+ *      fsbench [-s small|deep|huge|longnames]... fs:image...
+ *
+ *  Every shape runs in a child process on a copy-on-write copy of the
+ *  blank image, with cold caches (the drivers cannot be unmounted):
+ *  the tree is created and written, synced, remounted cold,
+ *  then looked up, listed and read back (and checked, untimed).
+ *  Then every file is pinned page by page at once as a mapping would
+ *  do it, e.g. the huge one takes more than PAGECACHE_MAX_PAGES frames.
+ *  One CSV line per phase goes to stdout.
+ */
+#include <stdint.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "fsbench.h"
+
+#define MAX_ENTRIES     4096
+#define PATH_LEN        32
+#define CHUNK           (64 * 1024)
+
+#define SMALL_DIRS      20
+#define SMALL_FILES     100
+#define DEEP_LEVELS     9       /* 2^10 - 1 directories with the root */
+#define DEEP_FILE       2048
+#define HUGE_FILE       (32 * 1024 * 1024)
+#define LONG_FILES      300     /* FAT aliases run out of ~n tails at 5 */
+
+struct entry {
+    char path[PATH_LEN];
+    bool isdir;
+    size_t size;
+};
+
+static struct entry theEntries[MAX_ENTRIES];
+static count_t theEntryCount = 0;
+
+static char theChunk[CHUNK];
+
+static const char *theImagePath;
+static const char *theFsName;
+static const char *theShape;
+
+
+/* monotonic time in microseconds, wraps around; libc has no 64-bit division */
+static uint32_t now_usec(void) {
+#ifdef LINUX
+    struct { int32_t tv_sec; int32_t tv_nsec; } ts;
+    __syscall2(SYS_clock_gettime, 1 /* CLOCK_MONOTONIC */, (intptr_t)&ts);
+    return (uint32_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return (uint32_t)time(NULL) * 1000000;
+#endif
+}
+
+static void check(int ret, const char *what, const char *path) {
+    if (!ret) return;
+    fprintf(stderr, "%s:%s %s(%s): %s\n",
+            theFsName, theShape, what, path, strerror(ret));
+    exit(1);
+}
+
+static void report(const char *phase, count_t ops, size_t bytes, uint32_t usec) {
+    uint32_t t = (usec ? usec : 1);
+    uint32_t opsps = (uint32_t)((double)ops * 1000000.0 / t);
+    uint32_t kibps = (uint32_t)((double)bytes * (1000000.0 / 1024.0) / t);
+
+    printf("%s,%s,%s,%s,%u,%u,%u,%u,%u\n",
+            theImagePath, theFsName, theShape, phase,
+            ops, bytes, usec, opsps, kibps);
+}
+
+
+/*
+ *  Shapes of the tree
+ */
+
+static struct entry *add_entry(bool isdir, size_t size) {
+    if (theEntryCount >= MAX_ENTRIES) {
+        fprintf(stderr, "too many entries\n");
+        exit(1);
+    }
+    struct entry *e = theEntries + theEntryCount++;
+    e->isdir = isdir;
+    e->size = size;
+    return e;
+}
+
+/* 20 directories of 100 files, 512 to 4096 bytes */
+static void shape_small(void) {
+    int d, f;
+    for (d = 0; d < SMALL_DIRS; ++d) {
+        struct entry *e = add_entry(true, 0);
+        snprintf(e->path, PATH_LEN, "/d%d", d);
+
+        for (f = 0; f < SMALL_FILES; ++f) {
+            e = add_entry(false, 512 * (1 + (d * SMALL_FILES + f) * 37 % 8));
+            snprintf(e->path, PATH_LEN, "/d%d/f%d", d, f);
+        }
+    }
+}
+
+/* a binary tree of directories, a 2K file "f" in each */
+static void deep_level(const char *dir, int level) {
+    struct entry *e = add_entry(false, DEEP_FILE);
+    snprintf(e->path, PATH_LEN, "%s/f", dir);
+    if (level == DEEP_LEVELS)
+        return;
+
+    const char *subdirs[] = { "a", "b" };
+    int i;
+    for (i = 0; i < 2; ++i) {
+        e = add_entry(true, 0);
+        snprintf(e->path, PATH_LEN, "%s/%s", dir, subdirs[i]);
+        deep_level(e->path, level + 1);
+    }
+}
+
+static void shape_deep(void) {
+    deep_level("", 0);
+}
+
+static void shape_huge(void) {
+    struct entry *e = add_entry(false, HUGE_FILE);
+    strcpy(e->path, "/big");
+}
+
+/* long names with a shared prefix in one directory, 512 bytes each */
+static void shape_longnames(void) {
+    struct entry *e = add_entry(true, 0);
+    strcpy(e->path, "/docs");
+
+    int f;
+    for (f = 0; f < LONG_FILES; ++f) {
+        e = add_entry(false, 512);
+        snprintf(e->path, PATH_LEN, "/docs/Document_%d.txt", f);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*make)(void);
+} theShapes[] = {
+    { "small", shape_small },
+    { "deep",  shape_deep },
+    { "huge",  shape_huge },
+    { "longnames", shape_longnames },
+};
+
+#define N_SHAPES  (sizeof(theShapes) / sizeof(theShapes[0]))
+
+
+/*
+ *  Phases
+ */
+
+static inline char pattern(size_t pos, count_t seed) {
+    return (char)(pos * 7 + pos / 4096 + seed);
+}
+
+static void fill_chunk(size_t pos, size_t len, count_t seed) {
+    size_t i;
+    for (i = 0; i < len; ++i)
+        theChunk[i] = pattern(pos + i, seed);
+}
+
+static void phase_create(void) {
+    count_t i;
+    uint32_t t0 = now_usec();
+    for (i = 0; i < theEntryCount; ++i) {
+        struct entry *e = theEntries + i;
+        int ret = e->isdir ? fsb_mkdir(e->path) : fsb_create(e->path);
+        check(ret, "create", e->path);
+    }
+    report("create", theEntryCount, 0, now_usec() - t0);
+}
+
+static void phase_write(void) {
+    count_t i, ops = 0;
+    size_t bytes = 0;
+    uint32_t dt = 0;
+
+    for (i = 0; i < theEntryCount; ++i) {
+        struct entry *e = theEntries + i;
+        if (e->isdir) continue;
+
+        inode_t ino;
+        size_t pos;
+        uint32_t t0 = now_usec();
+        check(fsb_lookup(e->path, &ino), "lookup", e->path);
+        for (pos = 0; pos < e->size; pos += CHUNK) {
+            size_t len = (e->size - pos < CHUNK ? e->size - pos : CHUNK);
+            uint32_t t1 = now_usec();
+            fill_chunk(pos, len, i);
+            t0 += now_usec() - t1;
+
+            check(fsb_write(ino, pos, theChunk, len), "write", e->path);
+        }
+        dt += now_usec() - t0;
+        ++ops;
+        bytes += e->size;
+    }
+
+    uint32_t t0 = now_usec();
+    check(fsb_sync(), "sync", "/");
+    dt += now_usec() - t0;
+    report("write", ops, bytes, dt);
+}
+
+static void phase_remount(char *image, size_t size) {
+    uint32_t t0 = now_usec();
+    check(fsb_mount(theFsName, image, size), "mount", theImagePath);
+    report("remount", 1, 0, now_usec() - t0);
+}
+
+static void phase_lookup(void) {
+    count_t i;
+    uint32_t t0 = now_usec();
+    for (i = 0; i < theEntryCount; ++i) {
+        inode_t ino;
+        check(fsb_lookup(theEntries[i].path, &ino), "lookup", theEntries[i].path);
+    }
+    report("lookup", theEntryCount, 0, now_usec() - t0);
+}
+
+static void phase_readdir(void) {
+    count_t i, dirs = 0, total = 0;
+    uint32_t dt = 0;
+
+    for (i = 0; i <= theEntryCount; ++i) {
+        const char *path = (i < theEntryCount ? theEntries[i].path : "/");
+        if ((i < theEntryCount) && !theEntries[i].isdir) continue;
+
+        inode_t ino;
+        count_t count;
+        uint32_t t0 = now_usec();
+        check(fsb_lookup(path, &ino), "lookup", path);
+        check(fsb_readdir(ino, &count), "readdir", path);
+        dt += now_usec() - t0;
+
+        ++dirs;
+        total += count;
+    }
+    report("readdir", dirs, 0, dt);
+    if (total < theEntryCount) {
+        fprintf(stderr, "%s:%s readdir: %d entries of %d\n",
+                theFsName, theShape, total, theEntryCount);
+        exit(1);
+    }
+}
+
+static void phase_read(bool verify) {
+    count_t i, ops = 0;
+    size_t bytes = 0;
+    uint32_t t0 = now_usec();
+
+    for (i = 0; i < theEntryCount; ++i) {
+        struct entry *e = theEntries + i;
+        if (e->isdir) continue;
+
+        inode_t ino;
+        struct readahead ra = { 0 };
+        size_t pos = 0;
+        check(fsb_lookup(e->path, &ino), "lookup", e->path);
+        for (;;) {
+            size_t done = 0;
+            check(fsb_read(ino, &ra, pos, theChunk, CHUNK, &done), "read", e->path);
+            if (!done) break;
+
+            if (verify) {
+                size_t j;
+                for (j = 0; j < done; ++j)
+                    if (theChunk[j] != pattern(pos + j, i))
+                        check(EIO, "verify", e->path);
+            }
+            pos += done;
+        }
+        if (pos != e->size)
+            check(EIO, "size", e->path);
+        ++ops;
+        bytes += pos;
+    }
+    if (!verify)
+        report("read", ops, bytes, now_usec() - t0);
+}
+
+/* pins all pages of a file, checks them and releases them */
+static void phase_map(void) {
+    count_t i;
+    for (i = 0; i < theEntryCount; ++i) {
+        struct entry *e = theEntries + i;
+        if (e->isdir) continue;
+
+        inode_t ino;
+        index_t index, npages = (e->size + PAGE_BYTES - 1) / PAGE_BYTES;
+        check(fsb_lookup(e->path, &ino), "lookup", e->path);
+        for (index = 0; index < npages; ++index) {
+            const char *page;
+            check(fsb_map_page(ino, index, &page), "map", e->path);
+
+            size_t j, pos = index * PAGE_BYTES;
+            for (j = 0; (j < PAGE_BYTES) && (pos + j < e->size); ++j)
+                if (page[j] != pattern(pos + j, i))
+                    check(EIO, "verify mapped", e->path);
+        }
+        for (index = 0; index < npages; ++index)
+            fsb_release_page(ino, index);
+    }
+}
+
+
+/*
+ *  Images
+ */
+
+static char *map_bytes(size_t size) {
+    char *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mmap(%d): %s\n", size, strerror(errno));
+        exit(1);
+    }
+    return p;
+}
+
+static char *load_image(const char *path, size_t *size) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *image = map_bytes(*size);
+    if (fread(image, 1, *size, f) != *size) {
+        fprintf(stderr, "%s: short read\n", path);
+        exit(1);
+    }
+    fclose(f);
+    return image;
+}
+
+/* in a child: `image` is its copy-on-write copy of the blank one */
+static void bench_shape(size_t s, char *image, size_t size) {
+    theEntryCount = 0;
+    theShapes[s].make();
+
+    check(fsb_mount(theFsName, image, size), "mount", theImagePath);
+    phase_create();
+    phase_write();
+    phase_remount(image, size);
+    phase_lookup();
+    phase_readdir();
+    phase_read(false);
+    phase_read(true);
+    phase_map();
+}
+
+static void bench_image(const char *arg, bool *shapes) {
+    static char fsname[16];
+    const char *colon = strchr(arg, ':');
+    if (!colon || (size_t)(colon - arg) >= sizeof(fsname)) {
+        fprintf(stderr, "expected fs:image, got '%s'\n", arg);
+        exit(1);
+    }
+    strncpy(fsname, arg, colon - arg);
+    fsname[colon - arg] = 0;
+    theFsName = fsname;
+    theImagePath = colon + 1;
+
+    size_t size;
+    char *blank = load_image(theImagePath, &size);
+
+    size_t s;
+    for (s = 0; s < N_SHAPES; ++s) {
+        if (!shapes[s]) continue;
+        theShape = theShapes[s].name;
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            bench_shape(s, blank, size);
+            fflush(stdout);
+            exit(0);
+        }
+
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "%s:%s failed\n", theFsName, theShape);
+            exit(1);
+        }
+    }
+
+    munmap(blank, size);
+}
+
+int main(int argc, char **argv) {
+    bool shapes[N_SHAPES] = { 0 };
+    bool anyshape = false;
+    int i;
+    size_t s;
+
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); ++i) {
+        if (strcmp(argv[i], "-s") || (i + 1 == argc))
+            goto usage;
+        ++i;
+        for (s = 0; s < N_SHAPES; ++s)
+            if (!strcmp(argv[i], theShapes[s].name))
+                break;
+        if (s == N_SHAPES)
+            goto usage;
+        shapes[s] = anyshape = true;
+    }
+    if (i == argc)
+        goto usage;
+    if (!anyshape)
+        for (s = 0; s < N_SHAPES; ++s)
+            shapes[s] = true;
+
+    printf("image,fs,shape,phase,ops,bytes,usec,ops_per_sec,kib_per_sec\n");
+    for (; i < argc; ++i)
+        bench_image(argv[i], shapes);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-s small|deep|huge|longnames]... fs:image...\n", argv[0]);
+    return 1;
+}
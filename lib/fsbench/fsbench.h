@@ -0,0 +1,48 @@
+#ifndef __COSEC_FSBENCH_H__
+#define __COSEC_FSBENCH_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "conf.h"
+#include "fs/pagecache.h"
+
+/*
+ *  The filesystem drivers of the kernel on an image in memory,
+ *  see hostkern.c. Paths are relative to the root of the image,
+ *  errors are positive errnos as in the kernel.
+ */
+
+/**
+ * \brief  mounts `image` with the driver `fsname` ("ext2" or "fat")
+ *         the state of a previous mount is not freed
+ */
+int fsb_mount(const char *fsname, char *image, size_t size);
+
+/**
+ * \brief  writes all dirty inodes and pages into the image
+ *         and drops the cached pages of the device
+ */
+int fsb_sync(void);
+
+int fsb_mkdir(const char *path);
+int fsb_create(const char *path);
+int fsb_lookup(const char *path, inode_t *ino);
+
+int fsb_write(inode_t ino, off_t pos, const char *buf, size_t buflen);
+
+/* sequential reads of a file should share `ra`, reset it to 0 for a new one */
+int fsb_read(inode_t ino, struct readahead *ra, off_t pos,
+             char *buf, size_t buflen, size_t *done);
+
+/**
+ * \brief  pins the cached page `index` of the file `ino` as a mapping
+ *         does (see vfs_inode_map_page()) until fsb_release_page()
+ */
+int fsb_map_page(inode_t ino, index_t index, const char **page);
+void fsb_release_page(inode_t ino, index_t index);
+
+/* counts the entries of the directory `ino`, with "." and ".." */
+int fsb_readdir(inode_t ino, count_t *count);
+
+#endif // __COSEC_FSBENCH_H__
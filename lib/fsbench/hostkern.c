@@ -0,0 +1,468 @@
+/*
+ *  What the filesystem drivers need from the kernel, on a Linux host.
+ *
+ *  The inode cache (src/fs/icache.c) and the page cache (src/fs/pagecache.c)
+ *  are the kernel's own; the block device is an image in memory that
+ *  serves every bio at once, and the page cache glue mirrors
+ *  src/fs/vfs.c and src/fs/devices.c. The numbers are the cost of the
+ *  filesystem code and the caches, without any device latency.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+
+#include <cosec/log.h>
+
+#include "mem/pmem.h"
+#include "mem/kheap.h"
+#include "fs/vfs.h"
+#include "fs/icache.h"
+#include "fs/pagecache.h"
+#include "fs/bio.h"
+#include "fs/blkqueue.h"
+#include "fs/ext2.h"
+#include "fs/fat.h"
+
+#include "fsbench.h"
+
+#define IMAGE_BLOCK     512
+
+/*
+ *  Memory and logging: kmalloc() is the heap of libc
+ */
+
+/* page cache frames, see __va() */
+void *pmem_alloc(size_t pages_count) {
+    char *frame = mmap(NULL, pages_count * PAGE_BYTES, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (frame == MAP_FAILED) return NULL;
+    return frame - KERN_OFF;
+}
+
+int k_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+
+/*
+ *  The image as a block device
+ */
+
+static char *theImage = NULL;
+static size_t theImageSize = 0;
+
+static size_t image_size_of_block(device *dev) {
+    UNUSED(dev);
+    return IMAGE_BLOCK;
+}
+
+static off_t image_size_in_blocks(device *dev) {
+    UNUSED(dev);
+    return theImageSize / IMAGE_BLOCK;
+}
+
+static struct device_operations theImageOps = {
+    .dev_size_of_block = image_size_of_block,
+    .dev_size_in_blocks = image_size_in_blocks,
+};
+
+static device theImageDevice = {
+    .dev_type = DEV_BLK,
+    .dev_ops = &theImageOps,
+};
+
+device * device_by_devno(devicetype_e ty, dev_t devno) {
+    UNUSED(devno);
+    return (ty == DEV_BLK ? &theImageDevice : NULL);
+}
+
+void bdev_plug(device *dev) { UNUSED(dev); }
+void bdev_unplug(device *dev) { UNUSED(dev); }
+
+void bio_init(struct bio *bio, device *dev, enum bio_op op, off_t block,
+              struct bio_vec *vecs, count_t vcnt)
+{
+    memset(bio, 0, sizeof(struct bio));
+    bio->bi_dev = dev;
+    bio->bi_op = op;
+    bio->bi_block = block;
+    bio->bi_io_vec = vecs;
+    bio->bi_vcnt = vcnt;
+}
+
+void bio_batch_init(struct bio_batch *batch) {
+    memset(batch, 0, sizeof(struct bio_batch));
+}
+
+/* completes at once */
+int bio_batch_submit(struct bio_batch *batch, struct bio *bio) {
+    size_t pos = (size_t)bio->bi_block * IMAGE_BLOCK;
+    count_t i;
+
+    for (i = 0; i < bio->bi_vcnt; ++i) {
+        struct bio_vec *vec = bio->bi_io_vec + i;
+        if (pos + vec->bv_len > theImageSize) {
+            bio->bi_error = EIO;
+            break;
+        }
+        if (bio->bi_op == BIO_READ)
+            memcpy(vec->bv_data, theImage + pos, vec->bv_len);
+        else
+            memcpy(theImage + pos, vec->bv_data, vec->bv_len);
+        pos += vec->bv_len;
+    }
+
+    bio->bi_done = true;
+    if (bio->bi_error && !batch->bb_error)
+        batch->bb_error = bio->bi_error;
+    return 0;
+}
+
+int bio_batch_wait(struct bio_batch *batch) {
+    return batch->bb_error;
+}
+
+static int image_transfer_pages(page_mapping *m, enum bio_op op, index_t index,
+                                char **pages, count_t npages)
+{
+    UNUSED(m);
+    count_t i;
+    for (i = 0; i < npages; ++i) {
+        size_t pos = (size_t)(index + i) * PAGE_BYTES;
+        size_t len = (pos < theImageSize ? theImageSize - pos : 0);
+        if (len > PAGE_BYTES)
+            len = PAGE_BYTES;
+
+        if (op == BIO_READ) {
+            memcpy(pages[i], theImage + pos, len);
+            memset(pages[i] + len, 0, PAGE_BYTES - len);
+        } else {
+            memcpy(theImage + pos, pages[i], len);
+        }
+    }
+    return 0;
+}
+
+static int image_readpage(page_mapping *m, index_t index, char *page) {
+    return image_transfer_pages(m, BIO_READ, index, &page, 1);
+}
+
+static int image_readpages(page_mapping *m, index_t index, char **pages, count_t npages) {
+    return image_transfer_pages(m, BIO_READ, index, pages, npages);
+}
+
+static int image_writepage(page_mapping *m, index_t index, const char *page) {
+    return image_transfer_pages(m, BIO_WRITE, index, (char **)&page, 1);
+}
+
+static int image_writepages(page_mapping *m, cached_page **pages, count_t npages) {
+    count_t i;
+    for (i = 0; i < npages; ++i)
+        image_transfer_pages(m, BIO_WRITE, pages[i]->cp_index, &pages[i]->cp_data, 1);
+    return 0;
+}
+
+static const struct page_mapping_ops theImageMappingOps = {
+    .readpage = image_readpage,
+    .readpages = image_readpages,
+    .writepage = image_writepage,
+    .writepages = image_writepages,
+};
+
+static page_mapping * image_pages(device *dev) {
+    if (!dev->dev_pages) {
+        dev->dev_pages = kmalloc(sizeof(page_mapping));
+        return_err_if(!dev->dev_pages, NULL, "%s: kmalloc failed", __func__);
+        pagecache_init_mapping(dev->dev_pages, dev, &theImageMappingOps);
+    }
+    return dev->dev_pages;
+}
+
+int bdev_blocking_read(
+        device *dev, struct readahead *ra, off_t pos,
+        char *buf, size_t buflen, size_t *written)
+{
+    page_mapping *m = image_pages(dev);
+    if (!m || (pos < 0) || ((size_t)pos >= theImageSize)) {
+        if (written) *written = 0;
+        return (m ? ENXIO : ENOMEM);
+    }
+
+    if (buflen > theImageSize - pos)
+        buflen = theImageSize - pos;
+    if (ra)
+        pagecache_readahead(m, ra, pos, buflen, (theImageSize - 1) / PAGE_BYTES);
+    return pagecache_read(m, pos, buf, buflen, written);
+}
+
+int bdev_blocking_write(
+        device *dev, off_t pos, const char *buf, size_t buflen, size_t *written)
+{
+    page_mapping *m = image_pages(dev);
+    if (!m || (pos < 0) || ((size_t)pos >= theImageSize)) {
+        if (written) *written = 0;
+        return (m ? ENXIO : ENOMEM);
+    }
+
+    if (buflen > theImageSize - pos)
+        buflen = theImageSize - pos;
+    return pagecache_write(m, pos, buf, buflen, written);
+}
+
+
+/*
+ *  Regular files in the page cache, as in src/fs/vfs.c
+ */
+
+int vfs_path_dirname_len(const char *path, size_t pathlen) {
+    if (!path) return -1;
+
+    char *last_sep = strnrchr(path, pathlen, FS_SEP);
+    if (!last_sep) return 0;
+
+    while ((last_sep > path) && (last_sep[-1] == FS_SEP))
+        --last_sep;
+    return (int)(last_sep - path);
+}
+
+static int vfs_readpage(page_mapping *m, index_t index, char *page) {
+    struct inode *idata = m->pm_host;
+    mountnode *sb = idata->i_sb;
+    return sb->sb_fs->ops->readpage(sb, idata, index, page);
+}
+
+static int vfs_writepage(page_mapping *m, index_t index, const char *page) {
+    struct inode *idata = m->pm_host;
+    mountnode *sb = idata->i_sb;
+    if (!sb->sb_fs->ops->writepage)
+        return EROFS;
+    return sb->sb_fs->ops->writepage(sb, idata, index, page);
+}
+
+static const struct page_mapping_ops vfs_inode_mapping_ops = {
+    .readpage = vfs_readpage,
+    .writepage = vfs_writepage,
+};
+
+static page_mapping * vfs_inode_pages(struct inode *idata) {
+    if (!idata->i_pages) {
+        idata->i_pages = kmalloc(sizeof(page_mapping));
+        return_err_if(!idata->i_pages, NULL, "%s: kmalloc failed", __func__);
+        pagecache_init_mapping(idata->i_pages, idata, &vfs_inode_mapping_ops);
+    }
+    return idata->i_pages;
+}
+
+int vfs_pagecache_read(
+        struct inode *idata, struct readahead *ra, off_t pos,
+        char *buf, size_t buflen, size_t *written)
+{
+    if (written) *written = 0;
+    if (pos >= idata->i_size)
+        return 0;
+    if ((off_t)buflen > idata->i_size - pos)
+        buflen = idata->i_size - pos;
+
+    page_mapping *m = vfs_inode_pages(idata);
+    if (!m) return ENOMEM;
+
+    if (ra)
+        pagecache_readahead(m, ra, pos, buflen, (idata->i_size - 1) / PAGE_BYTES);
+    return pagecache_read(m, pos, buf, buflen, written);
+}
+
+int vfs_pagecache_write(
+        struct inode *idata, off_t pos,
+        const char *buf, size_t buflen, size_t *written)
+{
+    size_t done = 0;
+    page_mapping *m = vfs_inode_pages(idata);
+    if (!m) return ENOMEM;
+
+    /* the size grows first: pages past it are not written back,
+     * and a reclaim may write back the new ones during the copy */
+    off_t oldsize = idata->i_size;
+    if ((off_t)(pos + buflen) > oldsize)
+        idata->i_size = pos + buflen;
+
+    int ret = pagecache_write(m, pos, buf, buflen, &done);
+    if ((done < buflen) && (idata->i_size > oldsize)) {
+        off_t end = pos + done;
+        idata->i_size = (end > oldsize ? end : oldsize);
+    }
+    if (idata->i_size != oldsize)
+        vfs_inode_dirty(idata);
+    if (written) *written = done;
+    return ret;
+}
+
+void vfs_inode_drop_pages(struct inode *idata) {
+    page_mapping *m = idata->i_pages;
+    if (!m) return;
+
+    pagecache_truncate(m, 0);
+    if (m->pm_npages) {
+        logmsgef("%s(ino=%d): pinned pages left", __func__, idata->i_no);
+        return;
+    }
+    kfree(m);
+    idata->i_pages = NULL;
+}
+
+
+/*
+ *  The benchmark interface
+ */
+
+static mountnode *theMount = NULL;
+
+int fsb_mount(const char *fsname, char *image, size_t size) {
+    fsdriver *fs;
+    mount_opts_t opts = { 0 };
+
+    if (!strcmp(fsname, "ext2")) {
+        fs = ext2_fs_driver();
+    } else if (!strcmp(fsname, "fat")) {
+        fs = fat_fs_driver();
+    } else {
+        return ENODEV;
+    }
+    opts.fs_id = fs->fs_id;
+
+    if (theImageDevice.dev_pages) {
+        pagecache_truncate(theImageDevice.dev_pages, 0);
+        kfree(theImageDevice.dev_pages);
+        theImageDevice.dev_pages = NULL;
+    }
+    theImage = image;
+    theImageSize = size;
+
+    mountnode *sb = kmalloc(sizeof(mountnode));
+    if (!sb) return ENOMEM;
+    memset(sb, 0, sizeof(mountnode));
+    sb->sb_fs = fs;
+
+    int ret = fs->ops->read_superblock(sb, &opts);
+    if (ret) {
+        kfree(sb);
+        return ret;
+    }
+    theMount = sb;
+    return 0;
+}
+
+int fsb_sync(void) {
+    int ret = pagecache_sync_all();
+    int err = vfs_sync_inodes(theMount);
+    if (!ret) ret = err;
+
+    /* the metadata written into device pages by the inode writeback */
+    err = pagecache_sync_all();
+    if (!ret) ret = err;
+
+    pagecache_truncate(theImageDevice.dev_pages, 0);
+    return ret;
+}
+
+int fsb_mkdir(const char *path) {
+    return theMount->sb_fs->ops->make_directory(theMount, NULL, path, 0755);
+}
+
+/* as vfs_mknod() */
+int fsb_create(const char *path) {
+    mountnode *sb = theMount;
+    fs_ops *ops = sb->sb_fs->ops;
+    size_t pathlen = strlen(path);
+    inode_t dirino, ino;
+    int ret;
+
+    int dirlen = vfs_path_dirname_len(path, pathlen);
+    ret = ops->lookup_inode(sb, &dirino, path, dirlen);
+    if (ret) return ret;
+
+    ret = ops->make_inode(sb, &ino, S_IFREG | 0644, NULL);
+    if (ret) return ret;
+
+    const char *name = path + dirlen;
+    while (name[0] == FS_SEP) ++name;
+    ret = ops->link_inode(sb, ino, dirino, name, SIZE_MAX);
+    if (ret && ops->free_inode)
+        ops->free_inode(sb, ino);
+    return ret;
+}
+
+int fsb_lookup(const char *path, inode_t *ino) {
+    return theMount->sb_fs->ops->lookup_inode(theMount, ino, path, SIZE_MAX);
+}
+
+int fsb_write(inode_t ino, off_t pos, const char *buf, size_t buflen) {
+    size_t done = 0;
+    int ret = theMount->sb_fs->ops->write_inode(theMount, ino, pos, buf, buflen, &done);
+    if (!ret && (done != buflen))
+        ret = EIO;
+    return ret;
+}
+
+int fsb_read(inode_t ino, struct readahead *ra, off_t pos,
+             char *buf, size_t buflen, size_t *done)
+{
+    struct inode *idata;
+    int ret = vfs_iget(theMount, ino, &idata);
+    if (ret) return ret;
+
+    ret = vfs_pagecache_read(idata, ra, pos, buf, buflen, done);
+    vfs_iput(idata);
+    return ret;
+}
+
+/* a pinned page keeps its inode referenced, as a mapping keeps its file */
+int fsb_map_page(inode_t ino, index_t index, const char **page) {
+    struct inode *idata;
+    int ret = vfs_iget(theMount, ino, &idata);
+    if (ret) return ret;
+
+    page_mapping *m = vfs_inode_pages(idata);
+    cached_page *pg;
+    ret = (m ? pagecache_get(m, index, true, &pg) : ENOMEM);
+    if (ret) {
+        vfs_iput(idata);
+        return ret;
+    }
+    *page = pg->cp_data;
+    return 0;
+}
+
+void fsb_release_page(inode_t ino, index_t index) {
+    struct inode *idata;
+    int ret = vfs_iget(theMount, ino, &idata);
+    returnv_err_if(ret, "%s: vfs_iget(%d) failed(%d)", __func__, ino, ret);
+
+    cached_page *pg = (idata->i_pages ? pagecache_find(idata->i_pages, index) : NULL);
+    if (pg) {
+        pagecache_put(pg);
+        vfs_iput(idata);
+    } else {
+        logmsgef("%s(ino=%d, index=%d): not cached", __func__, ino, index);
+    }
+    vfs_iput(idata);
+}
+
+int fsb_readdir(inode_t ino, count_t *count) {
+    void *iter = NULL;
+    struct dirent de;
+
+    *count = 0;
+    do {
+        int ret = theMount->sb_fs->ops->get_direntry(theMount, ino, &iter, &de);
+        if (ret) return ret;
+        ++*count;
+    } while (iter);
+    return 0;
+}
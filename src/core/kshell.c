@@ -16,6 +16,8 @@
 #include "dev/tty.h"
 #include "dev/pci.h"
 #include "dev/acpi.h"
+#include "dev/ramdisk.h"
+#include "dev/loop.h"
 
 #include "mem/pmem.h"
 #include "mem/kheap.h"
@@ -25,6 +27,11 @@
 
 #include "fs/vfs.h"
 #include "fs/devices.h"
+#include "fs/pagecache.h"
+#include "fs/bio.h"
+#include "fs/ramfs.h"
+#include "fs/ext2.h"
+#include "fs/fat.h"
 #include "process.h"
 
 #include "kshell.h"
@@ -613,6 +620,13 @@ const struct kshell_subcmd  test_cmds[] = {
     { .name = "usleep",  .handler = test_usleep,    },
     { .name = "acpi",    .handler = test_acpi,      },
     { .name = "str",     .handler = test_strs,      },
+    { .name = "pipe",    .handler = test_pipe,      },
+    { .name = "dcache",  .handler = test_dcache,    },
+    { .name = "ramdir",  .handler = test_ramdir,    },
+    { .name = "bigdir",  .handler = test_bigdir,    },
+    { .name = "readdir", .handler = test_readdir,   },
+    { .name = "splice",  .handler = test_splice,    },
+    { .name = "ramlimit", .handler = test_ramlimit, },
     { .name = 0,         .handler = 0    },
 };
 
@@ -679,6 +693,152 @@ static void fs_cat(const char *arg) {
     }
 }
 
+/* reads a word of `arg` into `buf`, returns what follows it */
+static const char *fs_mount_word(const char *arg, char *buf, size_t bufsize) {
+    size_t len = 0;
+    while (arg[len] && !isspace(arg[len]) && (len + 1 < bufsize)) {
+        buf[len] = arg[len];
+        ++len;
+    }
+    buf[len] = '\0';
+    arg += len;
+    while (isspace(*arg)) ++arg;
+    return arg;
+}
+
+/* mount ext2|fat /dev/path /abs/path [ro] [noindex] */
+static void fs_mount_bdev(uint fs_id, const char *arg) {
+    mount_opts_t opts = { .fs_id = fs_id };
+    char devpath[256];
+    char path[256];
+    struct stat st;
+
+    arg = fs_mount_word(arg, devpath, sizeof(devpath));
+    arg = fs_mount_word(arg, path, sizeof(path));
+    if (path[0] != '/') { k_printf("Error: an absolute path expected\n"); return; }
+    while (arg[0]) {
+        char opt[16];
+        arg = fs_mount_word(arg, opt, sizeof(opt));
+        if (!strcmp(opt, "ro")) {
+            opts.readonly = true;
+        } else if ((fs_id == EXT2_ID) && !strcmp(opt, "noindex")) {
+            opts.noindex = true;
+        } else {
+            k_printf("Error: unknown option '%s'\n", opt);
+            return;
+        }
+    }
+
+    int ret = vfs_stat(devpath, &st);
+    if (ret) { k_printf("Error: %s: %s\n", devpath, strerror(ret)); return; }
+    if (!S_ISBLK(st.st_mode)) { k_printf("Error: %s is not a block device\n", devpath); return; }
+
+    ret = vfs_mount(st.st_rdev, path, &opts);
+    if (ret) k_printf("mount failed: %s\n", strerror(ret));
+}
+
+/* mount ramfs /abs/path [size=<n>[K|M]] [nr_inodes=<n>] */
+static void fs_mount(const char *arg) {
+    mount_opts_t opts = { .fs_id = RAMFS_ID };
+    char path[256];
+    char *eptr;
+
+    if (!strncmp(arg, "ext2", 4)) {
+        arg += 4; while (isspace(*arg)) ++arg;
+        fs_mount_bdev(EXT2_ID, arg);
+        return;
+    }
+    if (!strncmp(arg, "fat", 3)) {
+        arg += 3; while (isspace(*arg)) ++arg;
+        fs_mount_bdev(FAT_ID, arg);
+        return;
+    }
+    if (strncmp(arg, "ramfs", 5)) { k_printf("Error: only ramfs, ext2 and fat can be mounted\n"); return; }
+    arg += 5; while (isspace(*arg)) ++arg;
+
+    arg = fs_mount_word(arg, path, sizeof(path));
+    if (path[0] != '/') { k_printf("Error: an absolute path expected\n"); return; }
+
+    for (;;) {
+        while (isspace(*arg)) ++arg;
+        if (!arg[0]) break;
+
+        if (!strncmp(arg, "size=", 5)) {
+            opts.size = strtol(arg + 5, &eptr, 0);
+            switch (*eptr) {
+                case 'k': case 'K': opts.size *= 1024; ++eptr; break;
+                case 'm': case 'M': opts.size *= 1024 * 1024; ++eptr; break;
+            }
+        } else if (!strncmp(arg, "nr_inodes=", 10)) {
+            opts.nr_inodes = strtol(arg + 10, &eptr, 0);
+        } else {
+            k_printf("Error: unknown option '%s'\n", arg);
+            return;
+        }
+        arg = eptr;
+    }
+
+    int ret = vfs_mount(gnu_dev_makedev(CHR_VIRT, CHR0_UNSPECIFIED), path, &opts);
+    if (ret) k_printf("mount failed: %s\n", strerror(ret));
+}
+
+/* losetup /dev/loopN /abs/file [ro] | losetup -d /dev/loopN */
+static void fs_losetup(const char *arg) {
+    char devpath[256];
+    char path[256];
+    struct stat st;
+    bool detach = false;
+    bool readonly = false;
+
+    if (!strncmp(arg, "-d", 2)) {
+        arg += 2; while (isspace(*arg)) ++arg;
+        detach = true;
+    }
+    arg = fs_mount_word(arg, devpath, sizeof(devpath));
+
+    int ret = vfs_stat(devpath, &st);
+    if (ret) { k_printf("Error: %s: %s\n", devpath, strerror(ret)); return; }
+    if (!S_ISBLK(st.st_mode) || (gnu_dev_major(st.st_rdev) != BLK_LOOPBACK)) {
+        k_printf("Error: %s is not a loop device\n", devpath);
+        return;
+    }
+    mindev_t minor = gnu_dev_minor(st.st_rdev);
+
+    if (detach) {
+        ret = loop_detach(minor);
+        if (ret) k_printf("losetup -d failed: %s\n", strerror(ret));
+        return;
+    }
+
+    arg = fs_mount_word(arg, path, sizeof(path));
+    if (path[0] != '/') { k_printf("Error: an absolute path expected\n"); return; }
+    if (!strcmp(arg, "ro")) {
+        readonly = true;
+    } else if (arg[0]) {
+        k_printf("Error: unknown option '%s'\n", arg);
+        return;
+    }
+
+    ret = loop_attach(minor, path, readonly);
+    if (ret) k_printf("losetup failed: %s\n", strerror(ret));
+}
+
+/* ramdisk <n>[K|M] */
+static void fs_ramdisk(const char *arg) {
+    char *eptr;
+    size_t size = strtol(arg, &eptr, 0);
+    switch (*eptr) {
+        case 'k': case 'K': size *= 1024; ++eptr; break;
+        case 'm': case 'M': size *= 1024 * 1024; ++eptr; break;
+    }
+    if ((eptr == arg) || *eptr) { k_printf("Error: a size expected\n"); return; }
+
+    mindev_t minor;
+    int ret = ramdisk_create(size, &minor);
+    if (ret) { k_printf("ramdisk failed: %s\n", strerror(ret)); return; }
+    k_printf("/dev/ram%d\n", minor);
+}
+
 void kshell_vfs(const struct kshell_command __unused *this, const char *arg) {
     if (!strncmp(arg, "ls", 2)) {
         arg += 2; while (isspace(*arg)) ++arg;
@@ -687,6 +847,10 @@ void kshell_vfs(const struct kshell_command __unused *this, const char *arg) {
     if (!strncmp(arg, "mounted", 7)) {
         print_mount();
     } else
+    if (!strncmp(arg, "mount", 5)) {
+        arg += 5; while (isspace(*arg)) ++arg;
+        fs_mount(arg);
+    } else
     if (!strncmp(arg, "mkdir", 5)) {
         arg += 5; while (isspace(*arg)) ++arg;
 
@@ -783,6 +947,25 @@ void kshell_vfs(const struct kshell_command __unused *this, const char *arg) {
         arg += 3; while (isspace(*arg)) ++arg;
 
         fs_cat(arg);
+    } else if (!strncmp(arg, "losetup", 7)) {
+        arg += 7; while (isspace(*arg)) ++arg;
+        fs_losetup(arg);
+    } else if (!strncmp(arg, "ramdisk", 7)) {
+        arg += 7; while (isspace(*arg)) ++arg;
+        fs_ramdisk(arg);
+    } else if (!strncmp(arg, "sync", 4)) {
+        int ret = vfs_sync();
+        if (ret) k_printf("sync failed: %s\n", strerror(ret));
+
+        struct pagecache_stats st;
+        pagecache_get_stats(&st);
+        k_printf("page cache: %d pages (%d dirty, %d pinned), %d hits, %d misses, %d read ahead, %d writebacks, %d reclaims\n",
+                st.pages, st.dirty, st.pinned, st.hits, st.misses, st.readahead, st.writebacks, st.reclaims);
+
+        struct bio_stats bst;
+        bio_get_stats(&bst);
+        k_printf("block I/O: %d requests, %d blocks, %d served block by block\n",
+                bst.submitted, bst.blocks, bst.emulated);
     } else {
         k_printf("Options: %s\n", this->options);
     }
@@ -829,6 +1012,9 @@ const struct kshell_command main_commands[] = {
         .description = "vfs utility",
         .options =
             "\n  mounted                 -- list mountpoints"
+            "\n  mount ramfs /abs/dir [size=<n>[K|M]] [nr_inodes=<n>] -- mount a limited ramfs"
+            "\n  mount ext2 /dev/path /abs/dir [ro] [noindex] -- mount an ext2 block device"
+            "\n  mount fat /dev/path /abs/dir [ro] -- mount a FAT12/16/32 block device"
             "\n  ls /absolute/dir/path   -- print directory entries list"
             "\n  stat /abs/path/to/flie  -- print `struct stat *` info"
             "\n  mkdir /abs/path/to/dir  -- create a directory"
@@ -838,6 +1024,10 @@ const struct kshell_command main_commands[] = {
             "\n  mv /abs/path /new/path  -- rename file"
             "\n  rm /abs/path            -- unlink path (possibly its inode)"
             "\n  cat [>] /abs/path       -- read/write file"
+            "\n  losetup /dev/loopN /abs/file [ro] -- back a loop device with a file"
+            "\n  losetup -d /dev/loopN   -- detach a loop device"
+            "\n  ramdisk <n>[K|M]        -- create a zeroed /dev/ramN"
+            "\n  sync                    -- write dirty cached pages back"
         },
     { .name = "halt",
         .handler = kshell_off,
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/errno.h>
 
 #define __DEBUG
@@ -15,41 +16,176 @@
 #include "conf.h"
 #include "mem/pmem.h"
 #include "mem/paging.h"
+#include "mem/kheap.h"
+#include "mem/mmap.h"
 #include "dev/tty.h"
 #include "fs/vfs.h"
 #include "tasks.h"
 
 #include "process.h"
-
-
-#define USER_STACK_TOP  (KERN_OFF - PAGE_BYTES)
+#include "signals.h"
 
 
 /*
  *  Global state
  */
 pid_t theCurrentPID;
-process_t * theProcessTable[NPROC_MAX] = { 0 };
+
+/* used PIDs, grows by doubling up to PID_MAX bits */
+static bitmap_word_t *thePidMap = NULL;
+static size_t thePidMapBits = 0;
+static pid_t theLastPid = 0;        /* next-fit hint */
+
+/* pid -> process_t hash, chained through ps_hnext; size is a power of 2 */
+static process_t **theProcessTable = NULL;
+static size_t theProcessTableSize = 0;
+static size_t theProcessCount = 0;
+
+#define PIDMAP_MIN_BITS     64
+#define PROCTABLE_MIN_SIZE  16
 
 
 /*
  *  PID management
  */
 
-static pid_t
-alloc_pid(void) {
-    pid_t i;
-    for (i = 1; i < NPROC_MAX; ++i) {
-        if (NULL == theProcessTable[i]) {
-            return i;
+static int pidmap_grow(size_t nbits) {
+    return_dbg_if(nbits > PID_MAX, EAGAIN,
+            "%s: PIDs exhausted\n", __func__);
+
+    size_t newbits = thePidMapBits ? thePidMapBits : PIDMAP_MIN_BITS;
+    while (newbits < nbits)
+        newbits *= 2;
+
+    bitmap_word_t *map = krealloc(thePidMap, BITMAP_BYTES(newbits));
+    return_err_if(!map, ENOMEM, "%s: krealloc failed", __func__);
+
+    size_t oldwords = BITMAP_WORDS(thePidMapBits);
+    memset(map + oldwords, 0, BITMAP_BYTES(newbits) - oldwords * sizeof(bitmap_word_t));
+    if (!thePidMap)
+        bitmap_set(map, 0);     /* PID 0 is invalid */
+
+    thePidMap = map;
+    thePidMapBits = newbits;
+    return 0;
+}
+
+static pid_t alloc_pid(void) {
+    size_t pid = bitmap_find_zero(thePidMap, thePidMapBits, theLastPid + 1);
+    if (pid == thePidMapBits)
+        pid = bitmap_find_zero(thePidMap, thePidMapBits, 1);
+    if (pid == thePidMapBits) {
+        if (pidmap_grow(thePidMapBits + 1))
+            return 0;
+    }
+
+    bitmap_set(thePidMap, pid);
+    theLastPid = pid;
+    return pid;
+}
+
+static inline size_t pid_bucket(pid_t pid) {
+    /* PIDs are allocated sequentially, the low bits are good enough */
+    return (size_t)pid & (theProcessTableSize - 1);
+}
+
+static int proc_table_grow(void) {
+    size_t i;
+    size_t oldsize = theProcessTableSize;
+    size_t newsize = oldsize ? 2 * oldsize : PROCTABLE_MIN_SIZE;
+
+    process_t **table = kmalloc(newsize * sizeof(process_t *));
+    return_err_if(!table, ENOMEM, "%s: kmalloc failed", __func__);
+    memset(table, 0, newsize * sizeof(process_t *));
+
+    process_t **oldtable = theProcessTable;
+    theProcessTable = table;
+    theProcessTableSize = newsize;
+
+    for (i = 0; i < oldsize; ++i) {
+        process_t *proc = oldtable[i];
+        while (proc) {
+            process_t *next = proc->ps_hnext;
+            size_t b = pid_bucket(proc->ps_pid);
+            proc->ps_hnext = table[b];
+            table[b] = proc;
+            proc = next;
+        }
+    }
+    if (oldtable)
+        kfree(oldtable);
+    return 0;
+}
+
+/*
+ *  Puts `proc` into the process table under `pid`,
+ *  a fresh PID is allocated if `pid` is 0.
+ */
+int proc_register(process_t *proc, pid_t pid) {
+    int ret;
+    if (theProcessCount >= theProcessTableSize) {
+        ret = proc_table_grow();
+        if (ret) return ret;
+    }
+
+    if (pid) {
+        return_dbg_if(pid < 0, EINVAL, "%s: pid=%d\n", __func__, pid);
+        if ((size_t)pid >= thePidMapBits) {
+            ret = pidmap_grow(pid + 1);
+            if (ret) return ret;
         }
+        return_dbg_if(bitmap_test(thePidMap, pid), EEXIST,
+                "%s: pid %d is taken\n", __func__, pid);
+        bitmap_set(thePidMap, pid);
+    } else {
+        pid = alloc_pid();
+        return_dbg_if(!pid, EAGAIN, "%s: no free PIDs\n", __func__);
     }
+
+    proc->ps_pid = pid;
+    proc->ps_task.is_process = true;
+
+    size_t b = pid_bucket(pid);
+    proc->ps_hnext = theProcessTable[b];
+    theProcessTable[b] = proc;
+    ++theProcessCount;
     return 0;
 }
 
+void proc_unregister(process_t *proc) {
+    pid_t pid = proc->ps_pid;
+    returnv_dbg_if(!theProcessTable, "%s: no process table\n", __func__);
+
+    process_t **link = theProcessTable + pid_bucket(pid);
+    while (*link && (*link != proc))
+        link = &(*link)->ps_hnext;
+    returnv_dbg_if(!*link, "%s: pid %d not registered\n", __func__, pid);
+
+    *link = proc->ps_hnext;
+    proc->ps_hnext = NULL;
+    proc->ps_task.is_process = false;
+    --theProcessCount;
+
+    bitmap_clear(thePidMap, pid);
+}
+
 process_t * proc_by_pid(pid_t pid) {
-    if (pid > NPROC_MAX) return 0;
-    return theProcessTable[pid];
+    if (!theProcessTable || (pid <= 0))
+        return NULL;
+
+    process_t *proc = theProcessTable[pid_bucket(pid)];
+    while (proc && (proc->ps_pid != pid))
+        proc = proc->ps_hnext;
+    return proc;
+}
+
+/* the smallest used PID greater than `pid`, 0 if none */
+pid_t proc_next_pid(pid_t pid) {
+    size_t i;
+    for (i = (size_t)pid + 1; i < thePidMapBits; ++i)
+        if (bitmap_test(thePidMap, i))
+            return (pid_t)i;
+    return 0;
 }
 
 pid_t current_pid(void) {
@@ -64,26 +200,125 @@ process_t * current_proc(void) {
     return (process_t *)task_current();
 }
 
+/* NULL for a kernel thread that is a bare task_struct */
+process_t * task_process(task_struct *task) {
+    if (!(task && task->is_process))
+        return NULL;
+    return (process_t *)task;
+}
+
 
+/*
+ *  File descriptor tables
+ */
+
+static int process_grow_fds(process_t *proc, int nfds) {
+    return_dbg_if(nfds > N_PROCESS_FDS_MAX, EMFILE,
+            "%s: pid=%d, fds exhausted\n", __func__, proc->ps_pid);
+
+    int oldnfds = proc->ps_nfds;
+    int newnfds = oldnfds ? oldnfds : N_PROCESS_FDS_MIN;
+    while (newnfds < nfds)
+        newnfds *= 2;
+
+    filedescr *fds = krealloc(proc->ps_fds, newnfds * sizeof(filedescr));
+    return_err_if(!fds, ENOMEM, "%s: krealloc(fds) failed", __func__);
+    proc->ps_fds = fds;
+    memset(fds + oldnfds, 0, (newnfds - oldnfds) * sizeof(filedescr));
+
+    bitmap_word_t *map = krealloc(proc->ps_fdmap, BITMAP_BYTES(newnfds));
+    return_err_if(!map, ENOMEM, "%s: krealloc(fdmap) failed", __func__);
+    proc->ps_fdmap = map;
+
+    size_t oldwords = BITMAP_WORDS(oldnfds);
+    memset(map + oldwords, 0, BITMAP_BYTES(newnfds) - oldwords * sizeof(bitmap_word_t));
+
+    proc->ps_nfds = newnfds;
+    return 0;
+}
+
+/* @returns the lowest free fd >= minfd marked as used, or -1 */
+int process_alloc_fd(process_t *proc, int minfd) {
+    int fd = bitmap_find_zero(proc->ps_fdmap, proc->ps_nfds, minfd);
+    if (fd >= proc->ps_nfds) {
+        if (minfd > fd)
+            fd = minfd;
+        if (process_grow_fds(proc, fd + 1))
+            return -1;
+    }
+
+    bitmap_set(proc->ps_fdmap, fd);
+    return fd;
+}
+
+/* marks exactly `fd` as used */
+int process_reserve_fd(process_t *proc, int fd) {
+    if (fd >= proc->ps_nfds) {
+        int ret = process_grow_fds(proc, fd + 1);
+        if (ret) return ret;
+    }
+    return_dbg_if(bitmap_test(proc->ps_fdmap, fd), EBUSY,
+            "%s: fd=%d is used\n", __func__, fd);
+
+    bitmap_set(proc->ps_fdmap, fd);
+    return 0;
+}
+
+/* drops the file reference held by `fd`, if any, and releases `fd` */
+void process_free_fd(process_t *proc, int fd) {
+    returnv_dbg_if(!((0 <= fd) && (fd < proc->ps_nfds)),
+            "%s: fd=%d out of range\n", __func__, fd);
+
+    filedescr *filedes = proc->ps_fds + fd;
+    if (filedes->fd_file)
+        file_put(filedes->fd_file);
+
+    memset(filedes, 0, sizeof(filedescr));
+    bitmap_clear(proc->ps_fdmap, fd);
+}
+
+/* `to` shares all open files of `from`, as fork() requires */
+int process_copy_fds(process_t *to, const process_t *from) {
+    int fd;
+    if (to->ps_nfds < from->ps_nfds) {
+        int ret = process_grow_fds(to, from->ps_nfds);
+        if (ret) return ret;
+    }
+
+    for (fd = 0; fd < from->ps_nfds; ++fd) {
+        if (!bitmap_test(from->ps_fdmap, fd))
+            continue;
+
+        to->ps_fds[fd] = from->ps_fds[fd];
+        if (to->ps_fds[fd].fd_file)
+            file_get(to->ps_fds[fd].fd_file);
+        bitmap_set(to->ps_fdmap, fd);
+    }
+    return 0;
+}
 
 int alloc_fd_for_pid(pid_t pid) {
-    int i;
     process *p = proc_by_pid(pid);
-    return_dbg_if(!p, EKERN, "%s: no process with pid %d\n", __func__, pid);
+    return_dbg_if(!p, -1, "%s: no process with pid %d\n", __func__, pid);
 
-    for (i = 0; i < N_PROCESS_FDS; ++i)
-        if (p->ps_fds[i].fd_ino < 1)
-            return i;
+    return process_alloc_fd(p, 0);
+}
+
+void free_fd_for_pid(pid_t pid, int fd) {
+    process *p = proc_by_pid(pid);
+    returnv_dbg_if(!p, "%s: no process with pid %d\n", __func__, pid);
 
-    return -1;
+    process_free_fd(p, fd);
 }
 
 filedescr * get_filedescr_for_pid(pid_t pid, int fd) {
     process *p = proc_by_pid(pid);
     return_dbg_if(p == NULL, NULL,
             "%s: no process with pid %d\n", __func__, pid);
-    return_dbg_if(!((0 <= fd) && (fd < N_PROCESS_FDS)), NULL,
+    return_dbg_if(!((0 <= fd) && (fd < p->ps_nfds)), NULL,
             "%s: fd=%d out of range\n", __func__, fd);
+    return_dbg_if(!bitmap_test(p->ps_fdmap, fd), NULL,
+            "%s: fd=%d is not open\n", __func__, fd);
 
     return p->ps_fds + fd;
 }
@@ -130,6 +365,9 @@ intptr_t sys_brk(void *addr) {
     uintptr_t vaddr = (uintptr_t)proc->ps_heap_end;
     void *pagedir = process_pagedir(proc);
 
+    return_dbg_if(!process_vm_range_free(proc, vaddr, pagealign_up(brk)),
+            (intptr_t)proc->ps_heap_end, "%s: *%x is mapped\n", __func__, brk);
+
     for (; vaddr < brk; vaddr += PAGE_BYTES) {
         void *paddr = pagedir_get_or_new(pagedir, (void *)vaddr, PTE_WRITABLE | PTE_USER);
         if (!paddr)
@@ -225,27 +463,32 @@ static int process_attach_tty(process_t *proc, const char *ttyfile) {
     mountnode *sb = NULL;
     inode_t ino = 0;
 
-    filedescr_t * fds = proc->ps_fds;
-    filedescr *infd =   fds + STDIN_FILENO;
-    filedescr *outfd =  fds + STDOUT_FILENO;
-    filedescr *errfd =  fds + STDERR_FILENO;
-    logmsgdf("%s: infd = *%x\n", __func__, (uintptr_t)infd);
-
     ret = vfs_lookup(ttyfile, &sb, &ino);
     return_err_if(ret, ret, "%s: vfs_lookup('%s'): %s",
                    __func__, ttyfile, strerror(ret));
     logmsgdf("%s: %s ino=%d\n", __func__, ttyfile, ino);
 
-    infd->fd_sb  = outfd->fd_sb  = errfd->fd_sb  = sb;
-    infd->fd_ino = outfd->fd_ino = errfd->fd_ino = ino;
-    infd->fd_pos = outfd->fd_pos = errfd->fd_pos = -1;
-
     struct stat st;
     ret = vfs_inode_stat(sb, ino, &st);
     return_err_if(ret, ret, "%s: vfs_stat: %s", __func__, strerror(ret));
     return_err_if(!S_ISCHR(st.st_mode), ENOTTY,
                   "%s: not a chardev: %s", __func__, ttyfile);
 
+    ret = process_reserve_fd(proc, STDIN_FILENO)
+       || process_reserve_fd(proc, STDOUT_FILENO)
+       || process_reserve_fd(proc, STDERR_FILENO);
+    return_err_if(ret, EMFILE, "%s: stdio fds are taken", __func__);
+
+    /* stdin, stdout and stderr share one open file */
+    file_t *ttyf = NULL;
+    ret = file_open(sb, ino, O_RDWR, &ttyf);
+    return_err_if(ret, ret, "%s: file_open('%s'): %s",
+                  __func__, ttyfile, strerror(ret));
+
+    proc->ps_fds[STDIN_FILENO].fd_file  = ttyf;
+    proc->ps_fds[STDOUT_FILENO].fd_file = file_get(ttyf);
+    proc->ps_fds[STDERR_FILENO].fd_file = file_get(ttyf);
+
     mindev_t ttyno = gnu_dev_minor(st.st_rdev);
     logmsgdf("%s: %s has mindev %d\n", __func__, ttyfile, ttyno);
 
@@ -369,6 +612,11 @@ void run_init(void) {
     void *stack = pagedir_get_or_new(pagedir, userstack, PTE_WRITABLE | PTE_USER);
     logmsgf("%s: userstack @%x\n", __func__, stack);
 
+    if (signal_map_vdso(pagedir)) {
+        logmsgef("%s: failed to map the vDSO", __func__);
+        goto cleanup_pagedir;
+    }
+
     /* TODO: initialize the new stack with argv, environ and auxval */
 
     /* setting the new process */
@@ -376,6 +624,12 @@ void run_init(void) {
     process_t *proc = &theInitProcess;
     proc->ps_ppid = 0;
     proc->ps_pid = pid;
+
+    int ret = proc_register(proc, pid);
+    if (ret) {
+        logmsgef("%s: proc_register(%d): %s", __func__, pid, strerror(ret));
+        goto cleanup_pagedir;
+    }
     proc->ps_cwd = "/";
     proc->ps_tty = CONSOLE_TTY;
     proc->ps_userstack = userstack;
@@ -401,7 +655,6 @@ void run_init(void) {
 #endif
 
     /* run the process */
-    theProcessTable[pid] = proc;
     sched_add_task(&proc->ps_task);
     logmsgif("%s: ready to rock!\n", __func__);
     return;
@@ -422,8 +675,9 @@ void cosecd_setup(int pid) {
     /* initialize tss and memory */
     void *pagedir = __pa(thePageDirectory);
 
-    theCosecThread.ps_pid = pid;
     theCosecThread.ps_tty = CONSOLE_TTY;
+    int ret = proc_register(&theCosecThread, pid);
+    assertv(!ret, "%s: proc_register(%d) failed", __func__, pid);
 
     task_struct *task = &theCosecThread.ps_task;
 
@@ -440,9 +694,6 @@ void cosecd_setup(int pid) {
     task->tss.cr3 = (uintptr_t)pagedir;
 
     process_attach_tty(&theCosecThread, "/dev/tty0");
-
-    /* make it official */
-    theProcessTable[pid] = &theCosecThread;
 }
 
 
@@ -451,8 +702,7 @@ void cosecd_setup(int pid) {
  */
 
 void proc_setup(void) {
-    /* PID 0 is invalid */
-    theProcessTable[0] = NULL;
+    signal_setup();
 
     /* the kernel thread `cosecd` with pid=2, keep pid=1 for init */
     cosecd_setup(PID_COSECD);
@@ -0,0 +1,308 @@
+/*
+ *  Signals
+ *
+ *  A process has two bitmaps, ps_sigpending and ps_sigblocked.
+ *  sending a signal only sets a pending bit; signals are delivered
+ *  when an interrupt or a syscall returns to user mode, so the cost
+ *  of a return with nothing pending is a single compare.
+ *
+ *  A handler is called on the user stack with a `struct sigframe`
+ *  under it; it returns into the vDSO page which calls sys_sigreturn().
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/errno.h>
+
+#include <cosec/log.h>
+
+#include "attrs.h"
+#include "arch/i386.h"
+#include "arch/intr.h"
+#include "mem/pmem.h"
+#include "mem/paging.h"
+#include "tasks.h"
+#include "process.h"
+#include "signals.h"
+
+/* flags that user code may change in its saved context */
+#define EFL_USER_BITS   0x0dd5  /* CF, PF, AF, ZF, SF, TF, DF, OF */
+
+/* src/arch/intr.S */
+extern const char vdso_start[], vdso_end[], vdso_sigreturn[];
+
+#define VDSO_SIGRETURN  (USER_VDSO_ADDR + (vdso_sigreturn - vdso_start))
+
+/* the physical page shared by all processes */
+static void *theVdsoPage = NULL;
+
+
+static inline bool signal_is_valid(int sig) {
+    return (0 < sig) && (sig < SIGMAX);
+}
+
+/*
+ *  Sending
+ */
+
+int signal_send(process_t *proc, int sig) {
+    return_dbg_if(!signal_is_valid(sig), EINVAL,
+            "%s(%d): EINVAL\n", __func__, sig);
+    sigset_t bit = sigbit(sig);
+
+    if (bit & (sigbit(SIGCONT) | sigbit(SIGKILL))) {
+        proc->ps_sigpending &= ~SIGMASK_DFL_STOP;
+        if (proc->ps_task.state == TS_STOPPED)
+            proc->ps_task.state = TS_READY;
+    }
+    if (bit & SIGMASK_DFL_STOP)
+        proc->ps_sigpending &= ~sigbit(SIGCONT);
+
+    proc->ps_sigpending |= bit;
+    return 0;
+}
+
+int sys_kill(pid_t pid, int sig) {
+    return_dbg_if(pid <= 0, -ETODO,
+            "%s(%d): process groups are TODO\n", __func__, pid);
+    return_dbg_if(!((0 <= sig) && (sig < SIGMAX)), -EINVAL,
+            "%s(sig=%d): EINVAL\n", __func__, sig);
+
+    process_t *proc = proc_by_pid(pid);
+    if (!proc)
+        return -ESRCH;
+    /* kernel threads never return to user mode */
+    if (proc->ps_task.tss.cs == SEL_KERN_CS)
+        return -EPERM;
+    if (sig == 0)
+        return 0;
+
+    return -signal_send(proc, sig);
+}
+
+
+/*
+ *  Delivery
+ */
+
+/* is [addr, addr+len) on the user stack? grows the stack if needed */
+static bool signal_user_stack_ok(process_t *proc, uintptr_t addr, size_t len) {
+    uintptr_t bottom = (uintptr_t)proc->ps_userstack;
+
+    if ((addr + len < addr) || (addr + len > USER_STACK_TOP))
+        return false;
+    if (addr >= bottom)
+        return true;
+    if (addr < bottom - USER_STACK_GROW_MAX)
+        return false;
+    return process_grow_stack(proc, (void *)addr) == 0;
+}
+
+static bool signal_push_frame(
+        process_t *proc, int sig,
+        struct interrupt_context *ctx, uint32_t *iret)
+{
+    struct sigaction *sa = proc->ps_sigactions + sig;
+
+    /* (%esp + 4) is 16-aligned at the handler entry, as after a call */
+    uintptr_t sp = ((iret[3] - sizeof(struct sigframe)) & ~0xf) - 4;
+    if (!signal_user_stack_ok(proc, sp, sizeof(struct sigframe)))
+        return false;
+
+    struct sigframe *frame = (struct sigframe *)sp;
+    frame->sf_retaddr = VDSO_SIGRETURN;
+    frame->sf_signum = sig;
+    frame->sf_regs = *ctx;
+    frame->sf_eip = iret[0];
+    frame->sf_eflags = iret[2];
+    frame->sf_esp = iret[3];
+    frame->sf_blocked = proc->ps_sigblocked;
+
+    proc->ps_sigblocked |= (sa->sa_mask | sigbit(sig)) & ~SIGMASK_UNCATCHABLE;
+
+    iret[0] = (uint32_t)sa->sa_handler;
+    iret[3] = sp;
+    return true;
+}
+
+static void signal_terminate(process_t *proc, int sig) {
+    logmsgif("%s: pid=%d killed by signal %d\n", __func__, proc->ps_pid, sig);
+
+    proc->ps_task.state = TS_EXITED;
+    proc->ps_task.tss.eax = sig;
+
+    task_yield(&proc->ps_task);
+    // TODO: cleanup resources, see sys_exit()
+}
+
+static void signal_stop(process_t *proc, int sig) {
+    logmsgif("%s: pid=%d stopped by signal %d\n", __func__, proc->ps_pid, sig);
+
+    proc->ps_task.state = TS_STOPPED;
+    task_yield(&proc->ps_task);
+}
+
+/*
+ *  Delivers pending signals to `proc` returning to `iret`
+ *  until a handler frame is set up or `proc` does not run anymore.
+ */
+static void signal_deliver(
+        process_t *proc, struct interrupt_context *ctx, uint32_t *iret)
+{
+    sigset_t ready;
+    while ((ready = proc->ps_sigpending & ~proc->ps_sigblocked)) {
+        int sig = __builtin_ctz(ready) + 1;
+        sigset_t bit = sigbit(sig);
+        proc->ps_sigpending &= ~bit;
+
+        struct sigaction *sa = proc->ps_sigactions + sig;
+        if (sa->sa_handler == SIG_IGN)
+            continue;
+
+        if (sa->sa_handler == SIG_DFL) {
+            if (bit & SIGMASK_DFL_IGNORE)
+                continue;
+            if (bit & SIGMASK_DFL_STOP)
+                signal_stop(proc, sig);
+            else
+                signal_terminate(proc, sig);
+            return;
+        }
+
+        if (signal_push_frame(proc, sig, ctx, iret))
+            return;
+
+        logmsgef("%s: pid=%d, no stack for signal %d at *%x\n",
+                 __func__, proc->ps_pid, sig, iret[3]);
+        signal_terminate(proc, SIGSEGV);
+        return;
+    }
+}
+
+void signal_return_hook(struct interrupt_context *ctx) {
+    struct interrupt_context *current = intr_context_esp();
+    if (current)
+        ctx = current;
+    if (!ctx)
+        return;
+
+    uint32_t *iret = (uint32_t *)((uintptr_t)ctx + CONTEXT_SIZE);
+    if (iret[1] != SEL_USER_CS)
+        return;
+
+    process_t *proc = current_proc();
+    if (likely(!(proc->ps_sigpending & ~proc->ps_sigblocked)))
+        return;
+
+    signal_deliver(proc, ctx, iret);
+}
+
+void signal_fault(int sig, uint32_t *iret) {
+    process_t *proc = current_proc();
+    struct sigaction *sa = proc->ps_sigactions + sig;
+    sigset_t bit = sigbit(sig);
+
+    /* the fault repeats if it is ignored or blocked: fall back to the default */
+    if ((sa->sa_handler == SIG_IGN) || (proc->ps_sigblocked & bit))
+        sa->sa_handler = SIG_DFL;
+    proc->ps_sigblocked &= ~bit;
+    proc->ps_sigpending |= bit;
+
+    signal_deliver(proc, intr_context_esp(), iret);
+}
+
+int sys_sigreturn(void) {
+    process_t *proc = current_proc();
+    struct interrupt_context *ctx = intr_context_esp();
+    uint32_t *iret = (uint32_t *)((uintptr_t)ctx + CONTEXT_SIZE);
+
+    /* the handler's `ret` has popped sf_retaddr */
+    uintptr_t sp = iret[3] - offsetof(struct sigframe, sf_signum);
+    if (!signal_user_stack_ok(proc, sp, sizeof(struct sigframe))) {
+        logmsgef("%s: pid=%d, bad frame at *%x\n", __func__, proc->ps_pid, sp);
+        signal_fault(SIGSEGV, iret);
+        return ctx->eax;
+    }
+
+    struct sigframe *frame = (struct sigframe *)sp;
+    uint32_t eflags = iret[2];
+
+    *ctx = frame->sf_regs;
+    ctx->ds = ctx->es = ctx->fs = ctx->gs = SEL_USER_DS;
+
+    iret[0] = frame->sf_eip;
+    iret[2] = (eflags & ~EFL_USER_BITS) | (frame->sf_eflags & EFL_USER_BITS);
+    iret[3] = frame->sf_esp;
+
+    proc->ps_sigblocked = frame->sf_blocked & ~SIGMASK_UNCATCHABLE;
+
+    /* int_syscall() stores the result to ctx->eax */
+    return ctx->eax;
+}
+
+
+/*
+ *  Handlers and masks
+ */
+
+int sys_sigaction(int signum, const struct sigaction *act, struct sigaction *oldact) {
+    process_t *proc = current_proc();
+    return_dbg_if(!signal_is_valid(signum), -EINVAL,
+            "%s(%d): EINVAL\n", __func__, signum);
+
+    struct sigaction *sa = proc->ps_sigactions + signum;
+    if (oldact)
+        *oldact = *sa;
+    if (!act)
+        return 0;
+
+    return_dbg_if(sigbit(signum) & SIGMASK_UNCATCHABLE, -EINVAL,
+            "%s(%d): cannot be caught\n", __func__, signum);
+
+    *sa = *act;
+    sa->sa_mask &= ~SIGMASK_UNCATCHABLE;
+
+    /* a pending signal that is now ignored is discarded */
+    if ((sa->sa_handler == SIG_IGN)
+        || ((sa->sa_handler == SIG_DFL) && (sigbit(signum) & SIGMASK_DFL_IGNORE)))
+        proc->ps_sigpending &= ~sigbit(signum);
+    return 0;
+}
+
+int sys_sigprocmask(int how, const sigset_t *set, sigset_t *oldset) {
+    process_t *proc = current_proc();
+
+    if (oldset)
+        *oldset = proc->ps_sigblocked;
+    if (!set)
+        return 0;
+
+    switch (how) {
+      case SIG_BLOCK:   proc->ps_sigblocked |= *set; break;
+      case SIG_UNBLOCK: proc->ps_sigblocked &= ~*set; break;
+      case SIG_SETMASK: proc->ps_sigblocked = *set; break;
+      default: return -EINVAL;
+    }
+    proc->ps_sigblocked &= ~SIGMASK_UNCATCHABLE;
+    return 0;
+}
+
+
+/*
+ *  vDSO
+ */
+
+int signal_map_vdso(pde_t *pagedir) {
+    return_err_if(!theVdsoPage, ENOMEM, "%s: no vDSO page", __func__);
+    return pagedir_map(pagedir, (void *)USER_VDSO_ADDR, theVdsoPage, PTE_USER);
+}
+
+void signal_setup(void) {
+    theVdsoPage = pmem_alloc(1);
+    assertv(theVdsoPage, "%s: cannot allocate the vDSO page", __func__);
+
+    char *page = __va(theVdsoPage);
+    memset(page, 0, PAGE_BYTES);
+    memcpy(page, vdso_start, vdso_end - vdso_start);
+}
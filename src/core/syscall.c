@@ -5,6 +5,7 @@
 
 #include "syscall.h"
 #include "process.h"
+#include "signals.h"
 #include "tasks.h"
 
 #include "arch/intr.h"
@@ -29,11 +30,6 @@ pid_t sys_waitpid(pid_t pid, int *wstatus, int flags) {
     return -ECHILD;
 }
 
-int sys_sigaction(int signum, const struct sigaction *act, struct sigaction *oldact) {
-    logmsgef("%s: TODO", __func__);
-    return -ETODO;
-}
-
 int sys_setsid(void) {
     logmsgef("%s: TODO", __func__);
     return -ETODO;
@@ -49,8 +45,14 @@ const syscall_handler syscalls[] = {
 
     [SYS_open]      = sys_open,
     [SYS_close]     = sys_close,
+    [SYS_dup]       = sys_dup,
+    [SYS_dup2]      = sys_dup2,
+    [SYS_pipe]      = sys_pipe,
+    [SYS_sendfile]  = sys_sendfile,
+    [SYS_splice]    = sys_splice,
 
     [SYS_waitpid]   = sys_waitpid,
+    [SYS_kill]      = sys_kill,
 
     [SYS_mkdir]     = sys_mkdir,
     [SYS_rename]    = sys_rename,
@@ -64,8 +66,13 @@ const syscall_handler syscalls[] = {
     [SYS_mount]     = sys_mount,
 
     [SYS_brk]       = (syscall_handler)sys_brk,
+    [SYS_mmap]      = (syscall_handler)sys_mmap,
+    [SYS_munmap]    = sys_munmap,
+    [SYS_msync]     = sys_msync,
 
-    //[SYS_sigaction] = sys_sigaction,
+    [SYS_sigaction] = sys_sigaction,
+    [SYS_sigprocmask] = sys_sigprocmask,
+    [SYS_sigreturn] = sys_sigreturn,
     //[SYS_fstat]     = sys_fstat,
 
     [SYS_print]     = sys_print,
@@ -88,15 +95,21 @@ void int_syscall() {
     if (!callee)
         goto unknown_syscall;
 
+    process_t *proc = task_process(task_current());
+    if (proc)
+        ++proc->ps_nsyscalls[intr_num];
+
     uint32_t result = callee(arg1, arg2, arg3);
     logmsgdf("%s(%d) -> %d (0x%x)\n",
             __func__, intr_num, result, result);
     ctx->eax = result;
-    return;
+    goto fun_exit;
 
 unknown_syscall:
     /* if syscall is not available, return ENOSYS */
     logmsgif("%s(%d or 0x%x): ENOSYS\n", __func__, intr_num, intr_num);
     ctx->eax = -ENOSYS;
-    return;
+
+fun_exit:
+    signal_return_hook(ctx);
 }
@@ -14,12 +14,14 @@
 #   define __DEBUG
 #endif
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <cosec/log.h>
 
+#include "attrs.h"
 #include "arch/i386.h"
 #include "arch/intr.h"
 #include "dev/intrs.h"
@@ -95,7 +97,24 @@ static inline void task_cpu_load(task_struct *task) {
     i386_switch_pagedir((void *)task->tss.cr3);
 }
 
+/* charges the current tick to user or kernel time of `task` */
+static inline void task_account_tick(task_struct *task) {
+    struct interrupt_context *context = intr_context_esp();
+    if (!context)
+        return;
+
+    uint32_t *iret_stack = (uint32_t *)((uintptr_t)context + CONTEXT_SIZE);
+    if (iret_stack[1] == SEL_KERN_CS)
+        ++task->stats.stime;
+    else
+        ++task->stats.utime;
+}
+
 static void task_timer_handler(uint tick) {
+    task_struct *current = (task_struct*)theCurrentTask;    // make a non-volatile copy
+    if (tick && current)
+        task_account_tick(current);
+
     if (!task_next)
         return; // no scheduler set
 
@@ -106,7 +125,13 @@ static void task_timer_handler(uint tick) {
     // switch to the next task:
     logmsgdf("%s(tick=%d)\n", __func__, tick);
 
-    task_struct *current = (task_struct*)theCurrentTask;    // make a non-volatile copy
+    if (current) {
+        if (tick && (current->state == TS_READY))
+            ++current->stats.nivcsw;
+        else
+            ++current->stats.nvcsw;
+    }
+
     task_save_context(current);
 
     task_cpu_load(next);
@@ -171,6 +196,8 @@ void task_init(task_struct *task, void *entry,
     assertv( task->tss_index, "Error: can't allocate GDT entry for TSSD\n");
     logmsgdf("%s(task=*%x): tss = GDT[%d]\n", __func__, task, task->tss_index);
 
+    memset(&task->stats, 0, sizeof(task->stats));
+
     /* init is done */
     task->state = TS_READY;
 }
@@ -208,6 +235,42 @@ void task_yield(task_struct *task) {
     task_timer_handler(0);
 }
 
+/*
+ *  Wait queues
+ */
+
+void wait_queue_sleep(wait_queue_t *wq) {
+    task_struct *task = (task_struct *)theCurrentTask;
+
+    task->state = TS_BLOCKED;
+    task->wq_next = wq->wq_head;
+    wq->wq_head = task;
+
+    /* the scheduler skips blocked tasks; if there is nothing else
+     * to run, just wait for the wakeup interrupt here */
+    while (task->state == TS_BLOCKED) {
+        intrs_enable();
+        cpu_halt();
+        intrs_disable();
+        barrier();
+    }
+}
+
+void wait_queue_wake_all(wait_queue_t *wq) {
+    bool intrs = i386_eflags() & EFL_IF;
+    intrs_disable();
+    task_struct *task = wq->wq_head;
+    wq->wq_head = NULL;
+    while (task) {
+        task_struct *next = task->wq_next;
+        task->wq_next = NULL;
+        if (task->state == TS_BLOCKED)
+            task->state = TS_READY;
+        task = next;
+    }
+    if (intrs) intrs_enable();
+}
+
 /*
  *  Setup
  */
@@ -504,3 +504,557 @@ void test_userspace(void) {
         task3.tss.esp, task3.tss.ss
     );
 }
+
+/***********************************************************/
+#include "fs/pipe.h"
+
+#define PIPEBENCH_BYTES     (4 * 1024 * 1024)
+#define PIPEBENCH_CHUNK     1024
+#define PIPEBENCH_ROUNDS    1000
+
+enum pipebench_op {
+    PIPEBENCH_SINK,     /* read `count` bytes, then ack with one byte */
+    PIPEBENCH_ECHO,     /* echo one byte back `count` times */
+};
+
+struct pipebench_cmd {
+    uint32_t op;
+    uint32_t count;
+};
+
+uint8_t pipebench_stack[TASK_KERNSTACK_SIZE];
+char pipebench_buf[PIPEBENCH_CHUNK];
+char pipebench_srvbuf[PIPEBENCH_CHUNK];
+
+task_struct pipebench_task;
+pipe_t *pipebench_to = NULL;
+pipe_t *pipebench_from = NULL;
+
+static void pipebench_readall(pipe_t *p, char *buf, size_t len) {
+    size_t nread = 0;
+    while (len) {
+        pipe_read(p, buf, len, &nread);
+        buf += nread;
+        len -= nread;
+    }
+}
+
+static void do_pipebench(void) {
+    struct pipebench_cmd cmd;
+    size_t nread;
+    uint32_t i;
+
+    for (;;) {
+        pipebench_readall(pipebench_to, (char *)&cmd, sizeof(cmd));
+        switch (cmd.op) {
+          case PIPEBENCH_SINK:
+            for (i = 0; i < cmd.count; i += nread) {
+                size_t len = cmd.count - i;
+                if (len > PIPEBENCH_CHUNK) len = PIPEBENCH_CHUNK;
+                pipe_read(pipebench_to, pipebench_srvbuf, len, &nread);
+            }
+            pipe_write(pipebench_from, "k", 1, NULL);
+            break;
+          case PIPEBENCH_ECHO:
+            for (i = 0; i < cmd.count; ++i) {
+                pipebench_readall(pipebench_to, pipebench_srvbuf, 1);
+                pipe_write(pipebench_from, pipebench_srvbuf, 1, NULL);
+            }
+            break;
+        }
+    }
+}
+
+static pipe_t * pipebench_pipe(void) {
+    pipe_t *p = pipe_new();
+    if (p) p->p_readers = p->p_writers = 1;
+    return p;
+}
+
+void test_pipe(void) {
+    struct pipebench_cmd cmd;
+    uint32_t i;
+    char c = 'x';
+
+    if (!pipebench_to) {
+        pipebench_to = pipebench_pipe();
+        pipebench_from = pipebench_pipe();
+        assertv(pipebench_to && pipebench_from, "%s: pipe_new failed\n", __func__);
+
+        task_kthread_init(&pipebench_task, (void *)do_pipebench,
+                (pipebench_stack + TASK_KERNSTACK_SIZE - 0x20));
+        sched_add_task(&pipebench_task);
+    }
+    uint freq = timer_frequency();
+
+    /* throughput */
+    memset(pipebench_buf, 'x', PIPEBENCH_CHUNK);
+    ulong tick0 = timer_ticks();
+
+    cmd.op = PIPEBENCH_SINK;
+    cmd.count = PIPEBENCH_BYTES;
+    pipe_write(pipebench_to, (char *)&cmd, sizeof(cmd), NULL);
+    for (i = 0; i < PIPEBENCH_BYTES; i += PIPEBENCH_CHUNK)
+        pipe_write(pipebench_to, pipebench_buf, PIPEBENCH_CHUNK, NULL);
+    pipebench_readall(pipebench_from, &c, 1);
+
+    uint dt = (uint)(timer_ticks() - tick0);
+    if (!dt) dt = 1;
+    k_printf("throughput: %d KB in %d ticks, %d KB/s\n",
+            PIPEBENCH_BYTES / 1024, dt, (PIPEBENCH_BYTES / 1024) * freq / dt);
+
+    /* ping-pong */
+    tick0 = timer_ticks();
+
+    cmd.op = PIPEBENCH_ECHO;
+    cmd.count = PIPEBENCH_ROUNDS;
+    pipe_write(pipebench_to, (char *)&cmd, sizeof(cmd), NULL);
+    for (i = 0; i < PIPEBENCH_ROUNDS; ++i) {
+        pipe_write(pipebench_to, &c, 1, NULL);
+        pipebench_readall(pipebench_from, &c, 1);
+    }
+
+    dt = (uint)(timer_ticks() - tick0);
+    /* no 64-bit division in the kernel */
+    uint usecs = dt * (1000000 / freq) + dt * (1000000 % freq) / freq;
+    k_printf("ping-pong: %d rounds in %d ticks, %d us/round\n",
+            PIPEBENCH_ROUNDS, dt, usecs / PIPEBENCH_ROUNDS);
+}
+
+/***********************************************************/
+#include <sys/errno.h>
+#include "fs/vfs.h"
+#include "fs/dcache.h"
+
+#define DCBENCH_DIRS        8
+#define DCBENCH_FILES       32
+#define DCBENCH_PATHS       (2 * DCBENCH_DIRS * DCBENCH_FILES)  /* a half does not exist */
+#define DCBENCH_LOOKUPS     10000
+#define DCBENCH_PATHLEN     40
+
+char dcbench_paths[DCBENCH_PATHS][DCBENCH_PATHLEN];
+
+/* what vfs_lookup() did before the dentry cache */
+static int dcbench_lookup_uncached(const char *path, inode_t *ino) {
+    mountnode *sb;
+    const char *fspath;
+    int ret = vfs_mountnode_by_path(path, &sb, &fspath);
+    if (ret) return ret;
+    return sb->sb_fs->ops->lookup_inode(sb, ino, fspath, SIZE_MAX);
+}
+
+static void dcbench_prepare(void) {
+    char dir[DCBENCH_PATHLEN];
+    int i, j, n = 0;
+
+    vfs_mkdir("/tmp/dcbench", 0755);
+    for (i = 0; i < DCBENCH_DIRS; ++i) {
+        snprintf(dir, sizeof(dir), "/tmp/dcbench/d%d", i);
+        vfs_mkdir(dir, 0755);
+        snprintf(dir, sizeof(dir), "/tmp/dcbench/d%d/sub", i);
+        vfs_mkdir(dir, 0755);
+
+        for (j = 0; j < DCBENCH_FILES; ++j) {
+            snprintf(dcbench_paths[n], DCBENCH_PATHLEN, "%s/f%d", dir, j);
+            vfs_mknod(dcbench_paths[n++], 0644, 0);
+            snprintf(dcbench_paths[n++], DCBENCH_PATHLEN, "%s/g%d", dir, j);
+        }
+    }
+}
+
+static uint dcbench_run(bool cached, int *nfound) {
+    inode_t ino;
+    int i, found = 0;
+
+    ulong tick0 = timer_ticks();
+    for (i = 0; i < DCBENCH_LOOKUPS; ++i) {
+        const char *path = dcbench_paths[i % DCBENCH_PATHS];
+        int ret = (cached ? vfs_lookup(path, NULL, &ino)
+                          : dcbench_lookup_uncached(path, &ino));
+        if (!ret) ++found;
+    }
+    *nfound = found;
+    return (uint)(timer_ticks() - tick0);
+}
+
+static void dcbench_report(const char *what, uint dt, int found) {
+    uint freq = timer_frequency();
+    /* no 64-bit division in the kernel */
+    uint usecs = dt * (1000000 / freq) + dt * (1000000 % freq) / freq;
+    k_printf("%s: %d lookups (%d found) in %d ticks, %d ns/lookup\n",
+            what, DCBENCH_LOOKUPS, found, dt, usecs / (DCBENCH_LOOKUPS / 1000));
+}
+
+void test_dcache(void) {
+    struct dcache_stats st;
+    int found;
+    uint dt;
+
+    if (!dcbench_paths[0][0])
+        dcbench_prepare();
+
+    dt = dcbench_run(false, &found);
+    dcbench_report("uncached", dt, found);
+
+    dcache_flush();
+    dt = dcbench_run(true, &found);
+    dcbench_report("cold", dt, found);
+
+    dt = dcbench_run(true, &found);
+    dcbench_report("warm", dt, found);
+
+    dcache_get_stats(&st);
+    k_printf("dcache: %d entries, %d hits, %d misses, %d evictions\n",
+            st.entries, st.hits, st.misses, st.evictions);
+
+    /* unlinking through another spelling must not leave a stale dentry */
+    inode_t ino;
+    vfs_mknod("/tmp/dcbench/dot", 0644, 0);
+    vfs_lookup("/tmp/dcbench/dot", NULL, &ino);
+    vfs_unlink("/tmp/./dcbench/d0/../dot");
+    k_printf("unlink via . and ..: %s\n",
+            (vfs_lookup("/tmp/dcbench/dot", NULL, &ino) == ENOENT) ? "ok" : "FAILED");
+}
+
+/***********************************************************/
+#define RDBENCH_DIR         "/tmp/rdbench"
+#define RDBENCH_FILES       2000    /* the kernel heap is not enough for 100k */
+#define RDBENCH_PATHLEN     64
+#define BDBENCH_FILES       50000   /* ext2 keeps them on the disk */
+
+static uint rdbench_nsecs(uint dt, int count) {
+    uint freq = timer_frequency();
+    /* no 64-bit division in the kernel */
+    uint usecs = dt * (1000000 / freq) + dt * (1000000 % freq) / freq;
+    if (!count) return 0;
+    return (usecs < 4000000 ? usecs * 1000 / count : usecs / count * 1000);
+}
+
+/* creates, looks up and unlinks `count` files in `dir` */
+static void rdbench_run(const char *dir, int count) {
+    char path[RDBENCH_PATHLEN];
+    inode_t ino;
+    int i, n, found = 0;
+    uint dt;
+
+    vfs_mkdir(dir, 0755);
+
+    ulong tick0 = timer_ticks();
+    for (n = 0; n < count; ++n) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, n);
+        int ret = vfs_mknod(path, 0644, 0);
+        if (ret) {
+            k_printf("mknod(%s) failed: %s\n", path, strerror(ret));
+            break;
+        }
+    }
+    dt = (uint)(timer_ticks() - tick0);
+    k_printf("create: %d files in %d ticks, %d ns/file\n", n, dt, rdbench_nsecs(dt, n));
+
+    /* the filesystem lookup, not the dentry cache */
+    tick0 = timer_ticks();
+    for (i = 0; i < 2 * n; ++i) {
+        snprintf(path, sizeof(path), "%s/%c%d", dir, (i % 2 ? 'g' : 'f'), i / 2);
+        if (!dcbench_lookup_uncached(path, &ino)) ++found;
+    }
+    dt = (uint)(timer_ticks() - tick0);
+    k_printf("lookup: %d names (%d found) in %d ticks, %d ns/lookup\n",
+            2 * n, found, dt, rdbench_nsecs(dt, 2 * n));
+
+    tick0 = timer_ticks();
+    for (i = 0; i < n; ++i) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        vfs_unlink(path);
+    }
+    dt = (uint)(timer_ticks() - tick0);
+    k_printf("unlink: %d files in %d ticks, %d ns/file\n", n, dt, rdbench_nsecs(dt, n));
+}
+
+/* `test ramdir <count>` */
+void test_ramdir(const char *arg) {
+    int count = atoi(arg);
+    if (count <= 0) count = RDBENCH_FILES;
+    rdbench_run(RDBENCH_DIR, count);
+}
+
+/*
+ *  `test bigdir /dir [count]`: the same on any filesystem, e.g. ext2
+ *  mounted with and without `noindex` to compare linear directories
+ *  with indexed ones.
+ */
+void test_bigdir(const char *arg) {
+    char dir[RDBENCH_PATHLEN / 2];
+    size_t len = 0;
+
+    while (arg[len] && (arg[len] != ' ') && (len + 1 < sizeof(dir))) {
+        dir[len] = arg[len];
+        ++len;
+    }
+    dir[len] = '\0';
+    if (dir[0] != '/') {
+        k_printf("Usage: test bigdir /abs/dir [count]\n");
+        return;
+    }
+
+    int count = atoi(arg + len);
+    if (count <= 0) count = BDBENCH_FILES;
+    rdbench_run(dir, count);
+}
+
+/* two names with the same strhash() */
+#define RDLIST_DIR          "/tmp/rdlist"
+static const char *rdlist_names[] = { "f3304", "f7840" };
+#define RDLIST_NAMES        (sizeof(rdlist_names) / sizeof(*rdlist_names))
+#define RDLIST_FILLERS      20      /* grow the table once, this reverses their bucket */
+#define RDLIST_ENTRIES      (2 + RDLIST_NAMES + RDLIST_FILLERS)     /* with . and .. */
+
+static void rdlist_path(char *path, size_t i) {
+    if (i < RDLIST_NAMES)
+        snprintf(path, RDBENCH_PATHLEN, "%s/%s", RDLIST_DIR, rdlist_names[i]);
+    else
+        snprintf(path, RDBENCH_PATHLEN, "%s/g%d", RDLIST_DIR, i - RDLIST_NAMES);
+}
+
+/* `test readdir`: lists a ramfs directory whose names collide */
+void test_readdir(void) {
+    char path[RDBENCH_PATHLEN];
+    mountnode *sb;
+    inode_t ino;
+    struct dirent de;
+    void *iter = NULL;
+    size_t i, n = 0;
+    int ret;
+
+    vfs_mkdir(RDLIST_DIR, 0755);
+    for (i = 0; i < RDLIST_NAMES + RDLIST_FILLERS; ++i) {
+        rdlist_path(path, i);
+        vfs_mknod(path, 0644, 0);
+    }
+
+    ret = vfs_lookup(RDLIST_DIR, &sb, &ino);
+    if (ret) {
+        k_printf("lookup(%s) failed: %s\n", RDLIST_DIR, strerror(ret));
+        return;
+    }
+
+    /* a cursor going back would never stop */
+    do {
+        ret = sb->sb_fs->ops->get_direntry(sb, ino, &iter, &de);
+        if (ret) break;
+        ++n;
+    } while (iter && (n <= RDLIST_ENTRIES));
+
+    if (ret)
+        k_printf("readdir failed: %s\n", strerror(ret));
+    else
+        k_printf("readdir: %d entries, %s\n", n,
+                 (!iter && (n == RDLIST_ENTRIES)) ? "ok" : "FAILED");
+
+    for (i = 0; i < RDLIST_NAMES + RDLIST_FILLERS; ++i) {
+        rdlist_path(path, i);
+        vfs_unlink(path);
+    }
+}
+
+/***********************************************************/
+#include <fcntl.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+#include "fs/file.h"
+
+#define SPBENCH_SRC         "/tmp/spsrc"
+#define SPBENCH_DST         "/tmp/spdst"
+#define SPBENCH_SIZE        (256 * 1024)
+#define SPBENCH_ROUNDS      16
+#define SPBENCH_BUFSZ       PAGE_BYTES
+
+static char spbench_buf[SPBENCH_BUFSZ];
+
+static int spbench_open(const char *path, int flags, file_t **f) {
+    mountnode *sb;
+    inode_t ino;
+    int ret = vfs_lookup(path, &sb, &ino);
+    if (ret == ENOENT) {
+        ret = vfs_mknod(path, S_IFREG | 0644, 0);
+        if (!ret) ret = vfs_lookup(path, &sb, &ino);
+    }
+    if (ret) return ret;
+    return file_open(sb, ino, flags, f);
+}
+
+/* the usual read()/write() loop through an intermediate buffer */
+static int spbench_copy(file_t *in, file_t *out, size_t *done) {
+    int ret = 0;
+    size_t n = 0;
+    for (;;) {
+        size_t nread = 0, nwritten = 0;
+        ret = file_read(in, spbench_buf, SPBENCH_BUFSZ, &nread);
+        if (ret || !nread) break;
+        in->f_pos += nread;
+
+        ret = file_write(out, spbench_buf, nread, &nwritten);
+        out->f_pos += nwritten;
+        n += nwritten;
+        if (ret || (nwritten < nread)) break;
+    }
+    *done = n;
+    return ret;
+}
+
+/* compares a buffered copy of a file to file_splice() */
+void test_splice(void) {
+    file_t *src = NULL, *dst = NULL;
+    size_t done = 0;
+    int i, ret;
+    uint dt;
+
+    ret = spbench_open(SPBENCH_SRC, O_RDWR, &src);
+    if (!ret) ret = spbench_open(SPBENCH_DST, O_RDWR, &dst);
+    if (ret) {
+        k_printf("open failed: %s\n", strerror(ret));
+        goto put_files;
+    }
+
+    for (i = 0; i < SPBENCH_BUFSZ; ++i)
+        spbench_buf[i] = (char)i;
+    for (src->f_pos = 0; src->f_pos < SPBENCH_SIZE; src->f_pos += done) {
+        ret = file_write(src, spbench_buf, SPBENCH_BUFSZ, &done);
+        if (ret || !done) {
+            k_printf("write failed: %s\n", strerror(ret));
+            goto put_files;
+        }
+    }
+
+    ulong tick0 = timer_ticks();
+    for (i = 0; i < SPBENCH_ROUNDS; ++i) {
+        src->f_pos = dst->f_pos = 0;
+        ret = spbench_copy(src, dst, &done);
+        if (ret) break;
+    }
+    dt = (uint)(timer_ticks() - tick0);
+    k_printf("read/write: %d x %d bytes in %d ticks\n", i, done, dt);
+
+    tick0 = timer_ticks();
+    for (i = 0; i < SPBENCH_ROUNDS; ++i) {
+        src->f_pos = dst->f_pos = 0;
+        ret = file_splice(src, dst, SPBENCH_SIZE, &done);
+        if (ret) break;
+    }
+    dt = (uint)(timer_ticks() - tick0);
+    k_printf("splice:     %d x %d bytes in %d ticks\n", i, done, dt);
+    if (ret)
+        k_printf("splice failed: %s\n", strerror(ret));
+
+    /* check the copy */
+    for (dst->f_pos = 0; dst->f_pos < SPBENCH_SIZE; dst->f_pos += done) {
+        ret = file_read(dst, spbench_buf, SPBENCH_BUFSZ, &done);
+        if (ret || !done) break;
+        for (i = 0; i < (int)done; ++i)
+            if (spbench_buf[i] != (char)(dst->f_pos + i)) {
+                k_printf("mismatch at %d\n", dst->f_pos + i);
+                goto put_files;
+            }
+    }
+
+put_files:
+    if (src) file_put(src);
+    if (dst) file_put(dst);
+    vfs_unlink(SPBENCH_SRC);
+    vfs_unlink(SPBENCH_DST);
+}
+
+/***********************************************************/
+#include "fs/devices.h"
+#include "fs/ramfs.h"
+
+#define RLTEST_DIR          "/tmp/rdlimit"
+#define RLTEST_OPEN         RLTEST_DIR "/open"
+#define RLTEST_PAGES        8
+#define RLTEST_INODES       8       /* with the root */
+
+static bool rltest_mounted = false;
+
+static void rltest_usage(const char *what, mountnode *sb) {
+    struct fs_usage st;
+    sb->sb_fs->ops->get_usage(sb, &st);
+    k_printf("%s: %d of %d pages, %d of %d inodes\n", what,
+             st.fu_blocks, st.fu_max_blocks, st.fu_inodes, st.fu_max_inodes);
+}
+
+/* writes pages to `f` until it fails, returns how many went in */
+static int rltest_fill(file_t *f, int *err) {
+    size_t done;
+    int n = 0;
+    for (;;) {
+        *err = file_write(f, spbench_buf, PAGE_BYTES, &done);
+        f->f_pos += done;
+        if (*err || (done < PAGE_BYTES)) break;
+        ++n;
+    }
+    return n;
+}
+
+/*
+ *  `test ramlimit`: fills a limited ramfs, then unlinks an open file.
+ *  Its inode and pages must come back once the file is closed.
+ */
+void test_ramlimit(void) {
+    char path[RDBENCH_PATHLEN];
+    mountnode *sb;
+    file_t *f = NULL;
+    int i, ret, err, nfiles, npages;
+
+    if (!rltest_mounted) {
+        mount_opts_t opts = {
+            .fs_id = RAMFS_ID,
+            .size = RLTEST_PAGES * PAGE_BYTES,
+            .nr_inodes = RLTEST_INODES,
+        };
+        vfs_mkdir(RLTEST_DIR, 0755);
+        ret = vfs_mount(gnu_dev_makedev(CHR_VIRT, CHR0_UNSPECIFIED), RLTEST_DIR, &opts);
+        if (ret) {
+            k_printf("mount(%s) failed: %s\n", RLTEST_DIR, strerror(ret));
+            return;
+        }
+        rltest_mounted = true;
+    }
+
+    ret = spbench_open(RLTEST_OPEN, O_RDWR, &f);
+    if (ret) {
+        k_printf("open(%s) failed: %s\n", RLTEST_OPEN, strerror(ret));
+        return;
+    }
+    sb = f->f_sb;
+
+    npages = rltest_fill(f, &err);
+    for (nfiles = 0; ; ++nfiles) {
+        snprintf(path, sizeof(path), "%s/f%d", RLTEST_DIR, nfiles);
+        ret = vfs_mknod(path, 0644, 0);
+        if (ret) break;
+    }
+    k_printf("filled: %d pages (%s), %d more files (%s)\n",
+             npages, strerror(err), nfiles, strerror(ret));
+    rltest_usage("full", sb);
+
+    vfs_unlink(RLTEST_OPEN);
+    rltest_usage("unlinked", sb);
+    file_put(f);
+    f = NULL;
+    rltest_usage("closed", sb);
+
+    /* the same again in place of the unlinked file */
+    ret = spbench_open(RLTEST_OPEN, O_RDWR, &f);
+    if (ret) {
+        k_printf("reopen: %s, FAILED\n", strerror(ret));
+    } else {
+        int n = rltest_fill(f, &err);
+        k_printf("refilled: %d pages, %s\n", n, (n == npages) ? "ok" : "FAILED");
+        file_put(f);
+    }
+
+    vfs_unlink(RLTEST_OPEN);
+    for (i = 0; i < nfiles; ++i) {
+        snprintf(path, sizeof(path), "%s/f%d", RLTEST_DIR, i);
+        vfs_unlink(path);
+    }
+}
@@ -0,0 +1,239 @@
+#include <string.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+
+#include <cosec/log.h>
+
+#include "attrs.h"
+#include "mem/kheap.h"
+#include "dev/loop.h"
+#include "fs/devices.h"
+#include "fs/bio.h"
+#include "fs/vfs.h"
+#include "fs/icache.h"
+#include "fs/pagecache.h"
+
+/*
+ *  Loop devices, block devices BLK_LOOPBACK:N (/dev/loopN).
+ *  The backing inode stays pinned while attached. A block is in the
+ *  page `block / LO_PAGE_BLOCKS` of the file: .dev_get_roblock and
+ *  .dev_get_rwblock give it in place, pinned by vfs_inode_map_page()
+ *  until .dev_forget_block; a bio is copied a page at a time.
+ */
+
+#define LO_PAGE_BLOCKS  (PAGE_BYTES / LOOP_BLOCK)
+
+struct loop_device {
+    device          dev;
+    struct inode   *lo_inode;       /* NULL if detached */
+    off_t           lo_blocks;
+    bool            lo_readonly;
+};
+
+static struct loop_device theLoops[LOOP_MAX];
+
+
+static char * loop_map_block(struct loop_device *lo, off_t block, bool write) {
+    return_dbg_if(!lo->lo_inode, NULL, "%s: loop%d is detached\n", __func__, lo->dev.dev_no);
+    return_dbg_if(!((0 <= block) && (block < lo->lo_blocks)), NULL,
+            "%s: loop%d has no block %d\n", __func__, lo->dev.dev_no, block);
+
+    char *page;
+    void *cookie;
+    index_t index = block / LO_PAGE_BLOCKS;
+    int ret = vfs_inode_map_page(lo->lo_inode, index, write, &page, &cookie);
+    return_dbg_if(ret, NULL, "%s: loop%d, page %d: %s\n",
+            __func__, lo->dev.dev_no, index, strerror(ret));
+
+    /* the pin is dropped by loop_forget_block() */
+    if (write)
+        vfs_inode_dirty_page(lo->lo_inode, index);
+    return page + (block % LO_PAGE_BLOCKS) * LOOP_BLOCK;
+}
+
+static const char * loop_get_roblock(device *dev, off_t block) {
+    return loop_map_block(dev->dev_data, block, false);
+}
+
+static char * loop_get_rwblock(device *dev, off_t block) {
+    struct loop_device *lo = dev->dev_data;
+    if (lo->lo_readonly)
+        return NULL;
+    return loop_map_block(lo, block, true);
+}
+
+static int loop_forget_block(device *dev, off_t block) {
+    struct loop_device *lo = dev->dev_data;
+    if (!lo->lo_inode)
+        return ENXIO;
+    vfs_inode_release_page(lo->lo_inode, block / LO_PAGE_BLOCKS);
+    return 0;
+}
+
+static size_t loop_size_of_block(device *dev) {
+    UNUSED(dev);
+    return LOOP_BLOCK;
+}
+
+static off_t loop_size_in_blocks(device *dev) {
+    struct loop_device *lo = dev->dev_data;
+    return (lo->lo_inode ? lo->lo_blocks : 0);
+}
+
+/* bio_submit() has checked the range */
+static int loop_submit(device *dev, struct bio *bio) {
+    struct loop_device *lo = dev->dev_data;
+    bool write = (bio->bi_op == BIO_WRITE);
+    off_t block = bio->bi_block;
+    int ret = 0;
+    count_t i;
+
+    if (!lo->lo_inode)
+        return ENXIO;
+    if (write && lo->lo_readonly)
+        return EROFS;
+
+    for (i = 0; (i < bio->bi_vcnt) && !ret; ++i) {
+        struct bio_vec *bv = bio->bi_io_vec + i;
+        size_t off = 0;
+        while (off < bv->bv_len) {
+            size_t inpage = (block % LO_PAGE_BLOCKS) * LOOP_BLOCK;
+            size_t len = PAGE_BYTES - inpage;
+            if (len > bv->bv_len - off)
+                len = bv->bv_len - off;
+
+            char *page;
+            void *cookie;
+            index_t index = block / LO_PAGE_BLOCKS;
+            ret = vfs_inode_map_page(lo->lo_inode, index, write, &page, &cookie);
+            if (ret) break;
+
+            if (write) {
+                memcpy(page + inpage, bv->bv_data + off, len);
+                vfs_inode_dirty_page(lo->lo_inode, index);
+            } else {
+                memcpy(bv->bv_data + off, page + inpage, len);
+            }
+            vfs_inode_unmap_page(cookie);
+
+            off += len;
+            block += len / LOOP_BLOCK;
+        }
+    }
+
+    bio_endio(bio, ret);
+    return 0;
+}
+
+struct device_operations loop_ops = {
+    .dev_get_roblock    = loop_get_roblock,
+    .dev_get_rwblock    = loop_get_rwblock,
+    .dev_forget_block   = loop_forget_block,
+    .dev_size_of_block  = loop_size_of_block,
+    .dev_size_in_blocks = loop_size_in_blocks,
+    .dev_submit         = loop_submit,
+};
+
+static device * get_loop_device(mindev_t devno) {
+    return_dbg_if(!(devno < LOOP_MAX), NULL, "%s: ENOENT\n", __func__);
+    return &theLoops[devno].dev;
+}
+
+static void loop_init(void) {
+    mindev_t i;
+    for (i = 0; i < LOOP_MAX; ++i) {
+        device *dev = &theLoops[i].dev;
+        dev->dev_type = DEV_BLK;
+        dev->dev_clss = BLK_LOOPBACK;
+        dev->dev_no   = i;
+        dev->dev_data = (void *)&theLoops[i];
+        dev->dev_ops  = &loop_ops;
+    }
+}
+
+struct devclass loop_family = {
+    .dev_type       = DEV_BLK,
+    .dev_maj        = BLK_LOOPBACK,
+    .dev_class_name = "loop devices",
+    .get_device     = get_loop_device,
+    .init_devclass  = loop_init,
+};
+
+struct devclass * get_loop_devclass(void) {
+    return &loop_family;
+}
+
+
+/*
+ *  Attaching files
+ */
+
+int loop_attach(mindev_t minor, const char *path, bool readonly) {
+    int ret;
+    return_dbg_if(!(minor < LOOP_MAX), ENXIO, "%s: no loop%d\n", __func__, minor);
+    struct loop_device *lo = &theLoops[minor];
+    return_dbg_if(lo->lo_inode, EBUSY, "%s: loop%d is attached\n", __func__, minor);
+
+    mountnode *sb;
+    inode_t ino;
+    ret = vfs_lookup(path, &sb, &ino);
+    if (ret) return ret;
+
+    struct inode *idata;
+    ret = vfs_iget(sb, ino, &idata);
+    if (ret) return ret;
+
+    if (!S_ISREG(idata->i_mode)) {
+        ret = EINVAL;
+        goto put_inode;
+    }
+    if (idata->i_size < LOOP_BLOCK) {
+        ret = ENOSPC;
+        goto put_inode;
+    }
+
+    lo->lo_blocks = idata->i_size / LOOP_BLOCK;
+    lo->lo_readonly = readonly;
+    lo->lo_inode = idata;
+
+    logmsgif("%s: loop%d on %s, %d blocks%s", __func__,
+             minor, path, lo->lo_blocks, (readonly ? ", read-only" : ""));
+    return 0;
+
+put_inode:
+    vfs_iput(idata);
+    return ret;
+}
+
+int loop_detach(mindev_t minor) {
+    int ret = 0;
+    return_dbg_if(!(minor < LOOP_MAX), ENXIO, "%s: no loop%d\n", __func__, minor);
+    struct loop_device *lo = &theLoops[minor];
+    device *dev = &lo->dev;
+    if (!lo->lo_inode)
+        return ENXIO;
+
+    /* filesystems are not unmounted */
+    if (vfs_device_mounted(gnu_dev_makedev(BLK_LOOPBACK, minor)))
+        return EBUSY;
+
+    /* the cached blocks of the device go to the file, then out */
+    page_mapping *m = dev->dev_pages;
+    if (m) {
+        ret = pagecache_sync(m);
+        if (ret) return ret;
+
+        pagecache_truncate(m, 0);
+        return_err_if(m->pm_npages, EBUSY, "%s: loop%d has pinned pages", __func__, minor);
+        kfree(m);
+        dev->dev_pages = NULL;
+    }
+
+    ret = vfs_inode_sync_pages(lo->lo_inode);
+    if (ret) logmsgef("%s: loop%d sync: %s", __func__, minor, strerror(ret));
+
+    vfs_iput(lo->lo_inode);
+    lo->lo_inode = NULL;
+    lo->lo_blocks = 0;
+    return ret;
+}
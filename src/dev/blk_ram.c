@@ -0,0 +1,235 @@
+#include <string.h>
+#include <stdio.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+
+#include <cosec/log.h>
+
+#include "attrs.h"
+#include "arch/mboot.h"
+#include "arch/multiboot.h"
+#include "mem/kheap.h"
+#include "mem/paging.h"
+#include "mem/pmem.h"
+#include "dev/ramdisk.h"
+#include "fs/devices.h"
+#include "fs/bio.h"
+#include "fs/vfs.h"
+
+/*
+ *  RAM disks, block devices BLK_RAM:N (/dev/ramN).
+ *  A block is `rd_pages[block / RD_PAGE_BLOCKS]` at the offset of the
+ *  block in its page, so the blocks are given in place and a bio is
+ *  a memcpy() of each of its runs within a page.
+ */
+
+#define RD_PAGE_BLOCKS  (PAGE_BYTES / RAMDISK_BLOCK)
+
+struct ramdisk {
+    device      dev;
+    char      **rd_pages;
+    count_t     rd_npages;
+    off_t       rd_blocks;
+    bool        rd_readonly;
+};
+
+static struct ramdisk *theRamDisks[RAMDISK_MAX];
+static count_t theRamDiskCount = 0;
+
+
+static char * ramdisk_block(struct ramdisk *rd, off_t block) {
+    return_dbg_if(!((0 <= block) && (block < rd->rd_blocks)), NULL,
+            "%s: ram%d has no block %d\n", __func__, rd->dev.dev_no, block);
+    return rd->rd_pages[block / RD_PAGE_BLOCKS] + (block % RD_PAGE_BLOCKS) * RAMDISK_BLOCK;
+}
+
+static const char * ramdisk_get_roblock(device *dev, off_t block) {
+    return ramdisk_block(dev->dev_data, block);
+}
+
+static char * ramdisk_get_rwblock(device *dev, off_t block) {
+    struct ramdisk *rd = dev->dev_data;
+    if (rd->rd_readonly)
+        return NULL;
+    return ramdisk_block(rd, block);
+}
+
+static size_t ramdisk_size_of_block(device *dev) {
+    UNUSED(dev);
+    return RAMDISK_BLOCK;
+}
+
+static off_t ramdisk_size_in_blocks(device *dev) {
+    struct ramdisk *rd = dev->dev_data;
+    return rd->rd_blocks;
+}
+
+/* bio_submit() has checked the range */
+static int ramdisk_submit(device *dev, struct bio *bio) {
+    struct ramdisk *rd = dev->dev_data;
+    off_t block = bio->bi_block;
+    count_t i;
+
+    if ((bio->bi_op == BIO_WRITE) && rd->rd_readonly)
+        return EROFS;
+
+    for (i = 0; i < bio->bi_vcnt; ++i) {
+        struct bio_vec *bv = bio->bi_io_vec + i;
+        size_t off = 0;
+        while (off < bv->bv_len) {
+            size_t inpage = (block % RD_PAGE_BLOCKS) * RAMDISK_BLOCK;
+            size_t len = PAGE_BYTES - inpage;
+            if (len > bv->bv_len - off)
+                len = bv->bv_len - off;
+
+            char *data = rd->rd_pages[block / RD_PAGE_BLOCKS] + inpage;
+            if (bio->bi_op == BIO_READ)
+                memcpy(bv->bv_data + off, data, len);
+            else
+                memcpy(data, bv->bv_data + off, len);
+
+            off += len;
+            block += len / RAMDISK_BLOCK;
+        }
+    }
+
+    bio_endio(bio, 0);
+    return 0;
+}
+
+struct device_operations ramdisk_ops = {
+    .dev_get_roblock    = ramdisk_get_roblock,
+    .dev_get_rwblock    = ramdisk_get_rwblock,
+    .dev_forget_block   = NULL,
+    .dev_size_of_block  = ramdisk_size_of_block,
+    .dev_size_in_blocks = ramdisk_size_in_blocks,
+    .dev_submit         = ramdisk_submit,
+};
+
+static device * get_ramdisk_device(mindev_t devno) {
+    return_dbg_if(!(devno < theRamDiskCount), NULL, "%s: ENOENT\n", __func__);
+    return &theRamDisks[devno]->dev;
+}
+
+struct devclass ramdisk_family = {
+    .dev_type       = DEV_BLK,
+    .dev_maj        = BLK_RAM,
+    .dev_class_name = "ram block devices",
+    .get_device     = get_ramdisk_device,
+    .init_devclass  = NULL,
+};
+
+struct devclass * get_ramdisk_devclass(void) {
+    return &ramdisk_family;
+}
+
+
+/*
+ *  Disks
+ */
+
+/* takes a disk with its rd_pages filled, makes /dev/ramN */
+static int ramdisk_register(struct ramdisk *rd, mindev_t *minor) {
+    mindev_t devno = theRamDiskCount;
+    device *dev = &rd->dev;
+    dev->dev_type = DEV_BLK;
+    dev->dev_clss = BLK_RAM;
+    dev->dev_no   = devno;
+    dev->dev_data = (void *)rd;
+    dev->dev_ops  = &ramdisk_ops;
+
+    theRamDisks[devno] = rd;
+    ++theRamDiskCount;
+
+    char name[] = "/dev/ram0";
+    name[8] = (char)('0' + devno);
+    int ret = vfs_mknod(name, S_IFBLK | 0660, gnu_dev_makedev(BLK_RAM, devno));
+    if (ret) logmsgef("mkdev b %d:%d %s: %s", BLK_RAM, devno, name, strerror(ret));
+
+    logmsgif("%s: ram%d, %d blocks%s", __func__,
+             devno, rd->rd_blocks, (rd->rd_readonly ? ", read-only" : ""));
+    if (minor) *minor = devno;
+    return 0;
+}
+
+static struct ramdisk * ramdisk_new(size_t size, bool readonly) {
+    return_err_if(theRamDiskCount >= RAMDISK_MAX, NULL,
+                  "%s: only %d RAM disks", __func__, RAMDISK_MAX);
+    return_dbg_if(size < RAMDISK_BLOCK, NULL, "%s: size %d\n", __func__, size);
+
+    struct ramdisk *rd = kmalloc(sizeof(struct ramdisk));
+    return_err_if(!rd, NULL, "%s: kmalloc failed", __func__);
+    memset(rd, 0, sizeof(struct ramdisk));
+
+    rd->rd_npages = pagealign_up(size) / PAGE_BYTES;
+    rd->rd_pages = kmalloc(rd->rd_npages * sizeof(char *));
+    if (!rd->rd_pages) {
+        logmsgef("%s: no memory for %d pages", __func__, rd->rd_npages);
+        kfree(rd);
+        return NULL;
+    }
+    rd->rd_blocks = (off_t)(size / RAMDISK_BLOCK);
+    rd->rd_readonly = readonly;
+    return rd;
+}
+
+int ramdisk_create(size_t size, mindev_t *minor) {
+    struct ramdisk *rd = ramdisk_new(size, false);
+    if (!rd) return ENOMEM;
+
+    count_t i;
+    for (i = 0; i < rd->rd_npages; ++i) {
+        void *frame = pmem_alloc(1);
+        if (!frame) {
+            /* the frames taken so far are not given back, as with pmem_free() */
+            logmsgef("%s: no memory for page %d of %d", __func__, i, rd->rd_npages);
+            kfree(rd->rd_pages);
+            kfree(rd);
+            return ENOMEM;
+        }
+        rd->rd_pages[i] = __va(frame);
+        memset(rd->rd_pages[i], 0, PAGE_BYTES);
+    }
+
+    return ramdisk_register(rd, minor);
+}
+
+int ramdisk_attach(char *mem, size_t size, bool readonly, mindev_t *minor) {
+    return_dbg_if((uintptr_t)mem % PAGE_BYTES, EINVAL,
+            "%s: *%x is not page-aligned\n", __func__, (uintptr_t)mem);
+
+    struct ramdisk *rd = ramdisk_new(size, readonly);
+    if (!rd) return ENOMEM;
+
+    count_t i;
+    for (i = 0; i < rd->rd_npages; ++i)
+        rd->rd_pages[i] = mem + i * PAGE_BYTES;
+
+    return ramdisk_register(rd, minor);
+}
+
+void ramdisk_setup_modules(void) {
+    count_t n_mods = 0;
+    module_t *mods;
+    mboot_modules_info(&n_mods, &mods);
+
+    size_t i;
+    for (i = 0; i < n_mods; ++i) {
+        if (!mods[i].string) continue;
+
+        const char *modname = (const char *)mods[i].string;
+        size_t namelen = strlen(modname);
+        if ((namelen < 4) || strcmp(modname + namelen - 4, ".img"))
+            continue;
+
+        mindev_t minor;
+        char *modstart = (char *)mods[i].mod_start;
+        size_t size = mods[i].mod_end - mods[i].mod_start;
+        int ret = ramdisk_attach(modstart, size, false, &minor);
+        if (ret) {
+            logmsgef("%s: module %s: %s", __func__, modname, strerror(ret));
+            continue;
+        }
+        k_printf(" module %s :\t/dev/ram%d\n", modname, minor);
+    }
+}
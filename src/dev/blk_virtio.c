@@ -0,0 +1,312 @@
+#include <string.h>
+#include <stdio.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+
+#include <cosec/log.h>
+
+#include "attrs.h"
+#include "mem/kheap.h"
+#include "mem/paging.h"
+#include "mem/pmem.h"
+#include "dev/intrs.h"
+#include "dev/pci.h"
+#include "dev/virtio.h"
+#include "arch/i386.h"
+#include "fs/devices.h"
+#include "fs/bio.h"
+#include "fs/blkqueue.h"
+#include "fs/vfs.h"
+
+/*
+ *  virtio-blk, block devices BLK_VIRTIO:N (/dev/vdX).
+ *  Every request takes one descriptor of the virtqueue, an indirect
+ *  one: its table in the request's slot lists the header, the data
+ *  segments and the status byte. So up to a queue size of requests
+ *  are in flight; they are completed from the IRQ in the order the
+ *  device finishes them.
+ */
+
+#define VBLK_MAX_DEVICES    4
+#define VBLK_SECTOR         512
+
+/* the device-specific configuration */
+#define VIO_BLK_CAPACITY    0   /* 64, R, in sectors */
+
+/* VIO_Dxx_FEATURE for a block device */
+enum vio_blk_features {
+    VIRTIO_BLK_F_RO         = (1u << 5),
+    VIRTIO_BLK_F_BLK_SIZE   = (1u << 6),
+    VIRTIO_BLK_F_FLUSH      = (1u << 9),
+};
+
+enum vio_blk_type {
+    VIRTIO_BLK_T_IN     = 0,
+    VIRTIO_BLK_T_OUT    = 1,
+    VIRTIO_BLK_T_FLUSH  = 4,
+};
+
+enum vio_blk_status {
+    VIRTIO_BLK_S_OK     = 0,
+    VIRTIO_BLK_S_IOERR  = 1,
+    VIRTIO_BLK_S_UNSUPP = 2,
+};
+
+struct __packed virtio_blk_hdr {
+    uint32_t type;      /* see: enum vio_blk_type */
+    uint32_t ioprio;
+    uint64_t sector;
+};
+
+#define VBLK_INDIRECT       64  /* descriptors in a request's table */
+#define VBLK_MAX_SEGMENTS   (VBLK_INDIRECT - 2)
+
+/* what the device reads and writes for a request, 16-byte aligned */
+struct __packed vblk_slot {
+    struct vring_desc       vs_table[VBLK_INDIRECT];
+    struct virtio_blk_hdr   vs_hdr;
+    uint8_t                 vs_status;
+    uint8_t                 vs_pad[15];
+};
+
+struct virtio_blk_device {
+    struct virtio_device virtio;
+    struct virtioq  vq;
+
+    device          dev;
+    off_t           sectors;
+    bool            readonly;
+
+    struct request_queue queue;
+    struct vblk_slot *slots;    /* vq.size of them */
+    size_t          slots_npages;
+    struct request **slot_rqs;  /* the request in flight in a slot */
+    uint16_t *      free_slots; /* a stack */
+    uint16_t        nfree;
+};
+
+static struct virtio_blk_device *theVirtBlk[VBLK_MAX_DEVICES];
+static count_t theVirtBlkCount = 0;
+
+
+static int blk_virtio_request(struct request_queue *q, struct request *rq) {
+    struct virtio_blk_device *vblk = q->q_data;
+    bool reading = (rq->rq_op == BIO_READ);
+    struct bio *bio;
+
+    return_dbg_if(rq->rq_nsegs > VBLK_MAX_SEGMENTS, EINVAL,
+            "%s: %d segments\n", __func__, rq->rq_nsegs);
+    if (!reading && vblk->readonly)
+        return EROFS;
+    return_err_if(!vblk->nfree, EBUSY, "%s: no free slots", __func__);
+
+    uint16_t slot = vblk->free_slots[--vblk->nfree];
+    struct vblk_slot *vs = vblk->slots + slot;
+
+    vs->vs_hdr.type = (reading ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT);
+    vs->vs_hdr.ioprio = 0;
+    vs->vs_hdr.sector = (uint64_t)rq->rq_block;
+    vs->vs_status = 0xFF;
+
+    struct vring_desc *d = vs->vs_table;
+    uint16_t n = 0;
+    d[n].addr = (uint64_t)(uint32_t)__pa(&vs->vs_hdr);
+    d[n].len = sizeof(struct virtio_blk_hdr);
+    d[n].flags = VIRTQ_DESC_F_NEXT;
+    d[n].next = n + 1;
+    ++n;
+
+    for (bio = rq->rq_bio; bio; bio = bio->bi_next) {
+        count_t v;
+        for (v = 0; v < bio->bi_vcnt; ++v, ++n) {
+            d[n].addr = (uint64_t)(uint32_t)__pa(bio->bi_io_vec[v].bv_data);
+            d[n].len = bio->bi_io_vec[v].bv_len;
+            d[n].flags = VIRTQ_DESC_F_NEXT | (reading ? VIRTQ_DESC_F_WRITE : 0);
+            d[n].next = n + 1;
+        }
+    }
+
+    d[n].addr = (uint64_t)(uint32_t)__pa(&vs->vs_status);
+    d[n].len = 1;
+    d[n].flags = VIRTQ_DESC_F_WRITE;
+    d[n].next = 0;
+    ++n;
+
+    virtioq_set_indirect(&vblk->vq, slot, vs->vs_table, n);
+
+    vblk->slot_rqs[slot] = rq;
+    virtioq_enqueue(&vblk->vq, slot);
+    virtioq_kick(&vblk->vq);
+    return 0;
+}
+
+static void blk_virtio_complete(struct virtio_blk_device *vblk) {
+    struct vring_used_elem used;
+
+    while (virtioq_pop_used(&vblk->vq, &used)) {
+        uint16_t slot = (uint16_t)used.id;
+
+        struct request *rq = vblk->slot_rqs[slot];
+        if (!rq) {
+            logmsgef("%s: slot %d is not in flight", __func__, slot);
+            continue;
+        }
+        uint8_t status = vblk->slots[slot].vs_status;
+        vblk->slot_rqs[slot] = NULL;
+        vblk->free_slots[vblk->nfree++] = slot;
+
+        int error = 0;
+        if (status != VIRTIO_BLK_S_OK) {
+            logmsgef("%s: vd%c, blocks [%d, +%d): status %d", __func__,
+                     'a' + vblk->dev.dev_no, rq->rq_block, rq->rq_nblocks, (uint)status);
+            error = EIO;
+        }
+        blk_end_request(&vblk->queue, rq, error);
+    }
+}
+
+static void blk_virtio_intr(struct virtio_device *dev, uint8_t isr) {
+    if (isr & VIRTIO_ISR_QUEUE)
+        blk_virtio_complete(dev->priv);
+}
+
+
+/*
+ *  Devices
+ */
+
+static size_t blk_virtio_size_of_block(device *dev) {
+    UNUSED(dev);
+    return VBLK_SECTOR;
+}
+
+static off_t blk_virtio_size_in_blocks(device *dev) {
+    struct virtio_blk_device *vblk = dev->dev_data;
+    return vblk->sectors;
+}
+
+struct device_operations blk_virtio_ops = {
+    .dev_size_of_block  = blk_virtio_size_of_block,
+    .dev_size_in_blocks = blk_virtio_size_in_blocks,
+};
+
+static device * get_blk_virtio_device(mindev_t devno) {
+    return_dbg_if(!(devno < theVirtBlkCount), NULL, "%s: ENOENT", __func__);
+    return &theVirtBlk[devno]->dev;
+}
+
+struct devclass blk_virtio_family = {
+    .dev_type       = DEV_BLK,
+    .dev_maj        = BLK_VIRTIO,
+    .dev_class_name = "virtio disks",
+    .get_device     = get_blk_virtio_device,
+    .init_devclass  = NULL,
+};
+
+static int blk_virtio_setup(struct virtio_blk_device *vblk) {
+    uint16_t i, qsz;
+    int ret;
+
+    /* negotiate features */
+    ret = virtio_negotiate(&vblk->virtio,
+            VIRTIO_F_RING_INDIR_DESC | VIRTIO_F_RING_EVENT_IDX | VIRTIO_BLK_F_RO);
+    return_msg_if(ret, ret, "%s: feature negotiation failed(%d)\n", __func__, ret);
+    vblk->readonly = (vblk->virtio.features & VIRTIO_BLK_F_RO) != 0;
+
+    /* the request queue */
+    ret = virtio_queue_setup(&vblk->virtio, &vblk->vq, 0, 0);
+    return_msg_if(ret, ret, "%s: vq setup failed(%d)\n", __func__, ret);
+    qsz = vblk->vq.size;
+
+    vblk->slots_npages = pagealign_up(qsz * sizeof(struct vblk_slot)) / PAGE_BYTES;
+    vblk->slots = kmem_alloc(vblk->slots_npages);
+    vblk->slot_rqs = kmalloc(qsz * sizeof(struct request *));
+    vblk->free_slots = kmalloc(qsz * sizeof(uint16_t));
+    return_err_if(!(vblk->slots && vblk->slot_rqs && vblk->free_slots), -ENOMEM,
+                  "%s: no memory for %d slots", __func__, qsz);
+
+    for (i = 0; i < qsz; ++i) {
+        vblk->slot_rqs[i] = NULL;
+        vblk->free_slots[i] = (uint16_t)(qsz - 1 - i);
+    }
+    vblk->nfree = qsz;
+
+    /* enable this virtio driver */
+    virtio_driver_ok(&vblk->virtio);
+    return 0;
+}
+
+int blk_virtio_init(pci_config_t *pciconf, uint bus, uint slot) {
+    uint32_t caplo, caphi;
+    int ret;
+
+    /* a transitional device or a virtio 1.0 one */
+    bool isblk = (pciconf->pci.device == 0x1042)
+              || (pciconf->pci_subsystem_id == 2);
+    assert(isblk, -EINVAL,
+           "%s: pci->subsystem_id is not VIRTIO_BLK\n", __func__);
+    return_err_if(theVirtBlkCount >= VBLK_MAX_DEVICES, -ETODO,
+                  "%s: only %d virtio disks at the moment\n", __func__, VBLK_MAX_DEVICES);
+
+    struct virtio_blk_device *vblk;
+    vblk = kmalloc(sizeof(struct virtio_blk_device));
+    return_err_if(!vblk, -ENOMEM, "%s: kmalloc failed", __func__);
+    memset(vblk, 0, sizeof(struct virtio_blk_device));
+
+    ret = virtio_pci_init(&vblk->virtio, pciconf, bus, slot);
+    if (ret) {
+        kfree(vblk);
+        return ret;
+    }
+    if (!(vblk->virtio.features & VIRTIO_F_RING_INDIR_DESC)) {
+        logmsgef("%s: no indirect descriptors, aborting configuration", __func__);
+        virtio_reset(&vblk->virtio);
+        kfree(vblk);
+        return -ENOSYS;
+    }
+
+    caplo = virtio_config_read32(&vblk->virtio, VIO_BLK_CAPACITY);
+    caphi = virtio_config_read32(&vblk->virtio, VIO_BLK_CAPACITY + 4);
+    vblk->sectors = ((caphi || (caplo > 0x7FFFFFFF)) ? 0x7FFFFFFF : (off_t)caplo);
+
+    ret = blk_virtio_setup(vblk);
+    if (ret) {
+        logmsgef("%s: blk_virtio_setup failed (%d)", __func__, ret);
+        virtio_reset(&vblk->virtio);
+        kfree(vblk);
+        return ret;
+    }
+
+    mindev_t devno = theVirtBlkCount;
+    device *dev = &vblk->dev;
+    dev->dev_type = DEV_BLK;
+    dev->dev_clss = BLK_VIRTIO;
+    dev->dev_no   = devno;
+    dev->dev_data = (void *)vblk;
+    dev->dev_ops  = &blk_virtio_ops;
+
+    blk_queue_init(&vblk->queue, dev, blk_virtio_request);
+    vblk->queue.q_data = vblk;
+    vblk->queue.q_depth = vblk->vq.size;
+    vblk->queue.q_max_segments = VBLK_MAX_SEGMENTS;
+    dev->dev_queue = &vblk->queue;
+
+    if (devno == 0)
+        devclass_register(&blk_virtio_family);
+    theVirtBlk[devno] = vblk;
+    ++theVirtBlkCount;
+
+    vblk->virtio.on_intr = blk_virtio_intr;
+    vblk->virtio.priv = vblk;
+    virtio_irq_register(&vblk->virtio);
+
+    char name[] = "/dev/vda";
+    name[7] = (char)('a' + devno);
+    ret = vfs_mknod(name, S_IFBLK | 0660, gnu_dev_makedev(BLK_VIRTIO, devno));
+    if (ret) logmsgef("mkdev b %d:%d %s: %s", BLK_VIRTIO, devno, name, strerror(ret));
+
+    logmsgif("%s: vd%c, %d sectors%s, queue of %d, intr = #%d", __func__,
+             'a' + devno, vblk->sectors, (vblk->readonly ? ", read-only" : ""),
+             vblk->vq.size, vblk->virtio.intr);
+    return 0;
+}
@@ -1,12 +1,41 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+
 #include <cosec/log.h>
+
 #include <arch/i386.h>
+#include <mem/paging.h>
+#include <mem/pmem.h>
+
+#include <dev/intrs.h>
+#include <dev/pci.h>
+#include <dev/ide.h>
+
+#include <fs/devices.h>
+#include <fs/bio.h>
+#include <fs/blkqueue.h>
+
+/*
+ *  The ATA driver.
+ *  Drives are found with IDENTIFY at boot. Requests come from their
+ *  request queues; a channel runs one command at a time, the request
+ *  of the other drive waits for it in d_pending. With a PCI bus master
+ *  IDE controller (PIIX in QEMU) a request is one READ/WRITE DMA
+ *  command over a PRD table of its segments, completed from the IRQ;
+ *  without it the sectors are moved by polled PIO. LBA48 commands are
+ *  used only for blocks beyond the reach of LBA28.
+ */
 
 #define IDE_PRIMARY         0x1F0
 #define IDE_PRIMARY_CTRL    0x3F6
-#define IDE_SLAVE           0x170
-#define IDE_SLAVE_CTRL      0x376
+#define IDE_PRIMARY_IRQ     14
+#define IDE_SECONDARY       0x170
+#define IDE_SECONDARY_CTRL  0x376
+#define IDE_SECONDARY_IRQ   15
 
 // port offsets
+#define DATAPORT        0x0
 #define SECTCOUNT       0x2
 #define LBA_lo          0x3
 #define LBA_mid         0x4
@@ -15,49 +44,541 @@
 #define CMDPORT         0x7
 #define STATUSPORT      0x7
 
+// the device control register at the control port
+#define CTRL_nIEN       0x02    /* no interrupts from the drive */
+
+// status bits
+#define STA_ERR         0x01
+#define STA_DRQ         0x08
+#define STA_DF          0x20
+#define STA_BSY         0x80
+
 #define DRIVE_MASTER    0xA0
 #define DRIVE_SLAVE     0xB0
+#define DRIVE_LBA       0x40
+
+#define IDE_CMD_READ            0x20
+#define IDE_CMD_READ_EXT        0x24
+#define IDE_CMD_READ_DMA_EXT    0x25
+#define IDE_CMD_WRITE           0x30
+#define IDE_CMD_WRITE_EXT       0x34
+#define IDE_CMD_WRITE_DMA_EXT   0x35
+#define IDE_CMD_READ_DMA        0xC8
+#define IDE_CMD_WRITE_DMA       0xCA
+#define IDE_CMD_IDENTIFY        0xEC
 
-#define IDE_CMD_IDENTIFY    0xEC
+// bus master registers, the secondary channel ones are at +8
+#define BM_COMMAND      0x0
+#define BM_STATUS       0x2
+#define BM_PRDT         0x4
 
-uint8_t ide_info_buf[512];
+#define BM_CMD_START    0x01
+#define BM_CMD_READ     0x08    /* from the drive to memory */
+#define BM_STA_ERR      0x02
+#define BM_STA_IRQ      0x04
 
-uint8_t ide_identify(uint port, uint8_t drive) {
-    outb_p(port + DRIVE_SELECT, drive);   // identify Primary Master
+#define IDE_LBA28_MAX   0x0FFFFFFF
+#define IDE_WAIT_LOOPS  1000000
 
-    outb(port + SECTCOUNT, 0);
-    outb(port + LBA_lo, 0);
-    outb(port + LBA_mid, 0);
-    outb(port + LBA_hi, 0);
+/* a Physical Region Descriptor: a segment that does not cross 64K */
+struct __packed ide_prd {
+    uint32_t    prd_addr;
+    uint16_t    prd_len;        /* 0 for 64K */
+    uint16_t    prd_flags;
+};
+#define PRD_EOT         0x8000
+#define IDE_PRD_MAX     (PAGE_BYTES / sizeof(struct ide_prd))
 
-    outb_p(port + CMDPORT, IDE_CMD_IDENTIFY);
+struct ide_drive;
+
+struct ide_channel {
+    uint16_t    ch_port;
+    uint16_t    ch_ctrl;
+    uint16_t    ch_bmport;      /* 0 if there is no bus master: PIO only */
+    irqnum_t    ch_irq;
+    struct ide_prd *ch_prdt;    /* a page */
+    struct ide_drive *ch_active;    /* the drive of the running DMA command */
+    struct request *ch_rq;          /* and its request */
+};
+
+struct ide_drive {
+    device      d_dev;
+    struct ide_channel *d_chan;
+    uint8_t     d_select;       /* DRIVE_MASTER or DRIVE_SLAVE */
+    bool        d_present;
+    bool        d_lba48;
+    off_t       d_sectors;
+    char        d_model[41];
+
+    struct request_queue d_queue;
+    struct request *d_pending;  /* dispatched while the channel was busy */
+};
+
+static struct ide_channel theIdeChannels[IDE_NCHANNELS];
+static struct ide_drive theIdeDrives[IDE_NDRIVES];
+
+static uint16_t ide_info_buf[256];
+
+
+static inline uint8_t ide_status(struct ide_channel *ch) {
+    uint8_t status;
+    inb(ch->ch_port + STATUSPORT, status);
+    return status;
+}
 
+/* a drive needs 400ns after selection or a command to show its status */
+static void ide_delay(struct ide_channel *ch) {
     uint8_t status;
-    inb(port + STATUSPORT, status);
-    if (!status) return 0;
+    int i;
+    for (i = 0; i < 4; ++i)
+        inb(ch->ch_ctrl, status);
+    UNUSED(status);
+}
+
+/* waits until the drive is not busy and (status & mask) == value */
+static int ide_wait(struct ide_channel *ch, uint8_t mask, uint8_t value) {
+    uint i;
+    for (i = 0; i < IDE_WAIT_LOOPS; ++i) {
+        uint8_t status = ide_status(ch);
+        if (status & STA_BSY)
+            continue;
+        if (status & (STA_ERR | STA_DF))
+            return EIO;
+        if ((status & mask) == value)
+            return 0;
+    }
+    logmsgef("%s(0x%x): timeout", __func__, (uint)ch->ch_port);
+    return EIO;
+}
+
+static bool ide_use_lba48(struct ide_drive *drive, off_t block, count_t nsect) {
+    return drive->d_lba48 && ((uint32_t)(block + nsect) > IDE_LBA28_MAX);
+}
+
+static void ide_command(struct ide_drive *drive, uint8_t cmd,
+                        off_t block, count_t nsect, bool lba48)
+{
+    struct ide_channel *ch = drive->d_chan;
+    uint16_t port = ch->ch_port;
+    uint32_t lba = (uint32_t)block;
+
+    if (lba48) {
+        outb(port + DRIVE_SELECT, (uint8_t)(drive->d_select | DRIVE_LBA));
+        ide_delay(ch);
+
+        /* the high bytes first */
+        outb(port + SECTCOUNT, (uint8_t)(nsect >> 8));
+        outb(port + LBA_lo, (uint8_t)(lba >> 24));
+        outb(port + LBA_mid, (uint8_t)0);
+        outb(port + LBA_hi, (uint8_t)0);
+    } else {
+        outb(port + DRIVE_SELECT, (uint8_t)(drive->d_select | DRIVE_LBA | ((lba >> 24) & 0xF)));
+        ide_delay(ch);
+    }
+    outb(port + SECTCOUNT, (uint8_t)nsect);     /* 256 is 0 */
+    outb(port + LBA_lo, (uint8_t)lba);
+    outb(port + LBA_mid, (uint8_t)(lba >> 8));
+    outb(port + LBA_hi, (uint8_t)(lba >> 16));
+
+    outb(port + CMDPORT, cmd);
+}
+
+
+/*
+ *  PIO
+ */
 
-    while (status & 0x80)   inb_p(port + STATUSPORT, status);
+static int ide_pio_transfer(struct ide_drive *drive, struct request *rq) {
+    struct ide_channel *ch = drive->d_chan;
+    bool lba48 = ide_use_lba48(drive, rq->rq_block, rq->rq_nblocks);
+    bool reading = (rq->rq_op == BIO_READ);
+    uint8_t cmd;
+    struct bio *bio;
+    int ret;
 
-    while (!(status & 0x09)) inb_p(port + STATUSPORT, status);
+    if (reading)
+        cmd = (lba48 ? IDE_CMD_READ_EXT : IDE_CMD_READ);
+    else
+        cmd = (lba48 ? IDE_CMD_WRITE_EXT : IDE_CMD_WRITE);
 
-    if (status & 0x01) {
-        logmsge("ide_identify: ERR bit set");
+    outb(ch->ch_ctrl, (uint8_t)CTRL_nIEN);
+    ide_command(drive, cmd, rq->rq_block, rq->rq_nblocks, lba48);
+    ide_delay(ch);
+
+    for (bio = rq->rq_bio; bio; bio = bio->bi_next) {
+        count_t v;
+        for (v = 0; v < bio->bi_vcnt; ++v) {
+            struct bio_vec *bv = bio->bi_io_vec + v;
+            size_t off;
+            for (off = 0; off < bv->bv_len; off += IDE_SECTOR) {
+                uint16_t *buf = (uint16_t *)(bv->bv_data + off);
+                int i;
+
+                ret = ide_wait(ch, STA_DRQ, STA_DRQ);
+                if (ret) return ret;
+
+                if (reading) {
+                    for (i = 0; i < IDE_SECTOR / 2; ++i)
+                        inw(ch->ch_port + DATAPORT, buf[i]);
+                } else {
+                    for (i = 0; i < IDE_SECTOR / 2; ++i)
+                        outw(ch->ch_port + DATAPORT, buf[i]);
+                }
+                ide_delay(ch);
+            }
+        }
+    }
+
+    return ide_wait(ch, 0, 0);
+}
+
+
+/*
+ *  DMA
+ */
+
+/* describes the segments of `rq` in the PRD table of its channel */
+static int ide_fill_prdt(struct ide_channel *ch, struct request *rq) {
+    struct ide_prd *prd = ch->ch_prdt;
+    count_t n = 0;
+    struct bio *bio;
+
+    for (bio = rq->rq_bio; bio; bio = bio->bi_next) {
+        count_t v;
+        for (v = 0; v < bio->bi_vcnt; ++v) {
+            uint32_t addr = (uint32_t)__pa(bio->bi_io_vec[v].bv_data);
+            size_t len = bio->bi_io_vec[v].bv_len;
+            return_dbg_if(addr & 1, EINVAL, "%s: odd address *%x\n", __func__, addr);
+
+            while (len) {
+                size_t chunk = 0x10000 - (addr & 0xFFFF);
+                if (chunk > len)
+                    chunk = len;
+                return_dbg_if(n >= IDE_PRD_MAX, EINVAL, "%s: too many segments\n", __func__);
+
+                prd[n].prd_addr = addr;
+                prd[n].prd_len = (uint16_t)chunk;
+                prd[n].prd_flags = 0;
+                ++n;
+
+                addr += chunk;
+                len -= chunk;
+            }
+        }
+    }
+
+    prd[n - 1].prd_flags = PRD_EOT;
+    return 0;
+}
+
+static int ide_dma_start(struct ide_drive *drive, struct request *rq) {
+    struct ide_channel *ch = drive->d_chan;
+    uint16_t bm = ch->ch_bmport;
+    bool lba48 = ide_use_lba48(drive, rq->rq_block, rq->rq_nblocks);
+    uint8_t dir, cmd, bmstatus;
+
+    int ret = ide_fill_prdt(ch, rq);
+    if (ret) return ret;
+
+    if (rq->rq_op == BIO_READ) {
+        dir = BM_CMD_READ;
+        cmd = (lba48 ? IDE_CMD_READ_DMA_EXT : IDE_CMD_READ_DMA);
+    } else {
+        dir = 0;
+        cmd = (lba48 ? IDE_CMD_WRITE_DMA_EXT : IDE_CMD_WRITE_DMA);
+    }
+
+    outl(bm + BM_PRDT, (uint32_t)__pa(ch->ch_prdt));
+    outb(bm + BM_COMMAND, dir);
+    inb(bm + BM_STATUS, bmstatus);
+    outb(bm + BM_STATUS, (uint8_t)(bmstatus | BM_STA_ERR | BM_STA_IRQ));   /* write 1 to clear */
+
+    outb(ch->ch_ctrl, (uint8_t)0);
+    ide_command(drive, cmd, rq->rq_block, rq->rq_nblocks, lba48);
+
+    outb(bm + BM_COMMAND, (uint8_t)(dir | BM_CMD_START));
+    return 0;
+}
+
+/* starts `rq` on the idle channel of `drive` */
+static int ide_start(struct ide_drive *drive, struct request *rq) {
+    struct ide_channel *ch = drive->d_chan;
+
+    if (!ch->ch_bmport) {
+        int ret = ide_pio_transfer(drive, rq);
+        blk_end_request(&drive->d_queue, rq, ret);
         return 0;
     }
 
-    uint16_t p = port;
-    n_insw(p, ide_info_buf, (uint16_t)256);
+    ch->ch_active = drive;
+    ch->ch_rq = rq;
+    int ret = ide_dma_start(drive, rq);
+    if (ret)
+        ch->ch_active = NULL;
+    return ret;
+}
 
-    return status;
+static int ide_request(struct request_queue *q, struct request *rq) {
+    struct ide_drive *drive = q->q_data;
+
+    if (drive->d_chan->ch_active) {
+        drive->d_pending = rq;
+        return 0;
+    }
+    return ide_start(drive, rq);
 }
 
-void ide_init(uint prm_port, uint prm_ctrl, uint slv_port, uint slv_ctrl) {
-    uint8_t ret = 0;
-    ret = ide_identify(prm_port, DRIVE_MASTER);
-    k_printf("Primary master identification: %x\n", (uint)ret);
+static void ide_channel_intr(struct ide_channel *ch) {
+    uint16_t bm = ch->ch_bmport;
+    uint8_t bmstatus, status;
+
+    inb(bm + BM_STATUS, bmstatus);
+    if (!(bmstatus & BM_STA_IRQ))
+        return;     /* not this channel */
+
+    outb(bm + BM_COMMAND, (uint8_t)0);
+    status = ide_status(ch);        /* acknowledges the drive's interrupt */
+    outb(bm + BM_STATUS, (uint8_t)(bmstatus | BM_STA_ERR | BM_STA_IRQ));
+
+    struct ide_drive *drive = ch->ch_active;
+    if (!drive) {
+        logmsgdf("%s(0x%x): spurious\n", __func__, (uint)ch->ch_port);
+        return;
+    }
+    int error = ((bmstatus & BM_STA_ERR) || (status & (STA_ERR | STA_DF))) ? EIO : 0;
+    struct request *rq = ch->ch_rq;
+    ch->ch_active = NULL;
+
+    /* the other drive of the channel goes first if it waits */
+    struct ide_drive *other = theIdeDrives + 2 * (ch - theIdeChannels);
+    if (other == drive)
+        ++other;
+    if (other->d_pending) {
+        struct request *next = other->d_pending;
+        other->d_pending = NULL;
+
+        int ret = ide_start(other, next);
+        if (ret)
+            blk_end_request(&other->d_queue, next, ret);
+    }
+
+    if (error)
+        logmsgef("%s: hd%c, blocks [%d, +%d): status 0x%x, bus master 0x%x", __func__,
+                 'a' + drive->d_dev.dev_no, rq->rq_block, rq->rq_nblocks,
+                 (uint)status, (uint)bmstatus);
+    blk_end_request(&drive->d_queue, rq, error);
+}
+
+static void ide_irq() {
+    int i;
+    for (i = 0; i < IDE_NCHANNELS; ++i)
+        if (theIdeChannels[i].ch_bmport)
+            ide_channel_intr(theIdeChannels + i);
+}
+
+
+/*
+ *  Devices
+ */
+
+static size_t ide_size_of_block(device *dev) {
+    UNUSED(dev);
+    return IDE_SECTOR;
+}
+
+static off_t ide_size_in_blocks(device *dev) {
+    struct ide_drive *drive = dev->dev_data;
+    return drive->d_sectors;
+}
+
+struct device_operations ide_ops = {
+    .dev_size_of_block  = ide_size_of_block,
+    .dev_size_in_blocks = ide_size_in_blocks,
+};
+
+static bool ide_identify(struct ide_drive *drive) {
+    struct ide_channel *ch = drive->d_chan;
+    uint16_t port = ch->ch_port;
+    uint8_t status, mid, hi;
+    int i;
+
+    outb(ch->ch_ctrl, (uint8_t)CTRL_nIEN);
+    outb(port + DRIVE_SELECT, drive->d_select);
+    ide_delay(ch);
+
+    outb(port + SECTCOUNT, (uint8_t)0);
+    outb(port + LBA_lo, (uint8_t)0);
+    outb(port + LBA_mid, (uint8_t)0);
+    outb(port + LBA_hi, (uint8_t)0);
+    outb(port + CMDPORT, (uint8_t)IDE_CMD_IDENTIFY);
+    ide_delay(ch);
+
+    status = ide_status(ch);
+    if (!status || (status == 0xFF))
+        return false;   /* no drive, a floating bus */
+
+    for (i = 0; (status & STA_BSY) && (i < IDE_WAIT_LOOPS); ++i)
+        status = ide_status(ch);
+    if (status & STA_BSY)
+        return false;
+
+    /* ATAPI and SATA devices abort IDENTIFY with their signature here */
+    inb(port + LBA_mid, mid);
+    inb(port + LBA_hi, hi);
+    if (mid || hi)
+        return false;
+
+    if (ide_wait(ch, STA_DRQ, STA_DRQ))
+        return false;
+
+    for (i = 0; i < 256; ++i)
+        inw(port + DATAPORT, ide_info_buf[i]);
+
+    return_dbg_if(!(ide_info_buf[49] & 0x0200), false,
+            "%s: hd%c has no LBA\n", __func__, 'a' + drive->d_dev.dev_no);
+
+    drive->d_lba48 = (ide_info_buf[83] & 0x0400) != 0;
+    uint32_t sectors = ide_info_buf[60] | ((uint32_t)ide_info_buf[61] << 16);
+    if (drive->d_lba48) {
+        if (ide_info_buf[102] || ide_info_buf[103])
+            sectors = 0xFFFFFFFF;
+        else
+            sectors = ide_info_buf[100] | ((uint32_t)ide_info_buf[101] << 16);
+    }
+    if (sectors > 0x7FFFFFFF)
+        sectors = 0x7FFFFFFF;   /* off_t */
+    drive->d_sectors = sectors;
+
+    /* the model string has its bytes swapped in words */
+    for (i = 0; i < 20; ++i) {
+        drive->d_model[2*i] = (char)(ide_info_buf[27 + i] >> 8);
+        drive->d_model[2*i + 1] = (char)(ide_info_buf[27 + i] & 0xFF);
+    }
+    for (i = 40; (i > 0) && (drive->d_model[i - 1] == ' '); --i) ;
+    drive->d_model[i] = 0;
+
+    return true;
 }
 
-void ide_setup(void) {
-    /* assume they have fixed ports, not configuring through PCI */
-    ide_init(IDE_PRIMARY, IDE_PRIMARY_CTRL, IDE_SLAVE, IDE_SLAVE_CTRL);
+/* gets ports of the PCI IDE controller if there is one */
+static void ide_probe_pci(void) {
+    uint bus, slot, func;
+    if (!pci_find_class(0x01, 0x01, &bus, &slot, &func)) {
+        logmsgif("%s: no PCI IDE controller, PIO only", __func__);
+        return;
+    }
+
+    uint clss = pci_config_read_dword(bus, slot, func, PCI_CONF_CLASS);
+    uint8_t progif = (uint8_t)(clss >> 8);
+    uint8_t intr = (uint8_t)pci_config_read_dword(bus, slot, func, PCI_CONF_INTR);
+    int i;
+
+    for (i = 0; i < IDE_NCHANNELS; ++i) {
+        struct ide_channel *ch = theIdeChannels + i;
+
+        /* a channel in the native mode has its ports in BARs */
+        if (progif & (1 << (2 * i))) {
+            uint bar = pci_config_read_dword(bus, slot, func, PCI_CONF_BAR0 + 8 * i);
+            uint ctrlbar = pci_config_read_dword(bus, slot, func, PCI_CONF_BAR0 + 8 * i + 4);
+            ch->ch_port = bar & 0xFFFC;
+            ch->ch_ctrl = (ctrlbar & 0xFFFC) + 2;
+            ch->ch_irq = intr;
+        }
+    }
+
+    if (!(progif & 0x80)) {
+        logmsgif("%s: pci %d:%d.%d, no bus mastering, PIO only", __func__, bus, slot, func);
+        return;
+    }
+
+    uint bar4 = pci_config_read_dword(bus, slot, func, PCI_CONF_BAR0 + 4 * 4);
+    if (!(bar4 & 1) || !(bar4 & 0xFFFC)) {
+        logmsgif("%s: pci %d:%d.%d, no bus master ports, PIO only", __func__, bus, slot, func);
+        return;
+    }
+
+    uint cmd = pci_config_read_dword(bus, slot, func, PCI_CONF_COMMAND);
+    pci_config_write_dword(bus, slot, func, PCI_CONF_COMMAND,
+                           (cmd & 0xFFFF) | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+    for (i = 0; i < IDE_NCHANNELS; ++i)
+        theIdeChannels[i].ch_bmport = (bar4 & 0xFFFC) + 8 * i;
+    logmsgif("%s: pci %d:%d.%d, bus master at 0x%x", __func__, bus, slot, func, bar4 & 0xFFFC);
+}
+
+static void init_ide_devices(void) {
+    int i;
+
+    theIdeChannels[0].ch_port = IDE_PRIMARY;
+    theIdeChannels[0].ch_ctrl = IDE_PRIMARY_CTRL;
+    theIdeChannels[0].ch_irq = IDE_PRIMARY_IRQ;
+    theIdeChannels[1].ch_port = IDE_SECONDARY;
+    theIdeChannels[1].ch_ctrl = IDE_SECONDARY_CTRL;
+    theIdeChannels[1].ch_irq = IDE_SECONDARY_IRQ;
+    ide_probe_pci();
+
+    for (i = 0; i < IDE_NDRIVES; ++i) {
+        struct ide_drive *drive = theIdeDrives + i;
+        device *dev = &drive->d_dev;
+
+        drive->d_chan = theIdeChannels + i / 2;
+        drive->d_select = (i % 2 ? DRIVE_SLAVE : DRIVE_MASTER);
+
+        dev->dev_type = DEV_BLK;
+        dev->dev_clss = BLK_IDE;
+        dev->dev_no   = i;
+        dev->dev_data = (void *)drive;
+        dev->dev_ops  = &ide_ops;
+
+        drive->d_present = ide_identify(drive);
+        if (!drive->d_present)
+            continue;
+
+        blk_queue_init(&drive->d_queue, dev, ide_request);
+        drive->d_queue.q_data = drive;
+        dev->dev_queue = &drive->d_queue;
+
+        logmsgif("hd%c: %s, %d sectors%s", 'a' + i, drive->d_model, drive->d_sectors,
+                 (drive->d_lba48 ? ", LBA48" : ""));
+    }
+
+    for (i = 0; i < IDE_NCHANNELS; ++i) {
+        struct ide_channel *ch = theIdeChannels + i;
+        if (!ch->ch_bmport)
+            continue;
+        if (!(theIdeDrives[2*i].d_present || theIdeDrives[2*i + 1].d_present)) {
+            ch->ch_bmport = 0;
+            continue;
+        }
+
+        ch->ch_prdt = kmem_alloc(1);
+        if (!ch->ch_prdt) {
+            logmsgef("%s: no memory for a PRD table, PIO only", __func__);
+            ch->ch_bmport = 0;
+            continue;
+        }
+
+        irq_set_handler(ch->ch_irq, ide_irq);
+        irq_enable(ch->ch_irq);
+    }
+}
+
+static device * get_ide_device(mindev_t devno) {
+    return_dbg_if(!(devno < IDE_NDRIVES), NULL, "%s: ENOENT", __func__);
+    if (!theIdeDrives[devno].d_present)
+        return NULL;
+
+    return &theIdeDrives[devno].d_dev;
+}
+
+struct devclass ide_family = {
+    .dev_type       = DEV_BLK,
+    .dev_maj        = BLK_IDE,
+    .dev_class_name = "ATA disks",
+    .get_device     = get_ide_device,
+    .init_devclass  = init_ide_devices,
+};
+
+struct devclass * get_ide_devclass(void) {
+    return &ide_family;
 }
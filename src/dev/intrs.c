@@ -16,6 +16,7 @@
 #include <dev/intrs.h>
 
 #include <mem/paging.h>
+#include <signals.h>
 
 #include <stdio.h>
 #include <sys/errno.h>
@@ -139,12 +140,18 @@ void irq_handler(void *stack, uint32_t irq_num) {
         outb(PIC2_CMD_PORT, PIC_EOI);
     }
     outb_p(PIC1_CMD_PORT, PIC_EOI);
+
+    signal_return_hook(NULL);
 }
 
 inline void irq_set_handler(irqnum_t irq_num, intr_handler_f handler) {
     irq[irq_num] = handler;
 }
 
+intr_handler_f irq_get_handler(irqnum_t irq_num) {
+    return irq[irq_num];
+}
+
 
 /**************** exceptions *****************/
 
@@ -160,8 +167,12 @@ void int_double_fault() {
     panic("DOUBLE FAULT");
 }
 
-void int_division_by_zero() {
-    logmsgef("INTR: division by zero, TODO\n");
+void int_division_by_zero(uint32_t *stack) {
+    logmsgef("INTR: division by zero at *%x:%x\n", stack[1], stack[0]);
+    if (stack[1] == SEL_USER_CS) {
+        signal_fault(SIGFPE, stack);
+        return;
+    }
     cpu_hang();
 }
 
@@ -169,7 +180,13 @@ void int_nonmaskable() {
     logmsg("exception: #NONMASKABLE\n");
 }
 
-void int_invalid_op(void *stack) {
+void int_invalid_op(uint32_t *stack) {
+    if (stack[1] == SEL_USER_CS) {
+        logmsgef("exception: #UD at *%x:%x\n", stack[1], stack[0]);
+        signal_fault(SIGILL, stack);
+        return;
+    }
+
     char buf[80];
     snprintf(buf, 80, "exception: #UD at %.8x:%0.8x",
                 (uint) *((uint32_t *)stack + 11),
@@ -212,6 +229,13 @@ void int_gpf(uint32_t *stack, err_t err) {
     uint32_t eip = stack[1];
     uint32_t cs = stack[2];
 
+    if (cs == SEL_USER_CS) {
+        logmsgef("%s: General Protection Fault at *%x:%x, error_code 0x%x\n",
+                __func__, cs, eip, err);
+        signal_fault(SIGSEGV, stack + 1);
+        return;
+    }
+
     logmsgef("\nFatal: General Protection Fault at *%x:%x, error_code 0x%x\n",
             cs, eip, err);
     cpu_hang();
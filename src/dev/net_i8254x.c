@@ -388,7 +388,8 @@ void i8254x_irq() {
 }
 
 
-int net_i8254x_init(pci_config_t *conf) {
+int net_i8254x_init(pci_config_t *conf, uint bus, uint slot) {
+    UNUSED(bus); UNUSED(slot);
     const char *funcname = __FUNCTION__;
     int ret;
     i8254x_nic *nic = &theI8254NIC;
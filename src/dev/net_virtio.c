@@ -12,6 +12,7 @@
 #include "mem/pmem.h"
 #include "dev/intrs.h"
 #include "dev/pci.h"
+#include "dev/virtio.h"
 #include "dev/timer.h"
 #include "arch/i386.h"
 
@@ -20,28 +21,9 @@
 #define CONF_TIMER_POLL     0
 #define CONF_ENABLE_IRQ     1
 
-/* virtio registers offsets from `portbase` */
-#define VIO_DEV_FEATURE       0   /* 32, R  */
-#define VIO_DRV_FEATURE       4   /* 32, RW */
-#define VIO_Q_ADDR            8   /* 32, RW */
-#define VIO_Q_SIZE           12   /* 16, R  */
-#define VIO_Q_SELECT         14   /* 16, RW */
-#define VIO_Q_NOTIFY         16   /* 16, RW */
-#define VIO_DEV_STA          18   /*  8, RW */
-#define VIO_ISR_STA          19   /*  8, R  */
-#define VIO_DEVICE_SPECIFIC_OFFSET    20
-
-#define VIO_MSIX_CONF_VECT   20   /* 16, RW */
-#define VIO_MSIX_Q_VECT      23   /* 16, RW */
-#define VIO_DEVICE_SPECIFIC_OFFSET_WITH_MSIX  24
-
-#define VIO_DEVIO_OFF      VIO_DEVICE_SPECIFIC_OFFSET
-
-#define VIO_NET_MAC           (VIO_DEVIO_OFF + 0)   /* 48, R, if VIRTIO_NET_F_MAC */
-#define VIO_NET_STA           (VIO_DEVIO_OFF + 6)   /* 16, R, if VIRTIO_NET_F_STATUS */
-
-/* may be written into VIO_MSIX_CONF_VECT */
-#define VIRTIO_MSI_NO_VECTOR  0xffff
+/* the device-specific configuration */
+#define VIO_NET_MAC           0   /* 48, R, if VIRTIO_NET_F_MAC */
+#define VIO_NET_STA           6   /* 16, R, if VIRTIO_NET_F_STATUS */
 
 #define VIRTIO_NET_RXQ  0
 #define VIRTIO_NET_TXQ  1
@@ -51,109 +33,6 @@
 #define FRAME_SIZE             (PAGE_BYTES/2)
 #define MAX_VIRTIO_FRAME_SIZE  (sizeof(struct virtio_net_hdr) + sizeof(struct eth_hdr_t) + ETH_MTU + 4)
 
-/* VIO_DEV_STA register */
-enum vio_dev_sta {
-    STA_ACK           = 0x01,
-    STA_DRV           = 0x02,
-    STA_DRV_OK        = 0x04,
-    STA_FAILED        = 0x80,
-};
-
-/* VIO_Dxx_FEATURE register */
-enum vio_features {
-    /* notify on empty avail_ring even if supppressed */
-    VIRTIO_F_NOTIFY_ON_EMPTY  = (1u << 24),
-    /* enable VIRTQ_DESC_F_INDIR */
-    VIRTIO_F_RING_INDIR_DESC  = (1u << 28),
-    /* enable `used_event` and `avail_event` */
-    VIRTIO_F_RING_EVENT_IDX   = (1u << 29),
-};
-
-enum vring_desc_flags {
-    VIRTQ_DESC_F_NEXT  = 1,
-    VIRTQ_DESC_F_WRITE = 2,
-    VIRTQ_DESC_F_INDIR = 4,
-};
-
-struct __packed vring_desc {
-    uint64_t addr;
-    uint32_t len;
-
-    uint16_t flags; /* see: enum vring_desc_flags */
-    uint16_t next;  /* if:  flags & VIRTQ_DESC_F_NEXT */
-};
-
-#define VIRTQ_AVAIL_F_NOINTR  1
-struct __packed vring_avail {
-    uint16_t flags; // 1: AVAIL_F_NO_INTERRUPT
-    uint16_t idx;
-    uint16_t ring[];
-};
-
-struct vring_used_elem {
-    uint32_t id;    // not uint16_t for padding
-    uint32_t len;
-};
-
-struct __packed vring_used {
-    uint16_t flags; // 1: USED_F_NO_NOTIFY
-    uint16_t idx;   // can increase beyond q->size (?), wraps around.
-    struct vring_used_elem ring[];
-};
-
-struct virtio_device {
-    uint16_t    iobase;
-    uint16_t    intr;
-    uint32_t    features;
-};
-
-struct virtioq {
-    uint16_t size; // the number of descriptors
-    size_t npages; // the combined size of desc+avail+used in pages
-
-    uint16_t last_used; // must wrap around
-
-    struct vring_desc   *desc;
-    struct vring_avail  *avail;
-    struct vring_used   *used;
-};
-
-static inline void virtioq_notify(struct virtio_device *dev, uint16_t queue) {
-    outw_p(dev->iobase + VIO_Q_NOTIFY, queue);
-};
-
-static inline uint16_t virtioq_enqueue(struct virtioq *q, uint16_t desc) {
-    uint16_t idx = q->avail->idx;
-    q->avail->ring[idx % q->size] = desc;
-    q->avail->idx += 1;
-    return idx;
-};
-
-static int virtio_vring_alloc(struct virtioq *q, uint16_t qsz) {
-    size_t desctbl_sz = qsz * sizeof(struct vring_desc);
-    size_t avail_sz = (3 + qsz) * sizeof(uint16_t);
-    size_t used_sz = 3 * sizeof(uint16_t) + qsz * sizeof(struct vring_used_elem);
-
-    size_t p = pagealign_up(desctbl_sz + avail_sz);
-    size_t used_off = p;
-    p += used_sz;
-    p = pagealign_up(p);
-
-    size_t npages = p / PAGE_BYTES;
-    char *qmem = pmem_alloc(npages);
-    return_err_if(!qmem, -ENOMEM,
-                  "%s: pmem_alloc(%d) failed\n", __func__, npages);
-    memset(qmem, 0, npages * PAGE_BYTES);
-    q->size = qsz;
-    q->npages = npages;
-    q->desc = (struct vring_desc *)qmem;
-    q->avail = (struct vring_avail *)(qmem + desctbl_sz);
-    q->used = (struct vring_used *)(qmem + used_off);
-
-    return 0;
-}
-
-
 /* VIO_Dxx_FEATURE for a network device */
 enum vio_net_features {
     /* device handles packets with a partial checksum */
@@ -224,15 +103,15 @@ struct virtio_net_device {
 
 struct virtio_net_device *theVirtNIC = NULL;
 
-static void net_virtio_print_features(uint32_t features, uint16_t portbase) {
+static void net_virtio_print_features(uint32_t features, struct virtio_device *dev) {
     logmsgf("[");
     if (features & VIRTIO_NET_F_STATUS) {
-        uint16_t sta;
-        inw(portbase + VIO_NET_STA, sta);
+        uint16_t sta = virtio_config_read16(dev, VIO_NET_STA);
         logmsgf("sta=%x ", sta);
     }
     if (features & VIRTIO_F_NOTIFY_ON_EMPTY) logmsgf("onempty ");
     if (features & VIRTIO_F_RING_INDIR_DESC) logmsgf("indir ");
+    if (features & VIRTIO_F_RING_EVENT_IDX) logmsgf("eventidx ");
     if (features & VIRTIO_NET_F_CSUM) logmsgf("csumd ");
     if (features & VIRTIO_NET_F_GUEST_CSUM) logmsgf("csumg ");
     if (features & VIRTIO_NET_F_GUEST_TSOV4) logmsgf("tsov4g ");
@@ -274,80 +153,59 @@ static void net_virtio_rxbuf_cleanup(struct netbuf *nbuf) {
     size_t desc = (bufptr - (uintptr_t)theVirtNIC->netbuf) / FRAME_SIZE;
 
     uint16_t idx = virtioq_enqueue(rxq, desc);
-    if (!rxq->used->flags)
-        virtioq_notify(&theVirtNIC->virtio, VIRTIO_NET_RXQ);
+    virtioq_kick(rxq);
 
-    logmsgdf("%s(buf=*%x): recycled desc=%d to avail=%d%s\n", __func__,
-             nbuf->buf, desc, idx, rxq->used->flags ? ", no_notify" : "");
+    logmsgdf("%s(buf=*%x): recycled desc=%d to avail=%d\n", __func__,
+             nbuf->buf, desc, idx);
 }
 
 bool net_virtio_is_up(struct netiface *iface) {
     struct virtio_net_device *nic = iface->device;
 
     /* get network status */
-    if (nic->virtio.features & VIRTIO_NET_F_STATUS) {
-        uint16_t hval;
-        inw(nic->virtio.iobase + VIO_NET_STA, hval);
-        return (bool)hval;
-    }
+    if (nic->virtio.features & VIRTIO_NET_F_STATUS)
+        return virtio_config_read16(&nic->virtio, VIO_NET_STA) & VIRTIO_NET_S_LINK_UP;
 
     return false;
 }
 
 static void net_virtio_poll(uint32_t t) {
     UNUSED(t);
-    uint16_t last_used, idx_used;
+    struct vring_used_elem used;
 
     // txq
     struct virtioq *txq = &theVirtNIC->txq;
-    txq->avail->flags = 1;
-    idx_used = txq->used->idx;
-    while (txq->last_used != idx_used) {
-        logmsgdf("%s: TX: last_used=%d, idx=%d\n", __func__,
-                 txq->last_used, idx_used);
+    while (virtioq_pop_used(txq, &used)) {
+        logmsgdf("%s: TX: desc=%d\n", __func__, used.id);
 
         // return the buffer to available
-        uint16_t idx = txq->last_used % txq->size;
-        struct vring_used_elem tx = txq->used->ring[idx];
-
-        uint8_t *buf = (uint8_t *)(uintptr_t)txq->desc[tx.id].addr;
+        uint8_t *buf = (uint8_t *)(uintptr_t)txq->desc[used.id].addr;
         net_virtio_frame_free(buf);
-        txq->desc[tx.id].addr = 0; // mark it free for re-use
-
-        txq->last_used += 1;
+        txq->desc[used.id].addr = 0; // mark it free for re-use
     }
-    txq->avail->flags = 0;
 
     // rxq
     struct virtioq *rxq = &theVirtNIC->rxq;
-    rxq->avail->flags = 1;
-    idx_used = rxq->used->idx;
-    while (rxq->last_used != idx_used) {
-        logmsgdf("%s: RX: last_used=%d, idx=%d\n", __func__,
-                 rxq->last_used, idx_used);
+    while (virtioq_pop_used(rxq, &used)) {
+        logmsgdf("%s: RX: desc=%d\n", __func__, used.id);
 
         // receive the data!
-        uint16_t idx = rxq->last_used % rxq->size;
-        struct vring_used_elem rx = rxq->used->ring[idx];
-        uint8_t *buf = (uint8_t *)(uintptr_t)rxq->desc[rx.id].addr;
+        uint8_t *buf = (uint8_t *)(uintptr_t)rxq->desc[used.id].addr;
 
         struct netbuf *nbuf = (struct netbuf *)(buf + MAX_VIRTIO_FRAME_SIZE);
         nbuf->buf = buf + sizeof(struct virtio_net_hdr);
-        nbuf->len = rx.len - sizeof(struct virtio_net_hdr);
+        nbuf->len = used.len - sizeof(struct virtio_net_hdr);
         nbuf->recycle = net_virtio_rxbuf_cleanup;
-        logmsgdf("%s: received *%x[%d], netbuf at *%x\n", __func__, buf, rx.len, nbuf);
+        logmsgdf("%s: received *%x[%d], netbuf at *%x\n", __func__, buf, used.len, nbuf);
 
         net_receive_driver_frame(&theVirtNIC->iface, nbuf);
-
-        rxq->last_used += 1;
     }
-    rxq->avail->flags = 0;
 }
 
-void net_virtio_irq() {
-    uint8_t val;
-    inb(theVirtNIC->virtio.iobase + VIO_ISR_STA, val);
-    if (val & 1) net_virtio_poll(0);
+static void net_virtio_intr(struct virtio_device *dev, uint8_t isr) {
+    UNUSED(dev);
+    if (isr & VIRTIO_ISR_QUEUE)
+        net_virtio_poll(0);
 }
 
 
@@ -388,50 +246,37 @@ int net_virtio_tx_enqueue(uint8_t *buf, size_t eth_len) {
 }
 
 int net_virtio_transmit(void) {
-    virtioq_notify(&theVirtNIC->virtio, VIRTIO_NET_TXQ);
+    virtioq_kick(&theVirtNIC->txq);
     return 0;
 }
 
 static int net_virtio_setup(struct virtio_net_device *nic) {
     int i, ret = 0;
-    uint16_t port, hval;
     uint32_t val;
 
-    /* reset */
-    hval = 0;
-    outw_p(nic->virtio.iobase + VIO_DEV_STA, hval);
-
-    hval = STA_ACK | STA_DRV;
-    outw_p(nic->virtio.iobase + VIO_DEV_STA, hval);
+    /* negotiate features */
+    val = VIRTIO_F_NOTIFY_ON_EMPTY;
+    val |= VIRTIO_F_RING_EVENT_IDX;
+    val |= VIRTIO_NET_F_MAC;
+    val |= VIRTIO_NET_F_STATUS;
+    val |= VIRTIO_NET_F_GUEST_CSUM;
+#if (CONF_HW_CHECKSUM)
+    // If you try to negotiate VIRTIO_NET_F_CSUM, QEMU's FCSless packets will not be delivered.
+    val |= VIRTIO_NET_F_CSUM;
+#endif
+    ret = virtio_negotiate(&nic->virtio, val);
+    return_msg_if(ret, ret, "%s: feature negotiation failed(%d)\n", __func__, ret);
+    logmsgdf("%s: negotiated  ", __func__);
+    net_virtio_print_features(nic->virtio.features, &nic->virtio);
 
     /* tx queue: allocate txq first, because rxq will need netbuf */
-    hval = VIRTIO_NET_TXQ;
-    outw_p(nic->virtio.iobase + VIO_Q_SELECT, hval);
-    inw_p(nic->virtio.iobase + VIO_Q_SIZE, hval);
-    assert(hval > 0, -ENOSYS, "%s: TX queue size is 0", __func__);
-
-    ret = virtio_vring_alloc(&nic->txq, hval);
+    ret = virtio_queue_setup(&nic->virtio, &nic->txq, VIRTIO_NET_TXQ, 0);
     return_msg_if(ret, ret, "%s: txq setup failed(%d)\n", __func__, ret);
-    //nic->txq.avail->flags |= VIRTQ_AVAIL_F_NOINTR;
-
-    logmsgdf("%s: tx_q[%d] at *%x (%d pages)\n", __func__,
-             (int)hval, nic->txq.desc, nic->txq.npages);
-
-    val = (uint32_t)nic->txq.desc / PAGE_BYTES;
-    outl_p(nic->virtio.iobase + VIO_Q_ADDR, val);
 
     /* rx queue */
-    hval = VIRTIO_NET_RXQ;
-    outw_p(nic->virtio.iobase + VIO_Q_SELECT, hval);
-    inw_p(nic->virtio.iobase + VIO_Q_SIZE, hval);
-    assert(hval > 0, -ENOSYS, "%s: RX queue size is 0", __func__);
-
-    ret = virtio_vring_alloc(&nic->rxq, hval);
+    ret = virtio_queue_setup(&nic->virtio, &nic->rxq, VIRTIO_NET_RXQ, 0);
     return_msg_if(ret, ret, "%s: rxq setup failed(%d)\n", __func__, ret);
 
-    logmsgdf("%s: rx_q[%d] at *%x (%d pages)\n",
-             __func__, (int)hval, nic->rxq.desc, nic->rxq.npages);
-
     /* netbuf: fill rx queue */
     const uint32_t netbufsz = nic->rxq.size * FRAME_SIZE;
     size_t netbuf_pages = pagealign_up(netbufsz) / PAGE_BYTES;
@@ -456,93 +301,59 @@ static int net_virtio_setup(struct virtio_net_device *nic) {
     rxavail->flags = 0;  // we do need an interrupt after each packet
     rxavail->idx = nic->rxq.size - 1; // TODO: fix off-by-one
 
-    val = (uint32_t)nic->rxq.desc / PAGE_BYTES;
-    outl_p(nic->virtio.iobase + VIO_Q_ADDR, val);
-
-    /* negotiate features */
-    val = VIRTIO_F_NOTIFY_ON_EMPTY;
-    val |= VIRTIO_NET_F_MAC;
-    val |= VIRTIO_NET_F_STATUS;
-    val |= VIRTIO_NET_F_GUEST_CSUM;
-#if (CONF_HW_CHECKSUM)
-    // If you try to negotiate VIRTIO_NET_F_CSUM, QEMU's FCSless packets will not be delivered.
-    val |= VIRTIO_NET_F_CSUM;
-#endif
-    outl_p(nic->virtio.iobase + VIO_DRV_FEATURE, val);
-    logmsgdf("%s: negotiating ", __func__);
-    net_virtio_print_features(val, nic->virtio.iobase);
-
-    inl(nic->virtio.iobase + VIO_DRV_FEATURE, val);
-    logmsgdf("%s: negotiated  ", __func__);
-    net_virtio_print_features(val, nic->virtio.iobase);
-    nic->virtio.features = val;
-
     /* enable this virtio driver */
-    hval = STA_DRV_OK | STA_DRV | STA_ACK;
-    outw_p(nic->virtio.iobase + VIO_DEV_STA, hval);
+    virtio_driver_ok(&nic->virtio);
+    virtioq_kick(&nic->rxq);
 
     return 0;
 }
 
 
-int net_virtio_init(pci_config_t *pciconf) {
-    uint32_t features = 0;
-    uint16_t portbase = 0;
+int net_virtio_init(pci_config_t *pciconf, uint bus, uint slot) {
+    int ret;
 
-    /* poke it for necessary features */
-    return_msg_if(pciconf->pci_rev_id > 0, -ENOSYS,
-                  "%s: pci.rev_id=%d, aborting configuration\n",
-                  __func__, pciconf->pci_rev_id);
-    assert(pciconf->pci_subsystem_id == 1, -EINVAL,
+    /* a transitional device or a virtio 1.0 one */
+    bool isnet = (pciconf->pci.device == 0x1041)
+              || (pciconf->pci_subsystem_id == 1);
+    assert(isnet, -EINVAL,
            "%s: pci->subsystem_id is not VIRTIO_NET\n", __func__);
 
     logmsgif("%s: pci %04x:%04x intr=%d:%02d", __func__,
              pciconf->pci.vendor, pciconf->pci.device,
              pciconf->pci_interrupt_pin, pciconf->pci_interrupt_line);
 
-    if (pciconf->pci_bar0.val & 1)
-        portbase = pciconf->pci_bar0.val & 0xfffc;
-    else if (pciconf->pci_bar1.val & 1)
-        portbase = pciconf->pci_bar1.val & 0xfffc;
-    else if (pciconf->pci_bar2.val & 1)
-        portbase = pciconf->pci_bar2.val & 0xfffc;
-    else if (pciconf->pci_bar3.val & 1)
-        portbase = pciconf->pci_bar3.val & 0xfffc;
-    else if (pciconf->pci_bar4.val & 1)
-        portbase = pciconf->pci_bar4.val & 0xfffc;
-    return_err_if(portbase == 0, -1, "%s: portbase not found\n", __func__);
-
-    inl(portbase + VIO_DEV_FEATURE, features);
-    logmsgf("%s: device ", __func__);
-    net_virtio_print_features(features, portbase);
-    return_err_if(!(features & VIRTIO_NET_F_MAC), -EINVAL,
-                  "%s: no MAC address, aborting configuration", __func__);
-
-    uint16_t mac0, mac1, mac2;
-    uint16_t macp = portbase + VIO_NET_MAC;
-    inw(macp + 0, mac0);
-    inw(macp + 2, mac1);
-    inw(macp + 4, mac2);
-
-    macaddr_t mac = { .word = { mac0, mac1, mac2 } };
-    logmsgf("%s: portbase = 0x%x, intr = #%d\n", __func__,
-             (uint)portbase, pciconf->pci_interrupt_line);
-
-    /* initialize */
+    /* initialize: the netiface callbacks know no device, so one for now */
     return_err_if(theVirtNIC, -ETODO,
                   "%s: only one network device at the moment\n", __func__);
 
     struct virtio_net_device *nic;
     nic = kmalloc(sizeof(struct virtio_net_device));
+    return_err_if(!nic, -ENOMEM, "%s: kmalloc failed\n", __func__);
     memset(nic, 0, sizeof(struct virtio_net_device));
-    nic->virtio.iobase = portbase;
-    nic->virtio.intr = pciconf->pci_interrupt_line;
-    nic->virtio.features = features;
-    nic->mac = mac;
 
-    int ret = net_virtio_setup(nic);
+    ret = virtio_pci_init(&nic->virtio, pciconf, bus, slot);
+    if (ret) {
+        kfree(nic);
+        return ret;
+    }
+
+    logmsgf("%s: device ", __func__);
+    net_virtio_print_features(nic->virtio.features, &nic->virtio);
+    if (!(nic->virtio.features & VIRTIO_NET_F_MAC)) {
+        logmsgef("%s: no MAC address, aborting configuration", __func__);
+        virtio_reset(&nic->virtio);
+        kfree(nic);
+        return -EINVAL;
+    }
+
+    for (ret = 0; ret < ETH_ALEN; ++ret)
+        nic->mac.oct[ret] = virtio_config_read8(&nic->virtio, VIO_NET_MAC + ret);
+    macaddr_t mac = nic->mac;
+
+    ret = net_virtio_setup(nic);
     if (ret) {
         logmsgef("%s: net_virtio_setup failed (%d)", __func__, ret);
+        virtio_reset(&nic->virtio);
         kfree(nic);
         return ret;
     }
@@ -551,10 +362,10 @@ int net_virtio_init(pci_config_t *pciconf) {
     theVirtNIC = nic;
 
 #if CONF_ENABLE_IRQ
-    irq_set_handler(nic->virtio.intr, net_virtio_irq);
-    irq_enable(nic->virtio.intr);
-    logmsgdf("%s: irq_set_handler(%d, net_virtio_irq)\n",  __func__,
-             nic->virtio.intr);
+    nic->virtio.on_intr = net_virtio_intr;
+    nic->virtio.priv = nic;
+    virtio_irq_register(&nic->virtio);
+    logmsgdf("%s: virtio_irq_register(%d)\n",  __func__, nic->virtio.intr);
 #endif
 
 #if CONF_TIMER_POLL
@@ -564,12 +375,12 @@ int net_virtio_init(pci_config_t *pciconf) {
 #endif
 
     /* get network status */
-    uint16_t hval;
-    inw(nic->virtio.iobase + VIO_NET_STA, hval);
-    logmsgf("%s: virtio network is %s\n", __func__, hval ? "up" : "down");
+    nic->iface.device = nic;
+    bool up = net_virtio_is_up(&nic->iface);
+    logmsgf("%s: virtio network is %s\n", __func__, up ? "up" : "down");
 
     logmsgif("%s: %s, mac=%02x:%02x:%02x:%02x:%02x:%02x", __func__,
-             (hval ? "up" : "down"),
+             (up ? "up" : "down"),
              mac.oct[0], mac.oct[1],
              mac.oct[2], mac.oct[3],
              mac.oct[4], mac.oct[5]);
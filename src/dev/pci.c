@@ -37,12 +37,13 @@ const char * pci_class_descriptions[] = {
 
 typedef struct {
     uint32_t pci_id;
-    int (*pci_init)(pci_config_t *);
+    int (*pci_init)(pci_config_t *, uint bus, uint slot);
     const char *pci_name;
 } pci_driver_t;
 
-extern int net_i8254x_init(pci_config_t *);
-extern int net_virtio_init(pci_config_t *);
+extern int net_i8254x_init(pci_config_t *, uint bus, uint slot);
+extern int net_virtio_init(pci_config_t *, uint bus, uint slot);
+extern int blk_virtio_init(pci_config_t *, uint bus, uint slot);
 
 const pci_driver_t pci_driver[] = {
     /*
@@ -55,6 +56,18 @@ const pci_driver_t pci_driver[] = {
       .pci_init = net_virtio_init,
       .pci_name = "VirtIO network card" },
 
+    { .pci_id = 0x10011af4,
+      .pci_init = blk_virtio_init,
+      .pci_name = "VirtIO block device" },
+
+    { .pci_id = 0x10411af4,
+      .pci_init = net_virtio_init,
+      .pci_name = "VirtIO 1.0 network card" },
+
+    { .pci_id = 0x10421af4,
+      .pci_init = blk_virtio_init,
+      .pci_name = "VirtIO 1.0 block device" },
+
     { .pci_init = NULL }
 };
 
@@ -64,7 +77,7 @@ uint16_t pci_config_read_word(uint16_t bus, uint16_t slot, uint16_t func, uint16
 }*/
 
 uint pci_config_read_dword(uint bus, uint slot, uint func, uint offset) {
-    uint address = ((bus & 0x3F) << 16) | ((slot & 0xF) << 11) | ((func & 0x3) << 8)
+    uint address = ((bus & 0x3F) << 16) | ((slot & 0xF) << 11) | ((func & 0x7) << 8)
         | (offset & 0xFC) | 0x80000000;
     outl(PCI_CONFIG_ADDR, address);
     uint res;
@@ -72,6 +85,31 @@ uint pci_config_read_dword(uint bus, uint slot, uint func, uint offset) {
     return res;
 }
 
+void pci_config_write_dword(uint bus, uint slot, uint func, uint offset, uint value) {
+    uint address = ((bus & 0x3F) << 16) | ((slot & 0xF) << 11) | ((func & 0x7) << 8)
+        | (offset & 0xFC) | 0x80000000;
+    outl(PCI_CONFIG_ADDR, address);
+    outl(PCI_CONFIG_DATA, value);
+}
+
+bool pci_find_class(uint8_t clss, uint8_t subclass, uint *bus, uint *slot, uint *func) {
+    uint b, s, f;
+    for (b = 0; b < 3; ++b)
+        for (s = 0; s < 32; ++s)
+            for (f = 0; f < 8; ++f) {
+                uint id = pci_config_read_dword(b, s, f, PCI_CONF_ID_OFF);
+                if (0xFFFF == (uint16_t)id)
+                    continue;
+
+                uint dev_class = pci_config_read_dword(b, s, f, PCI_CONF_CLASS_OFF);
+                if (((dev_class >> 24) == clss) && (((dev_class >> 16) & 0xFF) == subclass)) {
+                    *bus = b; *slot = s; *func = f;
+                    return true;
+                }
+            }
+    return false;
+}
+
 void pci_read_config(uint bus, uint slot, pci_config_t *conf) {
     assertv(sizeof(pci_config_t)/sizeof(uint32_t) == 0x10,
             "pci_config_t size is invalid");
@@ -177,7 +215,7 @@ static void pci_bus_setup(int bus) {
                conf.pci_interrupt_pin, conf.pci_interrupt_line,
                drv->pci_name);
 
-        int ret = drv->pci_init(&conf);
+        int ret = drv->pci_init(&conf, bus, slot);
         if (ret) {
             k_printf("[%04x:%04x] init error: %s\n",
                      conf.pci.vendor, conf.pci.device, strerror(-ret));
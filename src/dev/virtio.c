@@ -0,0 +1,379 @@
+#include <string.h>
+#include <sys/errno.h>
+
+#include <cosec/log.h>
+
+#include "mem/pmem.h"
+#include "mem/paging.h"
+#include "dev/intrs.h"
+#include "dev/pci.h"
+#include "dev/virtio.h"
+
+/* virtio 1.0 vendor PCI capabilities */
+struct __packed virtio_pci_cap {
+    uint8_t  cap_vndr;      /* PCI_CAP_VENDOR */
+    uint8_t  cap_next;
+    uint8_t  cap_len;
+    uint8_t  cfg_type;      /* see: enum virtio_pci_cap_type */
+    uint8_t  bar;
+    uint8_t  padding[3];
+    uint32_t offset;
+    uint32_t length;
+};
+
+enum virtio_pci_cap_type {
+    VIRTIO_PCI_CAP_COMMON_CFG   = 1,
+    VIRTIO_PCI_CAP_NOTIFY_CFG   = 2,
+    VIRTIO_PCI_CAP_ISR_CFG      = 3,
+    VIRTIO_PCI_CAP_DEVICE_CFG   = 4,
+};
+
+/* ring fields after the rings, if VIRTIO_F_RING_EVENT_IDX */
+#define vring_used_event(q)     ((q)->avail->ring[(q)->size])
+#define vring_avail_event(q)    \
+    (*(volatile uint16_t *)((uint8_t *)(q)->used->ring + (q)->size * sizeof(struct vring_used_elem)))
+
+/* orders a store before the following loads, which x86 may swap */
+#define virtio_mb()     asm volatile ("lock; addl $0,0(%%esp)" ::: "memory")
+
+static struct virtio_device *theVirtioIntrList = NULL;
+static intr_handler_f theVirtioChainedIrq[16];
+
+
+/*
+ *  Transports
+ */
+
+static inline uint8_t virtio_status(struct virtio_device *dev) {
+    uint8_t sta;
+    if (dev->modern)
+        return dev->common->device_status;
+    inb(dev->iobase + VIO_DEV_STA, sta);
+    return sta;
+}
+
+static inline void virtio_set_status(struct virtio_device *dev, uint8_t sta) {
+    if (dev->modern) {
+        dev->common->device_status = sta;
+        return;
+    }
+    outb_p(dev->iobase + VIO_DEV_STA, sta);
+}
+
+/* maps the part of a memory BAR a capability points to */
+static volatile uint8_t * virtio_map_cap(uint bus, uint slot, const struct virtio_pci_cap *cap) {
+    if (cap->bar > 5)
+        return NULL;
+
+    uint bar = pci_config_read_dword(bus, slot, 0, PCI_CONF_BAR0 + 4 * cap->bar);
+    if (bar & 1)
+        return NULL;        /* an I/O BAR */
+    if (((bar >> 1) & 3) == 2) {
+        uint barhi = pci_config_read_dword(bus, slot, 0, PCI_CONF_BAR0 + 4 * cap->bar + 4);
+        return_dbg_if(barhi, NULL, "%s: BAR%d is above 4G\n", __func__, cap->bar);
+    }
+
+    uintptr_t addr = (bar & 0xFFFFFFF0) + cap->offset;
+    return iomem_map(addr, cap->length);
+}
+
+/* finds the virtio 1.0 structures, returns false if there are none */
+static bool virtio_pci_modern(struct virtio_device *dev, uint bus, uint slot) {
+    uint stacmd = pci_config_read_dword(bus, slot, 0, PCI_CONF_COMMAND);
+    if (!((stacmd >> 16) & PCI_STATUS_CAPS))
+        return false;
+
+    uint8_t ptr = (uint8_t)pci_config_read_dword(bus, slot, 0, PCI_CONF_CAPS) & 0xFC;
+    int guard = 48;
+    while (ptr && guard--) {
+        struct virtio_pci_cap cap;
+        uint32_t w[4];
+        int i;
+        for (i = 0; i < 4; ++i)
+            w[i] = pci_config_read_dword(bus, slot, 0, ptr + 4 * i);
+        memcpy(&cap, w, sizeof(cap));
+
+        if (cap.cap_vndr == PCI_CAP_VENDOR) {
+            volatile uint8_t *p;
+            switch (cap.cfg_type) {
+            case VIRTIO_PCI_CAP_COMMON_CFG:
+                if (!dev->common && (p = virtio_map_cap(bus, slot, &cap)))
+                    dev->common = (volatile struct virtio_pci_common_cfg *)p;
+                break;
+            case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                if (!dev->notify && (p = virtio_map_cap(bus, slot, &cap))) {
+                    dev->notify = p;
+                    dev->notify_mult = pci_config_read_dword(bus, slot, 0, ptr + 16);
+                }
+                break;
+            case VIRTIO_PCI_CAP_ISR_CFG:
+                if (!dev->isr)
+                    dev->isr = virtio_map_cap(bus, slot, &cap);
+                break;
+            case VIRTIO_PCI_CAP_DEVICE_CFG:
+                if (!dev->devcfg)
+                    dev->devcfg = virtio_map_cap(bus, slot, &cap);
+                break;
+            }
+        }
+        ptr = cap.cap_next & 0xFC;
+    }
+
+    return dev->common && dev->notify && dev->isr;
+}
+
+int virtio_pci_init(struct virtio_device *dev, pci_config_t *conf, uint bus, uint slot) {
+    memset(dev, 0, sizeof(struct virtio_device));
+    dev->intr = conf->pci_interrupt_line;
+
+    uint cmd = pci_config_read_dword(bus, slot, 0, PCI_CONF_COMMAND);
+    pci_config_write_dword(bus, slot, 0, PCI_CONF_COMMAND,
+            (cmd & 0xFFFF) | PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+
+    if (virtio_pci_modern(dev, bus, slot)) {
+        dev->modern = true;
+    } else {
+        /* transitional devices have revision 0 and the legacy registers in BAR0 */
+        return_msg_if(conf->pci_rev_id > 0, -ENOSYS,
+                      "%s: pci.rev_id=%d and no usable virtio 1.0 structures\n",
+                      __func__, conf->pci_rev_id);
+        return_err_if(!(conf->pci_bar0.val & 1), -ENXIO, "%s: portbase not found\n", __func__);
+        dev->iobase = conf->pci_bar0.val & 0xfffc;
+    }
+
+    virtio_reset(dev);
+    virtio_set_status(dev, STA_ACK | STA_DRV);
+
+    if (dev->modern) {
+        dev->common->device_feature_select = 0;
+        dev->features = dev->common->device_feature;
+    } else {
+        inl(dev->iobase + VIO_DEV_FEATURE, dev->features);
+    }
+
+    logmsgif("%s: pci %d:%d, %s transport, features 0x%x", __func__, bus, slot,
+             (dev->modern ? "virtio 1.0" : "legacy"), dev->features);
+    return 0;
+}
+
+int virtio_negotiate(struct virtio_device *dev, uint32_t wanted) {
+    uint32_t features = dev->features & wanted;
+
+    if (dev->modern) {
+        dev->common->driver_feature_select = 0;
+        dev->common->driver_feature = features;
+        dev->common->driver_feature_select = 1;
+        dev->common->driver_feature = 1;    /* VIRTIO_F_VERSION_1 */
+
+        virtio_set_status(dev, STA_ACK | STA_DRV | STA_FEATURES_OK);
+        if (!(virtio_status(dev) & STA_FEATURES_OK)) {
+            virtio_set_status(dev, STA_FAILED);
+            logmsgef("%s: features 0x%x are not accepted", __func__, features);
+            return -ENOSYS;
+        }
+    } else {
+        outl_p(dev->iobase + VIO_DRV_FEATURE, features);
+    }
+
+    dev->features = features;
+    return 0;
+}
+
+void virtio_driver_ok(struct virtio_device *dev) {
+    uint8_t sta = STA_ACK | STA_DRV | STA_DRV_OK;
+    if (dev->modern)
+        sta |= STA_FEATURES_OK;
+    virtio_set_status(dev, sta);
+}
+
+void virtio_reset(struct virtio_device *dev) {
+    virtio_set_status(dev, 0);
+    if (dev->modern)
+        while (virtio_status(dev) != 0) ;
+}
+
+
+/*
+ *  Virtqueues
+ */
+
+static int virtio_vring_alloc(struct virtioq *q, uint16_t qsz) {
+    size_t desctbl_sz = qsz * sizeof(struct vring_desc);
+    size_t avail_sz = (3 + qsz) * sizeof(uint16_t);
+    size_t used_sz = 3 * sizeof(uint16_t) + qsz * sizeof(struct vring_used_elem);
+
+    size_t p = pagealign_up(desctbl_sz + avail_sz);
+    size_t used_off = p;
+    p += used_sz;
+    p = pagealign_up(p);
+
+    size_t npages = p / PAGE_BYTES;
+    char *qmem = kmem_alloc(npages);
+    return_err_if(!qmem, -ENOMEM,
+                  "%s: pmem_alloc(%d) failed\n", __func__, npages);
+    memset(qmem, 0, npages * PAGE_BYTES);
+    q->size = qsz;
+    q->npages = npages;
+    q->desc = (struct vring_desc *)qmem;
+    q->avail = (struct vring_avail *)(qmem + desctbl_sz);
+    q->used = (struct vring_used *)(qmem + used_off);
+
+    return 0;
+}
+
+int virtio_queue_setup(struct virtio_device *dev, struct virtioq *q, uint16_t index, uint16_t maxsize) {
+    uint16_t qsz;
+    int ret;
+
+    if (dev->modern) {
+        dev->common->queue_select = index;
+        qsz = dev->common->queue_size;
+    } else {
+        outw_p(dev->iobase + VIO_Q_SELECT, index);
+        inw_p(dev->iobase + VIO_Q_SIZE, qsz);
+    }
+    return_err_if(qsz == 0, -ENOSYS, "%s: queue %d size is 0", __func__, index);
+
+    /* only a virtio 1.0 device may be given a smaller queue */
+    if (dev->modern && maxsize && (qsz > maxsize)) {
+        qsz = maxsize;
+        dev->common->queue_size = qsz;
+    }
+
+    ret = virtio_vring_alloc(q, qsz);
+    return_msg_if(ret, ret, "%s: queue %d setup failed(%d)\n", __func__, index, ret);
+    q->index = index;
+    q->dev = dev;
+
+    if (dev->modern) {
+        dev->common->queue_desc_lo = (uint32_t)__pa(q->desc);
+        dev->common->queue_desc_hi = 0;
+        dev->common->queue_driver_lo = (uint32_t)__pa(q->avail);
+        dev->common->queue_driver_hi = 0;
+        dev->common->queue_device_lo = (uint32_t)__pa(q->used);
+        dev->common->queue_device_hi = 0;
+        q->notify = (volatile uint16_t *)(dev->notify
+                        + dev->common->queue_notify_off * dev->notify_mult);
+        dev->common->queue_enable = 1;
+    } else {
+        uint32_t pfn = (uint32_t)__pa(q->desc) / PAGE_BYTES;
+        outl_p(dev->iobase + VIO_Q_ADDR, pfn);
+    }
+
+    logmsgdf("%s: queue %d [%d] at *%x (%d pages)\n", __func__,
+             index, qsz, q->desc, q->npages);
+    return 0;
+}
+
+/* the Linux vring_need_event(): has `old_idx` passed `event_idx` on the way to `new_idx` */
+static inline bool vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+void virtioq_kick(struct virtioq *q) {
+    struct virtio_device *dev = q->dev;
+    uint16_t new_idx = q->avail->idx;
+    uint16_t old_idx = q->last_kick;
+    if (new_idx == old_idx)
+        return;
+    q->last_kick = new_idx;
+
+    /* the device must see the new index before we look at its wishes */
+    virtio_mb();
+    if (dev->features & VIRTIO_F_RING_EVENT_IDX) {
+        if (!vring_need_event(vring_avail_event(q), new_idx, old_idx))
+            return;
+    } else if (*(volatile uint16_t *)&q->used->flags & VIRTQ_USED_F_NO_NOTIFY) {
+        return;
+    }
+
+    if (q->notify)
+        *q->notify = q->index;
+    else
+        outw_p(dev->iobase + VIO_Q_NOTIFY, q->index);
+}
+
+bool virtioq_pop_used(struct virtioq *q, struct vring_used_elem *elem) {
+    if (q->last_used == *(volatile uint16_t *)&q->used->idx)
+        return false;
+    barrier();  /* the entry is read after the index */
+
+    *elem = q->used->ring[q->last_used % q->size];
+    ++q->last_used;
+
+    /* interrupt again as soon as there is anything after it */
+    if (q->dev->features & VIRTIO_F_RING_EVENT_IDX)
+        vring_used_event(q) = q->last_used;
+    return true;
+}
+
+
+/*
+ *  Device configuration and interrupts
+ */
+
+uint8_t virtio_config_read8(struct virtio_device *dev, uint off) {
+    uint8_t val;
+    if (dev->modern)
+        return dev->devcfg ? dev->devcfg[off] : 0;
+    inb(dev->iobase + VIO_DEVICE_SPECIFIC_OFFSET + off, val);
+    return val;
+}
+
+uint16_t virtio_config_read16(struct virtio_device *dev, uint off) {
+    uint16_t val;
+    if (dev->modern)
+        return dev->devcfg ? *(volatile uint16_t *)(dev->devcfg + off) : 0;
+    inw(dev->iobase + VIO_DEVICE_SPECIFIC_OFFSET + off, val);
+    return val;
+}
+
+uint32_t virtio_config_read32(struct virtio_device *dev, uint off) {
+    uint32_t val;
+    if (dev->modern)
+        return dev->devcfg ? *(volatile uint32_t *)(dev->devcfg + off) : 0;
+    inl(dev->iobase + VIO_DEVICE_SPECIFIC_OFFSET + off, val);
+    return val;
+}
+
+static void virtio_irq() {
+    bool claimed = false;
+    struct virtio_device *dev;
+    for (dev = theVirtioIntrList; dev; dev = dev->next_intr) {
+        uint8_t isr;
+        /* reading acknowledges */
+        if (dev->modern)
+            isr = *dev->isr;
+        else
+            inb(dev->iobase + VIO_ISR_STA, isr);
+        if (!isr)
+            continue;
+
+        claimed = true;
+        if (dev->on_intr)
+            dev->on_intr(dev, isr);
+    }
+    if (claimed)
+        return;
+
+    /* not ours: handlers do not know their line, ask every one we took over */
+    int i;
+    for (i = 0; i < 16; ++i)
+        if (theVirtioChainedIrq[i])
+            theVirtioChainedIrq[i]();
+}
+
+void virtio_irq_register(struct virtio_device *dev) {
+    irqnum_t irq = dev->intr;
+
+    dev->next_intr = theVirtioIntrList;
+    theVirtioIntrList = dev;
+
+    /* another driver's device on the same line */
+    intr_handler_f prev = irq_get_handler(irq);
+    if (prev && (prev != virtio_irq))
+        theVirtioChainedIrq[irq] = prev;
+
+    irq_set_handler(irq, virtio_irq);
+    irq_enable(irq);
+}
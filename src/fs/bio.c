@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+
+#include <cosec/log.h>
+
+#include "arch/i386.h"
+#include "fs/devices.h"
+#include "fs/bio.h"
+#include "fs/blkqueue.h"
+
+static struct bio_stats theBioStats;
+
+
+void bio_init(struct bio *bio, device *dev, enum bio_op op, off_t block,
+              struct bio_vec *vecs, count_t vcnt)
+{
+    memset(bio, 0, sizeof(struct bio));
+    bio->bi_dev = dev;
+    bio->bi_op = op;
+    bio->bi_block = block;
+    bio->bi_io_vec = vecs;
+    bio->bi_vcnt = vcnt;
+}
+
+size_t bio_size(const struct bio *bio) {
+    size_t size = 0;
+    count_t i;
+    for (i = 0; i < bio->bi_vcnt; ++i)
+        size += bio->bi_io_vec[i].bv_len;
+    return size;
+}
+
+/* serves `bio` with .dev_get_roblock/.dev_get_rwblock, a block at a time */
+static int bio_emulate(struct bio *bio) {
+    device *dev = bio->bi_dev;
+    struct device_operations *ops = dev->dev_ops;
+    size_t blksz = ops->dev_size_of_block(dev);
+    off_t block = bio->bi_block;
+    count_t i;
+
+    return_dbg_if(!ops->dev_get_roblock, ENOSYS, "%s: no dev_get_roblock\n", __func__);
+    if ((bio->bi_op == BIO_WRITE) && !ops->dev_get_rwblock)
+        return EROFS;
+
+    for (i = 0; i < bio->bi_vcnt; ++i) {
+        struct bio_vec *bv = bio->bi_io_vec + i;
+        size_t off;
+        for (off = 0; off < bv->bv_len; off += blksz, ++block) {
+            if (bio->bi_op == BIO_READ) {
+                const char *blockdata = ops->dev_get_roblock(dev, block);
+                if (!blockdata) return ENXIO;
+                memcpy(bv->bv_data + off, blockdata, blksz);
+            } else {
+                char *blockdata = ops->dev_get_rwblock(dev, block);
+                if (!blockdata) return ENXIO;
+                memcpy(blockdata, bv->bv_data + off, blksz);
+            }
+
+            if (ops->dev_forget_block)
+                ops->dev_forget_block(dev, block);
+        }
+    }
+    return 0;
+}
+
+int bio_submit(struct bio *bio) {
+    device *dev = bio->bi_dev;
+    struct device_operations *ops = dev->dev_ops;
+    count_t i;
+
+    return_dbg_if(!(ops->dev_size_of_block && ops->dev_size_in_blocks), ENOSYS,
+            "%s: not a block device\n", __func__);
+    return_dbg_if(!bio->bi_vcnt, EINVAL, "%s: no segments\n", __func__);
+
+    size_t blksz = ops->dev_size_of_block(dev);
+    for (i = 0; i < bio->bi_vcnt; ++i) {
+        size_t len = bio->bi_io_vec[i].bv_len;
+        return_dbg_if(!len || (len % blksz), EINVAL,
+                "%s: segment %d of %d bytes, block size %d\n", __func__, i, len, blksz);
+    }
+
+    count_t nblocks = bio_size(bio) / blksz;
+    off_t maxblock = ops->dev_size_in_blocks(dev);
+    return_dbg_if((bio->bi_block < 0) || (bio->bi_block > maxblock)
+                  || ((off_t)nblocks > maxblock - bio->bi_block),
+            ENXIO, "%s: blocks [%d, +%d) are beyond %d\n",
+            __func__, bio->bi_block, nblocks, maxblock);
+
+    bio->bi_error = 0;
+    bio->bi_done = false;
+    ++theBioStats.submitted;
+    theBioStats.blocks += nblocks;
+
+    if (dev->dev_queue)
+        return blk_queue_bio(dev->dev_queue, bio);
+    if (ops->dev_submit)
+        return ops->dev_submit(dev, bio);
+
+    ++theBioStats.emulated;
+    bio_endio(bio, bio_emulate(bio));
+    return 0;
+}
+
+int bio_submit_wait(struct bio *bio) {
+    int ret = bio_submit(bio);
+    if (ret) return ret;
+
+    /* do not sleep on a bio held back by a plug */
+    if (bio->bi_dev->dev_queue)
+        blk_queue_run(bio->bi_dev->dev_queue);
+
+    wait_event(&bio->bi_wait, bio->bi_done);
+    return bio->bi_error;
+}
+
+void bio_endio(struct bio *bio, int error) {
+    bio->bi_error = error;
+    if (bio->bi_end_io)
+        bio->bi_end_io(bio);
+
+    /* the waiter may free `bio` as soon as it runs after this */
+    bool intrs = i386_eflags() & EFL_IF;
+    intrs_disable();
+    bio->bi_done = true;
+    if (bio->bi_wait.wq_head)
+        wait_queue_wake_all(&bio->bi_wait);
+    if (intrs) intrs_enable();
+}
+
+void bio_get_stats(struct bio_stats *stats) {
+    *stats = theBioStats;
+}
+
+
+void bio_batch_init(struct bio_batch *batch) {
+    memset(batch, 0, sizeof(struct bio_batch));
+}
+
+static void bio_batch_end_io(struct bio *bio) {
+    struct bio_batch *batch = bio->bi_private;
+
+    bool intrs = i386_eflags() & EFL_IF;
+    intrs_disable();
+    if (bio->bi_error && !batch->bb_error)
+        batch->bb_error = bio->bi_error;
+    if (--batch->bb_pending == 0 && batch->bb_wait.wq_head)
+        wait_queue_wake_all(&batch->bb_wait);
+    if (intrs) intrs_enable();
+}
+
+int bio_batch_submit(struct bio_batch *batch, struct bio *bio) {
+    bio->bi_end_io = bio_batch_end_io;
+    bio->bi_private = batch;
+
+    bool intrs = i386_eflags() & EFL_IF;
+    intrs_disable();
+    ++batch->bb_pending;
+    if (intrs) intrs_enable();
+
+    int ret = bio_submit(bio);
+    if (ret) {
+        intrs_disable();
+        --batch->bb_pending;
+        if (intrs) intrs_enable();
+    }
+    return ret;
+}
+
+int bio_batch_wait(struct bio_batch *batch) {
+    wait_event(&batch->bb_wait, batch->bb_pending == 0);
+    return batch->bb_error;
+}
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+
+#include <cosec/log.h>
+
+#include "arch/i386.h"
+#include "mem/kheap.h"
+#include "dev/timer.h"
+#include "fs/devices.h"
+#include "fs/bio.h"
+#include "fs/blkqueue.h"
+
+/*
+ *  The queue is changed from drivers' interrupts too,
+ *  so all of it is done with interrupts disabled.
+ */
+#define blkq_lock(intrs) \
+    do { (intrs) = i386_eflags() & EFL_IF; intrs_disable(); } while (0)
+#define blkq_unlock(intrs) \
+    do { if (intrs) intrs_enable(); } while (0)
+
+
+void blk_queue_init(struct request_queue *q, device *dev,
+                    int (*request_fn)(struct request_queue *, struct request *))
+{
+    memset(q, 0, sizeof(struct request_queue));
+    q->q_dev = dev;
+    q->q_request_fn = request_fn;
+    q->q_max_blocks = BLKQ_MAX_BLOCKS;
+    q->q_max_segments = BLKQ_MAX_SEGMENTS;
+    q->q_depth = 1;
+}
+
+static ulong blkq_expire_ticks(enum bio_op op) {
+    uint ms = (op == BIO_READ ? BLKQ_READ_EXPIRE_MS : BLKQ_WRITE_EXPIRE_MS);
+    return ms * timer_frequency() / 1000;
+}
+
+static void blkq_fifo_remove(struct request_queue *q, struct request *rq) {
+    struct request **link = q->q_fifo + rq->rq_op;
+    while (*link && (*link != rq))
+        link = &(*link)->rq_fifo;
+    if (*link)
+        *link = rq->rq_fifo;
+}
+
+/* `next` starts where `rq` ends: `rq` takes its bios, `next` is freed */
+static void blkq_coalesce(struct request_queue *q, struct request *rq, struct request *next) {
+    rq->rq_biotail->bi_next = next->rq_bio;
+    rq->rq_biotail = next->rq_biotail;
+    rq->rq_nblocks += next->rq_nblocks;
+    rq->rq_nsegs += next->rq_nsegs;
+    if (next->rq_deadline < rq->rq_deadline)
+        rq->rq_deadline = next->rq_deadline;
+
+    rq->rq_next = next->rq_next;
+    blkq_fifo_remove(q, next);
+    kfree(next);
+}
+
+/* tries to add `bio` to a queued request, returns false if it fits none */
+static bool blkq_merge(struct request_queue *q, struct bio *bio, count_t nblocks) {
+    struct request *rq;
+    off_t end = bio->bi_block + nblocks;
+
+    for (rq = q->q_sorted[bio->bi_op]; rq && (rq->rq_block <= end); rq = rq->rq_next) {
+        if ((rq->rq_nblocks + nblocks > q->q_max_blocks)
+            || (rq->rq_nsegs + bio->bi_vcnt > q->q_max_segments))
+            continue;
+
+        if (rq->rq_block + (off_t)rq->rq_nblocks == bio->bi_block) {
+            rq->rq_biotail->bi_next = bio;
+            rq->rq_biotail = bio;
+            rq->rq_nblocks += nblocks;
+            rq->rq_nsegs += bio->bi_vcnt;
+
+            /* the bio may have closed the gap to the next request */
+            struct request *next = rq->rq_next;
+            if (next && (next->rq_block == end)
+                && (rq->rq_nblocks + next->rq_nblocks <= q->q_max_blocks)
+                && (rq->rq_nsegs + next->rq_nsegs <= q->q_max_segments))
+                blkq_coalesce(q, rq, next);
+            return true;
+        }
+
+        if (rq->rq_block == end) {
+            bio->bi_next = rq->rq_bio;
+            rq->rq_bio = bio;
+            rq->rq_block = bio->bi_block;
+            rq->rq_nblocks += nblocks;
+            rq->rq_nsegs += bio->bi_vcnt;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void blkq_insert(struct request_queue *q, struct request *rq) {
+    struct request **link = q->q_sorted + rq->rq_op;
+    while (*link && ((*link)->rq_block < rq->rq_block))
+        link = &(*link)->rq_next;
+    rq->rq_next = *link;
+    *link = rq;
+
+    link = q->q_fifo + rq->rq_op;
+    while (*link)
+        link = &(*link)->rq_fifo;
+    rq->rq_fifo = NULL;
+    *link = rq;
+}
+
+int blk_queue_bio(struct request_queue *q, struct bio *bio) {
+    bool intrs;
+    size_t blksz = q->q_dev->dev_ops->dev_size_of_block(q->q_dev);
+    count_t nblocks = bio_size(bio) / blksz;
+    bio->bi_next = NULL;
+
+    blkq_lock(intrs);
+    if (blkq_merge(q, bio, nblocks)) {
+        ++q->q_stats.merged;
+    } else {
+        struct request *rq = kmalloc(sizeof(struct request));
+        if (!rq) {
+            blkq_unlock(intrs);
+            return ENOMEM;
+        }
+
+        rq->rq_op = bio->bi_op;
+        rq->rq_block = bio->bi_block;
+        rq->rq_nblocks = nblocks;
+        rq->rq_nsegs = bio->bi_vcnt;
+        rq->rq_bio = rq->rq_biotail = bio;
+        rq->rq_deadline = timer_ticks() + blkq_expire_ticks(bio->bi_op);
+        blkq_insert(q, rq);
+    }
+    blkq_unlock(intrs);
+
+    if (!q->q_plugged)
+        blk_queue_run(q);
+    return 0;
+}
+
+/* the deadline elevator, see fs/blkqueue.h */
+static struct request * blkq_next_request(struct request_queue *q) {
+    enum bio_op op;
+    bool reads = (q->q_sorted[BIO_READ] != NULL);
+    bool writes = (q->q_sorted[BIO_WRITE] != NULL);
+    if (!(reads || writes))
+        return NULL;
+
+    if (reads && !(writes && (q->q_starved >= BLKQ_WRITES_STARVED))) {
+        op = BIO_READ;
+        if (writes) ++q->q_starved;
+    } else {
+        op = BIO_WRITE;
+        q->q_starved = 0;
+    }
+
+    struct request *rq = q->q_fifo[op];
+    if ((long)(timer_ticks() - rq->rq_deadline) >= 0) {
+        ++q->q_stats.expired;
+    } else {
+        /* the elevator goes on up from the last position or wraps around */
+        rq = q->q_sorted[op];
+        while (rq && (rq->rq_block < q->q_next_block))
+            rq = rq->rq_next;
+        if (!rq)
+            rq = q->q_sorted[op];
+    }
+
+    struct request **link = q->q_sorted + op;
+    while (*link != rq)
+        link = &(*link)->rq_next;
+    *link = rq->rq_next;
+    blkq_fifo_remove(q, rq);
+
+    rq->rq_next = rq->rq_fifo = NULL;
+    q->q_next_block = rq->rq_block + rq->rq_nblocks;
+    return rq;
+}
+
+void blk_queue_run(struct request_queue *q) {
+    bool intrs;
+    blkq_lock(intrs);
+
+    /* a request completed by request_fn itself comes back here */
+    if (q->q_running)
+        goto unlock;
+    q->q_running = true;
+
+    while (q->q_inflight < q->q_depth) {
+        struct request *rq = blkq_next_request(q);
+        if (!rq) break;
+
+        ++q->q_inflight;
+        ++q->q_stats.dispatched;
+
+        int ret = q->q_request_fn(q, rq);
+        if (ret)
+            blk_end_request(q, rq, ret);
+    }
+
+    q->q_running = false;
+unlock:
+    blkq_unlock(intrs);
+}
+
+void blk_end_request(struct request_queue *q, struct request *rq, int error) {
+    struct bio *bio = rq->rq_bio;
+    while (bio) {
+        struct bio *next = bio->bi_next;
+        bio_endio(bio, error);
+        bio = next;
+    }
+
+    --q->q_inflight;
+    kfree(rq);
+
+    blk_queue_run(q);
+}
+
+void bdev_plug(device *dev) {
+    if (dev->dev_queue)
+        ++dev->dev_queue->q_plugged;
+}
+
+void bdev_unplug(device *dev) {
+    struct request_queue *q = dev->dev_queue;
+    if (!q) return;
+
+    assertv(q->q_plugged, "%s: not plugged\n", __func__);
+    if (--q->q_plugged == 0)
+        blk_queue_run(q);
+}
@@ -0,0 +1,341 @@
+/*
+ *  The directory entry cache
+ *
+ *  dcache_lookup() walks a path one component at a time: the name is
+ *  scanned and hashed in a single pass and looked up in a global hash
+ *  table by (parent dentry, hash). Only a miss goes to the filesystem,
+ *  which then resolves the fs-local path up to this component; the
+ *  result (positive, negative or a mount crossing) is cached.
+ *  "." and ".." are followed in the cache and never cached themselves,
+ *  so every spelling of a path ends at the same dentry.
+ *
+ *  Filesystems that change their names by themselves (e.g. procfs)
+ *  set sb_flags.nodcache, nothing below their root is cached.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+
+#include <cosec/log.h>
+
+#include "attrs.h"
+#include "mem/kheap.h"
+#include "fs/vfs.h"
+#include "fs/dcache.h"
+
+extern mountnode *theRootMnt;
+
+static struct dentry theRootDentry;
+
+static struct dentry *theDentries[DCACHE_BUCKETS];
+
+static struct dcache_stats theDcacheStats;
+
+
+static inline struct dentry **
+dcache_bucket(const struct dentry *parent, uint32_t hash) {
+    uint32_t key = hash ^ ((uintptr_t)parent >> 4);
+    return &theDentries[key & (DCACHE_BUCKETS - 1)];
+}
+
+/*
+ *  The LRU list is circular with theRootDentry as its head;
+ *  theRootDentry itself is never evicted.
+ */
+static inline void dcache_lru_unlink(struct dentry *de) {
+    de->d_lru_prev->d_lru_next = de->d_lru_next;
+    de->d_lru_next->d_lru_prev = de->d_lru_prev;
+}
+
+static inline void dcache_lru_push(struct dentry *de) {
+    de->d_lru_next = theRootDentry.d_lru_next;
+    de->d_lru_prev = &theRootDentry;
+    theRootDentry.d_lru_next->d_lru_prev = de;
+    theRootDentry.d_lru_next = de;
+}
+
+static struct dentry * dcache_root(void) {
+    if (unlikely(!theRootDentry.d_sb)) {
+        theRootDentry.d_sb = theRootMnt;
+        theRootDentry.d_ino = theRootMnt->sb_root_ino;
+        theRootDentry.d_lru_prev = theRootDentry.d_lru_next = &theRootDentry;
+    }
+    return &theRootDentry;
+}
+
+
+static struct dentry * dcache_find(
+        const struct dentry *parent, uint32_t hash, const char *name, size_t namelen)
+{
+    struct dentry *de = *dcache_bucket(parent, hash);
+    for (; de; de = de->d_hnext) {
+        if ((de->d_hash == hash) && (de->d_parent == parent)
+            && (de->d_namelen == namelen) && !memcmp(de->d_name, name, namelen))
+            return de;
+    }
+    return NULL;
+}
+
+static void dcache_remove(struct dentry *de) {
+    struct dentry **link = dcache_bucket(de->d_parent, de->d_hash);
+    while (*link != de)
+        link = &(*link)->d_hnext;
+    *link = de->d_hnext;
+
+    dcache_lru_unlink(de);
+    --de->d_parent->d_nchildren;
+    --theDcacheStats.entries;
+    kfree(de);
+}
+
+/* evicts the least recently used dentry without children except `keep` */
+static bool dcache_evict(const struct dentry *keep) {
+    struct dentry *de = theRootDentry.d_lru_prev;
+    for (; de != &theRootDentry; de = de->d_lru_prev) {
+        if (de->d_nchildren || (de == keep))
+            continue;
+
+        dcache_remove(de);
+        ++theDcacheStats.evictions;
+        return true;
+    }
+    return false;
+}
+
+static struct dentry * dcache_alloc(
+        struct dentry *parent, uint32_t hash, const char *name, size_t namelen)
+{
+    if (theDcacheStats.entries >= DCACHE_MAX)
+        dcache_evict(parent);
+
+    struct dentry *de = kmalloc(sizeof(struct dentry) + namelen);
+    return_err_if(!de, NULL, "%s: kmalloc failed", __func__);
+
+    de->d_parent = parent;
+    de->d_nchildren = 0;
+    de->d_sb = parent->d_sb;
+    de->d_ino = 0;
+    de->d_hash = hash;
+    de->d_namelen = namelen;
+    memcpy(de->d_name, name, namelen);
+
+    struct dentry **bucket = dcache_bucket(parent, hash);
+    de->d_hnext = *bucket;
+    *bucket = de;
+
+    dcache_lru_push(de);
+    ++parent->d_nchildren;
+    ++theDcacheStats.entries;
+    return de;
+}
+
+/*
+ *  A miss: resolves the fs-local `fspath` up to `end` on `dir->d_sb`
+ *  and caches the result as a child of `dir`.
+ */
+static int dcache_fill(
+        struct dentry *dir, const char *fspath, const char *end,
+        const char *name, uint32_t hash, struct dentry **result)
+{
+    int ret;
+    mountnode *sb = dir->d_sb;
+    size_t pathlen = end - fspath;
+    inode_t ino = 0;
+
+    /* is something mounted here? */
+    mountnode *mnt = sb->sb_children;
+    for (; mnt; mnt = mnt->sb_brother) {
+        if (!strncmp(fspath, mnt->sb_mntpath, pathlen)
+            && (mnt->sb_mntpath[pathlen] == '\0'))
+            break;
+    }
+
+    if (mnt) {
+        sb = mnt;
+        ino = mnt->sb_root_ino;
+    } else {
+        return_dbg_if(!sb->sb_fs->ops->lookup_inode, ENOSYS,
+                "%s: no %s.lookup_inode\n", __func__, sb->sb_fs->name);
+        ret = sb->sb_fs->ops->lookup_inode(sb, &ino, fspath, pathlen);
+        if (ret == ENOENT)
+            ino = 0;
+        else if (ret)
+            return ret;
+    }
+
+    struct dentry *de = dcache_alloc(dir, hash, name, end - name);
+    if (!de) return ENOMEM;
+
+    de->d_sb = sb;
+    de->d_ino = ino;
+    *result = de;
+    return 0;
+}
+
+/*
+ *  The path of `dir` on its filesystem with `name` appended, in a new
+ *  buffer: a walk through "." or ".." cannot pass its own path down.
+ */
+static char * dcache_fspath(
+        const struct dentry *dir, const char *name, size_t namelen, size_t *pathlen)
+{
+    mountnode *sb = dir->d_sb;
+    const struct dentry *de;
+    size_t len = namelen;
+    for (de = dir; (de != &theRootDentry) && (de->d_parent->d_sb == sb); de = de->d_parent)
+        len += de->d_namelen + 1;
+
+    char *path = kmalloc(len + 1);
+    return_err_if(!path, NULL, "%s: kmalloc failed", __func__);
+
+    char *p = path + len;
+    *p = '\0';
+    p -= namelen;
+    memcpy(p, name, namelen);
+    for (de = dir; (de != &theRootDentry) && (de->d_parent->d_sb == sb); de = de->d_parent) {
+        *--p = FS_SEP;
+        p -= de->d_namelen;
+        memcpy(p, de->d_name, de->d_namelen);
+    }
+
+    *pathlen = len;
+    return path;
+}
+
+/*
+ *  Walks `path` through the cache.
+ *  If `fill` is false, stops with ENOENT at the first miss.
+ */
+static int dcache_walk(
+        const char *path, bool fill,
+        struct dentry **result, mountnode **mntnode, inode_t *ino)
+{
+    int ret;
+    return_log_if(!theRootMnt, EBADF, "%s: theRootMnt absent\n", __func__);
+    return_log_if(!(path && (path[0] == FS_SEP)), EINVAL,
+            "%s('%s'): requires the absolute path\n", __func__, path);
+
+    struct dentry *dir = dcache_root();
+    mountnode *fssb = dir->d_sb;
+    const char *fspath = path + 1;      /* the path on fssb */
+    const char *name = path + 1;
+    bool dotted = false;                /* fspath has "." or ".." in it */
+
+    for (;;) {
+        while (name[0] == FS_SEP)
+            ++name;
+        if (name[0] == '\0')
+            break;
+
+        if ((name[0] == '.') && ((name[1] == '\0') || (name[1] == FS_SEP))) {
+            ++name;
+            dotted = true;
+            continue;
+        }
+        if ((name[0] == '.') && (name[1] == '.')
+            && ((name[2] == '\0') || (name[2] == FS_SEP))) {
+            /* the parent of a mounted root is the mount point's parent */
+            if (dir != &theRootDentry)
+                dir = dir->d_parent;
+            name += 2;
+            dotted = true;
+            continue;
+        }
+
+        if (dir->d_sb != fssb) {
+            fssb = dir->d_sb;
+            fspath = name;
+        }
+
+        if (unlikely(fssb->sb_flags.nodcache)) {
+            if (!fill)
+                return ENOENT;
+            return_dbg_if(!fssb->sb_fs->ops->lookup_inode, ENOSYS,
+                    "%s: no %s.lookup_inode\n", __func__, fssb->sb_fs->name);
+            if (result) *result = NULL;
+            if (mntnode) *mntnode = fssb;
+            return fssb->sb_fs->ops->lookup_inode(fssb, ino, fspath, SIZE_MAX);
+        }
+
+        /* scan and hash the name in one pass, see strhash() */
+        uint32_t hash = 0;
+        const char *end = name;
+        for (; (end[0] != '\0') && (end[0] != FS_SEP); ++end) {
+            hash += end[0];
+            hash += (hash << 10);
+            hash ^= (hash >> 6);
+        }
+        hash += (hash << 3);
+        hash ^= (hash >> 11);
+        hash += (hash << 15);
+
+        struct dentry *de = dcache_find(dir, hash, name, end - name);
+        if (de) {
+            ++theDcacheStats.hits;
+            dcache_lru_unlink(de);
+            dcache_lru_push(de);
+        } else {
+            if (!fill)
+                return ENOENT;
+            ++theDcacheStats.misses;
+            if (dotted) {
+                size_t len, namelen = end - name;
+                char *buf = dcache_fspath(dir, name, namelen, &len);
+                if (!buf) return ENOMEM;
+                ret = dcache_fill(dir, buf, buf + len, buf + len - namelen, hash, &de);
+                kfree(buf);
+            } else
+                ret = dcache_fill(dir, fspath, end, name, hash, &de);
+            if (ret) return ret;
+        }
+
+        if (!de->d_ino) {
+            if (result) *result = de;
+            return ENOENT;
+        }
+
+        dir = de;
+        name = end;
+    }
+
+    if (result) *result = dir;
+    if (mntnode) *mntnode = dir->d_sb;
+    if (ino) *ino = dir->d_ino;
+    return 0;
+}
+
+int dcache_lookup(const char *path, mountnode **mntnode, inode_t *ino) {
+    return dcache_walk(path, true, NULL, mntnode, ino);
+}
+
+void dcache_invalidate(const char *path) {
+    struct dentry *de = NULL;
+    dcache_walk(path, false, &de, NULL, NULL);
+    if (!de || (de == &theRootDentry))
+        return;
+
+    if (de->d_nchildren)
+        dcache_flush();
+    else
+        dcache_remove(de);
+}
+
+void dcache_flush(void) {
+    struct dentry *root = dcache_root();
+    struct dentry *de = root->d_lru_next;
+    while (de != root) {
+        struct dentry *next = de->d_lru_next;
+        kfree(de);
+        de = next;
+    }
+
+    root->d_lru_prev = root->d_lru_next = root;
+    root->d_nchildren = 0;
+    memset(theDentries, 0, sizeof(theDentries));
+    theDcacheStats.entries = 0;
+}
+
+void dcache_get_stats(struct dcache_stats *stats) {
+    *stats = theDcacheStats;
+}
@@ -5,11 +5,18 @@
 #include <cosec/log.h>
 
 #include <mem/pmem.h>
+#include <mem/kheap.h>
 
 #include <dev/screen.h>
 #include <dev/tty.h>
+#include <dev/ide.h>
+#include <dev/ramdisk.h>
+#include <dev/loop.h>
 
 #include <fs/devices.h>
+#include <fs/pagecache.h>
+#include <fs/bio.h>
+#include <fs/blkqueue.h>
 
 /*
  *   Unspecified (0) character devices family
@@ -60,176 +67,175 @@ devclass  chr1_device_family = {
 };
 
 /*
- *  RAM block devices
+ *  Generic device operations
  */
 
-static device * get_ram_block_device(mindev_t mindev) {
-    UNUSED(mindev);
-    return NULL;
-}
-
-devclass  blk1_device_family = {
-    .dev_type       = DEV_BLK,
-    .dev_maj        = BLK_RAM,
-    .dev_class_name = "ram block devices",
-
-    .get_device     = get_ram_block_device,
-    .init_devclass  = NULL,
-};
-
-
 /*
- *  Generic device operations
+ *  Transfers pages [index, index + npages) as one bio, `vecs` has room
+ *  for npages segments. Block sizes must divide PAGE_BYTES; what is
+ *  beyond the end of the device reads as zeroes and is not written.
  */
-
-int bdev_blocking_read(
-        device *dev, off_t pos, char *buf, size_t buflen, size_t *written)
+static int bdev_transfer_pages(page_mapping *m, enum bio_op op, index_t index,
+                               char **pages, count_t npages, struct bio_vec *vecs)
 {
-    const char *funcname = __FUNCTION__;
-
-    int ret = 0;
-    size_t i;
-    size_t bytes_done = 0;
-
-    if (!dev->dev_ops->dev_size_of_block)  { ret = ENOSYS; goto error_exit; }
-    if (!dev->dev_ops->dev_size_in_blocks) { ret = ENOSYS; goto error_exit; }
-    if (!dev->dev_ops->dev_get_roblock)    { ret = ENOSYS; goto error_exit; }
-
+    device *dev = m->pm_host;
     size_t blksz = dev->dev_ops->dev_size_of_block(dev);
     off_t maxblock = dev->dev_ops->dev_size_in_blocks(dev);
-
-    size_t startoffset = pos % blksz;
-    size_t startbytes = (startoffset ? blksz - startoffset : 0);
-    size_t nfullblocks = (buflen - startbytes) / blksz;
-    size_t finalbytes = (buflen - startbytes) % blksz;
-
-    off_t curblock = pos / blksz;
-    const char *blockdata = NULL;
-
-    if (startbytes) {
-        if (curblock >= maxblock) { ret = ENXIO; goto error_exit; }
-
-        blockdata = dev->dev_ops->dev_get_roblock(dev, curblock);
-        if (!curblock) { ret = ENXIO; goto error_exit; }
-
-        memcpy(buf, blockdata + startoffset, startbytes);
-
-        if (dev->dev_ops->dev_forget_block)
-            dev->dev_ops->dev_forget_block(dev, curblock);
-        bytes_done += startbytes;
-        buf += startbytes;
-        ++curblock;
+    off_t perpage = PAGE_BYTES / blksz;
+    off_t block = index * perpage;
+    count_t i, nvecs = 0;
+
+    for (i = 0; i < npages; ++i, block += perpage) {
+        off_t nblocks = (block < maxblock ? maxblock - block : 0);
+        if (nblocks > perpage)
+            nblocks = perpage;
+
+        if (op == BIO_READ)
+            memset(pages[i] + nblocks * blksz, 0, PAGE_BYTES - nblocks * blksz);
+        if (!nblocks)
+            continue;
+
+        vecs[nvecs].bv_data = pages[i];
+        vecs[nvecs].bv_len = nblocks * blksz;
+        ++nvecs;
     }
+    if (!nvecs)
+        return 0;
 
-    for (i = 0; i < nfullblocks; ++i) {
-        if (curblock >= maxblock) { ret = ENXIO; goto error_exit; }
-
-        blockdata = dev->dev_ops->dev_get_roblock(dev, curblock);
-        if (!curblock) { ret = ENXIO; goto error_exit; }
-
-        memcpy(buf, blockdata, blksz);
-
-        if (dev->dev_ops->dev_forget_block)
-            dev->dev_ops->dev_forget_block(dev, curblock);
-        bytes_done += blksz;
-        buf += blksz;
-        ++curblock;
-    }
-
-    if (finalbytes) {
-        if (curblock >= maxblock) { ret = ENXIO; goto error_exit; }
-
-        blockdata = dev->dev_ops->dev_get_roblock(dev, curblock);
-        if (!curblock) { ret = ENXIO; goto error_exit; }
+    struct bio bio;
+    bio_init(&bio, dev, op, index * perpage, vecs, nvecs);
+    return bio_submit_wait(&bio);
+}
 
-        memcpy(buf, blockdata, finalbytes);
+static int bdev_readpage(page_mapping *m, index_t index, char *page) {
+    struct bio_vec vec;
+    return bdev_transfer_pages(m, BIO_READ, index, &page, 1, &vec);
+}
 
-        if (dev->dev_ops->dev_forget_block)
-            dev->dev_ops->dev_forget_block(dev, curblock);
-        bytes_done += finalbytes;
-        buf += finalbytes;
-    }
+static int bdev_readpages(page_mapping *m, index_t index, char **pages, count_t npages) {
+    struct bio_vec *vecs = kmalloc(npages * sizeof(struct bio_vec));
+    return_err_if(!vecs, ENOMEM, "%s: kmalloc failed", __func__);
 
-error_exit:
-    logmsgdf("%s: ret=%d, bytes_done=%d\n", ret, bytes_done);
-    if (written) *written = bytes_done;
+    int ret = bdev_transfer_pages(m, BIO_READ, index, pages, npages, vecs);
+    kfree(vecs);
     return ret;
 }
 
+static int bdev_writepage(page_mapping *m, index_t index, const char *page) {
+    struct bio_vec vec;
+    return bdev_transfer_pages(m, BIO_WRITE, index, (char **)&page, 1, &vec);
+}
 
-int bdev_blocking_write(
-        struct device *dev, off_t pos,
-        const char *buf, size_t buflen, size_t *written)
-{
-    const char *funcname = __FUNCTION__;
-
-    int ret = 0;
-    size_t i;
-    size_t bytes_done = 0;
-
-    if (!dev->dev_ops->dev_size_of_block)  { ret = ENOSYS; goto error_exit; }
-    if (!dev->dev_ops->dev_size_in_blocks) { ret = ENOSYS; goto error_exit; }
-    if (!dev->dev_ops->dev_get_roblock)    { ret = ENOSYS; goto error_exit; }
+struct bdev_wb {
+    struct bio      wb_bio;
+    struct bio_vec  wb_vec;
+};
 
+/*
+ *  Writes each page with its own bio, all in one batch under a plug:
+ *  a device with a request queue merges adjacent ones.
+ */
+static int bdev_writepages(page_mapping *m, cached_page **pages, count_t npages) {
+    device *dev = m->pm_host;
     size_t blksz = dev->dev_ops->dev_size_of_block(dev);
     off_t maxblock = dev->dev_ops->dev_size_in_blocks(dev);
+    off_t perpage = PAGE_BYTES / blksz;
+    struct bio_batch batch;
+    count_t i;
+    int ret = 0;
 
-    size_t startoffset = pos % blksz;
-    size_t startbytes = (startoffset ? blksz - startoffset : 0);
-    size_t nfullblocks = (buflen - startbytes) / blksz;
-    size_t finalbytes = (buflen - startbytes) % blksz;
-
-    off_t curblock = pos / blksz;
-    char *blockdata = NULL;
-
-    if (startbytes) {
-        if (curblock >= maxblock) { ret = ENXIO; goto error_exit; }
+    struct bdev_wb *wbs = kmalloc(npages * sizeof(struct bdev_wb));
+    return_err_if(!wbs, ENOMEM, "%s: kmalloc failed", __func__);
+
+    bio_batch_init(&batch);
+    bdev_plug(dev);
+    for (i = 0; i < npages; ++i) {
+        off_t block = pages[i]->cp_index * perpage;
+        off_t nblocks = (block < maxblock ? maxblock - block : 0);
+        if (nblocks > perpage)
+            nblocks = perpage;
+        if (!nblocks)
+            continue;
+
+        wbs[i].wb_vec.bv_data = pages[i]->cp_data;
+        wbs[i].wb_vec.bv_len = nblocks * blksz;
+        bio_init(&wbs[i].wb_bio, dev, BIO_WRITE, block, &wbs[i].wb_vec, 1);
+
+        ret = bio_batch_submit(&batch, &wbs[i].wb_bio);
+        if (ret) break;
+    }
+    bdev_unplug(dev);
 
-        blockdata = dev->dev_ops->dev_get_rwblock(dev, curblock);
-        if (!curblock) { ret = ENXIO; goto error_exit; }
+    int err = bio_batch_wait(&batch);
+    if (!ret) ret = err;
 
-        memcpy(blockdata + startoffset, buf, startbytes);
+    kfree(wbs);
+    return ret;
+}
 
-        if (dev->dev_ops->dev_forget_block)
-            dev->dev_ops->dev_forget_block(dev, curblock);
-        bytes_done += startbytes;
-        buf += startbytes;
-        ++curblock;
-    }
+static const struct page_mapping_ops bdev_mapping_ops = {
+    .readpage = bdev_readpage,
+    .readpages = bdev_readpages,
+    .writepage = bdev_writepage,
+    .writepages = bdev_writepages,
+};
 
-    for (i = 0; i < nfullblocks; ++i) {
-        if (curblock >= maxblock) { ret = ENXIO; goto error_exit; }
+/* gets the page cache of `dev` and its size in bytes */
+static int bdev_pages(device *dev, page_mapping **mapping, off_t *size) {
+    const char *funcname = __FUNCTION__;
+    struct device_operations *ops = dev->dev_ops;
 
-        blockdata = dev->dev_ops->dev_get_rwblock(dev, curblock);
-        if (!curblock) { ret = ENXIO; goto error_exit; }
+    return_dbg_if(!(ops->dev_size_of_block && ops->dev_size_in_blocks
+                    && (ops->dev_get_roblock || ops->dev_submit || dev->dev_queue)),
+            ENOSYS, "%s: not a block device\n", funcname);
 
-        memcpy(blockdata, buf, blksz);
+    size_t blksz = ops->dev_size_of_block(dev);
+    return_dbg_if(!blksz || (blksz > PAGE_BYTES) || (PAGE_BYTES % blksz), EINVAL,
+            "%s: block size %d is not supported\n", funcname, blksz);
+    *size = ops->dev_size_in_blocks(dev) * blksz;
 
-        if (dev->dev_ops->dev_forget_block)
-            dev->dev_ops->dev_forget_block(dev, curblock);
-        bytes_done += blksz;
-        buf += blksz;
-        ++curblock;
+    if (!dev->dev_pages) {
+        dev->dev_pages = kmalloc(sizeof(page_mapping));
+        return_err_if(!dev->dev_pages, ENOMEM, "%s: kmalloc failed", funcname);
+        pagecache_init_mapping(dev->dev_pages, dev, &bdev_mapping_ops);
     }
+    *mapping = dev->dev_pages;
+    return 0;
+}
 
-    if (finalbytes) {
-        if (curblock >= maxblock) { ret = ENXIO; goto error_exit; }
-
-        blockdata = dev->dev_ops->dev_get_rwblock(dev, curblock);
-        if (!curblock) { ret = ENXIO; goto error_exit; }
+int bdev_blocking_read(
+        device *dev, struct readahead *ra, off_t pos,
+        char *buf, size_t buflen, size_t *written)
+{
+    page_mapping *m;
+    off_t size;
+    int ret = bdev_pages(dev, &m, &size);
+    if (ret || (pos >= size)) {
+        if (written) *written = 0;
+        return (ret ? ret : ENXIO);
+    }
 
-        memcpy(blockdata, buf, finalbytes);
+    if ((off_t)buflen > size - pos)
+        buflen = size - pos;
+    if (ra)
+        pagecache_readahead(m, ra, pos, buflen, (size - 1) / PAGE_BYTES);
+    return pagecache_read(m, pos, buf, buflen, written);
+}
 
-        if (dev->dev_ops->dev_forget_block)
-            dev->dev_ops->dev_forget_block(dev, curblock);
-        bytes_done += finalbytes;
-        buf += finalbytes;
+int bdev_blocking_write(
+        device *dev, off_t pos, const char *buf, size_t buflen, size_t *written)
+{
+    page_mapping *m;
+    off_t size;
+    int ret = bdev_pages(dev, &m, &size);
+    if (ret || (pos >= size)) {
+        if (written) *written = 0;
+        return (ret ? ret : ENXIO);
     }
 
-error_exit:
-    logmsgdf("%s: ret=%d, bytes_done=%d\n", ret, bytes_done);
-    if (written) *written = bytes_done;
-    return ret;
+    if ((off_t)buflen > size - pos)
+        buflen = size - pos;
+    return pagecache_write(m, pos, buf, buflen, written);
 }
 
 /*
@@ -283,4 +289,7 @@ void dev_setup(void) {
     devclass_register( get_tty_devclass() );
 
     /* block devices */
+    devclass_register( get_ide_devclass() );
+    devclass_register( get_ramdisk_devclass() );
+    devclass_register( get_loop_devclass() );
 }
@@ -0,0 +1,2559 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <cosec/log.h>
+
+#include "attrs.h"
+#include "mem/kheap.h"
+#include "misc/bitmap.h"
+#include "fs/vfs.h"
+#include "fs/icache.h"
+#include "fs/pagecache.h"
+#include "fs/bio.h"
+#include "fs/blkqueue.h"
+#include "fs/ext2.h"
+
+/*
+ *  On-disk structures, little-endian as the CPU
+ */
+#define EXT2_SUPER_OFFSET       1024
+#define EXT2_SUPER_MAGIC        0xEF53
+#define EXT2_ROOT_INO           2
+
+#define EXT2_GOOD_OLD_REV       0
+#define EXT2_GOOD_OLD_FIRST_INO 11
+#define EXT2_GOOD_OLD_INODE_SIZE    128
+
+#define EXT2_NDIR_BLOCKS        12
+#define EXT2_IND_BLOCK          EXT2_NDIR_BLOCKS
+#define EXT2_DIND_BLOCK         (EXT2_IND_BLOCK + 1)
+#define EXT2_TIND_BLOCK         (EXT2_DIND_BLOCK + 1)
+#define EXT2_N_BLOCKS           (EXT2_TIND_BLOCK + 1)
+
+#define EXT2_FEATURE_COMPAT_DIR_INDEX       0x0020
+#define EXT2_FEATURE_INCOMPAT_FILETYPE      0x0002
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
+
+#define EXT2_INCOMPAT_SUPPORTED     (EXT2_FEATURE_INCOMPAT_FILETYPE)
+#define EXT2_RO_COMPAT_SUPPORTED    \
+    (EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT2_FEATURE_RO_COMPAT_LARGE_FILE)
+
+#define EXT2_NAME_LEN           255
+#define EXT2_DIR_REC_LEN(namelen)   (((namelen) + 8 + 3) & ~3)
+
+struct __packed ext2_super_block {
+    uint32_t s_inodes_count;
+    uint32_t s_blocks_count;
+    uint32_t s_r_blocks_count;
+    uint32_t s_free_blocks_count;
+    uint32_t s_free_inodes_count;
+    uint32_t s_first_data_block;
+    uint32_t s_log_block_size;      /* block size is 1024 << s_log_block_size */
+    uint32_t s_log_frag_size;
+    uint32_t s_blocks_per_group;
+    uint32_t s_frags_per_group;
+    uint32_t s_inodes_per_group;
+    uint32_t s_mtime;
+    uint32_t s_wtime;
+    uint16_t s_mnt_count;
+    uint16_t s_max_mnt_count;
+    uint16_t s_magic;
+    uint16_t s_state;
+    uint16_t s_errors;
+    uint16_t s_minor_rev_level;
+    uint32_t s_lastcheck;
+    uint32_t s_checkinterval;
+    uint32_t s_creator_os;
+    uint32_t s_rev_level;
+    uint16_t s_def_resuid;
+    uint16_t s_def_resgid;
+    /* EXT2_DYNAMIC_REV */
+    uint32_t s_first_ino;
+    uint16_t s_inode_size;
+    uint16_t s_block_group_nr;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t  s_uuid[16];
+    char     s_volume_name[16];
+    char     s_last_mounted[64];
+    uint32_t s_algorithm_usage_bitmap;
+    uint8_t  s_prealloc_blocks;
+    uint8_t  s_prealloc_dir_blocks;
+    uint16_t s_padding1;
+    uint8_t  s_journal_uuid[16];
+    uint32_t s_journal_inum;
+    uint32_t s_journal_dev;
+    uint32_t s_last_orphan;
+    uint32_t s_hash_seed[4];
+    uint8_t  s_def_hash_version;
+    uint8_t  s_reserved_char_pad;
+    uint16_t s_reserved_word_pad;
+    uint32_t s_default_mount_opts;
+    uint32_t s_first_meta_bg;
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;
+    uint32_t s_reserved[167];       /* up to 1024 bytes */
+};
+
+struct __packed ext2_group_desc {
+    uint32_t bg_block_bitmap;
+    uint32_t bg_inode_bitmap;
+    uint32_t bg_inode_table;
+    uint16_t bg_free_blocks_count;
+    uint16_t bg_free_inodes_count;
+    uint16_t bg_used_dirs_count;
+    uint16_t bg_pad;
+    uint32_t bg_reserved[3];
+};
+
+struct __packed ext2_inode {
+    uint16_t i_mode;
+    uint16_t i_uid;
+    uint32_t i_size;
+    uint32_t i_atime;
+    uint32_t i_ctime;
+    uint32_t i_mtime;
+    uint32_t i_dtime;
+    uint16_t i_gid;
+    uint16_t i_links_count;
+    uint32_t i_blocks;              /* in 512-byte sectors */
+    uint32_t i_flags;
+    uint32_t i_osd1;
+    uint32_t i_block[EXT2_N_BLOCKS];
+    uint32_t i_generation;
+    uint32_t i_file_acl;
+    uint32_t i_dir_acl;             /* the high 32 bits of i_size of a regular file */
+    uint32_t i_faddr;
+    uint8_t  i_osd2[12];
+};
+
+struct __packed ext2_dir_entry {
+    uint32_t inode;                 /* 0 if the entry is unused */
+    uint16_t rec_len;
+    uint8_t  name_len;
+    uint8_t  file_type;             /* if EXT2_FEATURE_INCOMPAT_FILETYPE */
+    char     name[];
+};
+
+enum ext2_file_type {
+    EXT2_FT_UNKNOWN = 0,
+    EXT2_FT_REG_FILE,
+    EXT2_FT_DIR,
+    EXT2_FT_CHRDEV,
+    EXT2_FT_BLKDEV,
+    EXT2_FT_FIFO,
+    EXT2_FT_SOCK,
+    EXT2_FT_SYMLINK,
+};
+
+/*
+ *  Directory indexes (htree): the first block of an indexed directory
+ *  is the root of a tree of file block numbers keyed by name hashes;
+ *  it looks like a block with "." and a ".." that takes the rest of it.
+ *  Index nodes look like a block with an empty entry.
+ */
+#define EXT2_INDEX_FL               0x00001000      /* i_flags */
+
+#define EXT2_FLAGS_SIGNED_HASH      0x0001          /* s_flags */
+#define EXT2_FLAGS_UNSIGNED_HASH    0x0002
+
+enum ext2_dx_hash_version {
+    EXT2_DX_HASH_LEGACY = 0,
+    EXT2_DX_HASH_HALF_MD4,
+    EXT2_DX_HASH_TEA,
+    EXT2_DX_HASH_LEGACY_UNSIGNED,
+    EXT2_DX_HASH_HALF_MD4_UNSIGNED,
+    EXT2_DX_HASH_TEA_UNSIGNED,
+};
+
+struct __packed ext2_dx_root_info {
+    uint32_t reserved_zero;
+    uint8_t  hash_version;
+    uint8_t  info_length;           /* 8 */
+    uint8_t  indirect_levels;
+    uint8_t  unused_flags;
+};
+
+struct __packed ext2_dx_entry {
+    uint32_t hash;                  /* the lowest hash in `block` */
+    uint32_t block;                 /* a file block */
+};
+
+/* instead of the hash of the first entry */
+struct __packed ext2_dx_countlimit {
+    uint16_t limit;
+    uint16_t count;
+};
+
+#define EXT2_DX_ROOT_INFO       (EXT2_DIR_REC_LEN(1) + EXT2_DIR_REC_LEN(2))
+#define EXT2_DX_ROOT_ENTRIES    (EXT2_DX_ROOT_INFO + sizeof(struct ext2_dx_root_info))
+#define EXT2_DX_NODE_ENTRIES    EXT2_DIR_REC_LEN(0)
+#define EXT2_DX_BLOCK_MASK      0x00ffffff
+#define EXT2_DX_MAX_LEVELS      2       /* the root and one level of nodes */
+
+
+/*
+ *  ext2
+ */
+
+static int ext2_read_superblock(mountnode *sb, const mount_opts_t *opts);
+static int ext2_get_usage(mountnode *sb, struct fs_usage *usage);
+static int ext2_lookup_inode(mountnode *sb, inode_t *ino, const char *path, size_t pathlen);
+static int ext2_make_directory(mountnode *sb, inode_t *ino, const char *path, mode_t mode);
+static int ext2_get_direntry(mountnode *sb, inode_t dirino, void **iter, struct dirent *dirent);
+static int ext2_make_inode(mountnode *sb, inode_t *ino, mode_t mode, void *info);
+static int ext2_free_inode(mountnode *sb, inode_t ino);
+static int ext2_link_inode(mountnode *sb, inode_t ino, inode_t dirino, const char *name, size_t namelen);
+static int ext2_unlink_inode(mountnode *sb, const char *path, size_t pathlen);
+static int ext2_inode_get(mountnode *sb, inode_t ino, struct inode *idata);
+static int ext2_inode_set(mountnode *sb, inode_t ino, struct inode *idata);
+static int ext2_read_inode(mountnode *sb, inode_t ino, off_t pos,
+                           char *buf, size_t buflen, size_t *written);
+static int ext2_write_inode(mountnode *sb, inode_t ino, off_t pos,
+                            const char *buf, size_t buflen, size_t *written);
+static int ext2_readpage(mountnode *sb, struct inode *idata, index_t index, char *page);
+static int ext2_writepage(mountnode *sb, struct inode *idata, index_t index, const char *page);
+static int ext2_trunc_inode(mountnode *sb, inode_t ino, off_t length);
+
+struct filesystem_operations  ext2_fsops = {
+    .read_superblock    = ext2_read_superblock,
+    .get_usage          = ext2_get_usage,
+    .lookup_inode       = ext2_lookup_inode,
+    .make_directory     = ext2_make_directory,
+    .get_direntry       = ext2_get_direntry,
+    .make_inode         = ext2_make_inode,
+    .free_inode         = ext2_free_inode,
+    .link_inode         = ext2_link_inode,
+    .unlink_inode       = ext2_unlink_inode,
+    .inode_get          = ext2_inode_get,
+    .inode_set          = ext2_inode_set,
+    .read_inode         = ext2_read_inode,
+    .write_inode        = ext2_write_inode,
+    .readpage           = ext2_readpage,
+    .writepage          = ext2_writepage,
+    .trunc_inode        = ext2_trunc_inode,
+};
+
+struct filesystem_driver  ext2_driver = {
+    .name = "ext2",
+    .fs_id = EXT2_ID,
+    .ops = &ext2_fsops,
+    .lst = { 0 },
+};
+
+fsdriver * ext2_fs_driver(void) {
+    return &ext2_driver;
+}
+
+
+/* used by struct superblock as `data` pointer to store FS-specific state */
+struct ext2_data {
+    device *    ed_dev;
+    struct ext2_super_block ed_super;
+    struct ext2_group_desc *ed_groups;
+    count_t     ed_ngroups;
+
+    size_t      ed_blksz;
+    off_t       ed_devblocks;       /* device blocks in a block */
+    count_t     ed_ptrs;            /* block numbers in an indirect block */
+    size_t      ed_inode_size;
+    inode_t     ed_first_ino;
+    bool        ed_filetype;        /* directory entries have file_type */
+    bool        ed_dx;              /* directory indexes are used and kept */
+
+    /* the group of the inode looked up last: a new inode goes next to its directory */
+    uint        ed_hint_group;
+    bitmap_word_t *ed_bitmap;       /* a block for bitmap searches */
+};
+
+/* ext2 blocks a page takes, so at most this many runs of blocks */
+#define EXT2_MAX_PAGE_BLOCKS    (PAGE_BYTES / 1024)
+
+/* new indirect blocks are filled from here */
+static char theExt2ZeroBlock[PAGE_BYTES];
+
+
+/*
+ *  Metadata I/O through the page cache of the device
+ */
+
+static int ext2_meta_read(struct ext2_data *ed, off_t pos, void *buf, size_t len) {
+    size_t done = 0;
+    int ret = bdev_blocking_read(ed->ed_dev, NULL, pos, buf, len, &done);
+    if (!ret && (done != len))
+        ret = EIO;
+    return_err_if(ret, ret, "%s(@%x, %d) failed(%d)", __func__, pos, len, ret);
+    return 0;
+}
+
+static int ext2_meta_write(struct ext2_data *ed, off_t pos, const void *buf, size_t len) {
+    size_t done = 0;
+    int ret = bdev_blocking_write(ed->ed_dev, pos, buf, len, &done);
+    if (!ret && (done != len))
+        ret = EIO;
+    return_err_if(ret, ret, "%s(@%x, %d) failed(%d)", __func__, pos, len, ret);
+    return 0;
+}
+
+static inline off_t ext2_block_pos(struct ext2_data *ed, uint32_t block) {
+    return (off_t)block * ed->ed_blksz;
+}
+
+static int ext2_write_super(struct ext2_data *ed) {
+    return ext2_meta_write(ed, EXT2_SUPER_OFFSET, &ed->ed_super, sizeof(struct ext2_super_block));
+}
+
+static int ext2_write_group(struct ext2_data *ed, uint group) {
+    off_t pos = ext2_block_pos(ed, ed->ed_super.s_first_data_block + 1)
+              + group * sizeof(struct ext2_group_desc);
+    return ext2_meta_write(ed, pos, ed->ed_groups + group, sizeof(struct ext2_group_desc));
+}
+
+
+/*
+ *  File data I/O: one bio per run of blocks, all of a page in one batch
+ */
+
+struct ext2_run {
+    uint32_t    r_block;
+    count_t     r_count;
+    char *      r_buf;
+};
+
+/* adds a block at `buf` to `runs`, merging it into the last one if possible */
+static void ext2_run_add(struct ext2_data *ed, struct ext2_run *runs, count_t *nruns,
+                         uint32_t block, char *buf)
+{
+    if (*nruns) {
+        struct ext2_run *last = runs + *nruns - 1;
+        if ((last->r_block + last->r_count == block)
+            && (last->r_buf + last->r_count * ed->ed_blksz == buf))
+        {
+            ++last->r_count;
+            return;
+        }
+    }
+    runs[*nruns].r_block = block;
+    runs[*nruns].r_count = 1;
+    runs[*nruns].r_buf = buf;
+    ++*nruns;
+}
+
+/*
+ *  Blocks written around the page cache of the device are copied into
+ *  its pages if they are cached there, e.g. next to metadata; otherwise
+ *  a dirty page of the device would write them back stale.
+ */
+static void ext2_bdev_update(struct ext2_data *ed, uint32_t block, count_t count, const char *buf) {
+    page_mapping *m = ed->ed_dev->dev_pages;
+    if (!m) return;
+
+    off_t pos = ext2_block_pos(ed, block);
+    size_t len = count * ed->ed_blksz;
+    while (len) {
+        size_t offset = pos % PAGE_BYTES;
+        size_t n = PAGE_BYTES - offset;
+        if (n > len) n = len;
+
+        cached_page *pg = pagecache_find(m, pos / PAGE_BYTES);
+        if (pg)
+            memcpy(pg->cp_data + offset, buf, n);
+
+        pos += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+static int ext2_data_io(struct ext2_data *ed, enum bio_op op, struct ext2_run *runs, count_t nruns) {
+    struct bio bios[EXT2_MAX_PAGE_BLOCKS];
+    struct bio_vec vecs[EXT2_MAX_PAGE_BLOCKS];
+    struct bio_batch batch;
+    count_t i;
+    int ret = 0;
+
+    if (!nruns)
+        return 0;
+
+    bio_batch_init(&batch);
+    bdev_plug(ed->ed_dev);
+    for (i = 0; i < nruns; ++i) {
+        vecs[i].bv_data = runs[i].r_buf;
+        vecs[i].bv_len = runs[i].r_count * ed->ed_blksz;
+        bio_init(&bios[i], ed->ed_dev, op, (off_t)runs[i].r_block * ed->ed_devblocks, vecs + i, 1);
+
+        ret = bio_batch_submit(&batch, &bios[i]);
+        if (ret) break;
+    }
+    bdev_unplug(ed->ed_dev);
+
+    int err = bio_batch_wait(&batch);
+    if (!ret) ret = err;
+    return_err_if(ret, ret, "%s: %s of block %d failed(%d)", __func__,
+                  (op == BIO_READ ? "read" : "write"), runs[0].r_block, ret);
+
+    if (op == BIO_WRITE)
+        for (i = 0; i < nruns; ++i)
+            ext2_bdev_update(ed, runs[i].r_block, runs[i].r_count, runs[i].r_buf);
+    return 0;
+}
+
+
+/*
+ *  Block and inode allocation
+ */
+
+static inline uint ext2_block_group(struct ext2_data *ed, uint32_t block) {
+    return (block - ed->ed_super.s_first_data_block) / ed->ed_super.s_blocks_per_group;
+}
+
+static inline uint32_t ext2_group_first_block(struct ext2_data *ed, uint group) {
+    return ed->ed_super.s_first_data_block + group * ed->ed_super.s_blocks_per_group;
+}
+
+static inline uint ext2_inode_group(struct ext2_data *ed, inode_t ino) {
+    return (ino - 1) / ed->ed_super.s_inodes_per_group;
+}
+
+/* blocks in `group`, the last one may be shorter */
+static count_t ext2_group_blocks(struct ext2_data *ed, uint group) {
+    uint32_t first = ext2_group_first_block(ed, group);
+    uint32_t left = ed->ed_super.s_blocks_count - first;
+    return (left < ed->ed_super.s_blocks_per_group ? left : ed->ed_super.s_blocks_per_group);
+}
+
+/*
+ *  Finds a free bit in `map` of `nbits` near `goal`: the goal itself
+ *  or a free bit up to the end of its 64-bit window, so that a file
+ *  goes on after its indirect block; then the start of a free byte
+ *  after it, so that a new run of blocks does not fill a small hole;
+ *  then any free bit from the goal on and finally from the start.
+ */
+#define EXT2_NEAR_BITS  64
+
+static size_t ext2_bitmap_search(const bitmap_word_t *map, size_t nbits, size_t goal) {
+    if (goal >= nbits)
+        goal = 0;
+    if (!bitmap_test(map, goal))
+        return goal;
+
+    size_t near = (goal + EXT2_NEAR_BITS) & ~(EXT2_NEAR_BITS - 1);
+    size_t bit = bitmap_find_zero(map, (near < nbits ? near : nbits), goal);
+    if (bit < near && bit < nbits)
+        return bit;
+
+    const uint8_t *bytes = (const uint8_t *)map;
+    size_t i;
+    for (i = (goal + 7) / 8; i < nbits / 8; ++i)
+        if (bytes[i] == 0)
+            return 8 * i;
+
+    bit = bitmap_find_zero(map, nbits, goal);
+    if (bit < nbits)
+        return bit;
+    return bitmap_find_zero(map, goal, 0);
+}
+
+/* allocates a block as close to `goal` as possible */
+static int ext2_alloc_block(struct ext2_data *ed, uint32_t goal, uint32_t *result) {
+    struct ext2_super_block *es = &ed->ed_super;
+    int ret;
+
+    if ((goal < es->s_first_data_block) || (goal >= es->s_blocks_count))
+        goal = es->s_first_data_block;
+    return_dbg_if(es->s_free_blocks_count == 0, ENOSPC, "%s: ENOSPC\n", __func__);
+
+    uint group = ext2_block_group(ed, goal);
+    count_t i;
+    for (i = 0; i < ed->ed_ngroups; ++i, group = (group + 1) % ed->ed_ngroups) {
+        struct ext2_group_desc *gd = ed->ed_groups + group;
+        if (gd->bg_free_blocks_count == 0)
+            continue;
+
+        off_t bmpos = ext2_block_pos(ed, gd->bg_block_bitmap);
+        ret = ext2_meta_read(ed, bmpos, ed->ed_bitmap, ed->ed_blksz);
+        if (ret) return ret;
+
+        size_t nbits = ext2_group_blocks(ed, group);
+        size_t start = (i == 0 ? goal - ext2_group_first_block(ed, group) : 0);
+        size_t bit = ext2_bitmap_search(ed->ed_bitmap, nbits, start);
+        if (bit >= nbits) {
+            logmsgef("%s: group %d has %d free blocks in descriptor, none in bitmap",
+                     __func__, group, gd->bg_free_blocks_count);
+            continue;
+        }
+
+        bitmap_set(ed->ed_bitmap, bit);
+        ret = ext2_meta_write(ed, bmpos + bit / 8, (uint8_t *)ed->ed_bitmap + bit / 8, 1);
+        if (ret) return ret;
+
+        --gd->bg_free_blocks_count;
+        --es->s_free_blocks_count;
+        ext2_write_group(ed, group);
+        ext2_write_super(ed);
+
+        *result = ext2_group_first_block(ed, group) + bit;
+        logmsgdf("%s(goal=%d): %d\n", __func__, goal, *result);
+        return 0;
+    }
+    return ENOSPC;
+}
+
+static int ext2_free_block(struct ext2_data *ed, uint32_t block) {
+    struct ext2_super_block *es = &ed->ed_super;
+    int ret;
+    return_err_if((block < es->s_first_data_block) || (block >= es->s_blocks_count), EIO,
+                  "%s(%d): not a data block", __func__, block);
+
+    uint group = ext2_block_group(ed, block);
+    struct ext2_group_desc *gd = ed->ed_groups + group;
+    size_t bit = block - ext2_group_first_block(ed, group);
+
+    uint8_t byte;
+    off_t pos = ext2_block_pos(ed, gd->bg_block_bitmap) + bit / 8;
+    ret = ext2_meta_read(ed, pos, &byte, 1);
+    if (ret) return ret;
+    return_err_if(!(byte & (1 << (bit % 8))), EIO,
+                  "%s(%d): the block is free already", __func__, block);
+
+    byte &= ~(1 << (bit % 8));
+    ret = ext2_meta_write(ed, pos, &byte, 1);
+    if (ret) return ret;
+
+    ++gd->bg_free_blocks_count;
+    ++es->s_free_blocks_count;
+    ext2_write_group(ed, group);
+    return ext2_write_super(ed);
+}
+
+/*
+ *  A directory goes to a group with more free inodes than average and
+ *  the most free blocks, to spread directory trees; other inodes go to
+ *  the group of their directory or the next one with room.
+ */
+static uint ext2_find_group(struct ext2_data *ed, bool isdir) {
+    count_t ngroups = ed->ed_ngroups;
+    uint group, best = ngroups;
+    count_t i;
+
+    if (isdir) {
+        count_t avg = ed->ed_super.s_free_inodes_count / ngroups;
+        for (group = 0; group < ngroups; ++group) {
+            struct ext2_group_desc *gd = ed->ed_groups + group;
+            if (!gd->bg_free_inodes_count || (gd->bg_free_inodes_count < avg))
+                continue;
+            if ((best == ngroups)
+                || (gd->bg_free_blocks_count > ed->ed_groups[best].bg_free_blocks_count))
+                best = group;
+        }
+        if (best < ngroups)
+            return best;
+    }
+
+    group = (ed->ed_hint_group < ngroups ? ed->ed_hint_group : 0);
+    for (i = 0; i < ngroups; ++i, group = (group + 1) % ngroups) {
+        struct ext2_group_desc *gd = ed->ed_groups + group;
+        if (gd->bg_free_inodes_count && gd->bg_free_blocks_count)
+            return group;
+        if (gd->bg_free_inodes_count && (best == ngroups))
+            best = group;
+    }
+    return best;
+}
+
+static int ext2_alloc_inode(struct ext2_data *ed, bool isdir, inode_t *result) {
+    struct ext2_super_block *es = &ed->ed_super;
+    int ret;
+
+    uint group = ext2_find_group(ed, isdir);
+    return_dbg_if(group >= ed->ed_ngroups, ENOSPC, "%s: ENOSPC\n", __func__);
+
+    struct ext2_group_desc *gd = ed->ed_groups + group;
+    off_t bmpos = ext2_block_pos(ed, gd->bg_inode_bitmap);
+    ret = ext2_meta_read(ed, bmpos, ed->ed_bitmap, ed->ed_blksz);
+    if (ret) return ret;
+
+    size_t nbits = es->s_inodes_per_group;
+    size_t from = 0;
+    if (group * nbits < ed->ed_first_ino - 1)
+        from = ed->ed_first_ino - 1 - group * nbits;
+
+    size_t bit = bitmap_find_zero(ed->ed_bitmap, nbits, from);
+    return_err_if(bit >= nbits, EIO, "%s: group %d has %d free inodes in descriptor, none in bitmap",
+                  __func__, group, gd->bg_free_inodes_count);
+
+    bitmap_set(ed->ed_bitmap, bit);
+    ret = ext2_meta_write(ed, bmpos + bit / 8, (uint8_t *)ed->ed_bitmap + bit / 8, 1);
+    if (ret) return ret;
+
+    --gd->bg_free_inodes_count;
+    if (isdir)
+        ++gd->bg_used_dirs_count;
+    --es->s_free_inodes_count;
+    ext2_write_group(ed, group);
+    ext2_write_super(ed);
+
+    *result = group * nbits + bit + 1;
+    return 0;
+}
+
+static int ext2_release_inode(struct ext2_data *ed, inode_t ino, bool isdir) {
+    int ret;
+    uint group = ext2_inode_group(ed, ino);
+    struct ext2_group_desc *gd = ed->ed_groups + group;
+    size_t bit = (ino - 1) % ed->ed_super.s_inodes_per_group;
+
+    uint8_t byte;
+    off_t pos = ext2_block_pos(ed, gd->bg_inode_bitmap) + bit / 8;
+    ret = ext2_meta_read(ed, pos, &byte, 1);
+    if (ret) return ret;
+    return_err_if(!(byte & (1 << (bit % 8))), EIO,
+                  "%s(%d): the inode is free already", __func__, ino);
+
+    byte &= ~(1 << (bit % 8));
+    ret = ext2_meta_write(ed, pos, &byte, 1);
+    if (ret) return ret;
+
+    ++gd->bg_free_inodes_count;
+    if (isdir && gd->bg_used_dirs_count)
+        --gd->bg_used_dirs_count;
+    ++ed->ed_super.s_free_inodes_count;
+    ext2_write_group(ed, group);
+    return ext2_write_super(ed);
+}
+
+
+/*
+ *  Inodes
+ */
+
+static int ext2_raw_inode_pos(struct ext2_data *ed, inode_t ino, off_t *pos) {
+    return_dbg_if((ino == 0) || (ino > ed->ed_super.s_inodes_count), ENOENT,
+                  "%s(%d): ENOENT\n", __func__, ino);
+
+    uint group = ext2_inode_group(ed, ino);
+    size_t index = (ino - 1) % ed->ed_super.s_inodes_per_group;
+    *pos = ext2_block_pos(ed, ed->ed_groups[group].bg_inode_table) + index * ed->ed_inode_size;
+    return 0;
+}
+
+static int ext2_raw_inode_read(struct ext2_data *ed, inode_t ino, struct ext2_inode *raw) {
+    off_t pos;
+    int ret = ext2_raw_inode_pos(ed, ino, &pos);
+    if (ret) return ret;
+    return ext2_meta_read(ed, pos, raw, sizeof(struct ext2_inode));
+}
+
+static int ext2_raw_inode_write(struct ext2_data *ed, inode_t ino, const struct ext2_inode *raw) {
+    off_t pos;
+    int ret = ext2_raw_inode_pos(ed, ino, &pos);
+    if (ret) return ret;
+    return ext2_meta_write(ed, pos, raw, sizeof(struct ext2_inode));
+}
+
+/* a fast symlink keeps its target in i_block */
+static inline bool ext2_is_fast_symlink(struct ext2_data *ed, const struct ext2_inode *raw) {
+    count_t acl = (raw->i_file_acl ? ed->ed_blksz / 512 : 0);
+    return S_ISLNK(raw->i_mode) && (raw->i_blocks == acl);
+}
+
+static inline bool ext2_has_blocks(mode_t mode) {
+    return S_ISREG(mode) || S_ISDIR(mode) || S_ISLNK(mode);
+}
+
+static void ext2_inode_to_vfs(struct ext2_data *ed, inode_t ino,
+                              const struct ext2_inode *raw, struct inode *idata)
+{
+    int i;
+    idata->i_no = ino;
+    idata->i_mode = raw->i_mode;
+    idata->i_nlinks = raw->i_links_count;
+    idata->i_size = raw->i_size;
+    idata->i_data = NULL;
+    if (S_ISREG(raw->i_mode) && raw->i_dir_acl)
+        logmsgef("%s(%d): files over 4G are not supported", __func__, ino);
+
+    if (S_ISCHR(raw->i_mode) || S_ISBLK(raw->i_mode)) {
+        if (raw->i_block[0]) {
+            idata->as.dev.maj = (raw->i_block[0] >> 8) & 0xff;
+            idata->as.dev.min = raw->i_block[0] & 0xff;
+        } else {
+            idata->as.dev.maj = (raw->i_block[1] & 0xfff00) >> 8;
+            idata->as.dev.min = (raw->i_block[1] & 0xff) | ((raw->i_block[1] >> 12) & 0xfff00);
+        }
+    } else if (ext2_is_fast_symlink(ed, raw)) {
+        idata->as.symlink.long_symlink = NULL;
+        memcpy(idata->as.symlink.short_symlink, raw->i_block, MAX_SHORT_SYMLINK_SIZE);
+    } else if (ext2_has_blocks(raw->i_mode)) {
+        idata->as.reg.block_count = raw->i_blocks / (ed->ed_blksz / 512);
+        for (i = 0; i < N_DIRECT_BLOCKS; ++i)
+            idata->as.reg.directblock[i] = raw->i_block[i];
+        idata->as.reg.indir1st_block = raw->i_block[EXT2_IND_BLOCK];
+        idata->as.reg.indir2nd_block = raw->i_block[EXT2_DIND_BLOCK];
+        idata->as.reg.indir3rd_block = raw->i_block[EXT2_TIND_BLOCK];
+    }
+}
+
+/* updates what struct inode keeps, the rest of `raw` stays as it is */
+static void ext2_inode_from_vfs(struct ext2_data *ed, const struct inode *idata,
+                                struct ext2_inode *raw)
+{
+    int i;
+    bool fast_symlink = ext2_is_fast_symlink(ed, raw);
+
+    raw->i_mode = idata->i_mode;
+    raw->i_links_count = idata->i_nlinks;
+    raw->i_size = idata->i_size;
+
+    if (S_ISCHR(idata->i_mode) || S_ISBLK(idata->i_mode)) {
+        majdev_t maj = idata->as.dev.maj;
+        mindev_t min = idata->as.dev.min;
+        if ((maj < 256) && (min < 256)) {
+            raw->i_block[0] = (maj << 8) | min;
+            raw->i_block[1] = 0;
+        } else {
+            raw->i_block[0] = 0;
+            raw->i_block[1] = (min & 0xff) | (maj << 8) | ((min & ~0xff) << 12);
+        }
+    } else if (fast_symlink) {
+        memcpy(raw->i_block, idata->as.symlink.short_symlink, MAX_SHORT_SYMLINK_SIZE);
+    } else if (ext2_has_blocks(idata->i_mode)) {
+        raw->i_blocks = idata->as.reg.block_count * (ed->ed_blksz / 512);
+        for (i = 0; i < N_DIRECT_BLOCKS; ++i)
+            raw->i_block[i] = idata->as.reg.directblock[i];
+        raw->i_block[EXT2_IND_BLOCK] = idata->as.reg.indir1st_block;
+        raw->i_block[EXT2_DIND_BLOCK] = idata->as.reg.indir2nd_block;
+        raw->i_block[EXT2_TIND_BLOCK] = idata->as.reg.indir3rd_block;
+    }
+}
+
+static int ext2_inode_get(mountnode *sb, inode_t ino, struct inode *idata) {
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_inode raw;
+
+    int ret = ext2_raw_inode_read(ed, ino, &raw);
+    if (ret) return ret;
+    return_dbg_if(raw.i_mode == 0, ENOENT, "%s(%d): a free inode\n", __func__, ino);
+
+    ext2_inode_to_vfs(ed, ino, &raw, idata);
+    return 0;
+}
+
+static int ext2_inode_set(mountnode *sb, inode_t ino, struct inode *idata) {
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_inode raw;
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+
+    int ret = ext2_raw_inode_read(ed, ino, &raw);
+    if (ret) return ret;
+
+    ext2_inode_from_vfs(ed, idata, &raw);
+    return ext2_raw_inode_write(ed, ino, &raw);
+}
+
+/*
+ *  The block map and the links of an inode are written through:
+ *  an unlinked inode is freed from its copy on the disk.
+ */
+static inline int ext2_inode_store(mountnode *sb, struct inode *idata) {
+    return ext2_inode_set(sb, idata->i_no, idata);
+}
+
+
+/*
+ *  The block map
+ */
+
+/* where an indirect entry is */
+static inline off_t ext2_ptr_pos(struct ext2_data *ed, uint32_t block, size_t index) {
+    return ext2_block_pos(ed, block) + index * sizeof(uint32_t);
+}
+
+static int ext2_new_block(struct ext2_data *ed, struct inode *idata, uint32_t goal,
+                          bool indirect, uint32_t *result)
+{
+    int ret = ext2_alloc_block(ed, goal, result);
+    if (ret) return ret;
+    ++idata->as.reg.block_count;
+
+    if (indirect)
+        ret = ext2_meta_write(ed, ext2_block_pos(ed, *result), theExt2ZeroBlock, ed->ed_blksz);
+    return ret;
+}
+
+/*
+ *  Finds the block of the file block `index`, 0 if it is a hole.
+ *  If `create`, a hole and the indirect blocks on the way are allocated
+ *  near `goal` and `*changed` is set: the inode must be stored.
+ */
+static int ext2_bmap(mountnode *sb, struct inode *idata, uint32_t index,
+                     bool create, uint32_t goal, uint32_t *result, bool *changed)
+{
+    struct ext2_data *ed = sb->sb_data;
+    count_t ptrs = ed->ed_ptrs;
+    size_t offsets[3];
+    off_t *root;
+    int depth, i, ret;
+
+    *result = 0;
+    if (index < N_DIRECT_BLOCKS) {
+        root = &idata->as.reg.directblock[index];
+        depth = 0;
+    } else if ((index -= N_DIRECT_BLOCKS) < ptrs) {
+        root = &idata->as.reg.indir1st_block;
+        depth = 1;
+        offsets[0] = index;
+    } else if ((index -= ptrs) < ptrs * ptrs) {
+        root = &idata->as.reg.indir2nd_block;
+        depth = 2;
+        offsets[0] = index / ptrs;
+        offsets[1] = index % ptrs;
+    } else {
+        index -= ptrs * ptrs;
+        return_dbg_if(index / ptrs / ptrs >= ptrs, EFBIG, "%s: EFBIG\n", __func__);
+        root = &idata->as.reg.indir3rd_block;
+        depth = 3;
+        offsets[0] = index / ptrs / ptrs;
+        offsets[1] = (index / ptrs) % ptrs;
+        offsets[2] = index % ptrs;
+    }
+
+    uint32_t block = (uint32_t)*root;
+    if (!block) {
+        if (!create) return 0;
+        ret = ext2_new_block(ed, idata, goal, (depth > 0), &block);
+        if (ret) return ret;
+        *root = (off_t)block;
+        *changed = true;
+    }
+
+    for (i = 0; i < depth; ++i) {
+        uint32_t next;
+        off_t pos = ext2_ptr_pos(ed, block, offsets[i]);
+        ret = ext2_meta_read(ed, pos, &next, sizeof(next));
+        if (ret) return ret;
+
+        if (!next) {
+            if (!create) return 0;
+            ret = ext2_new_block(ed, idata, goal, (i + 1 < depth), &next);
+            if (ret) return ret;
+            ret = ext2_meta_write(ed, pos, &next, sizeof(next));
+            if (ret) return ret;
+            *changed = true;
+        }
+        block = next;
+    }
+
+    *result = block;
+    return 0;
+}
+
+#define EXT2_GOAL_LOOKBACK  8
+
+/* the first block after the inode table of `group` */
+static uint32_t ext2_group_goal(struct ext2_data *ed, uint group) {
+    struct ext2_group_desc *gd = ed->ed_groups + group;
+    count_t itable = (ed->ed_super.s_inodes_per_group * ed->ed_inode_size + ed->ed_blksz - 1) / ed->ed_blksz;
+    return gd->bg_inode_table + itable;
+}
+
+/* a new block of the file should follow its previous blocks or be near its inode */
+static uint32_t ext2_goal(mountnode *sb, struct inode *idata, uint32_t index) {
+    struct ext2_data *ed = sb->sb_data;
+    uint32_t back, block;
+    bool changed = false;
+
+    for (back = 1; (back <= EXT2_GOAL_LOOKBACK) && (back <= index); ++back) {
+        if (ext2_bmap(sb, idata, index - back, false, 0, &block, &changed))
+            break;
+        if (block)
+            return block + back;
+    }
+
+    return ext2_group_goal(ed, ext2_inode_group(ed, idata->i_no));
+}
+
+/*
+ *  Frees the entries [first, ptrs) of the indirect `block` of `depth`
+ *  and what they point to. Returns true if the block itself is freed.
+ */
+static bool ext2_free_tree(mountnode *sb, struct inode *idata,
+                           uint32_t block, int depth, uint32_t first)
+{
+    struct ext2_data *ed = sb->sb_data;
+    count_t ptrs = ed->ed_ptrs;
+
+    uint32_t span = 1;
+    int i;
+    for (i = 1; i < depth; ++i)
+        span *= ptrs;
+
+    uint32_t *table = kmalloc(ed->ed_blksz);
+    return_err_if(!table, false, "%s: kmalloc failed", __func__);
+    if (ext2_meta_read(ed, ext2_block_pos(ed, block), table, ed->ed_blksz)) {
+        kfree(table);
+        return false;
+    }
+
+    bool keep = false, changed = false;
+    size_t j;
+    for (j = 0; j < ptrs; ++j) {
+        if (!table[j]) continue;
+
+        if ((j + 1) * span <= first) {
+            keep = true;
+            continue;
+        }
+
+        uint32_t subfirst = ((j * span < first) ? first - j * span : 0);
+        bool freed = true;
+        if (depth > 1) {
+            freed = ext2_free_tree(sb, idata, table[j], depth - 1, subfirst);
+        } else {
+            ext2_free_block(ed, table[j]);
+            --idata->as.reg.block_count;
+        }
+
+        if (freed) {
+            table[j] = 0;
+            changed = true;
+        } else {
+            keep = true;
+        }
+    }
+
+    if (!keep) {
+        ext2_free_block(ed, block);
+        --idata->as.reg.block_count;
+    } else if (changed) {
+        ext2_meta_write(ed, ext2_block_pos(ed, block), table, ed->ed_blksz);
+    }
+    kfree(table);
+    return !keep;
+}
+
+/* frees file blocks from `start` on, the inode is to be stored then */
+static void ext2_free_blocks_from(mountnode *sb, struct inode *idata, uint32_t start) {
+    struct ext2_data *ed = sb->sb_data;
+    count_t ptrs = ed->ed_ptrs;
+    uint32_t i;
+
+    for (i = start; i < N_DIRECT_BLOCKS; ++i) {
+        if (!idata->as.reg.directblock[i]) continue;
+        ext2_free_block(ed, idata->as.reg.directblock[i]);
+        idata->as.reg.directblock[i] = 0;
+        --idata->as.reg.block_count;
+    }
+
+    off_t *roots[3] = {
+        &idata->as.reg.indir1st_block,
+        &idata->as.reg.indir2nd_block,
+        &idata->as.reg.indir3rd_block,
+    };
+    uint32_t base = N_DIRECT_BLOCKS;
+    uint32_t span = ptrs;
+    int depth;
+    for (depth = 1; depth <= 3; ++depth, base += span, span *= ptrs) {
+        if (!*roots[depth - 1])
+            continue;
+        if (start >= base + span)
+            continue;
+
+        uint32_t first = (start > base ? start - base : 0);
+        if (ext2_free_tree(sb, idata, (uint32_t)*roots[depth - 1], depth, first))
+            *roots[depth - 1] = 0;
+    }
+}
+
+
+/*
+ *  File data
+ */
+
+static int ext2_readpage(mountnode *sb, struct inode *idata, index_t index, char *page) {
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_run runs[EXT2_MAX_PAGE_BLOCKS];
+    count_t nruns = 0;
+    count_t perpage = PAGE_BYTES / ed->ed_blksz;
+    off_t pagepos = (off_t)index * PAGE_BYTES;
+    bool changed = false;
+    count_t i;
+    int ret;
+
+    for (i = 0; i < perpage; ++i) {
+        char *buf = page + i * ed->ed_blksz;
+        if (pagepos + (off_t)(i * ed->ed_blksz) >= idata->i_size) {
+            memset(buf, 0, PAGE_BYTES - i * ed->ed_blksz);
+            break;
+        }
+
+        uint32_t block;
+        ret = ext2_bmap(sb, idata, index * perpage + i, false, 0, &block, &changed);
+        if (ret) return ret;
+
+        if (block)
+            ext2_run_add(ed, runs, &nruns, block, buf);
+        else
+            memset(buf, 0, ed->ed_blksz);
+    }
+
+    ret = ext2_data_io(ed, BIO_READ, runs, nruns);
+    if (ret) return ret;
+
+    /* the tail of the last block */
+    if ((idata->i_size > pagepos) && (idata->i_size - pagepos < PAGE_BYTES)) {
+        size_t tail = idata->i_size - pagepos;
+        memset(page + tail, 0, PAGE_BYTES - tail);
+    }
+    return 0;
+}
+
+/* blocks are allocated here, when the data are written back */
+static int ext2_writepage(mountnode *sb, struct inode *idata, index_t index, const char *page) {
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_run runs[EXT2_MAX_PAGE_BLOCKS];
+    count_t nruns = 0;
+    count_t perpage = PAGE_BYTES / ed->ed_blksz;
+    off_t pagepos = (off_t)index * PAGE_BYTES;
+    bool changed = false;
+    count_t i;
+    int ret = 0;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+
+    for (i = 0; i < perpage; ++i) {
+        if (pagepos + (off_t)(i * ed->ed_blksz) >= idata->i_size)
+            break;
+
+        uint32_t block, fblock = index * perpage + i;
+        ret = ext2_bmap(sb, idata, fblock, true, ext2_goal(sb, idata, fblock), &block, &changed);
+        if (ret) break;
+
+        ext2_run_add(ed, runs, &nruns, block, (char *)page + i * ed->ed_blksz);
+    }
+
+    if (changed) {
+        int err = ext2_inode_store(sb, idata);
+        if (!ret) ret = err;
+    }
+    if (ret) return ret;
+
+    return ext2_data_io(ed, BIO_WRITE, runs, nruns);
+}
+
+static int ext2_read_inode(
+        mountnode *sb, inode_t ino, off_t pos,
+        char *buf, size_t buflen, size_t *written)
+{
+    struct inode *idata;
+    int ret = vfs_iget(sb, ino, &idata);
+    if (ret) return ret;
+
+    if (S_ISREG(idata->i_mode))
+        ret = vfs_pagecache_read(idata, NULL, pos, buf, buflen, written);
+    else
+        ret = (S_ISDIR(idata->i_mode) ? EISDIR : EINVAL);
+
+    vfs_iput(idata);
+    return ret;
+}
+
+static int ext2_write_inode(
+        mountnode *sb, inode_t ino, off_t pos,
+        const char *buf, size_t buflen, size_t *written)
+{
+    struct inode *idata;
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    int ret = vfs_iget(sb, ino, &idata);
+    if (ret) return ret;
+
+    if (S_ISREG(idata->i_mode))
+        ret = vfs_pagecache_write(idata, pos, buf, buflen, written);
+    else
+        ret = (S_ISDIR(idata->i_mode) ? EISDIR : EINVAL);
+
+    vfs_iput(idata);
+    return ret;
+}
+
+static int ext2_trunc_inode(mountnode *sb, inode_t ino, off_t length) {
+    struct ext2_data *ed = sb->sb_data;
+    struct inode *idata;
+    int ret;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    return_dbg_if(length < 0, EINVAL, "%s: length=%d\n", __func__, length);
+
+    ret = vfs_iget(sb, ino, &idata);
+    if (ret) return ret;
+    if (!S_ISREG(idata->i_mode)) {
+        vfs_iput(idata);
+        return_dbg_if(true, EINVAL, "%s(ino = %d): not a regular file\n", __func__, ino);
+    }
+
+    if (length < idata->i_size) {
+        uint32_t keep = (length + ed->ed_blksz - 1) / ed->ed_blksz;
+        ext2_free_blocks_from(sb, idata, keep);
+
+        /* the tail of the last block must read as zeroes if the file grows again */
+        size_t offset = length % ed->ed_blksz;
+        uint32_t block = 0;
+        bool changed = false;
+        if (offset)
+            ext2_bmap(sb, idata, length / ed->ed_blksz, false, 0, &block, &changed);
+        if (block) {
+            char *buf = kmalloc(ed->ed_blksz);
+            if (buf) {
+                struct ext2_run run = { .r_block = block, .r_count = 1, .r_buf = buf };
+                if (!ext2_data_io(ed, BIO_READ, &run, 1)) {
+                    memset(buf + offset, 0, ed->ed_blksz - offset);
+                    ext2_data_io(ed, BIO_WRITE, &run, 1);
+                }
+                kfree(buf);
+            }
+        }
+    }
+
+    /* growing leaves a hole */
+    idata->i_size = length;
+    ret = ext2_inode_store(sb, idata);
+    vfs_iput(idata);
+    return ret;
+}
+
+
+/*
+ *  Directories
+ */
+
+static uint8_t ext2_file_type(mode_t mode) {
+    switch (mode & S_IFMT) {
+        case S_IFREG:  return EXT2_FT_REG_FILE;
+        case S_IFDIR:  return EXT2_FT_DIR;
+        case S_IFCHR:  return EXT2_FT_CHRDEV;
+        case S_IFBLK:  return EXT2_FT_BLKDEV;
+        case S_IFIFO:  return EXT2_FT_FIFO;
+        case S_IFSOCK: return EXT2_FT_SOCK;
+        case S_IFLNK:  return EXT2_FT_SYMLINK;
+    }
+    return EXT2_FT_UNKNOWN;
+}
+
+static uint8_t ext2_dirent_type(uint8_t file_type) {
+    switch (file_type) {
+        case EXT2_FT_REG_FILE:  return DT_REG;
+        case EXT2_FT_DIR:       return DT_DIR;
+        case EXT2_FT_CHRDEV:    return DT_CHR;
+        case EXT2_FT_BLKDEV:    return DT_BLK;
+        case EXT2_FT_FIFO:      return DT_FIFO;
+        case EXT2_FT_SOCK:      return DT_SOCK;
+        case EXT2_FT_SYMLINK:   return DT_LNK;
+    }
+    return DT_UNKNOWN;
+}
+
+/* reads the directory block `index`, returns its device block through `block` */
+static int ext2_dir_block(mountnode *sb, struct inode *dir, uint32_t index,
+                          char *buf, uint32_t *block)
+{
+    struct ext2_data *ed = sb->sb_data;
+    bool changed = false;
+    int ret = ext2_bmap(sb, dir, index, false, 0, block, &changed);
+    if (ret) return ret;
+    return_err_if(!*block, EIO, "%s: a hole in directory %d", __func__, dir->i_no);
+
+    return ext2_meta_read(ed, ext2_block_pos(ed, *block), buf, ed->ed_blksz);
+}
+
+/* validates the entry at `offset` of a directory block */
+static struct ext2_dir_entry *
+ext2_dir_entry_at(struct ext2_data *ed, struct inode *dir, char *buf, size_t offset) {
+    struct ext2_dir_entry *de = (struct ext2_dir_entry *)(buf + offset);
+    if ((de->rec_len < EXT2_DIR_REC_LEN(0)) || (de->rec_len % 4)
+        || (offset + de->rec_len > ed->ed_blksz)
+        || (EXT2_DIR_REC_LEN(de->name_len) > de->rec_len))
+    {
+        logmsgef("%s: directory %d has a bad entry at %d", __func__, dir->i_no, offset);
+        return NULL;
+    }
+    return de;
+}
+
+static inline count_t ext2_dir_nblocks(struct ext2_data *ed, struct inode *dir) {
+    return (dir->i_size + ed->ed_blksz - 1) / ed->ed_blksz;
+}
+
+/* searches one directory block for `name` */
+static int ext2_block_search(struct ext2_data *ed, struct inode *dir, char *buf,
+                             const char *name, size_t namelen, size_t *entoff, int *prevoff)
+{
+    size_t offset = 0;
+    int prev = -1;
+    while (offset < ed->ed_blksz) {
+        struct ext2_dir_entry *de = ext2_dir_entry_at(ed, dir, buf, offset);
+        if (!de) return EIO;
+
+        if (de->inode && (de->name_len == namelen) && !strncmp(de->name, name, namelen)) {
+            if (entoff) *entoff = offset;
+            if (prevoff) *prevoff = prev;
+            return 0;
+        }
+        prev = offset;
+        offset += de->rec_len;
+    }
+    return ENOENT;
+}
+
+static int ext2_linear_search(mountnode *sb, struct inode *dir, const char *name, size_t namelen,
+                              char *buf, uint32_t *block, size_t *entoff, int *prevoff)
+{
+    struct ext2_data *ed = sb->sb_data;
+    count_t nblocks = ext2_dir_nblocks(ed, dir);
+    uint32_t index;
+    int ret;
+
+    for (index = 0; index < nblocks; ++index) {
+        ret = ext2_dir_block(sb, dir, index, buf, block);
+        if (ret) return ret;
+
+        ret = ext2_block_search(ed, dir, buf, name, namelen, entoff, prevoff);
+        if (ret != ENOENT)
+            return ret;
+    }
+    return ENOENT;
+}
+
+/* puts an entry into the first gap of a directory block that fits it */
+static int ext2_block_insert(struct ext2_data *ed, struct inode *dir, char *buf,
+                             const char *name, size_t namelen, inode_t ino, uint8_t file_type)
+{
+    size_t need = EXT2_DIR_REC_LEN(namelen);
+    size_t offset = 0;
+
+    while (offset < ed->ed_blksz) {
+        struct ext2_dir_entry *cur = ext2_dir_entry_at(ed, dir, buf, offset);
+        if (!cur) return EIO;
+
+        size_t used = (cur->inode ? EXT2_DIR_REC_LEN(cur->name_len) : 0);
+        if (cur->rec_len - used >= need) {
+            struct ext2_dir_entry *de = cur;
+            if (used) {
+                de = (struct ext2_dir_entry *)(buf + offset + used);
+                de->rec_len = cur->rec_len - used;
+                cur->rec_len = used;
+            }
+            de->inode = ino;
+            de->name_len = namelen;
+            de->file_type = (ed->ed_filetype ? file_type : 0);
+            memcpy(de->name, name, namelen);
+            return 0;
+        }
+        offset += cur->rec_len;
+    }
+    return ENOSPC;
+}
+
+/* appends a block with one empty entry to `dir`, `buf` gets its contents */
+static int ext2_dir_grow(mountnode *sb, struct inode *dir, char *buf,
+                         uint32_t *index, uint32_t *block)
+{
+    struct ext2_data *ed = sb->sb_data;
+    bool changed = false;
+
+    *index = ext2_dir_nblocks(ed, dir);
+    int ret = ext2_bmap(sb, dir, *index, true, ext2_goal(sb, dir, *index), block, &changed);
+    if (ret) return ret;
+
+    memset(buf, 0, ed->ed_blksz);
+    ((struct ext2_dir_entry *)buf)->rec_len = ed->ed_blksz;
+    dir->i_size += ed->ed_blksz;
+    return ext2_inode_store(sb, dir);
+}
+
+
+/*
+ *  Directory indexes
+ */
+
+static bool ext2_dx_indexed(struct ext2_data *ed, struct inode *dir) {
+    struct ext2_inode raw;
+    if (ext2_raw_inode_read(ed, dir->i_no, &raw))
+        return false;
+    return (raw.i_flags & EXT2_INDEX_FL) != 0;
+}
+
+static int ext2_dx_set_indexed(struct ext2_data *ed, struct inode *dir, bool indexed) {
+    struct ext2_inode raw;
+    int ret = ext2_raw_inode_read(ed, dir->i_no, &raw);
+    if (ret) return ret;
+
+    if (indexed)
+        raw.i_flags |= EXT2_INDEX_FL;
+    else
+        raw.i_flags &= ~EXT2_INDEX_FL;
+    return ext2_raw_inode_write(ed, dir->i_no, &raw);
+}
+
+/* the name hashes are those of Linux and e2fsprogs */
+#define EXT2_DX_HASH_EOF    0x7fffffffu
+
+static inline uint32_t ext2_rol32(uint32_t word, uint shift) {
+    return (word << shift) | (word >> (32 - shift));
+}
+
+static uint32_t ext2_dx_legacy_hash(const char *name, size_t len, bool unsig) {
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    while (len--) {
+        int c = (unsig ? (int)(uint8_t)*name : (int)(signed char)*name);
+        ++name;
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+static void ext2_dx_str2hashbuf(const char *msg, int len, uint32_t *buf, int num, bool unsig) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    int i;
+    if (len > num * 4)
+        len = num * 4;
+    for (i = 0; i < len; ++i) {
+        int c = (unsig ? (int)(uint8_t)msg[i] : (int)(signed char)msg[i]);
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            --num;
+        }
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+#define EXT2_TEA_DELTA      0x9E3779B9
+
+static void ext2_dx_tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do {
+        sum += EXT2_TEA_DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    } while (--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define MD4_F(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z)  (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z)  ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s)  \
+    (a += f(b, c, d) + (x), a = ext2_rol32(a, s))
+#define MD4_K1  0
+#define MD4_K2  013240474631u
+#define MD4_K3  015666365641u
+
+static void ext2_dx_half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    MD4_ROUND(MD4_F, a, b, c, d, in[0] + MD4_K1,  3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1] + MD4_K1,  7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3] + MD4_K1, 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4] + MD4_K1,  3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5] + MD4_K1,  7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7] + MD4_K1, 19);
+
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2,  3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2,  5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2,  9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2,  3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2,  5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2,  9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3,  3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3,  9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3,  3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3,  9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/* the major hash of `name`, its lowest bit is clear */
+static uint32_t ext2_dx_hash(struct ext2_data *ed, uint version, const char *name, size_t namelen) {
+    uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint32_t in[8];
+    uint32_t hash = 0;
+    int len = (int)namelen;
+    int i;
+
+    for (i = 0; i < 4; ++i)
+        if (ed->ed_super.s_hash_seed[i]) {
+            memcpy(buf, ed->ed_super.s_hash_seed, sizeof(buf));
+            break;
+        }
+
+    bool unsig = (version >= EXT2_DX_HASH_LEGACY_UNSIGNED);
+    switch (version) {
+      case EXT2_DX_HASH_LEGACY:
+      case EXT2_DX_HASH_LEGACY_UNSIGNED:
+        hash = ext2_dx_legacy_hash(name, namelen, unsig);
+        break;
+      case EXT2_DX_HASH_HALF_MD4:
+      case EXT2_DX_HASH_HALF_MD4_UNSIGNED:
+        for (; len > 0; len -= 32, name += 32) {
+            ext2_dx_str2hashbuf(name, len, in, 8, unsig);
+            ext2_dx_half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+      case EXT2_DX_HASH_TEA:
+      case EXT2_DX_HASH_TEA_UNSIGNED:
+        for (; len > 0; len -= 16, name += 16) {
+            ext2_dx_str2hashbuf(name, len, in, 4, unsig);
+            ext2_dx_tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    }
+
+    hash &= ~1;
+    if (hash == (EXT2_DX_HASH_EOF << 1))
+        hash = (EXT2_DX_HASH_EOF - 1) << 1;
+    return hash;
+}
+
+struct ext2_dx_frame {
+    char *      f_buf;          /* an index block */
+    uint32_t    f_block;        /* its device block */
+    struct ext2_dx_entry *f_entries;
+    struct ext2_dx_entry *f_at; /* the one followed down */
+};
+
+/* the way from the root to a leaf */
+struct ext2_dx_path {
+    struct ext2_dx_frame p_frames[EXT2_DX_MAX_LEVELS];
+    int         p_levels;       /* frames used */
+    uint        p_version;      /* of the hash */
+    uint32_t    p_hash;         /* of the name looked for */
+};
+
+static inline struct ext2_dx_countlimit *ext2_dx_countlimit(struct ext2_dx_entry *entries) {
+    return (struct ext2_dx_countlimit *)entries;
+}
+
+static inline count_t ext2_dx_root_limit(struct ext2_data *ed) {
+    return (ed->ed_blksz - EXT2_DX_ROOT_ENTRIES) / sizeof(struct ext2_dx_entry);
+}
+
+static inline count_t ext2_dx_node_limit(struct ext2_data *ed) {
+    return (ed->ed_blksz - EXT2_DX_NODE_ENTRIES) / sizeof(struct ext2_dx_entry);
+}
+
+static inline uint32_t ext2_dx_leaf(struct ext2_dx_path *path) {
+    return path->p_frames[path->p_levels - 1].f_at->block & EXT2_DX_BLOCK_MASK;
+}
+
+static void ext2_dx_release(struct ext2_dx_path *path) {
+    int i;
+    for (i = 0; i < path->p_levels; ++i)
+        kfree(path->p_frames[i].f_buf);
+    path->p_levels = 0;
+}
+
+/* reads the index block `index` into `frame` */
+static int ext2_dx_read_node(mountnode *sb, struct inode *dir, uint32_t index,
+                             struct ext2_dx_frame *frame)
+{
+    struct ext2_data *ed = sb->sb_data;
+    int ret = ext2_dir_block(sb, dir, index, frame->f_buf, &frame->f_block);
+    if (ret) return ret;
+
+    frame->f_entries = (struct ext2_dx_entry *)(frame->f_buf + EXT2_DX_NODE_ENTRIES);
+    frame->f_at = frame->f_entries;
+
+    struct ext2_dx_countlimit *cl = ext2_dx_countlimit(frame->f_entries);
+    return_err_if((cl->limit != ext2_dx_node_limit(ed)) || !cl->count || (cl->count > cl->limit),
+                  EINVAL, "%s: directory %d has a bad index block %d", __func__, dir->i_no, index);
+    return 0;
+}
+
+/*
+ *  Follows the index of `dir` down to the leaf where `name` is or
+ *  should be. EINVAL means that the index is not usable.
+ */
+static int ext2_dx_probe(mountnode *sb, struct inode *dir, const char *name, size_t namelen,
+                         struct ext2_dx_path *path)
+{
+    const char *funcname = __FUNCTION__;
+    struct ext2_data *ed = sb->sb_data;
+    int ret;
+
+    memset(path, 0, sizeof(struct ext2_dx_path));
+    char *buf = kmalloc(ed->ed_blksz);
+    return_err_if(!buf, ENOMEM, "%s: kmalloc failed", funcname);
+    path->p_frames[0].f_buf = buf;
+    path->p_levels = 1;
+
+    ret = ext2_dir_block(sb, dir, 0, buf, &path->p_frames[0].f_block);
+    if (ret) return ret;
+
+    struct ext2_dx_root_info *info = (struct ext2_dx_root_info *)(buf + EXT2_DX_ROOT_INFO);
+    if (info->reserved_zero || (info->info_length != sizeof(struct ext2_dx_root_info))
+        || (info->hash_version > EXT2_DX_HASH_TEA)
+        || (info->indirect_levels >= EXT2_DX_MAX_LEVELS) || (info->unused_flags & 1))
+    {
+        logmsgef("%s: directory %d has an unsupported index", funcname, dir->i_no);
+        return EINVAL;
+    }
+
+    path->p_version = info->hash_version;
+    if (ed->ed_super.s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+        path->p_version += EXT2_DX_HASH_LEGACY_UNSIGNED;
+    path->p_hash = ext2_dx_hash(ed, path->p_version, name, namelen);
+
+    struct ext2_dx_frame *frame = path->p_frames;
+    frame->f_entries = (struct ext2_dx_entry *)(buf + EXT2_DX_ROOT_ENTRIES);
+    struct ext2_dx_countlimit *cl = ext2_dx_countlimit(frame->f_entries);
+    return_err_if((cl->limit != ext2_dx_root_limit(ed)) || !cl->count || (cl->count > cl->limit),
+                  EINVAL, "%s: directory %d has a bad index root", funcname, dir->i_no);
+
+    for (;;) {
+        /* the last entry with a hash not above the one looked for */
+        struct ext2_dx_entry *p = frame->f_entries + 1;
+        struct ext2_dx_entry *q = frame->f_entries + ext2_dx_countlimit(frame->f_entries)->count - 1;
+        while (p <= q) {
+            struct ext2_dx_entry *m = p + (q - p) / 2;
+            if (m->hash > path->p_hash)
+                q = m - 1;
+            else
+                p = m + 1;
+        }
+        frame->f_at = p - 1;
+
+        if (path->p_levels > info->indirect_levels)
+            return 0;
+
+        ++frame;
+        frame->f_buf = kmalloc(ed->ed_blksz);
+        return_err_if(!frame->f_buf, ENOMEM, "%s: kmalloc failed", funcname);
+        ++path->p_levels;
+
+        ret = ext2_dx_read_node(sb, dir, frame[-1].f_at->block & EXT2_DX_BLOCK_MASK, frame);
+        if (ret) return ret;
+    }
+}
+
+/*
+ *  Names with the same hash may go on in the next leaf, its hash
+ *  has the lowest bit set then. Returns ENOENT if it's not the case.
+ */
+static int ext2_dx_next_leaf(mountnode *sb, struct inode *dir, struct ext2_dx_path *path) {
+    int level = path->p_levels - 1;
+    struct ext2_dx_frame *frame;
+    int ret;
+
+    for (;;) {
+        frame = path->p_frames + level;
+        count_t count = ext2_dx_countlimit(frame->f_entries)->count;
+        if (frame->f_at + 1 < frame->f_entries + count)
+            break;
+        if (level == 0)
+            return ENOENT;
+        --level;
+    }
+
+    ++frame->f_at;
+    if ((frame->f_at->hash & ~1) != path->p_hash)
+        return ENOENT;
+
+    for (; level + 1 < path->p_levels; ++level, ++frame) {
+        ret = ext2_dx_read_node(sb, dir, frame->f_at->block & EXT2_DX_BLOCK_MASK, frame + 1);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int ext2_dx_search(mountnode *sb, struct inode *dir, const char *name, size_t namelen,
+                          char *buf, uint32_t *block, size_t *entoff, int *prevoff)
+{
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_dx_path path;
+
+    int ret = ext2_dx_probe(sb, dir, name, namelen, &path);
+    while (!ret) {
+        ret = ext2_dir_block(sb, dir, ext2_dx_leaf(&path), buf, block);
+        if (ret) break;
+
+        ret = ext2_block_search(ed, dir, buf, name, namelen, entoff, prevoff);
+        if (ret != ENOENT) break;
+
+        ret = ext2_dx_next_leaf(sb, dir, &path);
+    }
+
+    ext2_dx_release(&path);
+    return ret;
+}
+
+/* adds an index entry after frame->f_at, there must be room for it */
+static void ext2_dx_insert(struct ext2_dx_frame *frame, uint32_t hash, uint32_t index) {
+    struct ext2_dx_countlimit *cl = ext2_dx_countlimit(frame->f_entries);
+    struct ext2_dx_entry *new = frame->f_at + 1;
+
+    memmove(new + 1, new, (frame->f_entries + cl->count - new) * sizeof(struct ext2_dx_entry));
+    new->hash = hash;
+    new->block = index;
+    ++cl->count;
+}
+
+static inline int ext2_dx_write(struct ext2_data *ed, struct ext2_dx_frame *frame) {
+    return ext2_meta_write(ed, ext2_block_pos(ed, frame->f_block), frame->f_buf, ed->ed_blksz);
+}
+
+/*
+ *  Makes room for one more entry in the lowest index block of `path`:
+ *  a full root moves its entries into a new node a level down,
+ *  a full node gives its upper half to a new one.
+ */
+static int ext2_dx_make_room(mountnode *sb, struct inode *dir, struct ext2_dx_path *path) {
+    const char *funcname = __FUNCTION__;
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_dx_frame *frame = path->p_frames + path->p_levels - 1;
+    struct ext2_dx_countlimit *cl = ext2_dx_countlimit(frame->f_entries);
+    uint32_t nodeidx, nodeblock;
+    int ret;
+
+    if (cl->count < cl->limit)
+        return 0;
+
+    if (path->p_levels > 1) {
+        struct ext2_dx_countlimit *pcl = ext2_dx_countlimit(frame[-1].f_entries);
+        return_log_if(pcl->count >= pcl->limit, ENOSPC,
+                      "%s: the index of directory %d is full\n", funcname, dir->i_no);
+    }
+
+    char *nodebuf = kmalloc(ed->ed_blksz);
+    return_err_if(!nodebuf, ENOMEM, "%s: kmalloc failed", funcname);
+    ret = ext2_dir_grow(sb, dir, nodebuf, &nodeidx, &nodeblock);
+    if (ret) {
+        kfree(nodebuf);
+        return ret;
+    }
+
+    struct ext2_dx_entry *entries = (struct ext2_dx_entry *)(nodebuf + EXT2_DX_NODE_ENTRIES);
+    count_t count = cl->count;
+
+    if (path->p_levels == 1) {
+        /* the root entries go a level down */
+        struct ext2_dx_root_info *info = (struct ext2_dx_root_info *)(frame->f_buf + EXT2_DX_ROOT_INFO);
+        struct ext2_dx_frame *child = frame + 1;
+
+        memcpy(entries, frame->f_entries, count * sizeof(struct ext2_dx_entry));
+        ext2_dx_countlimit(entries)->limit = ext2_dx_node_limit(ed);
+        ext2_dx_countlimit(entries)->count = count;
+
+        child->f_buf = nodebuf;
+        child->f_block = nodeblock;
+        child->f_entries = entries;
+        child->f_at = entries + (frame->f_at - frame->f_entries);
+        ++path->p_levels;
+
+        cl->count = 1;
+        frame->f_entries[0].block = nodeidx;
+        frame->f_at = frame->f_entries;
+        info->indirect_levels = 1;
+
+        ret = ext2_dx_write(ed, child);
+        if (!ret) ret = ext2_dx_write(ed, frame);
+        return ret;
+    }
+
+    /* the upper half of the node goes into the new one */
+    struct ext2_dx_frame *parent = frame - 1;
+    count_t keep = count - count / 2;
+    uint32_t hash2 = frame->f_entries[keep].hash;
+
+    memcpy(entries, frame->f_entries + keep, (count - keep) * sizeof(struct ext2_dx_entry));
+    ext2_dx_countlimit(entries)->limit = ext2_dx_node_limit(ed);
+    ext2_dx_countlimit(entries)->count = count - keep;
+    cl->count = keep;
+    ext2_dx_insert(parent, hash2, nodeidx);
+
+    ret = ext2_dx_write(ed, frame);
+    if (!ret) ret = ext2_meta_write(ed, ext2_block_pos(ed, nodeblock), nodebuf, ed->ed_blksz);
+    if (!ret) ret = ext2_dx_write(ed, parent);
+
+    if (frame->f_at >= frame->f_entries + keep) {
+        /* the way goes through the new node now */
+        frame->f_at = entries + (frame->f_at - frame->f_entries - keep);
+        frame->f_entries = entries;
+        frame->f_block = nodeblock;
+        kfree(frame->f_buf);
+        frame->f_buf = nodebuf;
+        ++parent->f_at;
+    } else {
+        kfree(nodebuf);
+    }
+    return ret;
+}
+
+struct ext2_dx_map {
+    uint32_t    m_hash;
+    uint16_t    m_offset;
+    uint16_t    m_size;
+};
+
+/* packs the entries `map[from..to)` of `src` into the block `dst` */
+static void ext2_dx_pack(struct ext2_data *ed, const char *src, char *dst,
+                         struct ext2_dx_map *map, count_t from, count_t to)
+{
+    struct ext2_dir_entry *last = (struct ext2_dir_entry *)dst;
+    size_t offset = 0;
+    count_t i;
+
+    memset(dst, 0, ed->ed_blksz);
+    for (i = from; i < to; ++i) {
+        last = (struct ext2_dir_entry *)(dst + offset);
+        memcpy(last, src + map[i].m_offset, map[i].m_size);
+        last->rec_len = map[i].m_size;
+        offset += map[i].m_size;
+    }
+    last->rec_len = ed->ed_blksz - (offset - (from < to ? last->rec_len : 0));
+}
+
+/*
+ *  Splits the full leaf in `buf` by hashes: about the upper half of its
+ *  bytes goes into a new leaf, then the new entry goes into one of them.
+ */
+static int ext2_dx_split_leaf(mountnode *sb, struct inode *dir, struct ext2_dx_path *path,
+                              char *buf, uint32_t block,
+                              const char *name, size_t namelen, inode_t ino, uint8_t file_type)
+{
+    const char *funcname = __FUNCTION__;
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_dx_frame *frame = path->p_frames + path->p_levels - 1;
+    uint32_t newidx, newblock;
+    count_t n = 0, j;
+    int ret;
+
+    char *newbuf = kmalloc(ed->ed_blksz);
+    char *tmp = kmalloc(ed->ed_blksz);
+    struct ext2_dx_map *map = kmalloc(ed->ed_blksz / EXT2_DIR_REC_LEN(1) * sizeof(struct ext2_dx_map));
+    if (!(newbuf && tmp && map)) {
+        logmsgef("%s: kmalloc failed", funcname);
+        ret = ENOMEM;
+        goto exit;
+    }
+
+    /* the entries sorted by hash */
+    size_t offset = 0;
+    while (offset < ed->ed_blksz) {
+        struct ext2_dir_entry *de = ext2_dir_entry_at(ed, dir, buf, offset);
+        if (!de) { ret = EIO; goto exit; }
+
+        if (de->inode) {
+            uint32_t hash = ext2_dx_hash(ed, path->p_version, de->name, de->name_len);
+            for (j = n; (j > 0) && (map[j - 1].m_hash > hash); --j)
+                map[j] = map[j - 1];
+            map[j].m_hash = hash;
+            map[j].m_offset = offset;
+            map[j].m_size = EXT2_DIR_REC_LEN(de->name_len);
+            ++n;
+        }
+        offset += de->rec_len;
+    }
+    if (n < 2) {
+        logmsgef("%s: directory %d: a full leaf with %d entries", funcname, dir->i_no, n);
+        ret = EIO;
+        goto exit;
+    }
+
+    size_t moved = 0;
+    count_t split = n;
+    while ((split > 1) && (moved + map[split - 1].m_size / 2 <= ed->ed_blksz / 2))
+        moved += map[--split].m_size;
+    if (split == n)
+        --split;
+
+    uint32_t hash2 = map[split].m_hash;
+    bool continued = (hash2 == map[split - 1].m_hash);
+
+    ret = ext2_dir_grow(sb, dir, newbuf, &newidx, &newblock);
+    if (ret) goto exit;
+
+    ext2_dx_pack(ed, buf, newbuf, map, split, n);
+    ext2_dx_pack(ed, buf, tmp, map, 0, split);
+    memcpy(buf, tmp, ed->ed_blksz);
+
+    char *target = (path->p_hash >= hash2 ? newbuf : buf);
+    ret = ext2_block_insert(ed, dir, target, name, namelen, ino, file_type);
+    if (ret == ENOSPC) ret = EIO;
+
+    int err = ext2_meta_write(ed, ext2_block_pos(ed, newblock), newbuf, ed->ed_blksz);
+    if (!err) err = ext2_meta_write(ed, ext2_block_pos(ed, block), buf, ed->ed_blksz);
+    if (!err) {
+        ext2_dx_insert(frame, hash2 | (continued ? 1 : 0), newidx);
+        err = ext2_dx_write(ed, frame);
+    }
+    if (!ret) ret = err;
+
+exit:
+    if (map) kfree(map);
+    if (tmp) kfree(tmp);
+    if (newbuf) kfree(newbuf);
+    return ret;
+}
+
+/* `buf` is a leaf block to be kept */
+static int ext2_dx_add(mountnode *sb, struct inode *dir, const char *name, size_t namelen,
+                       inode_t ino, uint8_t file_type, char *buf)
+{
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_dx_path path;
+    uint32_t block;
+
+    int ret = ext2_dx_probe(sb, dir, name, namelen, &path);
+    if (ret) goto exit;
+
+    ret = ext2_dir_block(sb, dir, ext2_dx_leaf(&path), buf, &block);
+    if (ret) goto exit;
+
+    ret = ext2_block_insert(ed, dir, buf, name, namelen, ino, file_type);
+    if (ret != ENOSPC) {
+        if (!ret)
+            ret = ext2_meta_write(ed, ext2_block_pos(ed, block), buf, ed->ed_blksz);
+        goto exit;
+    }
+
+    /* the leaf is full */
+    ret = ext2_dx_make_room(sb, dir, &path);
+    if (!ret)
+        ret = ext2_dx_split_leaf(sb, dir, &path, buf, block, name, namelen, ino, file_type);
+
+exit:
+    ext2_dx_release(&path);
+    return ret;
+}
+
+/*
+ *  Indexes a directory of one full block `buf`: its entries but
+ *  "." and ".." move into a new leaf and the block becomes the root.
+ *  EINVAL if the block does not start with "." and "..".
+ */
+static int ext2_dx_make_indexed(mountnode *sb, struct inode *dir, char *buf, uint32_t block) {
+    const char *funcname = __FUNCTION__;
+    struct ext2_data *ed = sb->sb_data;
+    uint32_t leafidx, leafblock;
+    int ret;
+
+    struct ext2_dir_entry *dot = ext2_dir_entry_at(ed, dir, buf, 0);
+    if (!dot || (dot->name_len != 1) || (dot->name[0] != '.'))
+        return EINVAL;
+    size_t offset = dot->rec_len;
+    struct ext2_dir_entry *dotdot = ext2_dir_entry_at(ed, dir, buf, offset);
+    if (!dotdot || (dotdot->name_len != 2) || strncmp(dotdot->name, "..", 2))
+        return EINVAL;
+    offset += dotdot->rec_len;
+    inode_t self = dot->inode, parent = dotdot->inode;
+
+    char *leaf = kmalloc(ed->ed_blksz);
+    return_err_if(!leaf, ENOMEM, "%s: kmalloc failed", funcname);
+
+    ret = ext2_dir_grow(sb, dir, leaf, &leafidx, &leafblock);
+    if (ret) goto exit;
+
+    struct ext2_dir_entry *last = NULL;
+    size_t leafoff = 0;
+    while (offset < ed->ed_blksz) {
+        struct ext2_dir_entry *de = ext2_dir_entry_at(ed, dir, buf, offset);
+        if (!de) { ret = EIO; goto exit; }
+
+        if (de->inode) {
+            last = (struct ext2_dir_entry *)(leaf + leafoff);
+            memcpy(last, de, EXT2_DIR_REC_LEN(de->name_len));
+            last->rec_len = EXT2_DIR_REC_LEN(de->name_len);
+            leafoff += last->rec_len;
+        }
+        offset += de->rec_len;
+    }
+    if (last)
+        last->rec_len += ed->ed_blksz - leafoff;
+
+    uint8_t dirtype = (ed->ed_filetype ? EXT2_FT_DIR : 0);
+    memset(buf, 0, ed->ed_blksz);
+    dot = (struct ext2_dir_entry *)buf;
+    dot->inode = self;
+    dot->rec_len = EXT2_DIR_REC_LEN(1);
+    dot->name_len = 1;
+    dot->file_type = dirtype;
+    dot->name[0] = '.';
+    dotdot = (struct ext2_dir_entry *)(buf + EXT2_DIR_REC_LEN(1));
+    dotdot->inode = parent;
+    dotdot->rec_len = ed->ed_blksz - EXT2_DIR_REC_LEN(1);
+    dotdot->name_len = 2;
+    dotdot->file_type = dirtype;
+    dotdot->name[0] = dotdot->name[1] = '.';
+
+    struct ext2_dx_root_info *info = (struct ext2_dx_root_info *)(buf + EXT2_DX_ROOT_INFO);
+    info->hash_version = ed->ed_super.s_def_hash_version;
+    if (info->hash_version > EXT2_DX_HASH_TEA)
+        info->hash_version = EXT2_DX_HASH_HALF_MD4;
+    info->info_length = sizeof(struct ext2_dx_root_info);
+
+    struct ext2_dx_entry *entries = (struct ext2_dx_entry *)(buf + EXT2_DX_ROOT_ENTRIES);
+    ext2_dx_countlimit(entries)->limit = ext2_dx_root_limit(ed);
+    ext2_dx_countlimit(entries)->count = 1;
+    entries[0].block = leafidx;
+
+    ret = ext2_meta_write(ed, ext2_block_pos(ed, leafblock), leaf, ed->ed_blksz);
+    if (!ret) ret = ext2_meta_write(ed, ext2_block_pos(ed, block), buf, ed->ed_blksz);
+    if (!ret) ret = ext2_dx_set_indexed(ed, dir, true);
+    logmsgdf("%s: directory %d is indexed now\n", funcname, dir->i_no);
+
+exit:
+    kfree(leaf);
+    return ret;
+}
+
+
+/*
+ *  Directory entries
+ */
+
+/*
+ *  Searches `dir` for `name`; `buf` keeps its block then,
+ *  `*entoff` is the offset of the entry in it and `*prevoff` of
+ *  the previous one or -1.
+ */
+static int ext2_dir_search(mountnode *sb, struct inode *dir, const char *name, size_t namelen,
+                           char *buf, uint32_t *block, size_t *entoff, int *prevoff)
+{
+    struct ext2_data *ed = sb->sb_data;
+    if (ed->ed_dx && ext2_dx_indexed(ed, dir)) {
+        int ret = ext2_dx_search(sb, dir, name, namelen, buf, block, entoff, prevoff);
+        if (ret != EINVAL)
+            return ret;
+        /* a bad index, the entries are still there */
+    }
+    return ext2_linear_search(sb, dir, name, namelen, buf, block, entoff, prevoff);
+}
+
+/*
+ *  Inserts an entry: through the index of `dir` or into the first gap
+ *  that fits it. A directory of one full block gets an index,
+ *  a larger one without it gets a new block.
+ */
+static int ext2_dir_add(mountnode *sb, struct inode *dir, const char *name, size_t namelen,
+                        inode_t ino, uint8_t file_type)
+{
+    struct ext2_data *ed = sb->sb_data;
+    count_t nblocks = ext2_dir_nblocks(ed, dir);
+    uint32_t index, block;
+    int ret;
+
+    char *buf = kmalloc(ed->ed_blksz);
+    return_err_if(!buf, ENOMEM, "%s: kmalloc failed", __func__);
+
+    if (ext2_dx_indexed(ed, dir)) {
+        if (ed->ed_dx) {
+            ret = ext2_dx_add(sb, dir, name, namelen, ino, file_type, buf);
+            if (ret != EINVAL)
+                goto exit;
+        }
+        /* the index would be stale */
+        ret = ext2_dx_set_indexed(ed, dir, false);
+        if (ret) goto exit;
+    }
+
+    for (index = 0; index < nblocks; ++index) {
+        ret = ext2_dir_block(sb, dir, index, buf, &block);
+        if (ret) goto exit;
+
+        ret = ext2_block_insert(ed, dir, buf, name, namelen, ino, file_type);
+        if (ret != ENOSPC) {
+            if (!ret)
+                ret = ext2_meta_write(ed, ext2_block_pos(ed, block), buf, ed->ed_blksz);
+            goto exit;
+        }
+    }
+
+    if ((nblocks == 1) && ed->ed_dx) {
+        ret = ext2_dx_make_indexed(sb, dir, buf, block);
+        if (ret != EINVAL) {
+            if (!ret)
+                ret = ext2_dx_add(sb, dir, name, namelen, ino, file_type, buf);
+            goto exit;
+        }
+    }
+
+    ret = ext2_dir_grow(sb, dir, buf, &index, &block);
+    if (ret) goto exit;
+    ret = ext2_block_insert(ed, dir, buf, name, namelen, ino, file_type);
+    if (!ret)
+        ret = ext2_meta_write(ed, ext2_block_pos(ed, block), buf, ed->ed_blksz);
+
+exit:
+    kfree(buf);
+    return ret;
+}
+
+static int ext2_lookup_inode(mountnode *sb, inode_t *result, const char *path, size_t pathlen) {
+    const char *funcname = __FUNCTION__;
+    struct ext2_data *ed = sb->sb_data;
+    logmsgdf("%s(path='%s', pathlen=%d)\n", funcname, path, pathlen);
+
+    pathlen = strnlen(path, pathlen);
+    inode_t ino = sb->sb_root_ino;
+    int ret = 0;
+
+    char *buf = kmalloc(ed->ed_blksz);
+    return_err_if(!buf, ENOMEM, "%s: kmalloc failed", funcname);
+
+    size_t pos = 0;
+    for (;;) {
+        while ((pos < pathlen) && (path[pos] == FS_SEP))
+            ++pos;
+        if (pos >= pathlen)
+            break;
+
+        size_t namelen = 0;
+        while ((pos + namelen < pathlen) && (path[pos + namelen] != FS_SEP))
+            ++namelen;
+
+        struct inode *dir;
+        ret = vfs_iget(sb, ino, &dir);
+        if (ret) break;
+
+        if (!S_ISDIR(dir->i_mode)) {
+            ret = ENOTDIR;
+        } else {
+            uint32_t block;
+            size_t offset;
+            ret = ext2_dir_search(sb, dir, path + pos, namelen, buf, &block, &offset, NULL);
+            if (!ret)
+                ino = ((struct ext2_dir_entry *)(buf + offset))->inode;
+        }
+        vfs_iput(dir);
+        if (ret) break;
+
+        pos += namelen;
+    }
+
+    kfree(buf);
+    if (ret) {
+        if (result) *result = 0;
+        return ret;
+    }
+
+    ed->ed_hint_group = ext2_inode_group(ed, ino);
+    if (result) *result = ino;
+    return 0;
+}
+
+/* `*iter` is the offset of the next entry, NULL at the start and at the end */
+static int ext2_get_direntry(mountnode *sb, inode_t dirino, void **iter, struct dirent *dirent) {
+    const char *funcname = __FUNCTION__;
+    struct ext2_data *ed = sb->sb_data;
+    struct inode *dir;
+    int ret;
+
+    ret = vfs_iget(sb, dirino, &dir);
+    return_dbg_if(ret, ret, "%s: vfs_iget(%d) failed(%d)\n", funcname, dirino, ret);
+    if (!S_ISDIR(dir->i_mode)) {
+        vfs_iput(dir);
+        return_log_if(true, ENOTDIR, "%s: node %d is not a directory\n", funcname, dirino);
+    }
+
+    char *buf = kmalloc(ed->ed_blksz);
+    if (!buf) {
+        vfs_iput(dir);
+        return_err_if(true, ENOMEM, "%s: kmalloc failed", funcname);
+    }
+
+    off_t pos = (off_t)(size_t)*iter;
+    uint32_t loaded = UINT_MAX, block;
+    bool found = false;
+    ret = ENOENT;
+
+    while (pos < dir->i_size) {
+        uint32_t index = pos / ed->ed_blksz;
+        size_t offset = pos % ed->ed_blksz;
+        if (index != loaded) {
+            ret = ext2_dir_block(sb, dir, index, buf, &block);
+            if (ret) break;
+            loaded = index;
+        }
+
+        struct ext2_dir_entry *de = ext2_dir_entry_at(ed, dir, buf, offset);
+        if (!de) { ret = EIO; break; }
+        pos += de->rec_len;
+        if (!de->inode)
+            continue;
+
+        if (found) {
+            /* there is one more */
+            *iter = (void *)(size_t)(pos - de->rec_len);
+            ret = 0;
+            goto exit;
+        }
+
+        dirent->d_ino = de->inode;
+        dirent->d_namlen = de->name_len;
+        memcpy(dirent->d_name, de->name, de->name_len);
+        dirent->d_name[de->name_len] = '\0';
+        dirent->d_reclen = sizeof(struct dirent) - UCHAR_MAX + dirent->d_namlen + 1;
+        dirent->d_type = ext2_dirent_type(de->file_type);
+        if (!ed->ed_filetype) {
+            struct inode *idata;
+            if (!vfs_iget(sb, de->inode, &idata)) {
+                dirent->d_type = ext2_dirent_type(ext2_file_type(idata->i_mode));
+                vfs_iput(idata);
+            }
+        }
+        found = true;
+    }
+
+    if (found && ((ret == 0) || (ret == ENOENT))) {
+        *iter = NULL;   /* that was the last one */
+        ret = 0;
+    }
+
+exit:
+    kfree(buf);
+    vfs_iput(dir);
+    return ret;
+}
+
+static int ext2_link_inode(
+        mountnode *sb, inode_t ino, inode_t dirino, const char *name, size_t namelen)
+{
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_inode raw;
+    struct inode *dir, *idata;
+    int ret;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    namelen = strnlen(name, namelen);
+    return_dbg_if(namelen == 0, EINVAL, "%s: no name\n", __func__);
+    return_dbg_if(namelen > EXT2_NAME_LEN, EINVAL, "%s: the name is too long\n", __func__);
+
+    /* a new inode is not pinned before it has a link, the last vfs_iput() frees it */
+    ret = ext2_raw_inode_read(ed, ino, &raw);
+    if (ret) return ret;
+    return_dbg_if(raw.i_mode == 0, ENOENT, "%s: no inode %d\n", __func__, ino);
+
+    ret = vfs_iget(sb, dirino, &dir);
+    return_dbg_if(ret, ret, "%s: no directory %d\n", __func__, dirino);
+    if (!S_ISDIR(dir->i_mode)) {
+        ret = ENOTDIR;
+        goto exit;
+    }
+
+    char *buf = kmalloc(ed->ed_blksz);
+    if (!buf) { ret = ENOMEM; goto exit; }
+    uint32_t block;
+    ret = ext2_dir_search(sb, dir, name, namelen, buf, &block, NULL, NULL);
+    kfree(buf);
+    if (ret != ENOENT) {
+        if (!ret) ret = EEXIST;
+        goto exit;
+    }
+
+    ret = ext2_dir_add(sb, dir, name, namelen, ino, ext2_file_type(raw.i_mode));
+    if (ret) goto exit;
+
+    ret = vfs_iget(sb, ino, &idata);
+    if (ret) goto exit;
+    ++idata->i_nlinks;
+    ret = ext2_inode_store(sb, idata);
+    vfs_iput(idata);
+
+exit:
+    vfs_iput(dir);
+    return ret;
+}
+
+static int ext2_unlink_inode(mountnode *sb, const char *path, size_t pathlen) {
+    struct ext2_data *ed = sb->sb_data;
+    struct inode *dir, *idata;
+    int ret;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    pathlen = strnlen(path, pathlen);
+
+    int dlen = vfs_path_dirname_len(path, pathlen);
+    return_dbg_if(dlen < 0, EINVAL, "%s: dirlen=%d\n", __func__, dlen);
+    size_t dirlen = (size_t)dlen;
+
+    inode_t dirino;
+    ret = ext2_lookup_inode(sb, &dirino, path, dirlen);
+    return_dbg_if(ret, ret, "%s: lookup_inode(%s[:%d]) failed(%d)\n", __func__, path, dirlen, ret);
+
+    const char *basename = path + dirlen;
+    while ((basename < path + pathlen) && (basename[0] == FS_SEP))
+        ++basename;
+    size_t namelen = pathlen - (basename - path);
+    return_dbg_if(namelen == 0, EINVAL, "%s: no basename\n", __func__);
+
+    ret = vfs_iget(sb, dirino, &dir);
+    if (ret) return ret;
+    char *buf = kmalloc(ed->ed_blksz);
+    if (!buf) {
+        vfs_iput(dir);
+        return ENOMEM;
+    }
+
+    uint32_t block;
+    size_t offset;
+    int prev;
+    ret = ext2_dir_search(sb, dir, basename, namelen, buf, &block, &offset, &prev);
+    if (ret) goto exit;
+
+    struct ext2_dir_entry *de = (struct ext2_dir_entry *)(buf + offset);
+    inode_t ino = de->inode;
+
+    ret = vfs_iget(sb, ino, &idata);
+    if (ret) goto exit;
+    if (S_ISDIR(idata->i_mode)) {
+        vfs_iput(idata);
+        ret = EISDIR;
+        goto exit;
+    }
+
+    if (prev >= 0)
+        ((struct ext2_dir_entry *)(buf + prev))->rec_len += de->rec_len;
+    else
+        de->inode = 0;
+    ret = ext2_meta_write(ed, ext2_block_pos(ed, block), buf, ed->ed_blksz);
+    if (ret) {
+        vfs_iput(idata);
+        goto exit;
+    }
+
+    --idata->i_nlinks;
+    ret = ext2_inode_store(sb, idata);
+    logmsgdf("%s(%s): nlinks=%d\n", __func__, path, idata->i_nlinks);
+    /* the last vfs_iput() frees it */
+    vfs_iput(idata);
+
+exit:
+    kfree(buf);
+    vfs_iput(dir);
+    return ret;
+}
+
+
+/*
+ *  Making and freeing inodes
+ */
+
+static void ext2_raw_inode_init(struct ext2_inode *raw, mode_t mode) {
+    uint32_t now = (uint32_t)time(NULL);
+    memset(raw, 0, sizeof(struct ext2_inode));
+    raw->i_mode = mode;
+    raw->i_atime = raw->i_ctime = raw->i_mtime = now;
+}
+
+static int ext2_make_inode(mountnode *sb, inode_t *result, mode_t mode, void *info) {
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_inode raw;
+    inode_t ino;
+    int ret;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    if ((mode & S_IFMT) == 0)
+        mode |= S_IFREG;
+    return_dbg_if(S_ISDIR(mode), EINVAL, "%s(IFDIR)\n", __func__);
+
+    ret = ext2_alloc_inode(ed, false, &ino);
+    return_dbg_if(ret, ret, "%s: ext2_alloc_inode failed(%d)\n", __func__, ret);
+
+    ext2_raw_inode_init(&raw, mode);
+    if (S_ISCHR(mode) || S_ISBLK(mode)) {
+        struct inode idata;
+        dev_t dev = (dev_t)(size_t)info;
+        memset(&idata, 0, sizeof(idata));
+        idata.i_mode = mode;
+        idata.as.dev.maj = gnu_dev_major(dev);
+        idata.as.dev.min = gnu_dev_minor(dev);
+        ext2_inode_from_vfs(ed, &idata, &raw);
+    }
+
+    ret = ext2_raw_inode_write(ed, ino, &raw);
+    if (ret) {
+        ext2_release_inode(ed, ino, false);
+        return ret;
+    }
+
+    if (result) *result = ino;
+    return 0;
+}
+
+static int ext2_free_inode(mountnode *sb, inode_t ino) {
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_inode raw;
+    int ret;
+
+    /* its cached copy is gone, the block map on the disk is up to date */
+    ret = ext2_raw_inode_read(ed, ino, &raw);
+    if (ret) return ret;
+    return_dbg_if(raw.i_mode == 0, ENOENT, "%s(%d): a free inode\n", __func__, ino);
+
+    bool isdir = S_ISDIR(raw.i_mode);
+    if (ext2_has_blocks(raw.i_mode) && !ext2_is_fast_symlink(ed, &raw)) {
+        struct inode idata;
+        memset(&idata, 0, sizeof(idata));
+        ext2_inode_to_vfs(ed, ino, &raw, &idata);
+        ext2_free_blocks_from(sb, &idata, 0);
+        ext2_inode_from_vfs(ed, &idata, &raw);
+    }
+
+    raw.i_links_count = 0;
+    raw.i_size = 0;
+    raw.i_dtime = (uint32_t)time(NULL);
+    ret = ext2_raw_inode_write(ed, ino, &raw);
+    if (ret) return ret;
+
+    logmsgdf("%s: ino=%d\n", __func__, ino);
+    return ext2_release_inode(ed, ino, isdir);
+}
+
+static int ext2_make_directory(mountnode *sb, inode_t *result, const char *path, mode_t mode) {
+    struct ext2_data *ed = sb->sb_data;
+    struct inode *parent = NULL;
+    struct ext2_inode raw;
+    inode_t ino = 0, parino;
+    uint32_t block = 0;
+    int ret;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    size_t pathlen = strlen(path);
+    while (pathlen && (path[pathlen - 1] == FS_SEP))
+        --pathlen;
+    return_dbg_if(pathlen == 0, EEXIST, "%s: the root exists\n", __func__);
+
+    int dirlen = vfs_path_dirname_len(path, pathlen);
+    const char *basename = path + dirlen;
+    while (basename[0] == FS_SEP) ++basename;
+    size_t namelen = pathlen - (basename - path);
+    return_dbg_if(namelen > EXT2_NAME_LEN, EINVAL, "%s: the name is too long\n", __func__);
+
+    ret = ext2_lookup_inode(sb, &parino, path, dirlen);
+    return_dbg_if(ret, ret, "%s: no parent for '%s'\n", __func__, path);
+    ret = vfs_iget(sb, parino, &parent);
+    if (ret) return ret;
+    if (!S_ISDIR(parent->i_mode)) {
+        ret = ENOTDIR;
+        goto error_exit;
+    }
+
+    char *buf = kmalloc(ed->ed_blksz);
+    if (!buf) { ret = ENOMEM; goto error_exit; }
+
+    ret = ext2_dir_search(sb, parent, basename, namelen, buf, &block, NULL, NULL);
+    block = 0;
+    if (ret != ENOENT) {
+        if (!ret) ret = EEXIST;
+        goto error_free;
+    }
+
+    ret = ext2_alloc_inode(ed, true, &ino);
+    if (ret) goto error_free;
+
+    ret = ext2_alloc_block(ed, ext2_group_goal(ed, ext2_inode_group(ed, ino)), &block);
+    if (ret) goto error_free;
+
+    /* "." and ".." */
+    memset(buf, 0, ed->ed_blksz);
+    struct ext2_dir_entry *de = (struct ext2_dir_entry *)buf;
+    de->inode = ino;
+    de->rec_len = EXT2_DIR_REC_LEN(1);
+    de->name_len = 1;
+    de->file_type = (ed->ed_filetype ? EXT2_FT_DIR : 0);
+    de->name[0] = '.';
+    de = (struct ext2_dir_entry *)(buf + EXT2_DIR_REC_LEN(1));
+    de->inode = parino;
+    de->rec_len = ed->ed_blksz - EXT2_DIR_REC_LEN(1);
+    de->name_len = 2;
+    de->file_type = (ed->ed_filetype ? EXT2_FT_DIR : 0);
+    de->name[0] = de->name[1] = '.';
+    ret = ext2_meta_write(ed, ext2_block_pos(ed, block), buf, ed->ed_blksz);
+    if (ret) goto error_free;
+
+    ext2_raw_inode_init(&raw, S_IFDIR | (mode & ~S_IFMT));
+    raw.i_links_count = 2;
+    raw.i_size = ed->ed_blksz;
+    raw.i_blocks = ed->ed_blksz / 512;
+    raw.i_block[0] = block;
+    ret = ext2_raw_inode_write(ed, ino, &raw);
+    if (ret) goto error_free;
+
+    ret = ext2_dir_add(sb, parent, basename, namelen, ino, EXT2_FT_DIR);
+    if (ret) goto error_free;
+
+    ++parent->i_nlinks;
+    ext2_inode_store(sb, parent);
+
+    kfree(buf);
+    vfs_iput(parent);
+    if (result) *result = ino;
+    return 0;
+
+error_free:
+    kfree(buf);
+    if (block) ext2_free_block(ed, block);
+    if (ino) ext2_release_inode(ed, ino, true);
+error_exit:
+    vfs_iput(parent);
+    if (result) *result = 0;
+    return ret;
+}
+
+
+/*
+ *  The superblock
+ */
+
+static int ext2_read_superblock(mountnode *sb, const mount_opts_t *opts) {
+    const char *funcname = __FUNCTION__;
+    int ret;
+
+    device *dev = device_by_devno(DEV_BLK, sb->sb_dev);
+    return_dbg_if(!dev, ENODEV, "%s: no block device %d:%d\n", funcname,
+                  gnu_dev_major(sb->sb_dev), gnu_dev_minor(sb->sb_dev));
+
+    struct ext2_data *ed = kmalloc(sizeof(struct ext2_data));
+    return_err_if(!ed, ENOMEM, "%s: kmalloc failed", funcname);
+    memset(ed, 0, sizeof(struct ext2_data));
+    ed->ed_dev = dev;
+
+    struct ext2_super_block *es = &ed->ed_super;
+    ret = ext2_meta_read(ed, EXT2_SUPER_OFFSET, es, sizeof(struct ext2_super_block));
+    if (ret) goto error_exit;
+
+    ret = EINVAL;
+    if (es->s_magic != EXT2_SUPER_MAGIC) {
+        logmsgef("%s: no ext2 magic (0x%x)", funcname, es->s_magic);
+        goto error_exit;
+    }
+    if (es->s_rev_level > EXT2_GOOD_OLD_REV) {
+        if (es->s_feature_incompat & ~EXT2_INCOMPAT_SUPPORTED) {
+            logmsgef("%s: unsupported features 0x%x", funcname,
+                     es->s_feature_incompat & ~EXT2_INCOMPAT_SUPPORTED);
+            ret = ENOSYS;
+            goto error_exit;
+        }
+        if (es->s_feature_ro_compat & ~EXT2_RO_COMPAT_SUPPORTED) {
+            logmsgif("%s: read-only features 0x%x, mounting read-only", funcname,
+                     es->s_feature_ro_compat & ~EXT2_RO_COMPAT_SUPPORTED);
+            sb->sb_flags.ro = true;
+        }
+    }
+
+    size_t devblksz = dev->dev_ops->dev_size_of_block(dev);
+    ed->ed_blksz = 1024 << es->s_log_block_size;
+    if ((ed->ed_blksz > PAGE_BYTES) || (ed->ed_blksz % devblksz)) {
+        logmsgef("%s: block size %d is not supported", funcname, ed->ed_blksz);
+        goto error_exit;
+    }
+    ed->ed_devblocks = ed->ed_blksz / devblksz;
+    ed->ed_ptrs = ed->ed_blksz / sizeof(uint32_t);
+    if (!es->s_blocks_per_group || !es->s_inodes_per_group
+        || (es->s_blocks_per_group > 8 * ed->ed_blksz)
+        || (es->s_inodes_per_group > 8 * ed->ed_blksz))
+    {
+        logmsgef("%s: bad group geometry", funcname);
+        goto error_exit;
+    }
+
+    if (es->s_rev_level == EXT2_GOOD_OLD_REV) {
+        ed->ed_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+        ed->ed_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    } else {
+        ed->ed_inode_size = es->s_inode_size;
+        ed->ed_first_ino = es->s_first_ino;
+        ed->ed_filetype = (es->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) != 0;
+    }
+    ed->ed_dx = (es->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) && !opts->noindex;
+    if (ed->ed_inode_size < sizeof(struct ext2_inode)) {
+        logmsgef("%s: inode size %d", funcname, ed->ed_inode_size);
+        goto error_exit;
+    }
+
+    ed->ed_ngroups = (es->s_blocks_count - es->s_first_data_block
+                      + es->s_blocks_per_group - 1) / es->s_blocks_per_group;
+    size_t gdsize = ed->ed_ngroups * sizeof(struct ext2_group_desc);
+    ed->ed_groups = kmalloc(gdsize);
+    ed->ed_bitmap = kmalloc(ed->ed_blksz);
+    if (!(ed->ed_groups && ed->ed_bitmap)) {
+        ret = ENOMEM;
+        goto error_exit;
+    }
+    ret = ext2_meta_read(ed, ext2_block_pos(ed, es->s_first_data_block + 1), ed->ed_groups, gdsize);
+    if (ret) goto error_exit;
+
+    sb->sb_blksz = ed->ed_blksz;
+    sb->sb_root_ino = EXT2_ROOT_INO;
+    sb->sb_data = ed;
+
+    if (!sb->sb_flags.ro) {
+        ++es->s_mnt_count;
+        es->s_mtime = (uint32_t)time(NULL);
+        ext2_write_super(ed);
+    }
+
+    logmsgif("%s: %d blocks of %d, %d inodes, %d groups%s", funcname,
+             es->s_blocks_count, ed->ed_blksz, es->s_inodes_count, ed->ed_ngroups,
+             (sb->sb_flags.ro ? ", read-only" : ""));
+    return 0;
+
+error_exit:
+    if (ed->ed_groups) kfree(ed->ed_groups);
+    if (ed->ed_bitmap) kfree(ed->ed_bitmap);
+    kfree(ed);
+    return ret;
+}
+
+static int ext2_get_usage(mountnode *sb, struct fs_usage *usage) {
+    struct ext2_data *ed = sb->sb_data;
+    struct ext2_super_block *es = &ed->ed_super;
+    usage->fu_blocks = es->s_blocks_count - es->s_free_blocks_count;
+    usage->fu_max_blocks = es->s_blocks_count;
+    usage->fu_inodes = es->s_inodes_count - es->s_free_inodes_count;
+    usage->fu_max_inodes = es->s_inodes_count;
+    return 0;
+}
@@ -0,0 +1,2443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/errno.h>
+
+#include <cosec/log.h>
+
+#include "attrs.h"
+#include "mem/kheap.h"
+#include "misc/bitmap.h"
+#include "fs/vfs.h"
+#include "fs/icache.h"
+#include "fs/pagecache.h"
+#include "fs/bio.h"
+#include "fs/blkqueue.h"
+#include "fs/fat.h"
+
+/*
+ *  On-disk structures, little-endian as the CPU
+ */
+#define FAT_BOOT_SIGNATURE      0xAA55
+
+#define FAT12_MAX_CLUSTERS      4084
+#define FAT16_MAX_CLUSTERS      65524
+
+#define FAT12_EOC               0x0FF8      /* and above: the end of a chain */
+#define FAT16_EOC               0xFFF8
+#define FAT32_EOC               0x0FFFFFF8
+#define FAT32_MASK              0x0FFFFFFF
+
+#define FAT32_MIRROR_OFF        0x0080      /* bpb_ext_flags: only the active FAT is used */
+#define FAT32_ACTIVE_FAT        0x000F
+
+struct __packed fat_boot_sector {
+    uint8_t  bs_jump[3];
+    char     bs_oem_name[8];
+    uint16_t bpb_bytes_per_sec;
+    uint8_t  bpb_sec_per_clus;
+    uint16_t bpb_rsvd_sec_cnt;
+    uint8_t  bpb_num_fats;
+    uint16_t bpb_root_ent_cnt;      /* FAT12/16: entries of the fixed root directory */
+    uint16_t bpb_tot_sec16;
+    uint8_t  bpb_media;
+    uint16_t bpb_fat_sz16;
+    uint16_t bpb_sec_per_trk;
+    uint16_t bpb_num_heads;
+    uint32_t bpb_hidd_sec;
+    uint32_t bpb_tot_sec32;
+    /* FAT32 */
+    uint32_t bpb_fat_sz32;
+    uint16_t bpb_ext_flags;
+    uint16_t bpb_fs_ver;
+    uint32_t bpb_root_clus;
+    uint16_t bpb_fs_info;
+    uint16_t bpb_bk_boot_sec;
+    uint8_t  bpb_reserved[12];
+    uint8_t  bs_drv_num;
+    uint8_t  bs_reserved1;
+    uint8_t  bs_boot_sig;
+    uint32_t bs_vol_id;
+    char     bs_vol_lab[11];
+    char     bs_fil_sys_type[8];
+    uint8_t  bs_code[420];
+    uint16_t bs_signature;          /* FAT_BOOT_SIGNATURE */
+};
+
+#define FAT_FSINFO_LEAD_SIG     0x41615252
+#define FAT_FSINFO_STRUC_SIG    0x61417272
+#define FAT_FSINFO_FREE         488     /* fsi_free_count, fsi_nxt_free */
+#define FAT_FSINFO_UNKNOWN      0xFFFFFFFF
+
+struct __packed fat_fsinfo {
+    uint32_t fsi_lead_sig;
+    uint8_t  fsi_reserved1[480];
+    uint32_t fsi_struc_sig;
+    uint32_t fsi_free_count;
+    uint32_t fsi_nxt_free;
+    uint8_t  fsi_reserved2[12];
+    uint32_t fsi_trail_sig;
+};
+
+enum fat_attr {
+    FAT_ATTR_READ_ONLY  = 0x01,
+    FAT_ATTR_HIDDEN     = 0x02,
+    FAT_ATTR_SYSTEM     = 0x04,
+    FAT_ATTR_VOLUME_ID  = 0x08,
+    FAT_ATTR_DIRECTORY  = 0x10,
+    FAT_ATTR_ARCHIVE    = 0x20,
+    FAT_ATTR_LONG_NAME  = 0x0F,
+    FAT_ATTR_LONG_MASK  = 0x3F,
+};
+
+#define FAT_NTRES_LOWER_BASE    0x08
+#define FAT_NTRES_LOWER_EXT     0x10
+
+#define FAT_DIRENT_SIZE         32
+#define FAT_DIRENT_FREE         0xE5    /* the first byte of a deleted entry */
+#define FAT_DIRENT_E5           0x05    /* a name that starts with 0xE5 */
+#define FAT_DIR_MAX_BYTES       (65536 * FAT_DIRENT_SIZE)
+
+struct __packed fat_dir_entry {
+    char     name[11];              /* 8.3, padded with spaces */
+    uint8_t  attr;
+    uint8_t  ntres;
+    uint8_t  crt_time_tenth;
+    uint16_t crt_time;
+    uint16_t crt_date;
+    uint16_t lst_acc_date;
+    uint16_t fst_clus_hi;
+    uint16_t wrt_time;
+    uint16_t wrt_date;
+    uint16_t fst_clus_lo;
+    uint32_t file_size;
+};
+
+/*
+ *  Long names: up to 20 entries of 13 UCS-2 characters precede
+ *  the short entry, the last part first.
+ */
+#define FAT_LFN_LAST            0x40    /* lfn_ord */
+#define FAT_LFN_ORD_MASK        0x1F
+#define FAT_LFN_CHARS           13
+#define FAT_LFN_MAX             255
+
+struct __packed fat_lfn_entry {
+    uint8_t  lfn_ord;
+    uint16_t lfn_name1[5];
+    uint8_t  lfn_attr;              /* FAT_ATTR_LONG_NAME */
+    uint8_t  lfn_type;
+    uint8_t  lfn_chksum;            /* of the short name */
+    uint16_t lfn_name2[6];
+    uint16_t lfn_fst_clus_lo;
+    uint16_t lfn_name3[2];
+};
+
+/* tries to find a unique short name for a long one */
+#define FAT_ALIAS_TRIES         64
+
+
+/*
+ *  fat
+ */
+
+static int fat_read_superblock(mountnode *sb, const mount_opts_t *opts);
+static int fat_get_usage(mountnode *sb, struct fs_usage *usage);
+static int fat_lookup_inode(mountnode *sb, inode_t *ino, const char *path, size_t pathlen);
+static int fat_make_directory(mountnode *sb, inode_t *ino, const char *path, mode_t mode);
+static int fat_get_direntry(mountnode *sb, inode_t dirino, void **iter, struct dirent *dirent);
+static int fat_make_inode(mountnode *sb, inode_t *ino, mode_t mode, void *info);
+static int fat_free_inode(mountnode *sb, inode_t ino);
+static int fat_link_inode(mountnode *sb, inode_t ino, inode_t dirino, const char *name, size_t namelen);
+static int fat_unlink_inode(mountnode *sb, const char *path, size_t pathlen);
+static struct inode * fat_inode_incore(mountnode *sb, inode_t ino);
+static int fat_read_inode(mountnode *sb, inode_t ino, off_t pos,
+                          char *buf, size_t buflen, size_t *written);
+static int fat_write_inode(mountnode *sb, inode_t ino, off_t pos,
+                           const char *buf, size_t buflen, size_t *written);
+static int fat_readpage(mountnode *sb, struct inode *idata, index_t index, char *page);
+static int fat_writepage(mountnode *sb, struct inode *idata, index_t index, const char *page);
+static int fat_trunc_inode(mountnode *sb, inode_t ino, off_t length);
+
+struct filesystem_operations  fat_fsops = {
+    .read_superblock    = fat_read_superblock,
+    .get_usage          = fat_get_usage,
+    .lookup_inode       = fat_lookup_inode,
+    .make_directory     = fat_make_directory,
+    .get_direntry       = fat_get_direntry,
+    .make_inode         = fat_make_inode,
+    .free_inode         = fat_free_inode,
+    .link_inode         = fat_link_inode,
+    .unlink_inode       = fat_unlink_inode,
+    .inode_incore       = fat_inode_incore,
+    .read_inode         = fat_read_inode,
+    .write_inode        = fat_write_inode,
+    .readpage           = fat_readpage,
+    .writepage          = fat_writepage,
+    .trunc_inode        = fat_trunc_inode,
+};
+
+struct filesystem_driver  fat_driver = {
+    .name = "fat",
+    .fs_id = FAT_ID,
+    .ops = &fat_fsops,
+    .lst = { 0 },
+};
+
+fsdriver * fat_fs_driver(void) {
+    return &fat_driver;
+}
+
+
+enum fat_type {
+    FAT12 = 12,
+    FAT16 = 16,
+    FAT32 = 32,
+};
+
+/* a run of consecutive clusters of a file */
+struct fat_extent {
+    uint32_t    fx_index;           /* the first file cluster of the run */
+    uint32_t    fx_cluster;
+    uint32_t    fx_count;
+};
+
+#define FAT_EXTENTS_MIN     4
+
+struct fat_node {
+    struct inode fn_inode;          /* fn_inode.i_data points here */
+    off_t       fn_pos;             /* the short entry on the device, 0 if none */
+    off_t       fn_pos2;            /* the second name while it is renamed */
+    off_t       fn_dsize;           /* the size in the entry */
+    uint32_t    fn_first;           /* the first cluster, 0 if none */
+    uint8_t     fn_attr;
+
+    struct fat_extent *fn_ext;      /* the cluster chain */
+    count_t     fn_next;
+    count_t     fn_extmax;
+    uint32_t    fn_nclusters;
+
+    struct fat_node *fn_inext;      /* fd_byino chain */
+    struct fat_node *fn_pnext;      /* fd_bypos chain */
+};
+
+#define FAT_NODE_BUCKETS    64      /* a power of 2 */
+#define FAT_NODES_MAX       256     /* unreferenced nodes are dropped above this */
+
+/* a chunk of the FAT for chain walks */
+#define FAT_BUF_BYTES       PAGE_BYTES
+#define FAT_NO_BUF          ((size_t)-1)
+
+/* used by struct superblock as `data` pointer to store FS-specific state */
+struct fat_data {
+    device *    fd_dev;
+    enum fat_type fd_type;
+    size_t      fd_secsz;
+    size_t      fd_clsz;
+    size_t      fd_devblksz;
+
+    off_t       fd_fat_pos;         /* the first FAT written */
+    size_t      fd_fat_bytes;       /* the size of a FAT */
+    count_t     fd_fat_copies;      /* how many FATs are written */
+    off_t       fd_root_pos;        /* FAT12/16: the fixed root directory */
+    size_t      fd_root_bytes;
+    uint32_t    fd_root_clus;       /* FAT32: the first cluster of the root */
+    off_t       fd_data_pos;        /* cluster 2 */
+    off_t       fd_fsinfo_pos;      /* 0 if none */
+
+    uint32_t    fd_maxcl;           /* the last data cluster */
+    uint32_t    fd_eoc;             /* the end of chain mark */
+    bitmap_word_t *fd_used;         /* a bit per cluster */
+    uint32_t    fd_nfree;
+    uint32_t    fd_next_free;       /* next-fit: free clusters are searched from here */
+
+    char *      fd_fatbuf;
+    size_t      fd_fatbuf_off;      /* the offset of fd_fatbuf in the FAT */
+
+    struct fat_node *fd_byino[FAT_NODE_BUCKETS];
+    struct fat_node *fd_bypos[FAT_NODE_BUCKETS];
+    struct fat_node *fd_root;
+    count_t     fd_nnodes;
+    count_t     fd_nodes_limit;     /* unreferenced nodes are dropped above this */
+    count_t     fd_nrenamed;        /* nodes with fn_pos2 */
+    inode_t     fd_next_ino;        /* for nodes that their positions do not number */
+};
+
+/* clusters a page takes at most, so at most this many runs */
+#define FAT_MAX_PAGE_RUNS   (PAGE_BYTES / 512)
+
+/* new clusters are filled from here */
+static char theFatZeroPage[PAGE_BYTES];
+
+
+/*
+ *  Metadata I/O through the page cache of the device
+ */
+
+static int fat_meta_read(struct fat_data *fd, off_t pos, void *buf, size_t len) {
+    size_t done = 0;
+    int ret = bdev_blocking_read(fd->fd_dev, NULL, pos, buf, len, &done);
+    if (!ret && (done != len))
+        ret = EIO;
+    return_err_if(ret, ret, "%s(@%x, %d) failed(%d)", __func__, pos, len, ret);
+    return 0;
+}
+
+static int fat_meta_write(struct fat_data *fd, off_t pos, const void *buf, size_t len) {
+    size_t done = 0;
+    int ret = bdev_blocking_write(fd->fd_dev, pos, buf, len, &done);
+    if (!ret && (done != len))
+        ret = EIO;
+    return_err_if(ret, ret, "%s(@%x, %d) failed(%d)", __func__, pos, len, ret);
+    return 0;
+}
+
+static inline bool fat_cluster_valid(struct fat_data *fd, uint32_t cluster) {
+    return (2 <= cluster) && (cluster <= fd->fd_maxcl);
+}
+
+static inline off_t fat_cluster_pos(struct fat_data *fd, uint32_t cluster) {
+    return fd->fd_data_pos + (off_t)(cluster - 2) * fd->fd_clsz;
+}
+
+static int fat_write_fsinfo(struct fat_data *fd) {
+    if (!fd->fd_fsinfo_pos)
+        return 0;
+    uint32_t fsi[2] = { fd->fd_nfree, fd->fd_next_free };
+    return fat_meta_write(fd, fd->fd_fsinfo_pos + FAT_FSINFO_FREE, fsi, sizeof(fsi));
+}
+
+
+/*
+ *  File data I/O: one bio per run of clusters, all of a page in one batch
+ */
+
+struct fat_run {
+    off_t       r_pos;              /* on the device */
+    size_t      r_len;
+    char *      r_buf;
+};
+
+/* adds `len` bytes at `buf` to `runs`, merging them into the last one if possible */
+static void fat_run_add(struct fat_run *runs, count_t *nruns, off_t pos, size_t len, char *buf) {
+    if (*nruns) {
+        struct fat_run *last = runs + *nruns - 1;
+        if ((last->r_pos + (off_t)last->r_len == pos) && (last->r_buf + last->r_len == buf)) {
+            last->r_len += len;
+            return;
+        }
+    }
+    runs[*nruns].r_pos = pos;
+    runs[*nruns].r_len = len;
+    runs[*nruns].r_buf = buf;
+    ++*nruns;
+}
+
+/*
+ *  Data written around the page cache of the device are copied into
+ *  its pages if they are cached there, e.g. next to a directory;
+ *  otherwise a dirty page of the device would write them back stale.
+ */
+static void fat_bdev_update(struct fat_data *fd, off_t pos, size_t len, const char *buf) {
+    page_mapping *m = fd->fd_dev->dev_pages;
+    if (!m) return;
+
+    while (len) {
+        size_t offset = pos % PAGE_BYTES;
+        size_t n = PAGE_BYTES - offset;
+        if (n > len) n = len;
+
+        cached_page *pg = pagecache_find(m, pos / PAGE_BYTES);
+        if (pg)
+            memcpy(pg->cp_data + offset, buf, n);
+
+        pos += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+static int fat_data_io(struct fat_data *fd, enum bio_op op, struct fat_run *runs, count_t nruns) {
+    struct bio bios[FAT_MAX_PAGE_RUNS];
+    struct bio_vec vecs[FAT_MAX_PAGE_RUNS];
+    struct bio_batch batch;
+    count_t i;
+    int ret = 0;
+
+    if (!nruns)
+        return 0;
+
+    bio_batch_init(&batch);
+    bdev_plug(fd->fd_dev);
+    for (i = 0; i < nruns; ++i) {
+        vecs[i].bv_data = runs[i].r_buf;
+        vecs[i].bv_len = runs[i].r_len;
+        bio_init(&bios[i], fd->fd_dev, op, runs[i].r_pos / fd->fd_devblksz, vecs + i, 1);
+
+        ret = bio_batch_submit(&batch, &bios[i]);
+        if (ret) break;
+    }
+    bdev_unplug(fd->fd_dev);
+
+    int err = bio_batch_wait(&batch);
+    if (!ret) ret = err;
+    return_err_if(ret, ret, "%s: %s at @%x failed(%d)", __func__,
+                  (op == BIO_READ ? "read" : "write"), runs[0].r_pos, ret);
+
+    if (op == BIO_WRITE)
+        for (i = 0; i < nruns; ++i)
+            fat_bdev_update(fd, runs[i].r_pos, runs[i].r_len, runs[i].r_buf);
+    return 0;
+}
+
+
+/*
+ *  The FAT
+ */
+
+/* the byte `off` of the FAT, read with the rest of its chunk into fd_fatbuf */
+static int fat_table_byte(struct fat_data *fd, size_t off, uint8_t *byte) {
+    size_t chunk = off - off % FAT_BUF_BYTES;
+    if (chunk != fd->fd_fatbuf_off) {
+        size_t len = fd->fd_fat_bytes - chunk;
+        if (len > FAT_BUF_BYTES) len = FAT_BUF_BYTES;
+
+        fd->fd_fatbuf_off = FAT_NO_BUF;
+        int ret = fat_meta_read(fd, fd->fd_fat_pos + chunk, fd->fd_fatbuf, len);
+        if (ret) return ret;
+        fd->fd_fatbuf_off = chunk;
+    }
+    *byte = (uint8_t)fd->fd_fatbuf[off - chunk];
+    return 0;
+}
+
+static inline size_t fat_entry_off(struct fat_data *fd, uint32_t cluster) {
+    switch (fd->fd_type) {
+      case FAT12: return cluster + cluster / 2;
+      case FAT16: return cluster * 2;
+      default:    return cluster * 4;
+    }
+}
+
+/* bytes an entry touches: a FAT12 entry takes a byte and a half */
+static inline size_t fat_entry_len(struct fat_data *fd) {
+    return (fd->fd_type == FAT12 ? 2 : fd->fd_type / 8);
+}
+
+static int fat_get(struct fat_data *fd, uint32_t cluster, uint32_t *value) {
+    size_t off = fat_entry_off(fd, cluster);
+    size_t len = fat_entry_len(fd);
+    uint8_t b[4];
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        int ret = fat_table_byte(fd, off + i, b + i);
+        if (ret) return ret;
+    }
+
+    switch (fd->fd_type) {
+      case FAT12: {
+        uint16_t v = b[0] | (b[1] << 8);
+        *value = (cluster & 1) ? (v >> 4) : (v & 0x0FFF);
+        break;
+      }
+      case FAT16:
+        *value = b[0] | (b[1] << 8);
+        break;
+      default:
+        *value = (b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24)) & FAT32_MASK;
+    }
+    return 0;
+}
+
+/* sets the entry in every copy of the FAT */
+static int fat_set(struct fat_data *fd, uint32_t cluster, uint32_t value) {
+    size_t off = fat_entry_off(fd, cluster);
+    size_t len = fat_entry_len(fd);
+    uint8_t b[4];
+    size_t i;
+    int ret;
+
+    for (i = 0; i < len; ++i) {
+        ret = fat_table_byte(fd, off + i, b + i);
+        if (ret) return ret;
+    }
+
+    switch (fd->fd_type) {
+      case FAT12: {
+        uint16_t v = b[0] | (b[1] << 8);
+        if (cluster & 1)
+            v = (v & 0x000F) | (value << 4);
+        else
+            v = (v & 0xF000) | (value & 0x0FFF);
+        b[0] = v & 0xFF;
+        b[1] = v >> 8;
+        break;
+      }
+      case FAT16:
+        b[0] = value & 0xFF;
+        b[1] = (value >> 8) & 0xFF;
+        break;
+      default:
+        /* the upper 4 bits are reserved */
+        b[0] = value & 0xFF;
+        b[1] = (value >> 8) & 0xFF;
+        b[2] = (value >> 16) & 0xFF;
+        b[3] = (b[3] & 0xF0) | ((value >> 24) & 0x0F);
+    }
+
+    for (i = 0; i < len; ++i)
+        if (off + i - fd->fd_fatbuf_off < FAT_BUF_BYTES)
+            fd->fd_fatbuf[off + i - fd->fd_fatbuf_off] = b[i];
+
+    for (i = 0; i < fd->fd_fat_copies; ++i) {
+        off_t pos = fd->fd_fat_pos + (off_t)(i * fd->fd_fat_bytes) + off;
+        ret = fat_meta_write(fd, pos, b, len);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static inline bool fat_is_eoc(struct fat_data *fd, uint32_t value) {
+    switch (fd->fd_type) {
+      case FAT12: return value >= FAT12_EOC;
+      case FAT16: return value >= FAT16_EOC;
+      default:    return value >= FAT32_EOC;
+    }
+}
+
+/* the goal first, then the first free one from the next-fit hint on */
+static int fat_alloc_cluster(struct fat_data *fd, uint32_t goal, uint32_t *result) {
+    size_t nbits = fd->fd_maxcl + 1;
+    size_t cluster = goal;
+
+    if (!(fat_cluster_valid(fd, goal) && !bitmap_test(fd->fd_used, goal))) {
+        cluster = bitmap_find_zero(fd->fd_used, nbits, fd->fd_next_free);
+        if (cluster >= nbits)
+            cluster = bitmap_find_zero(fd->fd_used, nbits, 2);
+        return_dbg_if(cluster >= nbits, ENOSPC, "%s: ENOSPC\n", __func__);
+    }
+
+    bitmap_set(fd->fd_used, cluster);
+    --fd->fd_nfree;
+    fd->fd_next_free = (cluster < fd->fd_maxcl ? cluster + 1 : 2);
+    *result = cluster;
+    return 0;
+}
+
+static void fat_release_cluster(struct fat_data *fd, uint32_t cluster) {
+    if (!bitmap_test(fd->fd_used, cluster)) {
+        logmsgef("%s: cluster %d is free already", __func__, cluster);
+        return;
+    }
+    bitmap_clear(fd->fd_used, cluster);
+    ++fd->fd_nfree;
+}
+
+/* builds the bitmap of used clusters */
+static int fat_scan_table(struct fat_data *fd) {
+    uint32_t cluster;
+
+    memset(fd->fd_used, 0, BITMAP_BYTES(fd->fd_maxcl + 1));
+    bitmap_set(fd->fd_used, 0);
+    bitmap_set(fd->fd_used, 1);
+    fd->fd_nfree = 0;
+
+    for (cluster = 2; cluster <= fd->fd_maxcl; ++cluster) {
+        uint32_t value;
+        int ret = fat_get(fd, cluster, &value);
+        if (ret) return ret;
+
+        if (value)
+            bitmap_set(fd->fd_used, cluster);
+        else
+            ++fd->fd_nfree;
+    }
+    return 0;
+}
+
+
+/*
+ *  Extents: the cluster chain of a node
+ */
+
+static int fat_ext_add(struct fat_node *node, uint32_t cluster) {
+    if (node->fn_next) {
+        struct fat_extent *last = node->fn_ext + node->fn_next - 1;
+        if (last->fx_cluster + last->fx_count == cluster) {
+            ++last->fx_count;
+            goto added;
+        }
+    }
+
+    if (node->fn_next == node->fn_extmax) {
+        count_t extmax = (node->fn_extmax ? 2 * node->fn_extmax : FAT_EXTENTS_MIN);
+        struct fat_extent *ext = krealloc(node->fn_ext, extmax * sizeof(struct fat_extent));
+        return_err_if(!ext, ENOMEM, "%s: krealloc failed", __func__);
+        node->fn_ext = ext;
+        node->fn_extmax = extmax;
+    }
+
+    struct fat_extent *ex = node->fn_ext + node->fn_next++;
+    ex->fx_index = node->fn_nclusters;
+    ex->fx_cluster = cluster;
+    ex->fx_count = 1;
+
+added:
+    ++node->fn_nclusters;
+    node->fn_inode.as.reg.block_count = node->fn_nclusters;
+    return 0;
+}
+
+/* the cluster of file cluster `index`, it must be below fn_nclusters */
+static uint32_t fat_bmap(struct fat_node *node, uint32_t index) {
+    count_t lo = 0, hi = node->fn_next;
+    while (hi - lo > 1) {
+        count_t mid = (lo + hi) / 2;
+        if (node->fn_ext[mid].fx_index <= index)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    struct fat_extent *ex = node->fn_ext + lo;
+    return ex->fx_cluster + (index - ex->fx_index);
+}
+
+static inline uint32_t fat_last_cluster(struct fat_node *node) {
+    if (!node->fn_next)
+        return 0;
+    struct fat_extent *last = node->fn_ext + node->fn_next - 1;
+    return last->fx_cluster + last->fx_count - 1;
+}
+
+/* leaves the first `keep` clusters in the map */
+static void fat_ext_trunc(struct fat_node *node, uint32_t keep) {
+    while (node->fn_next && (node->fn_ext[node->fn_next - 1].fx_index >= keep))
+        --node->fn_next;
+    if (node->fn_next) {
+        struct fat_extent *last = node->fn_ext + node->fn_next - 1;
+        if (last->fx_index + last->fx_count > keep)
+            last->fx_count = keep - last->fx_index;
+    }
+    node->fn_nclusters = keep;
+    node->fn_inode.as.reg.block_count = keep;
+}
+
+/* walks the chain from fn_first once */
+static int fat_ext_load(struct fat_data *fd, struct fat_node *node) {
+    const char *funcname = __FUNCTION__;
+    uint32_t cluster = node->fn_first;
+
+    while (cluster) {
+        if (!fat_cluster_valid(fd, cluster)) {
+            logmsgef("%s: cluster %d in the chain of %d", funcname, cluster, node->fn_first);
+            break;
+        }
+        if (node->fn_nclusters > fd->fd_maxcl) {
+            logmsgef("%s: the chain of %d loops", funcname, node->fn_first);
+            break;
+        }
+
+        int ret = fat_ext_add(node, cluster);
+        if (ret) return ret;
+
+        uint32_t next;
+        ret = fat_get(fd, cluster, &next);
+        if (ret) return ret;
+        if (fat_is_eoc(fd, next))
+            break;
+        cluster = next;
+    }
+    return 0;
+}
+
+/* adds the pieces of [pos, pos + len) of `node` to `runs`, the clusters must be there */
+static void fat_map_runs(struct fat_data *fd, struct fat_node *node, off_t pos, size_t len,
+                         char *buf, struct fat_run *runs, count_t *nruns)
+{
+    while (len) {
+        uint32_t index = pos / fd->fd_clsz;
+        size_t offset = pos % fd->fd_clsz;
+        size_t n = fd->fd_clsz - offset;
+        if (n > len) n = len;
+
+        off_t devpos = fat_cluster_pos(fd, fat_bmap(node, index)) + offset;
+        fat_run_add(runs, nruns, devpos, n, buf);
+
+        pos += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+static bool fat_page_dirty(struct inode *idata, index_t index) {
+    if (!idata->i_pages)
+        return false;
+    cached_page *pg = pagecache_find(idata->i_pages, index);
+    return pg && pg->cp_flags.dirty;
+}
+
+/*
+ *  New clusters of a file are zeroed, a file has no holes; pages that
+ *  are dirty or `keep` (being written back) will be written there anyway.
+ */
+static int fat_zero_range(struct fat_data *fd, struct fat_node *node,
+                          off_t from, off_t to, index_t keep)
+{
+    /* bios take whole sectors: the head of a partial one is kept */
+    size_t head = from % fd->fd_secsz;
+    if (head && ((index_t)(from / PAGE_BYTES) != keep)) {
+        struct fat_run run;
+        count_t nruns = 0;
+        char *sector = kmalloc(fd->fd_secsz);
+        return_err_if(!sector, ENOMEM, "%s: kmalloc failed", __func__);
+
+        fat_map_runs(fd, node, from - head, fd->fd_secsz, sector, &run, &nruns);
+        int ret = fat_data_io(fd, BIO_READ, &run, nruns);
+        if (!ret) {
+            memset(sector + head, 0, fd->fd_secsz - head);
+            ret = fat_data_io(fd, BIO_WRITE, &run, nruns);
+        }
+        kfree(sector);
+        if (ret) return ret;
+    }
+    if (head)
+        from += fd->fd_secsz - head;
+
+    while (from < to) {
+        index_t index = from / PAGE_BYTES;
+        off_t end = (off_t)(index + 1) * PAGE_BYTES;
+        if (end > to) end = to;
+
+        if ((index != keep) && !fat_page_dirty(&node->fn_inode, index)) {
+            struct fat_run runs[FAT_MAX_PAGE_RUNS];
+            count_t nruns = 0;
+            fat_map_runs(fd, node, from, end - from, theFatZeroPage, runs, &nruns);
+            int ret = fat_data_io(fd, BIO_WRITE, runs, nruns);
+            if (ret) return ret;
+        }
+        from = end;
+    }
+    return 0;
+}
+
+/* directory clusters are zeroed through the page cache of the device */
+static int fat_zero_cluster(struct fat_data *fd, uint32_t cluster) {
+    off_t pos = fat_cluster_pos(fd, cluster);
+    size_t done;
+    for (done = 0; done < fd->fd_clsz; done += PAGE_BYTES) {
+        size_t n = fd->fd_clsz - done;
+        if (n > PAGE_BYTES) n = PAGE_BYTES;
+        int ret = fat_meta_write(fd, pos + done, theFatZeroPage, n);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+/*
+ *  Grows the chain of `node` up to `need` clusters, each next to the previous
+ *  one if it is free; fn_first may change, the entry must be stored then.
+ */
+static int fat_extend(mountnode *sb, struct fat_node *node, uint32_t need, index_t keep) {
+    struct fat_data *fd = sb->sb_data;
+    struct inode *idata = &node->fn_inode;
+    uint32_t oldn = node->fn_nclusters;
+    uint32_t last = fat_last_cluster(node);
+    int ret = 0;
+
+    while (node->fn_nclusters < need) {
+        uint32_t cluster;
+        ret = fat_alloc_cluster(fd, (last ? last + 1 : 0), &cluster);
+        if (ret) break;
+
+        ret = fat_ext_add(node, cluster);
+        if (!ret) ret = fat_set(fd, cluster, fd->fd_eoc);
+        if (!ret) ret = (last ? fat_set(fd, last, cluster) : 0);
+        if (ret) {
+            if (node->fn_nclusters > oldn && fat_last_cluster(node) == cluster)
+                fat_ext_trunc(node, node->fn_nclusters - 1);
+            fat_set(fd, cluster, 0);
+            fat_release_cluster(fd, cluster);
+            break;
+        }
+
+        if (!last)
+            node->fn_first = cluster;
+        last = cluster;
+    }
+    fat_write_fsinfo(fd);
+
+    if (S_ISDIR(idata->i_mode)) {
+        uint32_t i;
+        for (i = oldn; i < node->fn_nclusters; ++i) {
+            int err = fat_zero_cluster(fd, fat_bmap(node, i));
+            if (!ret) ret = err;
+        }
+        idata->i_size = (off_t)node->fn_nclusters * fd->fd_clsz;
+    } else {
+        int err = fat_zero_range(fd, node, (off_t)oldn * fd->fd_clsz,
+                                 (off_t)node->fn_nclusters * fd->fd_clsz, keep);
+        if (!ret) ret = err;
+    }
+    return ret;
+}
+
+/* frees the clusters of `node` from file cluster `keep` on */
+static int fat_shrink(mountnode *sb, struct fat_node *node, uint32_t keep) {
+    struct fat_data *fd = sb->sb_data;
+    int ret = 0;
+
+    if (keep >= node->fn_nclusters)
+        return 0;
+
+    if (keep)
+        ret = fat_set(fd, fat_bmap(node, keep - 1), fd->fd_eoc);
+    else
+        node->fn_first = 0;
+    if (ret) return ret;
+
+    count_t i;
+    for (i = 0; i < node->fn_next; ++i) {
+        struct fat_extent *ex = node->fn_ext + i;
+        uint32_t j = (ex->fx_index < keep ? keep - ex->fx_index : 0);
+        for (; j < ex->fx_count; ++j) {
+            uint32_t cluster = ex->fx_cluster + j;
+            int err = fat_set(fd, cluster, 0);
+            if (err) {
+                /* it is lost, but not reused */
+                if (!ret) ret = err;
+                continue;
+            }
+            fat_release_cluster(fd, cluster);
+        }
+    }
+    fat_ext_trunc(node, keep);
+    fat_write_fsinfo(fd);
+    return ret;
+}
+
+
+/*
+ *  Names
+ */
+
+static inline uint16_t fat_toupper(uint16_t c) {
+    return (('a' <= c) && (c <= 'z')) ? c - 'a' + 'A' : c;
+}
+
+static inline uint16_t fat_tolower(uint16_t c) {
+    return (('A' <= c) && (c <= 'Z')) ? c - 'A' + 'a' : c;
+}
+
+static uint8_t fat_lfn_checksum(const char *shortname) {
+    uint8_t sum = 0;
+    int i;
+    for (i = 0; i < 11; ++i)
+        sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)shortname[i];
+    return sum;
+}
+
+/* UTF-8 (up to 3 bytes a character) to UCS-2 */
+static int fat_utf8_to_ucs2(const char *name, size_t namelen, uint16_t *ucs, size_t *ulen) {
+    size_t i = 0, n = 0;
+    while (i < namelen) {
+        uint8_t c = (uint8_t)name[i];
+        size_t len, k;
+        uint16_t u;
+
+        if (c < 0x80) { u = c; len = 1; }
+        else if ((c & 0xE0) == 0xC0) { u = c & 0x1F; len = 2; }
+        else if ((c & 0xF0) == 0xE0) { u = c & 0x0F; len = 3; }
+        else return EINVAL;
+
+        if (i + len > namelen)
+            return EINVAL;
+        for (k = 1; k < len; ++k) {
+            c = (uint8_t)name[i + k];
+            if ((c & 0xC0) != 0x80)
+                return EINVAL;
+            u = (u << 6) | (c & 0x3F);
+        }
+
+        if (n >= FAT_LFN_MAX)
+            return EINVAL;
+        ucs[n++] = u;
+        i += len;
+    }
+    *ulen = n;
+    return 0;
+}
+
+/* returns the length or 0 if it does not fit into `bufsize` with the null */
+static size_t fat_ucs2_to_utf8(const uint16_t *ucs, size_t ulen, char *buf, size_t bufsize) {
+    size_t i, n = 0;
+    for (i = 0; i < ulen; ++i) {
+        uint16_t u = ucs[i];
+        size_t len = (u < 0x80 ? 1 : (u < 0x800 ? 2 : 3));
+        if (n + len + 1 > bufsize)
+            return 0;
+
+        switch (len) {
+          case 1:
+            buf[n] = u;
+            break;
+          case 2:
+            buf[n] = 0xC0 | (u >> 6);
+            buf[n + 1] = 0x80 | (u & 0x3F);
+            break;
+          default:
+            buf[n] = 0xE0 | (u >> 12);
+            buf[n + 1] = 0x80 | ((u >> 6) & 0x3F);
+            buf[n + 2] = 0x80 | (u & 0x3F);
+        }
+        n += len;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+static bool fat_ucs2_equal(const uint16_t *a, const uint16_t *b, size_t len) {
+    size_t i;
+    for (i = 0; i < len; ++i)
+        if (fat_toupper(a[i]) != fat_toupper(b[i]))
+            return false;
+    return true;
+}
+
+/* "NAME.EXT" of a short entry, lowercase if NT says so */
+static size_t fat_short_name(const struct fat_dir_entry *de, char *buf) {
+    size_t base = 8, ext = 3, i, n = 0;
+    while (base && de->name[base - 1] == ' ') --base;
+    while (ext && de->name[8 + ext - 1] == ' ') --ext;
+
+    for (i = 0; i < base; ++i) {
+        char c = de->name[i];
+        if ((i == 0) && ((uint8_t)c == FAT_DIRENT_E5))
+            c = (char)FAT_DIRENT_FREE;
+        buf[n++] = (de->ntres & FAT_NTRES_LOWER_BASE) ? fat_tolower(c) : c;
+    }
+    if (ext) {
+        buf[n++] = '.';
+        for (i = 0; i < ext; ++i) {
+            char c = de->name[8 + i];
+            buf[n++] = (de->ntres & FAT_NTRES_LOWER_EXT) ? fat_tolower(c) : c;
+        }
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+static bool fat_short_char(char c) {
+    if ((('A' <= c) && (c <= 'Z')) || (('a' <= c) && (c <= 'z')) || (('0' <= c) && (c <= '9')))
+        return true;
+    return (c != '\0') && strchr("$%'-_@~`!(){}^#&", c);
+}
+
+static bool fat_name_char(uint16_t u) {
+    return (u >= 0x20) && !((u < 0x80) && strchr("\"*/:<>?\\|", u));
+}
+
+/* letters of a part of a short name: 1 if uppercase, 2 if lowercase, 3 if mixed */
+static int fat_short_case(const char *part, size_t len) {
+    int cases = 0;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        if (('A' <= part[i]) && (part[i] <= 'Z')) cases |= 1;
+        if (('a' <= part[i]) && (part[i] <= 'z')) cases |= 2;
+    }
+    return cases;
+}
+
+/* if `name` is a short name as it is, makes its entry name and NT case flags */
+static bool fat_name_is_short(const char *name, size_t namelen, char *shortname, uint8_t *ntres) {
+    const char *dot = memchr(name, '.', namelen);
+    size_t baselen = (dot ? (size_t)(dot - name) : namelen);
+    size_t extlen = (dot ? namelen - baselen - 1 : 0);
+    size_t i;
+
+    if ((baselen == 0) || (baselen > 8) || (extlen > 3) || (dot && (extlen == 0)))
+        return false;
+    for (i = 0; i < namelen; ++i)
+        if ((name + i != dot) && !fat_short_char(name[i]))
+            return false;
+
+    int basecase = fat_short_case(name, baselen);
+    int extcase = fat_short_case(name + baselen + 1, extlen);
+    if ((basecase == 3) || (extcase == 3))
+        return false;
+
+    memset(shortname, ' ', 11);
+    for (i = 0; i < baselen; ++i)
+        shortname[i] = fat_toupper(name[i]);
+    for (i = 0; i < extlen; ++i)
+        shortname[8 + i] = fat_toupper(name[baselen + 1 + i]);
+    if ((uint8_t)shortname[0] == FAT_DIRENT_FREE)
+        shortname[0] = FAT_DIRENT_E5;
+
+    *ntres = 0;
+    if (basecase == 2) *ntres |= FAT_NTRES_LOWER_BASE;
+    if (extcase == 2)  *ntres |= FAT_NTRES_LOWER_EXT;
+    return true;
+}
+
+/*
+ *  The short alias of a long name: uppercase, without spaces and dots
+ *  but the last one, other characters replaced by '_';
+ *  try `n` is "BASE~n.EXT", then "BAhhhh~1.EXT" with a hash of the name.
+ */
+static void fat_alias(const char *name, size_t namelen, uint try, char *shortname) {
+    char base[8], tail[8];
+    size_t baselen = 0, extlen = 0, taillen, i;
+
+    const char *dot = NULL;
+    for (i = 0; i < namelen; ++i)
+        if (name[i] == '.') dot = name + i;
+    if (dot == name) dot = NULL;
+
+    memset(shortname, ' ', 11);
+    for (i = 0; (name + i < (dot ? dot : name + namelen)) && (baselen < 8); ++i) {
+        uint8_t c = (uint8_t)name[i];
+        if ((c == ' ') || (c == '.') || ((c & 0xC0) == 0x80))
+            continue;
+        base[baselen++] = (fat_short_char(c) ? fat_toupper(c) : '_');
+    }
+    for (i = 1; dot && (dot + i < name + namelen) && (extlen < 3); ++i) {
+        uint8_t c = (uint8_t)dot[i];
+        if ((c == ' ') || ((c & 0xC0) == 0x80))
+            continue;
+        shortname[8 + extlen++] = (fat_short_char(c) ? fat_toupper(c) : '_');
+    }
+    if (baselen == 0)
+        base[baselen++] = '_';
+
+    if (try <= 4) {
+        taillen = snprintf(tail, sizeof(tail), "~%d", try);
+    } else {
+        uint16_t hash = 0;
+        for (i = 0; i < namelen; ++i)
+            hash = (hash << 3) ^ (hash >> 13) ^ (uint8_t)name[i];
+        hash += try;
+        if (baselen > 2) baselen = 2;
+
+        /* no %X in our printf */
+        for (i = 0; i < 4; ++i)
+            tail[i] = "0123456789ABCDEF"[(hash >> (12 - 4 * i)) & 0xF];
+        tail[4] = '~';
+        tail[5] = '1';
+        taillen = 6;
+    }
+
+    if (baselen > 8 - taillen)
+        baselen = 8 - taillen;
+    memcpy(shortname, base, baselen);
+    memcpy(shortname + baselen, tail, taillen);
+}
+
+/* a DOS date and time */
+static void fat_dos_time(time_t now, uint16_t *date, uint16_t *dtime) {
+    uint32_t secs = (uint32_t)now;
+    uint32_t days = secs / 86400, rem = secs % 86400;
+
+    /* the civil date of a day since 1970-01-01 */
+    uint32_t z = days + 719468;
+    uint32_t era = z / 146097;
+    uint32_t doe = z - era * 146097;
+    uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    uint32_t mp = (5 * doy + 2) / 153;
+    uint32_t day = doy - (153 * mp + 2) / 5 + 1;
+    uint32_t month = (mp < 10 ? mp + 3 : mp - 9);
+    uint32_t year = yoe + era * 400 + (month <= 2);
+
+    if (year < 1980) {
+        *date = (1 << 5) | 1;
+        *dtime = 0;
+        return;
+    }
+    *date = ((year - 1980) << 9) | (month << 5) | day;
+    *dtime = ((rem / 3600) << 11) | (((rem / 60) % 60) << 5) | ((rem % 60) / 2);
+}
+
+static inline uint32_t fat_entry_cluster(struct fat_data *fd, const struct fat_dir_entry *de) {
+    uint32_t hi = (fd->fd_type == FAT32 ? de->fst_clus_hi : 0);
+    return (hi << 16) | de->fst_clus_lo;
+}
+
+static inline void fat_entry_set_cluster(struct fat_dir_entry *de, uint32_t cluster) {
+    de->fst_clus_hi = cluster >> 16;
+    de->fst_clus_lo = cluster & 0xFFFF;
+}
+
+static void fat_entry_init(struct fat_dir_entry *de, uint8_t attr, uint32_t cluster) {
+    memset(de, 0, sizeof(struct fat_dir_entry));
+    de->attr = attr;
+    fat_entry_set_cluster(de, cluster);
+    uint16_t date, dtime;
+    fat_dos_time(time(NULL), &date, &dtime);
+    de->crt_date = de->wrt_date = de->lst_acc_date = date;
+    de->crt_time = de->wrt_time = dtime;
+}
+
+static inline bool fat_entry_is_dot(const struct fat_dir_entry *de) {
+    return (de->name[0] == '.')
+        && (!memcmp(de->name + 1, "          ", 10) || !memcmp(de->name + 1, ".         ", 10));
+}
+
+
+/*
+ *  Nodes: in-core inodes, hashed by index and by the position of the entry
+ */
+
+static inline struct fat_node **fat_ino_bucket(struct fat_data *fd, inode_t ino) {
+    return &fd->fd_byino[ino & (FAT_NODE_BUCKETS - 1)];
+}
+
+static inline struct fat_node **fat_pos_bucket(struct fat_data *fd, off_t pos) {
+    return &fd->fd_bypos[(pos / FAT_DIRENT_SIZE) & (FAT_NODE_BUCKETS - 1)];
+}
+
+static struct fat_node * fat_node_find(struct fat_data *fd, inode_t ino) {
+    struct fat_node *node = *fat_ino_bucket(fd, ino);
+    for (; node; node = node->fn_inext)
+        if (node->fn_inode.i_no == ino)
+            return node;
+    return NULL;
+}
+
+/* the node named by the entry at `pos` */
+static struct fat_node * fat_node_at(struct fat_data *fd, off_t pos) {
+    struct fat_node *node = *fat_pos_bucket(fd, pos);
+    for (; node; node = node->fn_pnext)
+        if (node->fn_pos == pos)
+            return node;
+
+    if (fd->fd_nrenamed) {
+        uint i;
+        for (i = 0; i < FAT_NODE_BUCKETS; ++i)
+            for (node = fd->fd_byino[i]; node; node = node->fn_inext)
+                if (node->fn_pos2 == pos)
+                    return node;
+    }
+    return NULL;
+}
+
+static void fat_node_set_pos(struct fat_data *fd, struct fat_node *node, off_t pos) {
+    if (node->fn_pos) {
+        struct fat_node **link = fat_pos_bucket(fd, node->fn_pos);
+        while (*link != node)
+            link = &(*link)->fn_pnext;
+        *link = node->fn_pnext;
+    }
+
+    node->fn_pos = pos;
+    if (pos) {
+        struct fat_node **bucket = fat_pos_bucket(fd, pos);
+        node->fn_pnext = *bucket;
+        *bucket = node;
+    }
+}
+
+static void fat_node_unhash(struct fat_data *fd, struct fat_node *node) {
+    struct fat_node **link = fat_ino_bucket(fd, node->fn_inode.i_no);
+    while (*link != node)
+        link = &(*link)->fn_inext;
+    *link = node->fn_inext;
+
+    fat_node_set_pos(fd, node, 0);
+    if (node->fn_pos2)
+        --fd->fd_nrenamed;
+}
+
+static void fat_node_free(struct fat_data *fd, struct fat_node *node) {
+    fat_node_unhash(fd, node);
+    if (node->fn_ext)
+        kfree(node->fn_ext);
+    kfree(node);
+    --fd->fd_nnodes;
+}
+
+/*
+ *  An unused node that is numbered by the position of its entry
+ *  is read again from the disk when it is needed.
+ */
+static bool fat_node_droppable(struct fat_node *node) {
+    struct inode *idata = &node->fn_inode;
+    if (idata->i_refs || idata->i_nfds || !idata->i_nlinks)
+        return false;
+    if (!node->fn_pos || node->fn_pos2 || (idata->i_no != (inode_t)(node->fn_pos / FAT_DIRENT_SIZE)))
+        return false;
+    if (idata->i_pages) {
+        if (idata->i_pages->pm_ndirty)
+            return false;
+        vfs_inode_drop_pages(idata);
+        if (idata->i_pages)
+            return false;
+    }
+    return true;
+}
+
+static void fat_node_shrink_cache(struct fat_data *fd) {
+    uint i;
+    for (i = 0; i < FAT_NODE_BUCKETS; ++i) {
+        struct fat_node *node = fd->fd_byino[i];
+        while (node) {
+            struct fat_node *next = node->fn_inext;
+            if (fat_node_droppable(node))
+                fat_node_free(fd, node);
+            node = next;
+        }
+    }
+
+    fd->fd_nodes_limit = 2 * fd->fd_nnodes;
+    if (fd->fd_nodes_limit < FAT_NODES_MAX)
+        fd->fd_nodes_limit = FAT_NODES_MAX;
+}
+
+static struct fat_node * fat_node_new(struct fat_data *fd, inode_t ino) {
+    if (fd->fd_nnodes >= fd->fd_nodes_limit)
+        fat_node_shrink_cache(fd);
+
+    struct fat_node *node = kmalloc(sizeof(struct fat_node));
+    return_err_if(!node, NULL, "%s: kmalloc failed", __func__);
+    memset(node, 0, sizeof(struct fat_node));
+    node->fn_inode.i_no = ino;
+    node->fn_inode.i_data = node;
+
+    struct fat_node **bucket = fat_ino_bucket(fd, ino);
+    node->fn_inext = *bucket;
+    *bucket = node;
+    ++fd->fd_nnodes;
+    return node;
+}
+
+static void fat_node_set_attr(struct fat_node *node, uint8_t attr) {
+    mode_t mode = (attr & FAT_ATTR_DIRECTORY) ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+    if (attr & FAT_ATTR_READ_ONLY)
+        mode &= ~0222;
+    node->fn_attr = attr;
+    node->fn_inode.i_mode = mode;
+}
+
+static int fat_node_load(struct fat_data *fd, struct fat_node *node, const struct fat_dir_entry *de) {
+    struct inode *idata = &node->fn_inode;
+    off_t size;
+
+    fat_node_set_attr(node, de->attr);
+    idata->i_nlinks = 1;
+    node->fn_first = fat_entry_cluster(fd, de);
+
+    int ret = fat_ext_load(fd, node);
+    if (ret) return ret;
+
+    off_t allocated = (off_t)node->fn_nclusters * fd->fd_clsz;
+    if (S_ISDIR(idata->i_mode)) {
+        size = allocated;
+    } else {
+        size = (de->file_size > INT_MAX ? INT_MAX : (off_t)de->file_size);
+        if (size > allocated) {
+            logmsgef("%s: the size %d of @%x is over its %d clusters", __func__,
+                     size, node->fn_pos, node->fn_nclusters);
+            size = allocated;
+        }
+    }
+    idata->i_size = node->fn_dsize = size;
+    return 0;
+}
+
+/* reads the node of the entry at `pos` as `ino` */
+static struct fat_node * fat_node_read(struct fat_data *fd, inode_t ino, off_t pos,
+                                       const struct fat_dir_entry *de)
+{
+    struct fat_node *node = fat_node_new(fd, ino);
+    if (!node) return NULL;
+
+    fat_node_set_pos(fd, node, pos);
+    if (fat_node_load(fd, node, de)) {
+        fat_node_free(fd, node);
+        return NULL;
+    }
+    return node;
+}
+
+/*
+ *  The index of the entry at `pos`: its node's if there is one;
+ *  otherwise the position tells it, unless a renamed node took that.
+ */
+static int fat_pos_ino(struct fat_data *fd, off_t pos, const struct fat_dir_entry *de, inode_t *ino) {
+    struct fat_node *node = fat_node_at(fd, pos);
+    if (node) {
+        *ino = node->fn_inode.i_no;
+        return 0;
+    }
+
+    *ino = pos / FAT_DIRENT_SIZE;
+    if (!fat_node_find(fd, *ino))
+        return 0;
+
+    node = fat_node_read(fd, fd->fd_next_ino++, pos, de);
+    if (!node) return ENOMEM;
+    *ino = node->fn_inode.i_no;
+    return 0;
+}
+
+static struct inode * fat_inode_incore(mountnode *sb, inode_t ino) {
+    struct fat_data *fd = sb->sb_data;
+    struct fat_dir_entry de;
+
+    struct fat_node *node = fat_node_find(fd, ino);
+    if (node)
+        return &node->fn_inode;
+
+    /* not in memory: an index below fd_next_ino is the position of its entry */
+    off_t pos = (off_t)ino * FAT_DIRENT_SIZE;
+    if ((ino == FAT_ROOT_INO) || (ino >= fd->fd_next_ino) || (pos < fd->fd_fat_pos))
+        return NULL;
+    if (fat_node_at(fd, pos))
+        return NULL;
+    if (fat_meta_read(fd, pos, &de, sizeof(de)))
+        return NULL;
+    if ((de.name[0] == 0) || ((uint8_t)de.name[0] == FAT_DIRENT_FREE)
+        || ((de.attr & FAT_ATTR_LONG_MASK) == FAT_ATTR_LONG_NAME)
+        || (de.attr & FAT_ATTR_VOLUME_ID) || fat_entry_is_dot(&de))
+    {
+        logmsgdf("%s(%d): no entry at @%x\n", __func__, ino, pos);
+        return NULL;
+    }
+
+    node = fat_node_read(fd, ino, pos, &de);
+    return (node ? &node->fn_inode : NULL);
+}
+
+/* writes the first cluster, the size and the attributes into the entries of `node` */
+static int fat_node_store(mountnode *sb, struct fat_node *node) {
+    struct fat_data *fd = sb->sb_data;
+    struct fat_dir_entry de;
+    off_t positions[2] = { node->fn_pos, node->fn_pos2 };
+    int i, ret;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    for (i = 0; i < 2; ++i) {
+        if (!positions[i])
+            continue;
+        ret = fat_meta_read(fd, positions[i], &de, sizeof(de));
+        if (ret) return ret;
+
+        fat_entry_set_cluster(&de, node->fn_first);
+        de.attr = node->fn_attr;
+        if (!S_ISDIR(node->fn_inode.i_mode)) {
+            de.file_size = node->fn_inode.i_size;
+            de.attr |= FAT_ATTR_ARCHIVE;
+        }
+        uint16_t date, dtime;
+        fat_dos_time(time(NULL), &date, &dtime);
+        de.wrt_date = de.lst_acc_date = date;
+        de.wrt_time = dtime;
+
+        ret = fat_meta_write(fd, positions[i], &de, sizeof(de));
+        if (ret) return ret;
+    }
+    node->fn_dsize = node->fn_inode.i_size;
+    return 0;
+}
+
+
+/*
+ *  Directories
+ */
+
+static inline bool fat_is_fixed_root(struct fat_data *fd, struct fat_node *dir) {
+    return (dir == fd->fd_root) && (fd->fd_type != FAT32);
+}
+
+/* where the directory offset `off` is on the device */
+static int fat_dir_pos(struct fat_data *fd, struct fat_node *dir, off_t off, off_t *pos) {
+    if (fat_is_fixed_root(fd, dir)) {
+        if ((size_t)off >= fd->fd_root_bytes)
+            return ENOENT;
+        *pos = fd->fd_root_pos + off;
+        return 0;
+    }
+
+    uint32_t index = off / fd->fd_clsz;
+    if (index >= dir->fn_nclusters)
+        return ENOENT;
+    *pos = fat_cluster_pos(fd, fat_bmap(dir, index)) + off % fd->fd_clsz;
+    return 0;
+}
+
+/* an entry with its long name */
+struct fat_entry {
+    off_t       fe_first_off;       /* the first slot of its long name in the directory */
+    off_t       fe_off;             /* the short entry in the directory */
+    off_t       fe_pos;             /* the short entry on the device */
+    struct fat_dir_entry fe_de;
+    uint16_t    fe_lfn[FAT_LFN_MAX + FAT_LFN_CHARS];
+    size_t      fe_lfnlen;          /* 0 if there is no long name */
+};
+
+/* goes through the slots of a directory a sector at a time */
+struct fat_scan {
+    struct fat_node *sc_dir;
+    off_t       sc_off;             /* the next slot */
+    off_t       sc_pos;             /* the last slot on the device */
+    char *      sc_buf;             /* a sector */
+    off_t       sc_bufpos;          /* of sc_buf on the device, -1 if none */
+    struct fat_entry sc_entry;
+    uint16_t    sc_uname[FAT_LFN_MAX];  /* the name looked for */
+    size_t      sc_ulen;
+};
+
+static struct fat_scan * fat_scan_open(struct fat_data *fd, struct fat_node *dir, off_t off) {
+    struct fat_scan *sc = kmalloc(sizeof(struct fat_scan));
+    return_err_if(!sc, NULL, "%s: kmalloc failed", __func__);
+    sc->sc_buf = kmalloc(fd->fd_secsz);
+    if (!sc->sc_buf) {
+        kfree(sc);
+        return_err_if(true, NULL, "%s: kmalloc failed", __func__);
+    }
+    sc->sc_dir = dir;
+    sc->sc_off = off;
+    sc->sc_bufpos = -1;
+    sc->sc_ulen = 0;
+    return sc;
+}
+
+static void fat_scan_close(struct fat_scan *sc) {
+    kfree(sc->sc_buf);
+    kfree(sc);
+}
+
+/* the next slot, ENOENT after the last one */
+static int fat_scan_slot(struct fat_data *fd, struct fat_scan *sc, struct fat_dir_entry **slot) {
+    off_t pos;
+    int ret = fat_dir_pos(fd, sc->sc_dir, sc->sc_off, &pos);
+    if (ret) return ret;
+
+    off_t sector = pos - pos % fd->fd_secsz;
+    if (sector != sc->sc_bufpos) {
+        sc->sc_bufpos = -1;
+        ret = fat_meta_read(fd, sector, sc->sc_buf, fd->fd_secsz);
+        if (ret) return ret;
+        sc->sc_bufpos = sector;
+    }
+
+    *slot = (struct fat_dir_entry *)(sc->sc_buf + (pos - sector));
+    sc->sc_pos = pos;
+    sc->sc_off += FAT_DIRENT_SIZE;
+    return 0;
+}
+
+/* the next entry with its long name if it has a valid one, ENOENT at the end */
+static int fat_scan_entry(struct fat_data *fd, struct fat_scan *sc) {
+    struct fat_entry *e = &sc->sc_entry;
+    uint8_t expected = 0, chksum = 0;
+    bool haslfn = false;
+
+    for (;;) {
+        struct fat_dir_entry *de;
+        int ret = fat_scan_slot(fd, sc, &de);
+        if (ret) return ret;
+
+        uint8_t first = (uint8_t)de->name[0];
+        if (first == 0)
+            return ENOENT;
+        if (first == FAT_DIRENT_FREE) {
+            haslfn = false;
+            continue;
+        }
+
+        if ((de->attr & FAT_ATTR_LONG_MASK) == FAT_ATTR_LONG_NAME) {
+            struct fat_lfn_entry *lfn = (struct fat_lfn_entry *)de;
+            uint8_t ord = lfn->lfn_ord & FAT_LFN_ORD_MASK;
+
+            if (lfn->lfn_ord & FAT_LFN_LAST) {
+                if ((ord == 0) || (ord * FAT_LFN_CHARS > FAT_LFN_MAX + FAT_LFN_CHARS - 1)) {
+                    haslfn = false;
+                    continue;
+                }
+                haslfn = true;
+                chksum = lfn->lfn_chksum;
+                e->fe_first_off = sc->sc_off - FAT_DIRENT_SIZE;
+                e->fe_lfnlen = ord * FAT_LFN_CHARS;
+            } else if (!haslfn || (ord != expected) || (lfn->lfn_chksum != chksum)) {
+                haslfn = false;
+                continue;
+            }
+            expected = ord - 1;
+
+            uint16_t *chars = e->fe_lfn + (ord - 1) * FAT_LFN_CHARS;
+            memcpy(chars, lfn->lfn_name1, sizeof(lfn->lfn_name1));
+            memcpy(chars + 5, lfn->lfn_name2, sizeof(lfn->lfn_name2));
+            memcpy(chars + 11, lfn->lfn_name3, sizeof(lfn->lfn_name3));
+            continue;
+        }
+
+        if (de->attr & FAT_ATTR_VOLUME_ID) {
+            haslfn = false;
+            continue;
+        }
+
+        e->fe_off = sc->sc_off - FAT_DIRENT_SIZE;
+        e->fe_pos = sc->sc_pos;
+        memcpy(&e->fe_de, de, sizeof(struct fat_dir_entry));
+
+        if (haslfn && (expected == 0) && (chksum == fat_lfn_checksum(de->name))) {
+            size_t len = 0;
+            while ((len < e->fe_lfnlen) && e->fe_lfn[len] && (e->fe_lfn[len] != 0xFFFF))
+                ++len;
+            e->fe_lfnlen = (len <= FAT_LFN_MAX ? len : 0);
+        } else {
+            e->fe_lfnlen = 0;
+        }
+        if (!e->fe_lfnlen)
+            e->fe_first_off = e->fe_off;
+        return 0;
+    }
+}
+
+static bool fat_entry_match(struct fat_scan *sc, const char *name, size_t namelen) {
+    struct fat_entry *e = &sc->sc_entry;
+    if (e->fe_lfnlen && (e->fe_lfnlen == sc->sc_ulen)
+        && fat_ucs2_equal(e->fe_lfn, sc->sc_uname, sc->sc_ulen))
+        return true;
+
+    char shortname[13];
+    size_t len = fat_short_name(&e->fe_de, shortname);
+    if (len != namelen)
+        return false;
+    size_t i;
+    for (i = 0; i < len; ++i)
+        if (fat_toupper((uint8_t)shortname[i]) != fat_toupper((uint8_t)name[i]))
+            return false;
+    return true;
+}
+
+/* finds `name` in `dir` case-insensitively, sc->sc_entry is it then */
+static int fat_dir_find(struct fat_data *fd, struct fat_scan *sc, const char *name, size_t namelen) {
+    int ret = fat_utf8_to_ucs2(name, namelen, sc->sc_uname, &sc->sc_ulen);
+    return_dbg_if(ret, ret, "%s: not a valid name\n", __func__);
+
+    while (!(ret = fat_scan_entry(fd, sc)))
+        if (fat_entry_match(sc, name, namelen))
+            return 0;
+    return ret;
+}
+
+static int fat_short_exists(struct fat_data *fd, struct fat_node *dir, const char *shortname) {
+    struct fat_scan *sc = fat_scan_open(fd, dir, 0);
+    if (!sc) return ENOMEM;
+
+    int ret;
+    while (!(ret = fat_scan_entry(fd, sc)))
+        if (!memcmp(sc->sc_entry.fe_de.name, shortname, 11))
+            break;
+    fat_scan_close(sc);
+    return ret;     /* 0 if it exists */
+}
+
+/* finds `nslots` free slots in a row, the directory grows if there are none */
+static int fat_dir_find_free(mountnode *sb, struct fat_node *dir, count_t nslots, off_t *result) {
+    struct fat_data *fd = sb->sb_data;
+    struct fat_dir_entry *de;
+    off_t start = 0;
+    count_t nfree = 0;
+    int ret;
+
+    struct fat_scan *sc = fat_scan_open(fd, dir, 0);
+    if (!sc) return ENOMEM;
+
+    while (!(ret = fat_scan_slot(fd, sc, &de))) {
+        uint8_t first = (uint8_t)de->name[0];
+        if ((first != 0) && (first != FAT_DIRENT_FREE)) {
+            nfree = 0;
+            continue;
+        }
+        if (nfree++ == 0)
+            start = sc->sc_off - FAT_DIRENT_SIZE;
+        if (nfree == nslots)
+            break;
+    }
+    off_t end = sc->sc_off;
+    fat_scan_close(sc);
+    if (ret == 0) {
+        *result = start;
+        return 0;
+    }
+    if (ret != ENOENT)
+        return ret;
+
+    /* the free slots at the end and the new clusters */
+    if (nfree == 0)
+        start = end;
+    return_dbg_if(fat_is_fixed_root(fd, dir), ENOSPC, "%s: the root is full\n", __func__);
+
+    off_t size = start + nslots * FAT_DIRENT_SIZE;
+    return_dbg_if(size > FAT_DIR_MAX_BYTES, ENOSPC, "%s: the directory is full\n", __func__);
+
+    uint32_t need = (size + fd->fd_clsz - 1) / fd->fd_clsz;
+    ret = fat_extend(sb, dir, need, 0);
+    if (ret) return ret;
+
+    *result = start;
+    return 0;
+}
+
+/* writes `nslots` slots from the directory offset `off` on */
+static int fat_dir_write(struct fat_data *fd, struct fat_node *dir, off_t off,
+                         const void *slots, count_t nslots)
+{
+    const char *src = slots;
+    count_t i;
+    for (i = 0; i < nslots; ++i) {
+        off_t pos;
+        int ret = fat_dir_pos(fd, dir, off + i * FAT_DIRENT_SIZE, &pos);
+        if (!ret) ret = fat_meta_write(fd, pos, src + i * FAT_DIRENT_SIZE, FAT_DIRENT_SIZE);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+/* marks the slots of the entry [first_off, off] free */
+static int fat_dir_erase(struct fat_data *fd, struct fat_node *dir, off_t first_off, off_t off) {
+    const uint8_t freemark = FAT_DIRENT_FREE;
+    for (; first_off <= off; first_off += FAT_DIRENT_SIZE) {
+        off_t pos;
+        int ret = fat_dir_pos(fd, dir, first_off, &pos);
+        if (!ret) ret = fat_meta_write(fd, pos, &freemark, 1);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+/*
+ *  Adds `name` to `dir` as `proto` (but its name): with a long name
+ *  and a unique short alias if it is not a short name itself.
+ *  `*result` is the position of the short entry on the device.
+ */
+static int fat_dir_add(mountnode *sb, struct fat_node *dir, const char *name, size_t namelen,
+                       struct fat_dir_entry *proto, off_t *result)
+{
+    struct fat_data *fd = sb->sb_data;
+    uint16_t uname[FAT_LFN_MAX];
+    size_t ulen, i;
+    count_t nslots = 1;
+    int ret;
+
+    ret = fat_utf8_to_ucs2(name, namelen, uname, &ulen);
+    return_dbg_if(ret, EINVAL, "%s: not a valid name\n", __func__);
+    for (i = 0; i < ulen; ++i)
+        return_dbg_if(!fat_name_char(uname[i]), EINVAL, "%s: not a valid name\n", __func__);
+    return_dbg_if((name[namelen - 1] == '.') || (name[namelen - 1] == ' '), EINVAL,
+                  "%s: a name ends with '.' or ' '\n", __func__);
+
+    if (!fat_name_is_short(name, namelen, proto->name, &proto->ntres)) {
+        uint try;
+        proto->ntres = 0;
+        for (try = 1; try <= FAT_ALIAS_TRIES; ++try) {
+            fat_alias(name, namelen, try, proto->name);
+            ret = fat_short_exists(fd, dir, proto->name);
+            if (ret) break;
+        }
+        if (ret != ENOENT) {
+            if (!ret) ret = EEXIST;
+            return_dbg_if(true, ret, "%s: no short alias for '%s'\n", __func__, name);
+        }
+        nslots += (ulen + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS;
+    }
+
+    off_t off;
+    ret = fat_dir_find_free(sb, dir, nslots, &off);
+    if (ret) return ret;
+
+    /* the long name, its last part first */
+    uint8_t chksum = fat_lfn_checksum(proto->name);
+    count_t ord;
+    for (ord = nslots - 1; ord > 0; --ord) {
+        struct fat_lfn_entry lfn;
+        uint16_t chars[FAT_LFN_CHARS];
+        for (i = 0; i < FAT_LFN_CHARS; ++i) {
+            size_t at = (ord - 1) * FAT_LFN_CHARS + i;
+            chars[i] = (at < ulen ? uname[at] : (at == ulen ? 0 : 0xFFFF));
+        }
+
+        memset(&lfn, 0, sizeof(lfn));
+        lfn.lfn_ord = ord | (ord == nslots - 1 ? FAT_LFN_LAST : 0);
+        lfn.lfn_attr = FAT_ATTR_LONG_NAME;
+        lfn.lfn_chksum = chksum;
+        memcpy(lfn.lfn_name1, chars, sizeof(lfn.lfn_name1));
+        memcpy(lfn.lfn_name2, chars + 5, sizeof(lfn.lfn_name2));
+        memcpy(lfn.lfn_name3, chars + 11, sizeof(lfn.lfn_name3));
+
+        ret = fat_dir_write(fd, dir, off + (nslots - 1 - ord) * FAT_DIRENT_SIZE, &lfn, 1);
+        if (ret) return ret;
+    }
+
+    off += (nslots - 1) * FAT_DIRENT_SIZE;
+    ret = fat_dir_write(fd, dir, off, proto, 1);
+    if (ret) return ret;
+    return fat_dir_pos(fd, dir, off, result);
+}
+
+/* the cluster of the parent of `dir` from its ".." */
+static int fat_dotdot_cluster(struct fat_data *fd, uint32_t dircluster, uint32_t *result) {
+    struct fat_dir_entry de;
+    int ret = fat_meta_read(fd, fat_cluster_pos(fd, dircluster) + FAT_DIRENT_SIZE, &de, sizeof(de));
+    if (ret) return ret;
+    return_dbg_if(memcmp(de.name, "..         ", 11), EIO,
+                  "%s: no '..' in cluster %d\n", __func__, dircluster);
+    *result = fat_entry_cluster(fd, &de);
+    return 0;
+}
+
+/*
+ *  ".." does not tell where the entry of the parent is:
+ *  it is looked up by its cluster in the grandparent.
+ */
+static int fat_parent_ino(mountnode *sb, struct fat_node *dir, inode_t *result) {
+    struct fat_data *fd = sb->sb_data;
+    struct fat_node tmp, *gdir = fd->fd_root;
+    uint32_t parent, grand;
+    int ret;
+
+    *result = FAT_ROOT_INO;
+    if ((dir == fd->fd_root) || !dir->fn_first)
+        return 0;
+
+    ret = fat_dotdot_cluster(fd, dir->fn_first, &parent);
+    if (ret) return ret;
+    if (!parent || (parent == fd->fd_root_clus))
+        return 0;
+
+    ret = fat_dotdot_cluster(fd, parent, &grand);
+    if (ret) return ret;
+    memset(&tmp, 0, sizeof(tmp));
+    if (grand && (grand != fd->fd_root_clus)) {
+        gdir = &tmp;
+        tmp.fn_first = grand;
+        tmp.fn_inode.i_mode = S_IFDIR;
+        ret = fat_ext_load(fd, &tmp);
+        if (ret) goto exit;
+    }
+
+    struct fat_scan *sc = fat_scan_open(fd, gdir, 0);
+    if (!sc) { ret = ENOMEM; goto exit; }
+    while (!(ret = fat_scan_entry(fd, sc))) {
+        struct fat_dir_entry *de = &sc->sc_entry.fe_de;
+        if ((de->attr & FAT_ATTR_DIRECTORY) && !fat_entry_is_dot(de)
+            && (fat_entry_cluster(fd, de) == parent))
+            break;
+    }
+    if (!ret)
+        ret = fat_pos_ino(fd, sc->sc_entry.fe_pos, &sc->sc_entry.fe_de, result);
+    else if (ret == ENOENT)
+        ret = EIO;
+    fat_scan_close(sc);
+
+exit:
+    if (tmp.fn_ext)
+        kfree(tmp.fn_ext);
+    return ret;
+}
+
+static int fat_lookup_inode(mountnode *sb, inode_t *result, const char *path, size_t pathlen) {
+    struct fat_data *fd = sb->sb_data;
+    logmsgdf("%s(path='%s', pathlen=%d)\n", __func__, path, pathlen);
+
+    pathlen = strnlen(path, pathlen);
+    inode_t ino = sb->sb_root_ino;
+    int ret = 0;
+
+    size_t pos = 0;
+    for (;;) {
+        while ((pos < pathlen) && (path[pos] == FS_SEP))
+            ++pos;
+        if (pos >= pathlen)
+            break;
+
+        size_t namelen = 0;
+        while ((pos + namelen < pathlen) && (path[pos + namelen] != FS_SEP))
+            ++namelen;
+
+        struct inode *idata;
+        ret = vfs_iget(sb, ino, &idata);
+        if (ret) break;
+        struct fat_node *dir = idata->i_data;
+
+        if (!S_ISDIR(idata->i_mode)) {
+            ret = ENOTDIR;
+        } else if ((namelen == 1) && (path[pos] == '.')) {
+            /* the same directory */
+        } else if ((namelen == 2) && !strncmp(path + pos, "..", 2)) {
+            ret = fat_parent_ino(sb, dir, &ino);
+        } else {
+            struct fat_scan *sc = fat_scan_open(fd, dir, 0);
+            if (!sc) {
+                ret = ENOMEM;
+            } else {
+                ret = fat_dir_find(fd, sc, path + pos, namelen);
+                if (!ret)
+                    ret = fat_pos_ino(fd, sc->sc_entry.fe_pos, &sc->sc_entry.fe_de, &ino);
+                fat_scan_close(sc);
+            }
+        }
+        vfs_iput(idata);
+        if (ret) break;
+
+        pos += namelen;
+    }
+
+    if (ret) {
+        if (result) *result = 0;
+        return ret;
+    }
+    if (result) *result = ino;
+    return 0;
+}
+
+static int fat_fill_dirent(mountnode *sb, struct fat_node *dir, struct fat_entry *e,
+                           struct dirent *dirent)
+{
+    struct fat_data *fd = sb->sb_data;
+    struct fat_dir_entry *de = &e->fe_de;
+    int ret;
+
+    size_t len = 0;
+    if (e->fe_lfnlen)
+        len = fat_ucs2_to_utf8(e->fe_lfn, e->fe_lfnlen, dirent->d_name, sizeof(dirent->d_name));
+    if (!len)
+        len = fat_short_name(de, dirent->d_name);
+
+    if (!strcmp(dirent->d_name, ".")) {
+        dirent->d_ino = dir->fn_inode.i_no;
+    } else if (!strcmp(dirent->d_name, "..")) {
+        ret = fat_parent_ino(sb, dir, &dirent->d_ino);
+        if (ret) return ret;
+    } else {
+        ret = fat_pos_ino(fd, e->fe_pos, de, &dirent->d_ino);
+        if (ret) return ret;
+    }
+
+    dirent->d_namlen = len;
+    dirent->d_reclen = sizeof(struct dirent) - UCHAR_MAX + dirent->d_namlen + 1;
+    dirent->d_type = (de->attr & FAT_ATTR_DIRECTORY ? DT_DIR : DT_REG);
+    return 0;
+}
+
+/* `*iter` is the offset of the next entry, NULL at the start and at the end */
+static int fat_get_direntry(mountnode *sb, inode_t dirino, void **iter, struct dirent *dirent) {
+    const char *funcname = __FUNCTION__;
+    struct fat_data *fd = sb->sb_data;
+    struct inode *idata;
+    int ret;
+
+    ret = vfs_iget(sb, dirino, &idata);
+    return_dbg_if(ret, ret, "%s: vfs_iget(%d) failed(%d)\n", funcname, dirino, ret);
+    if (!S_ISDIR(idata->i_mode)) {
+        vfs_iput(idata);
+        return_log_if(true, ENOTDIR, "%s: node %d is not a directory\n", funcname, dirino);
+    }
+    struct fat_node *dir = idata->i_data;
+
+    struct fat_scan *sc = fat_scan_open(fd, dir, (off_t)(size_t)*iter);
+    if (!sc) {
+        vfs_iput(idata);
+        return ENOMEM;
+    }
+
+    ret = fat_scan_entry(fd, sc);
+    if (!ret)
+        ret = fat_fill_dirent(sb, dir, &sc->sc_entry, dirent);
+    if (!ret) {
+        /* is there one more? */
+        int next = fat_scan_entry(fd, sc);
+        if (next == 0)
+            *iter = (void *)(size_t)sc->sc_entry.fe_first_off;
+        else if (next == ENOENT)
+            *iter = NULL;
+        else
+            ret = next;
+    }
+
+    fat_scan_close(sc);
+    vfs_iput(idata);
+    return ret;
+}
+
+/*
+ *  FAT has no hard links: a second name of a file is only allowed for
+ *  vfs_rename(), that links the new name before it unlinks the old one.
+ *  Both names are kept up to date until then.
+ */
+static int fat_link_inode(
+        mountnode *sb, inode_t ino, inode_t dirino, const char *name, size_t namelen)
+{
+    struct fat_data *fd = sb->sb_data;
+    struct inode *idata, *diridata;
+    struct fat_dir_entry de;
+    off_t pos;
+    int ret;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    namelen = strnlen(name, namelen);
+    return_dbg_if(namelen == 0, EINVAL, "%s: no name\n", __func__);
+
+    ret = vfs_iget(sb, ino, &idata);
+    return_dbg_if(ret, ret, "%s: no inode %d\n", __func__, ino);
+    struct fat_node *node = idata->i_data;
+
+    ret = vfs_iget(sb, dirino, &diridata);
+    if (ret) {
+        vfs_iput(idata);
+        return_dbg_if(true, ret, "%s: no directory %d\n", __func__, dirino);
+    }
+    struct fat_node *dir = diridata->i_data;
+
+    if (!S_ISDIR(diridata->i_mode)) {
+        ret = ENOTDIR;
+        goto exit;
+    }
+    if (S_ISDIR(idata->i_mode) || (idata->i_nlinks >= 2)) {
+        ret = (S_ISDIR(idata->i_mode) ? EPERM : EMLINK);
+        logmsgdf("%s(%d): no more links\n", __func__, ino);
+        goto exit;
+    }
+
+    struct fat_scan *sc = fat_scan_open(fd, dir, 0);
+    if (!sc) { ret = ENOMEM; goto exit; }
+    ret = fat_dir_find(fd, sc, name, namelen);
+    fat_scan_close(sc);
+    if (ret != ENOENT) {
+        if (!ret) ret = EEXIST;
+        goto exit;
+    }
+
+    fat_entry_init(&de, node->fn_attr | FAT_ATTR_ARCHIVE, node->fn_first);
+    de.file_size = node->fn_dsize;
+    ret = fat_dir_add(sb, dir, name, namelen, &de, &pos);
+    if (ret) goto exit;
+
+    if (idata->i_nlinks) {
+        node->fn_pos2 = pos;
+        ++fd->fd_nrenamed;
+    } else {
+        fat_node_set_pos(fd, node, pos);
+        /* nobody else knows a new inode yet, it may be numbered by its position */
+        inode_t posino = pos / FAT_DIRENT_SIZE;
+        if ((idata->i_refs == 1) && !fat_node_find(fd, posino)) {
+            fat_node_unhash(fd, node);
+            idata->i_no = posino;
+            struct fat_node **bucket = fat_ino_bucket(fd, posino);
+            node->fn_inext = *bucket;
+            *bucket = node;
+            fat_node_set_pos(fd, node, pos);
+        }
+    }
+    ++idata->i_nlinks;
+
+exit:
+    vfs_iput(diridata);
+    vfs_iput(idata);
+    return ret;
+}
+
+static int fat_unlink_inode(mountnode *sb, const char *path, size_t pathlen) {
+    struct fat_data *fd = sb->sb_data;
+    struct inode *diridata, *idata;
+    int ret;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    pathlen = strnlen(path, pathlen);
+
+    int dlen = vfs_path_dirname_len(path, pathlen);
+    return_dbg_if(dlen < 0, EINVAL, "%s: dirlen=%d\n", __func__, dlen);
+    size_t dirlen = (size_t)dlen;
+
+    inode_t dirino;
+    ret = fat_lookup_inode(sb, &dirino, path, dirlen);
+    return_dbg_if(ret, ret, "%s: lookup_inode(%s[:%d]) failed(%d)\n", __func__, path, dirlen, ret);
+
+    const char *basename = path + dirlen;
+    while ((basename < path + pathlen) && (basename[0] == FS_SEP))
+        ++basename;
+    size_t namelen = pathlen - (basename - path);
+    return_dbg_if(namelen == 0, EINVAL, "%s: no basename\n", __func__);
+
+    ret = vfs_iget(sb, dirino, &diridata);
+    if (ret) return ret;
+    struct fat_node *dir = diridata->i_data;
+
+    struct fat_scan *sc = fat_scan_open(fd, dir, 0);
+    if (!sc) {
+        vfs_iput(diridata);
+        return ENOMEM;
+    }
+
+    ret = fat_dir_find(fd, sc, basename, namelen);
+    if (ret) goto exit;
+    struct fat_entry *e = &sc->sc_entry;
+
+    inode_t ino;
+    ret = fat_pos_ino(fd, e->fe_pos, &e->fe_de, &ino);
+    if (!ret) ret = vfs_iget(sb, ino, &idata);
+    if (ret) goto exit;
+    struct fat_node *node = idata->i_data;
+
+    if (S_ISDIR(idata->i_mode)) {
+        vfs_iput(idata);
+        ret = EISDIR;
+        goto exit;
+    }
+
+    ret = fat_dir_erase(fd, dir, e->fe_first_off, e->fe_off);
+    if (ret) {
+        vfs_iput(idata);
+        goto exit;
+    }
+
+    if (node->fn_pos2) {
+        if (node->fn_pos2 != e->fe_pos)
+            fat_node_set_pos(fd, node, node->fn_pos2);
+        node->fn_pos2 = 0;
+        --fd->fd_nrenamed;
+    } else {
+        fat_node_set_pos(fd, node, 0);
+    }
+    --idata->i_nlinks;
+    logmsgdf("%s(%s): nlinks=%d\n", __func__, path, idata->i_nlinks);
+    /* the last vfs_iput() frees it */
+    vfs_iput(idata);
+
+exit:
+    fat_scan_close(sc);
+    vfs_iput(diridata);
+    return ret;
+}
+
+
+/*
+ *  Making and freeing inodes
+ */
+
+/* a new file has no name until it is linked */
+static int fat_make_inode(mountnode *sb, inode_t *result, mode_t mode, void *info) {
+    const char *funcname = __FUNCTION__;
+    struct fat_data *fd = sb->sb_data;
+    UNUSED(info);
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", funcname);
+    if ((mode & S_IFMT) == 0)
+        mode |= S_IFREG;
+    return_dbg_if(!S_ISREG(mode), EPERM, "%s(mode=0x%x): only regular files\n", funcname, mode);
+
+    struct fat_node *node = fat_node_new(fd, fd->fd_next_ino++);
+    return_err_if(!node, ENOMEM, "%s: no node", funcname);
+    fat_node_set_attr(node, FAT_ATTR_ARCHIVE | ((mode & S_IWUSR) ? 0 : FAT_ATTR_READ_ONLY));
+
+    if (result) *result = node->fn_inode.i_no;
+    return 0;
+}
+
+static int fat_free_inode(mountnode *sb, inode_t ino) {
+    struct fat_data *fd = sb->sb_data;
+
+    struct fat_node *node = fat_node_find(fd, ino);
+    return_dbg_if(!node, ENOENT, "%s(%d): no node\n", __func__, ino);
+    return_dbg_if(node->fn_inode.i_nlinks, EBUSY, "%s(%d): linked\n", __func__, ino);
+
+    int ret = 0;
+    if (!sb->sb_flags.ro)
+        ret = fat_shrink(sb, node, 0);
+
+    logmsgdf("%s: ino=%d\n", __func__, ino);
+    fat_node_free(fd, node);
+    return ret;
+}
+
+static int fat_make_directory(mountnode *sb, inode_t *result, const char *path, mode_t mode) {
+    struct fat_data *fd = sb->sb_data;
+    struct inode *paridata = NULL;
+    struct fat_dir_entry dots[2], de;
+    uint32_t cluster = 0;
+    off_t pos;
+    int ret;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    size_t pathlen = strlen(path);
+    while (pathlen && (path[pathlen - 1] == FS_SEP))
+        --pathlen;
+    return_dbg_if(pathlen == 0, EEXIST, "%s: the root exists\n", __func__);
+
+    int dirlen = vfs_path_dirname_len(path, pathlen);
+    const char *basename = path + dirlen;
+    while (basename[0] == FS_SEP) ++basename;
+    size_t namelen = pathlen - (basename - path);
+
+    inode_t parino;
+    ret = fat_lookup_inode(sb, &parino, path, dirlen);
+    return_dbg_if(ret, ret, "%s: no parent for '%s'\n", __func__, path);
+    ret = vfs_iget(sb, parino, &paridata);
+    if (ret) return ret;
+    struct fat_node *parent = paridata->i_data;
+    if (!S_ISDIR(paridata->i_mode)) {
+        ret = ENOTDIR;
+        goto error_exit;
+    }
+
+    struct fat_scan *sc = fat_scan_open(fd, parent, 0);
+    if (!sc) { ret = ENOMEM; goto error_exit; }
+    ret = fat_dir_find(fd, sc, basename, namelen);
+    fat_scan_close(sc);
+    if (ret != ENOENT) {
+        if (!ret) ret = EEXIST;
+        goto error_exit;
+    }
+
+    ret = fat_alloc_cluster(fd, 0, &cluster);
+    if (ret) { cluster = 0; goto error_exit; }
+    ret = fat_set(fd, cluster, fd->fd_eoc);
+    if (!ret) ret = fat_zero_cluster(fd, cluster);
+    if (ret) goto error_exit;
+
+    /* "." and "..", that is 0 for the root */
+    uint8_t attr = FAT_ATTR_DIRECTORY | ((mode & S_IWUSR) ? 0 : FAT_ATTR_READ_ONLY);
+    fat_entry_init(&dots[0], FAT_ATTR_DIRECTORY, cluster);
+    memcpy(dots[0].name, ".          ", 11);
+    fat_entry_init(&dots[1], FAT_ATTR_DIRECTORY, (parent == fd->fd_root ? 0 : parent->fn_first));
+    memcpy(dots[1].name, "..         ", 11);
+    ret = fat_meta_write(fd, fat_cluster_pos(fd, cluster), dots, sizeof(dots));
+    if (ret) goto error_exit;
+
+    fat_entry_init(&de, attr, cluster);
+    ret = fat_dir_add(sb, parent, basename, namelen, &de, &pos);
+    if (ret) goto error_exit;
+    fat_write_fsinfo(fd);
+
+    vfs_iput(paridata);
+    if (result)
+        return fat_pos_ino(fd, pos, &de, result);
+    return 0;
+
+error_exit:
+    if (cluster) {
+        fat_set(fd, cluster, 0);
+        fat_release_cluster(fd, cluster);
+    }
+    vfs_iput(paridata);
+    if (result) *result = 0;
+    return ret;
+}
+
+
+/*
+ *  File data
+ */
+
+static int fat_readpage(mountnode *sb, struct inode *idata, index_t index, char *page) {
+    struct fat_data *fd = sb->sb_data;
+    struct fat_node *node = idata->i_data;
+    struct fat_run runs[FAT_MAX_PAGE_RUNS];
+    count_t nruns = 0;
+    off_t pagepos = (off_t)index * PAGE_BYTES;
+    off_t allocated = (off_t)node->fn_nclusters * fd->fd_clsz;
+    size_t len = 0;
+
+    if ((pagepos < idata->i_size) && (pagepos < allocated)) {
+        len = (allocated - pagepos < PAGE_BYTES ? allocated - pagepos : PAGE_BYTES);
+        fat_map_runs(fd, node, pagepos, len, page, runs, &nruns);
+    }
+
+    int ret = fat_data_io(fd, BIO_READ, runs, nruns);
+    if (ret) return ret;
+
+    /* the tail after the end */
+    size_t tail = len;
+    if ((idata->i_size > pagepos) && (idata->i_size - pagepos < (off_t)tail))
+        tail = idata->i_size - pagepos;
+    memset(page + tail, 0, PAGE_BYTES - tail);
+    return 0;
+}
+
+/* clusters are allocated here, when the data are written back */
+static int fat_writepage(mountnode *sb, struct inode *idata, index_t index, const char *page) {
+    struct fat_data *fd = sb->sb_data;
+    struct fat_node *node = idata->i_data;
+    struct fat_run runs[FAT_MAX_PAGE_RUNS];
+    count_t nruns = 0;
+    off_t pagepos = (off_t)index * PAGE_BYTES;
+    uint32_t first = node->fn_first;
+    int ret = 0;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    /* nothing to keep: an extending write grows i_size before its copy,
+     * see vfs_pagecache_write(), so its pages are not past it */
+    if (pagepos >= idata->i_size)
+        return 0;
+
+    off_t end = (idata->i_size - pagepos < PAGE_BYTES ? idata->i_size : pagepos + PAGE_BYTES);
+    uint32_t need = (end + fd->fd_clsz - 1) / fd->fd_clsz;
+    if (need > node->fn_nclusters)
+        ret = fat_extend(sb, node, need, index);
+
+    off_t allocated = (off_t)node->fn_nclusters * fd->fd_clsz;
+    if (allocated > pagepos) {
+        size_t len = (allocated - pagepos < PAGE_BYTES ? allocated - pagepos : PAGE_BYTES);
+        fat_map_runs(fd, node, pagepos, len, (char *)page, runs, &nruns);
+        int err = fat_data_io(fd, BIO_WRITE, runs, nruns);
+        if (!ret) ret = err;
+    }
+
+    if ((node->fn_first != first) || (node->fn_dsize != idata->i_size)) {
+        /* the size may not be over the clusters */
+        off_t size = idata->i_size;
+        if (size > allocated) idata->i_size = allocated;
+        int err = fat_node_store(sb, node);
+        idata->i_size = size;
+        if (!ret) ret = err;
+    }
+    return ret;
+}
+
+static int fat_read_inode(
+        mountnode *sb, inode_t ino, off_t pos,
+        char *buf, size_t buflen, size_t *written)
+{
+    struct inode *idata;
+    int ret = vfs_iget(sb, ino, &idata);
+    if (ret) return ret;
+
+    if (S_ISREG(idata->i_mode))
+        ret = vfs_pagecache_read(idata, NULL, pos, buf, buflen, written);
+    else
+        ret = (S_ISDIR(idata->i_mode) ? EISDIR : EINVAL);
+
+    vfs_iput(idata);
+    return ret;
+}
+
+static int fat_write_inode(
+        mountnode *sb, inode_t ino, off_t pos,
+        const char *buf, size_t buflen, size_t *written)
+{
+    struct inode *idata;
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    int ret = vfs_iget(sb, ino, &idata);
+    if (ret) return ret;
+
+    if (S_ISREG(idata->i_mode))
+        ret = vfs_pagecache_write(idata, pos, buf, buflen, written);
+    else
+        ret = (S_ISDIR(idata->i_mode) ? EISDIR : EINVAL);
+
+    vfs_iput(idata);
+    return ret;
+}
+
+/* a file has no holes: growing allocates zeroed clusters */
+static int fat_trunc_inode(mountnode *sb, inode_t ino, off_t length) {
+    struct fat_data *fd = sb->sb_data;
+    struct inode *idata;
+    int ret;
+
+    return_dbg_if(sb->sb_flags.ro, EROFS, "%s: EROFS\n", __func__);
+    return_dbg_if(length < 0, EINVAL, "%s: length=%d\n", __func__, length);
+
+    ret = vfs_iget(sb, ino, &idata);
+    if (ret) return ret;
+    if (!S_ISREG(idata->i_mode)) {
+        vfs_iput(idata);
+        return_dbg_if(true, EINVAL, "%s(ino = %d): not a regular file\n", __func__, ino);
+    }
+    struct fat_node *node = idata->i_data;
+    uint32_t need = (length + fd->fd_clsz - 1) / fd->fd_clsz;
+
+    if (need > node->fn_nclusters) {
+        ret = fat_extend(sb, node, need, (index_t)-1);
+    } else {
+        ret = fat_shrink(sb, node, need);
+
+        /* the tail of the last cluster must read as zeroes if the file grows again */
+        off_t allocated = (off_t)need * fd->fd_clsz;
+        if (!ret && (length < allocated) && (length < idata->i_size))
+            ret = fat_zero_range(fd, node, length, allocated, (index_t)-1);
+    }
+
+    if (!ret)
+        idata->i_size = length;
+    int err = fat_node_store(sb, node);
+    if (!ret) ret = err;
+    vfs_iput(idata);
+    return ret;
+}
+
+
+/*
+ *  The superblock
+ */
+
+static int fat_read_superblock(mountnode *sb, const mount_opts_t *opts) {
+    const char *funcname = __FUNCTION__;
+    struct fat_boot_sector *bs = NULL;
+    int ret;
+    UNUSED(opts);
+
+    device *dev = device_by_devno(DEV_BLK, sb->sb_dev);
+    return_dbg_if(!dev, ENODEV, "%s: no block device %d:%d\n", funcname,
+                  gnu_dev_major(sb->sb_dev), gnu_dev_minor(sb->sb_dev));
+
+    struct fat_data *fd = kmalloc(sizeof(struct fat_data));
+    return_err_if(!fd, ENOMEM, "%s: kmalloc failed", funcname);
+    memset(fd, 0, sizeof(struct fat_data));
+    fd->fd_dev = dev;
+    fd->fd_fatbuf_off = FAT_NO_BUF;
+
+    bs = kmalloc(sizeof(struct fat_boot_sector));
+    if (!bs) { ret = ENOMEM; goto error_exit; }
+    ret = fat_meta_read(fd, 0, bs, sizeof(struct fat_boot_sector));
+    if (ret) goto error_exit;
+
+    ret = EINVAL;
+    size_t secsz = bs->bpb_bytes_per_sec;
+    if ((bs->bs_signature != FAT_BOOT_SIGNATURE) || (secsz < 512) || (secsz > PAGE_BYTES)
+        || (secsz & (secsz - 1)) || !bs->bpb_sec_per_clus
+        || (bs->bpb_sec_per_clus & (bs->bpb_sec_per_clus - 1))
+        || !bs->bpb_rsvd_sec_cnt || !bs->bpb_num_fats)
+    {
+        logmsgef("%s: no FAT boot sector", funcname);
+        goto error_exit;
+    }
+
+    size_t devblksz = dev->dev_ops->dev_size_of_block(dev);
+    if (secsz % devblksz) {
+        logmsgef("%s: sector size %d is not supported", funcname, secsz);
+        goto error_exit;
+    }
+
+    uint32_t fatsz = (bs->bpb_fat_sz16 ? bs->bpb_fat_sz16 : bs->bpb_fat_sz32);
+    uint32_t totsec = (bs->bpb_tot_sec16 ? bs->bpb_tot_sec16 : bs->bpb_tot_sec32);
+    uint32_t rootsec = (bs->bpb_root_ent_cnt * FAT_DIRENT_SIZE + secsz - 1) / secsz;
+    uint32_t datastart = bs->bpb_rsvd_sec_cnt + bs->bpb_num_fats * fatsz + rootsec;
+    if (!fatsz || (datastart >= totsec)) {
+        logmsgef("%s: bad geometry", funcname);
+        goto error_exit;
+    }
+    if ((uint64_t)totsec * secsz > INT_MAX) {
+        logmsgef("%s: volumes over 2G are not supported", funcname);
+        goto error_exit;
+    }
+
+    uint32_t nclusters = (totsec - datastart) / bs->bpb_sec_per_clus;
+    fd->fd_type = (nclusters <= FAT12_MAX_CLUSTERS ? FAT12
+                   : (nclusters <= FAT16_MAX_CLUSTERS ? FAT16 : FAT32));
+    if ((fd->fd_type == FAT32) && (bs->bpb_fat_sz16 || bs->bpb_root_ent_cnt || bs->bpb_fs_ver)) {
+        logmsgef("%s: not a FAT32 volume", funcname);
+        goto error_exit;
+    }
+
+    fd->fd_secsz = secsz;
+    fd->fd_clsz = secsz * bs->bpb_sec_per_clus;
+    fd->fd_devblksz = devblksz;
+    fd->fd_fat_bytes = fatsz * secsz;
+    fd->fd_fat_pos = bs->bpb_rsvd_sec_cnt * secsz;
+    fd->fd_fat_copies = bs->bpb_num_fats;
+    fd->fd_root_pos = fd->fd_fat_pos + bs->bpb_num_fats * fd->fd_fat_bytes;
+    fd->fd_root_bytes = bs->bpb_root_ent_cnt * FAT_DIRENT_SIZE;
+    fd->fd_data_pos = (off_t)datastart * secsz;
+
+    /* the FAT may be shorter than the data */
+    uint32_t entries = fd->fd_fat_bytes * 8 / fd->fd_type;
+    if (nclusters + 2 > entries)
+        nclusters = entries - 2;
+    fd->fd_maxcl = nclusters + 1;
+
+    switch (fd->fd_type) {
+      case FAT12: fd->fd_eoc = 0x0FFF; break;
+      case FAT16: fd->fd_eoc = 0xFFFF; break;
+      case FAT32:
+        fd->fd_eoc = FAT32_MASK;
+        fd->fd_root_clus = bs->bpb_root_clus;
+        if (!fat_cluster_valid(fd, fd->fd_root_clus)) {
+            logmsgef("%s: bad root cluster %d", funcname, fd->fd_root_clus);
+            goto error_exit;
+        }
+        if (bs->bpb_ext_flags & FAT32_MIRROR_OFF) {
+            uint active = bs->bpb_ext_flags & FAT32_ACTIVE_FAT;
+            fd->fd_fat_pos += active * fd->fd_fat_bytes;
+            fd->fd_fat_copies = 1;
+        }
+        break;
+    }
+
+    fd->fd_used = kmalloc(BITMAP_BYTES(fd->fd_maxcl + 1));
+    fd->fd_fatbuf = kmalloc(FAT_BUF_BYTES);
+    if (!(fd->fd_used && fd->fd_fatbuf)) {
+        ret = ENOMEM;
+        goto error_exit;
+    }
+    ret = fat_scan_table(fd);
+    if (ret) goto error_exit;
+    fd->fd_next_free = 2;
+
+    if ((fd->fd_type == FAT32) && bs->bpb_fs_info && (bs->bpb_fs_info < bs->bpb_rsvd_sec_cnt)) {
+        struct fat_fsinfo *fsi = (struct fat_fsinfo *)bs;
+        off_t fsipos = bs->bpb_fs_info * secsz;
+        ret = fat_meta_read(fd, fsipos, fsi, sizeof(struct fat_fsinfo));
+        if (ret) goto error_exit;
+        if ((fsi->fsi_lead_sig == FAT_FSINFO_LEAD_SIG) && (fsi->fsi_struc_sig == FAT_FSINFO_STRUC_SIG)) {
+            fd->fd_fsinfo_pos = fsipos;
+            if (fat_cluster_valid(fd, fsi->fsi_nxt_free))
+                fd->fd_next_free = fsi->fsi_nxt_free;
+        }
+    }
+
+    /* numbers of nodes that their positions do not number start after the volume */
+    fd->fd_next_ino = (inode_t)((uint64_t)totsec * secsz / FAT_DIRENT_SIZE) + 1;
+    fd->fd_nodes_limit = FAT_NODES_MAX;
+
+    ret = ENOMEM;
+    struct fat_node *root = fat_node_new(fd, FAT_ROOT_INO);
+    if (!root) goto error_exit;
+    fd->fd_root = root;
+    fat_node_set_attr(root, FAT_ATTR_DIRECTORY);
+    root->fn_inode.i_nlinks = 2;
+    if (fd->fd_type == FAT32) {
+        root->fn_first = fd->fd_root_clus;
+        ret = fat_ext_load(fd, root);
+        if (ret) goto error_exit;
+        root->fn_inode.i_size = (off_t)root->fn_nclusters * fd->fd_clsz;
+    } else {
+        root->fn_inode.i_size = fd->fd_root_bytes;
+    }
+
+    sb->sb_blksz = fd->fd_clsz;
+    sb->sb_root_ino = FAT_ROOT_INO;
+    sb->sb_data = fd;
+
+    if (!sb->sb_flags.ro)
+        fat_write_fsinfo(fd);
+
+    kfree(bs);
+    logmsgif("%s: FAT%d, %d clusters of %d, %d free%s", funcname,
+             fd->fd_type, nclusters, fd->fd_clsz, fd->fd_nfree,
+             (sb->sb_flags.ro ? ", read-only" : ""));
+    return 0;
+
+error_exit:
+    if (fd->fd_root) fat_node_free(fd, fd->fd_root);
+    if (fd->fd_used) kfree(fd->fd_used);
+    if (fd->fd_fatbuf) kfree(fd->fd_fatbuf);
+    if (bs) kfree(bs);
+    kfree(fd);
+    return ret;
+}
+
+static int fat_get_usage(mountnode *sb, struct fs_usage *usage) {
+    struct fat_data *fd = sb->sb_data;
+    usage->fu_blocks = fd->fd_maxcl - 1 - fd->fd_nfree;
+    usage->fu_max_blocks = fd->fd_maxcl - 1;
+    usage->fu_inodes = 0;
+    usage->fu_max_inodes = 0;
+    return 0;
+}
@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+
+#include <cosec/log.h>
+
+#include "mem/kheap.h"
+#include "fs/vfs.h"
+#include "fs/icache.h"
+#include "fs/devices.h"
+#include "fs/file.h"
+#include "fs/pipe.h"
+
+
+/*
+ *  Regular files
+ */
+static int reg_file_read(file_t *f, char *buf, size_t buflen, size_t *done) {
+    mountnode *sb = f->f_sb;
+    if (sb->sb_fs->ops->readpage)
+        return vfs_pagecache_read(f->f_inode, &f->f_ra, f->f_pos, buf, buflen, done);
+    return_dbg_if(!sb->sb_fs->ops->read_inode, ENOSYS,
+            "%s: no %s.read_inode\n", __func__, sb->sb_fs->name);
+    return sb->sb_fs->ops->read_inode(sb, f->f_ino, f->f_pos, buf, buflen, done);
+}
+
+static int reg_file_write(file_t *f, const char *buf, size_t buflen, size_t *done) {
+    mountnode *sb = f->f_sb;
+    if (sb->sb_fs->ops->readpage)
+        return vfs_pagecache_write(f->f_inode, f->f_pos, buf, buflen, done);
+    return_dbg_if(!sb->sb_fs->ops->write_inode, ENOSYS,
+            "%s: no %s.write_inode\n", __func__, sb->sb_fs->name);
+    return sb->sb_fs->ops->write_inode(sb, f->f_ino, f->f_pos, buf, buflen, done);
+}
+
+static int reg_file_map_data(file_t *f, const char **data, size_t *len, void **cookie) {
+    struct inode *idata = f->f_inode;
+    if (f->f_pos >= idata->i_size) {
+        *len = 0;
+        return 0;
+    }
+
+    char *page;
+    int ret = vfs_inode_map_page(idata, f->f_pos / PAGE_BYTES, false, &page, cookie);
+    if (ret) return ret;
+
+    size_t offset = f->f_pos % PAGE_BYTES;
+    size_t avail = PAGE_BYTES - offset;
+    if ((off_t)avail > idata->i_size - f->f_pos)
+        avail = idata->i_size - f->f_pos;
+    if (*len > avail)
+        *len = avail;
+
+    *data = page + offset;
+    return 0;
+}
+
+static void reg_file_unmap_data(file_t *f, void *cookie, size_t consumed) {
+    UNUSED(f); UNUSED(consumed);
+    vfs_inode_unmap_page(cookie);
+}
+
+static const file_ops reg_file_ops = {
+    .read = reg_file_read,
+    .write = reg_file_write,
+    .map_data = reg_file_map_data,
+    .unmap_data = reg_file_unmap_data,
+};
+
+/*
+ *  Character devices
+ */
+static int chr_file_read(file_t *f, char *buf, size_t buflen, size_t *done) {
+    device *dev = f->f_dev;
+    return_dbg_if(!dev->dev_ops->dev_read_buf, ENOSYS,
+            "%s: no dev_read_buf\n", __func__);
+    return dev->dev_ops->dev_read_buf(dev, buf, buflen, done, f->f_pos);
+}
+
+static int chr_file_write(file_t *f, const char *buf, size_t buflen, size_t *done) {
+    device *dev = f->f_dev;
+    return_dbg_if(!dev->dev_ops->dev_write_buf, ENOSYS,
+            "%s: no dev_write_buf\n", __func__);
+    return dev->dev_ops->dev_write_buf(dev, buf, buflen, done, f->f_pos);
+}
+
+static const file_ops chr_file_ops = {
+    .read = chr_file_read,
+    .write = chr_file_write,
+};
+
+/*
+ *  Block devices
+ */
+static int blk_file_read(file_t *f, char *buf, size_t buflen, size_t *done) {
+    return bdev_blocking_read(f->f_dev, &f->f_ra, f->f_pos, buf, buflen, done);
+}
+
+static const file_ops blk_file_ops = {
+    .read = blk_file_read,
+};
+
+
+static const file_ops * file_ops_by_mode(mode_t mode) {
+    switch (mode & S_IFMT) {
+      case S_IFREG: return &reg_file_ops;
+      case S_IFCHR: return &chr_file_ops;
+      case S_IFBLK: return &blk_file_ops;
+      case S_IFIFO: return &pipe_file_ops;
+      default: return NULL;
+    }
+}
+
+
+/*
+ *  File objects
+ */
+
+int file_open(mountnode *sb, inode_t ino, int flags, file_t **result) {
+    const char *funcname = __FUNCTION__;
+    int ret;
+    return_log_if(!result, EINVAL, "%s(NULL)\n", funcname);
+
+    struct inode *idata;
+    ret = vfs_iget(sb, ino, &idata);
+    if (ret) return ret;
+
+    device *dev = NULL;
+    off_t pos = 0;
+    switch (idata->i_mode & S_IFMT) {
+      case S_IFCHR:
+        dev = device_by_devno(DEV_CHR, inode_devno(idata));
+        if (!dev) {
+            logmsgdf("%s: no chrdev for ino=%d\n", funcname, ino);
+            ret = ENXIO;
+            goto put_inode;
+        }
+        if (dev->dev_ops->dev_has_data)
+            pos = -1; /* this device is not seekable */
+        break;
+      case S_IFBLK:
+        dev = device_by_devno(DEV_BLK, inode_devno(idata));
+        if (!dev) {
+            logmsgdf("%s: no blkdev for ino=%d\n", funcname, ino);
+            ret = ENXIO;
+            goto put_inode;
+        }
+        break;
+      case S_IFIFO:
+        pos = -1;
+        break;
+      case S_IFSOCK:
+        logmsgdf("TODO: opened a socket\n");
+        break;
+      case S_IFREG:
+        if (flags & (O_RDWR | O_WRONLY)) {
+            if (flags & O_TRUNC) {
+                vfs_inode_trunc(sb, ino, 0);
+            } else if (flags & O_APPEND) {
+                pos = idata->i_size;
+            }
+        }
+        break;
+    }
+
+    file_t *f = kmalloc(sizeof(file_t));
+    if (!f) {
+        logmsgef("%s: kmalloc failed", funcname);
+        ret = ENOMEM;
+        goto put_inode;
+    }
+
+    f->f_refs = 1;
+    f->f_flags = flags;
+    f->f_pos = pos;
+    f->f_sb = sb;
+    f->f_ino = ino;
+    f->f_inode = idata;
+    f->f_mode = idata->i_mode;
+    f->f_dev = dev;
+    f->f_data = NULL;
+    memset(&f->f_ra, 0, sizeof(f->f_ra));
+    f->f_ops = file_ops_by_mode(idata->i_mode);
+
+    if (S_ISFIFO(idata->i_mode)) {
+        ret = pipe_fifo_open(f);
+        if (ret) {
+            kfree(f);
+            goto put_inode;
+        }
+    }
+
+    ++idata->i_nfds;
+
+    *result = f;
+    return 0;
+
+put_inode:
+    vfs_iput(idata);
+    return ret;
+}
+
+file_t * file_get(file_t *f) {
+    ++f->f_refs;
+    return f;
+}
+
+void file_put(file_t *f) {
+    if (--f->f_refs > 0)
+        return;
+
+    if (f->f_ops && f->f_ops->release)
+        f->f_ops->release(f);
+
+    if (f->f_inode) {
+        --f->f_inode->i_nfds;
+        /* the inode is deleted if i_nfds == 0 and i_nlinks == 0 */
+        vfs_iput(f->f_inode);
+    }
+
+    kfree(f);
+}
+
+int file_read(file_t *f, char *buf, size_t buflen, size_t *done) {
+    if (S_ISDIR(f->f_mode))
+        return EISDIR;
+    return_dbg_if(!(f->f_ops && f->f_ops->read), ETODO,
+            "%s(ino=%d, mode=0x%x): ETODO\n", __func__, f->f_ino, f->f_mode);
+
+    return f->f_ops->read(f, buf, buflen, done);
+}
+
+int file_write(file_t *f, const char *buf, size_t buflen, size_t *done) {
+    if (S_ISDIR(f->f_mode))
+        return EISDIR;
+    return_dbg_if(!(f->f_ops && f->f_ops->write), ETODO,
+            "%s(ino=%d, mode=0x%x): ETODO\n", __func__, f->f_ino, f->f_mode);
+
+    return f->f_ops->write(f, buf, buflen, done);
+}
+
+int file_splice(file_t *in, file_t *out, size_t count, size_t *done) {
+    int ret = 0;
+    size_t n = 0;
+
+    return_dbg_if(!(in->f_ops && in->f_ops->map_data), EINVAL,
+            "%s(ino=%d, mode=0x%x): cannot be spliced\n", __func__, in->f_ino, in->f_mode);
+    return_dbg_if(!(out->f_ops && out->f_ops->write), EINVAL,
+            "%s(ino=%d, mode=0x%x): cannot be written\n", __func__, out->f_ino, out->f_mode);
+    /* a pipe into itself would wait for itself, a file would overlap */
+    return_dbg_if((in->f_data && (in->f_data == out->f_data))
+                  || (in->f_inode && (in->f_inode == out->f_inode)),
+            EINVAL, "%s: the same file on both ends\n", __func__);
+
+    while (n < count) {
+        const char *data;
+        void *cookie = NULL;
+        size_t len = count - n;
+        size_t written = 0;
+
+        ret = in->f_ops->map_data(in, &data, &len, &cookie);
+        if (ret || !len) {
+            if (!ret && in->f_ops->unmap_data)
+                in->f_ops->unmap_data(in, cookie, 0);
+            break;
+        }
+
+        ret = out->f_ops->write(out, data, len, &written);
+        if (in->f_ops->unmap_data)
+            in->f_ops->unmap_data(in, cookie, written);
+
+        if (in->f_pos >= 0) in->f_pos += written;
+        if (out->f_pos >= 0) out->f_pos += written;
+        n += written;
+
+        if (ret || (written < len))
+            break;
+    }
+
+    if (done) *done = n;
+    /* a partial transfer is still a success */
+    return (n ? 0 : ret);
+}
@@ -7,9 +7,21 @@
 #include <cosec/log.h>
 
 #include "fs/vfs.h"
+#include "fs/file.h"
+#include "fs/pipe.h"
 #include "process.h"
 
 
+/* I/O counters of the calling process; kernel tasks have none */
+static void sys_account_io(size_t rchar, size_t wchar) {
+    process_t *proc = task_process(task_current());
+    if (!proc)
+        return;
+    proc->ps_rchar += rchar;
+    proc->ps_wchar += wchar;
+}
+
+
 int sys_mount(mount_info_t *mnt) {
     logmsgdf("%s(*%x)\n", __func__, mnt);
     return ETODO; //vfs_mount(mnt->source, mnt->target, mnt->fstype);
@@ -67,57 +79,38 @@ int sys_open(const char *pathname, int flags) {
     return_err_if(!p, -EKERN, "%s: no current pid", __func__);
 
     /* TODO: protect with mutex till the end of function */
-    int fd = alloc_fd_for_pid(pid); /* does not actually alloc, just gets a free fd */
+    int fd = alloc_fd_for_pid(pid);
     return_dbg_if(fd < 0, -EMFILE,
             "%s; pid=%d fds exhausted\n", __func__, pid);
     logmsgdf("%s: fd=%d\n", __func__, fd);
 
     filedescr *filedes = get_filedescr_for_pid(pid, fd);
 
-    filedes->fd_flags = flags;
-    filedes->fd_pos = 0;
-
     if ((ino == 0) && (flags & O_CREAT)) {
         /* create a regular file */
         ret = vfs_mknod(pathname, S_IFREG | p->ps_umask, 0);
-        return_dbg_if(ret, -ret, "%s: vfs_mknod failed(%d)\n", __func__, ret);
+        if (ret) {
+            logmsgdf("%s: vfs_mknod failed(%d)\n", __func__, ret);
+            goto free_fd;
+        }
 
         ret = vfs_lookup(pathname, &sb, &ino);
-        return_err_if(ret, -EKERN,
-                "%s: cannot find ino for created path='%s'\n", __func__, pathname);
-    }
-
-    /* update the inode */
-    struct inode idata;
-    ret = vfs_inode_get(sb, ino, &idata);
-    if (ret) return -ret;
-
-    ++ idata.i_nfds;
-    vfs_inode_set(sb, ino, &idata);
-
-    device *dev;
-    switch (idata.i_mode & S_IFMT) {
-      case S_IFCHR:
-        dev = device_by_devno(DEV_CHR, inode_devno(&idata));
-        if (dev && dev->dev_ops->dev_has_data)
-            filedes->fd_pos = -1; /* this device is not seekable */
-        break;
-      case S_IFSOCK: case S_IFIFO:
-        logmsgdf("TODO: opened a socket/pipe\n");
-        break;
-      default:
-        if (rw & (O_RDWR | O_WRONLY)) {
-            if (flags & O_TRUNC) {
-                vfs_inode_trunc(sb, ino, 0);
-            } else if (flags & O_APPEND) {
-                filedes->fd_pos = idata.i_size;
-            }
+        if (ret) {
+            logmsgef("%s: cannot find ino for created path='%s'\n", __func__, pathname);
+            ret = EKERN;
+            goto free_fd;
         }
     }
 
-    filedes->fd_sb = sb;
-    filedes->fd_ino = ino; /* now filedescr is used */
+    ret = file_open(sb, ino, flags, &filedes->fd_file);
+    if (ret) goto free_fd;
+
+    filedes->fd_flags = 0;
     return fd;
+
+free_fd:
+    free_fd_for_pid(pid, fd);
+    return -ret;
 }
 
 int sys_read(int fd, void *buf, size_t count) {
@@ -125,26 +118,21 @@ int sys_read(int fd, void *buf, size_t count) {
     int ret;
     size_t nread = 0;
 
-    process *p = current_proc();
-    return_err_if(!p, -EKERN, "%s: no current pid", __func__);
-
-    return_dbg_if(!((0 <= fd) && (fd < N_PROCESS_FDS)), -EINVAL,
-            "%s(fd=%d): EINVAL\n", fd);
-
-    filedescr *filedes = p->ps_fds + fd;
+    filedescr *filedes = get_filedescr_for_pid(current_pid(), fd);
     return_dbg_if(!filedes, -EBADF,
             "%s(fd=%d): EBADF\n", __func__, fd);
-    return_dbg_if(filedes->fd_flags & O_WRONLY, -EBADF,
+
+    file_t *f = filedes->fd_file;
+    return_dbg_if(f->f_flags & O_WRONLY, -EBADF,
             "%s(fd=%d): write-only, EBADF\n", __func__, fd);
 
-    /* TODO: check if fd is writable */
-    ret = vfs_inode_read(filedes->fd_sb, filedes->fd_ino, filedes->fd_pos,
-                buf, count, &nread);
-    return_dbg_if(ret, -ret, "%s: inode_read failed(%d)\n", ret);
+    ret = file_read(f, buf, count, &nread);
+    return_dbg_if(ret, -ret, "%s: file_read failed(%d)\n", __func__, ret);
 
-    if (filedes->fd_pos >= 0) {
-        filedes->fd_pos += nread;
+    if (f->f_pos >= 0) {
+        f->f_pos += nread;
     }
+    sys_account_io(nread, 0);
     return nread;
 }
 
@@ -153,47 +141,155 @@ int sys_write(int fd, const void *buf, size_t count) {
     int ret;
     size_t nwritten = 0;
 
-    process *p = current_proc();
-    return_err_if(!p, -EKERN, "%s: no current pid", __func__);
-
-    return_dbg_if(!((0 <= fd) && (fd < N_PROCESS_FDS)), -EINVAL,
-            "%s(fd=%d): EINVAL\n", fd);
-
-    filedescr *filedes = p->ps_fds + fd;
+    filedescr *filedes = get_filedescr_for_pid(current_pid(), fd);
     return_dbg_if(!filedes, -EBADF,
             "%s(fd=%d): EBADF\n", __func__, fd);
-    return_dbg_if(filedes->fd_flags & O_RDONLY, -EBADF,
+
+    file_t *f = filedes->fd_file;
+    return_dbg_if(f->f_flags & O_RDONLY, -EBADF,
             "%s(fd=%d): O_RDONLY, EBADF\n", __func__, fd);
 
-    ret = vfs_inode_write(filedes->fd_sb, filedes->fd_ino, filedes->fd_pos,
-                buf, count, &nwritten);
-    return_dbg_if(ret, -ret, "%s: inode_write failed(%d)\n", ret);
+    ret = file_write(f, buf, count, &nwritten);
+    return_dbg_if(ret, -ret, "%s: file_write failed(%d)\n", __func__, ret);
 
-    if (filedes->fd_pos >= 0) {
-        filedes->fd_pos += nwritten;
+    if (f->f_pos >= 0) {
+        f->f_pos += nwritten;
     }
+    sys_account_io(0, nwritten);
     return nwritten;
 }
 
 int sys_close(int fd) {
     logmsgdf("%s(%d)\n", __func__, fd);
-    int ret;
-
     pid_t pid = current_pid();
 
     filedescr *filedes = get_filedescr_for_pid(pid, fd);
-    return_dbg_if(!filedes, EBADF, "%s: EBADF fd=%d\n", __func__, fd);
+    return_dbg_if(!filedes, -EBADF, "%s: EBADF fd=%d\n", __func__, fd);
+
+    /* drops the file reference, the last one releases the inode */
+    free_fd_for_pid(pid, fd);
+    return 0;
+}
+
+int sys_dup(int oldfd) {
+    logmsgdf("%s(%d)\n", __func__, oldfd);
+    process *p = current_proc();
+
+    filedescr *filedes = get_filedescr_for_pid(p->ps_pid, oldfd);
+    return_dbg_if(!filedes, -EBADF, "%s: EBADF fd=%d\n", __func__, oldfd);
+    file_t *f = filedes->fd_file;
 
-    struct inode idata;
-    ret = vfs_inode_get(filedes->fd_sb, filedes->fd_ino, &idata);
-    return_dbg_if(ret, ret, "%s: inode_get failed(%d)\n", __func__, ret);
+    int fd = process_alloc_fd(p, 0);
+    return_dbg_if(fd < 0, -EMFILE, "%s: pid=%d fds exhausted\n", __func__, p->ps_pid);
 
-    --idata.i_nfds;
-    /* inode may be deleted if i_nfds == 0 and i_nlinks == 0 */
-    ret = vfs_inode_set(filedes->fd_sb, filedes->fd_ino, &idata);
+    p->ps_fds[fd].fd_file = file_get(f);
+    p->ps_fds[fd].fd_flags = 0;
+    return fd;
+}
+
+int sys_dup2(int oldfd, int newfd) {
+    logmsgdf("%s(%d, %d)\n", __func__, oldfd, newfd);
+    process *p = current_proc();
 
-    filedes->fd_ino = 0; /* now it's free */
+    filedescr *filedes = get_filedescr_for_pid(p->ps_pid, oldfd);
+    return_dbg_if(!filedes, -EBADF, "%s: EBADF fd=%d\n", __func__, oldfd);
+    return_dbg_if(!((0 <= newfd) && (newfd < N_PROCESS_FDS_MAX)), -EBADF,
+            "%s: newfd=%d out of range\n", __func__, newfd);
+    if (oldfd == newfd)
+        return newfd;
+
+    file_t *f = file_get(filedes->fd_file);
+
+    if (get_filedescr_for_pid(p->ps_pid, newfd))
+        process_free_fd(p, newfd);
+
+    int ret = process_reserve_fd(p, newfd);
+    if (ret) {
+        file_put(f);
+        return -ret;
+    }
+
+    p->ps_fds[newfd].fd_file = f;
+    p->ps_fds[newfd].fd_flags = 0;
+    return newfd;
+}
+
+int sys_pipe(int pipefd[2]) {
+    logmsgdf("%s(*%x)\n", __func__, pipefd);
+    int ret;
+    process *p = current_proc();
+
+    file_t *rf = NULL, *wf = NULL;
+    ret = pipe_open_files(&rf, &wf);
+    return_dbg_if(ret, -ret, "%s: pipe_open_files failed(%d)\n", __func__, ret);
+
+    int rfd = process_alloc_fd(p, 0);
+    if (rfd < 0) {
+        ret = EMFILE;
+        goto put_files;
+    }
+    p->ps_fds[rfd].fd_file = rf;
+
+    int wfd = process_alloc_fd(p, 0);
+    if (wfd < 0) {
+        process_free_fd(p, rfd);
+        file_put(wf);
+        return -EMFILE;
+    }
+    p->ps_fds[wfd].fd_file = wf;
+
+    pipefd[0] = rfd;
+    pipefd[1] = wfd;
     return 0;
+
+put_files:
+    file_put(rf);
+    file_put(wf);
+    return -ret;
+}
+
+static int sys_splice_files(file_t *in, file_t *out, size_t count) {
+    int ret;
+    size_t ndone = 0;
+
+    return_dbg_if(in->f_flags & O_WRONLY, -EBADF, "%s: input is write-only\n", __func__);
+    return_dbg_if(out->f_flags & O_RDONLY, -EBADF, "%s: output is O_RDONLY\n", __func__);
+
+    ret = file_splice(in, out, count, &ndone);
+    return_dbg_if(ret, -ret, "%s: file_splice failed(%d)\n", __func__, ret);
+
+    sys_account_io(ndone, ndone);
+    return ndone;
+}
+
+/* copies from the position of a regular file `in_fd` inside the kernel */
+int sys_sendfile(int out_fd, int in_fd, size_t count) {
+    logmsgdf("%s(%d, %d, %d)\n", __func__, out_fd, in_fd, count);
+    pid_t pid = current_pid();
+
+    filedescr *infd = get_filedescr_for_pid(pid, in_fd);
+    filedescr *outfd = get_filedescr_for_pid(pid, out_fd);
+    return_dbg_if(!(infd && outfd), -EBADF,
+            "%s(%d, %d): EBADF\n", __func__, out_fd, in_fd);
+    return_dbg_if(!S_ISREG(infd->fd_file->f_mode), -EINVAL,
+            "%s: in_fd=%d is not a regular file\n", __func__, in_fd);
+
+    return sys_splice_files(infd->fd_file, outfd->fd_file, count);
+}
+
+/* moves data to or from a pipe, one of the ends must be a pipe */
+int sys_splice(int fd_in, int fd_out, size_t len) {
+    logmsgdf("%s(%d, %d, %d)\n", __func__, fd_in, fd_out, len);
+    pid_t pid = current_pid();
+
+    filedescr *infd = get_filedescr_for_pid(pid, fd_in);
+    filedescr *outfd = get_filedescr_for_pid(pid, fd_out);
+    return_dbg_if(!(infd && outfd), -EBADF,
+            "%s(%d, %d): EBADF\n", __func__, fd_in, fd_out);
+    return_dbg_if(!(S_ISFIFO(infd->fd_file->f_mode) || S_ISFIFO(outfd->fd_file->f_mode)),
+            -EINVAL, "%s: neither end is a pipe\n", __func__);
+
+    return sys_splice_files(infd->fd_file, outfd->fd_file, len);
 }
 
 /* @returns negative error if error or the new offset */
@@ -204,49 +300,38 @@ off_t sys_lseek(int fd, off_t offset, int whence) {
     filedescr *fildes = get_filedescr_for_pid(current_pid(), fd);
     return_dbg_if(!fildes, -EBADF,
             "%s(fd=%d): EBADF\n", __func__, fd);
-    return_dbg_if(0 == fildes->fd_ino, -EBADF,
-            "%s(fd=%d): fd_ino=0, EBADF\n", __func__, fd, fildes->fd_ino);
-    return_dbg_if(fildes->fd_pos < 0, -ESPIPE,
-            "%s(fd=%d): fd_pos < 0, ESPIPE\n", __func__, fd);
 
-    struct inode idata;
-    ret = vfs_inode_get(fildes->fd_sb, fildes->fd_ino, &idata);
-    return_dbg_if(ret, -ret, "%s: inode_get failed(%d)\n", __func__, ret);
+    file_t *f = fildes->fd_file;
+    return_dbg_if(f->f_pos < 0, -ESPIPE,
+            "%s(fd=%d): f_pos < 0, ESPIPE\n", __func__, fd);
 
-    device *dev;
-    switch (idata.i_mode & S_IFMT) {
+    switch (f->f_mode & S_IFMT) {
       case S_IFIFO: case S_IFSOCK:
         return -ESPIPE;
       case S_IFDIR:
         return -EISDIR;
-      case S_IFCHR:
-        dev = device_by_devno(DEV_CHR, inode_devno(&idata));
-        return_dbg_if(!dev, -ENXIO, "%s: ENODEV\n", __func__);
-        return_dbg_if(dev->dev_ops->dev_has_data, -ESPIPE,
-                    "%s(fd=%d): device is not seekable\n", __func__, fd);
-        break;
     }
 
+    off_t size = f->f_inode->i_size;
+
     switch (whence) {
       case SEEK_CUR:
-        fildes->fd_pos += offset;
-        ret = fildes->fd_pos;
+        f->f_pos += offset;
         break;
       case SEEK_SET:
-        fildes->fd_pos = offset;
-        ret = fildes->fd_pos;
+        f->f_pos = offset;
         break;
       case SEEK_END:
-        fildes->fd_pos = idata.i_size - offset;
+        f->f_pos = size - offset;
         break;
       default:
         return -EINVAL;
     }
-    ret = fildes->fd_pos;
-    if (fildes->fd_pos > idata.i_size)
-        fildes->fd_pos = idata.i_size;
-    if (fildes->fd_pos < 0)
-        fildes->fd_pos = 0;
+    ret = f->f_pos;
+    if (f->f_pos > size)
+        f->f_pos = size;
+    if (f->f_pos < 0)
+        f->f_pos = 0;
     return ret;
 }
 
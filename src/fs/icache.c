@@ -0,0 +1,211 @@
+/*
+ *  The in-core inode cache
+ *
+ *  Cached copies are hashed by (superblock, inode index).
+ *  A copy with no references is put on its superblock's LRU list,
+ *  the least recently used one is written back and freed when the
+ *  list is longer than ICACHE_LRU_MAX.
+ *  Filesystems that keep inodes in memory only get reference counting.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+
+#include <cosec/log.h>
+
+#include "attrs.h"
+#include "mem/kheap.h"
+#include "fs/vfs.h"
+#include "fs/icache.h"
+#include "fs/pagecache.h"
+
+static struct inode *theInodes[ICACHE_BUCKETS];
+
+
+static inline struct inode **
+icache_bucket(const mountnode *sb, inode_t ino) {
+    uint32_t key = ino ^ ((uintptr_t)sb >> 4);
+    return &theInodes[key & (ICACHE_BUCKETS - 1)];
+}
+
+static struct inode * icache_find(mountnode *sb, inode_t ino) {
+    struct inode *idata = *icache_bucket(sb, ino);
+    for (; idata; idata = idata->i_hnext)
+        if ((idata->i_no == ino) && (idata->i_sb == sb))
+            return idata;
+    return NULL;
+}
+
+static void icache_unhash(struct inode *idata) {
+    struct inode **link = icache_bucket(idata->i_sb, idata->i_no);
+    while (*link != idata)
+        link = &(*link)->i_hnext;
+    *link = idata->i_hnext;
+}
+
+/*
+ *  sb_inode_lru is circular, sb_inode_lru->i_lru_prev is the oldest
+ */
+static void icache_lru_push(struct inode *idata) {
+    mountnode *sb = idata->i_sb;
+    struct inode *head = sb->sb_inode_lru;
+    if (head) {
+        idata->i_lru_next = head;
+        idata->i_lru_prev = head->i_lru_prev;
+        head->i_lru_prev->i_lru_next = idata;
+        head->i_lru_prev = idata;
+    } else {
+        idata->i_lru_next = idata->i_lru_prev = idata;
+    }
+    sb->sb_inode_lru = idata;
+    ++sb->sb_inode_lru_len;
+}
+
+static void icache_lru_unlink(struct inode *idata) {
+    mountnode *sb = idata->i_sb;
+    if (idata->i_lru_next == idata) {
+        sb->sb_inode_lru = NULL;
+    } else {
+        idata->i_lru_prev->i_lru_next = idata->i_lru_next;
+        idata->i_lru_next->i_lru_prev = idata->i_lru_prev;
+        if (sb->sb_inode_lru == idata)
+            sb->sb_inode_lru = idata->i_lru_next;
+    }
+    --sb->sb_inode_lru_len;
+}
+
+static int icache_writeback(struct inode *idata) {
+    mountnode *sb = idata->i_sb;
+    if (!idata->i_state.dirty)
+        return 0;
+
+    return_dbg_if(!sb->sb_fs->ops->inode_set, ENOSYS,
+            "%s: no %s.inode_set\n", __func__, sb->sb_fs->name);
+    int ret = sb->sb_fs->ops->inode_set(sb, idata->i_no, idata);
+    return_err_if(ret, ret, "%s: %s.inode_set(%d) failed(%d)",
+            __func__, sb->sb_fs->name, idata->i_no, ret);
+
+    idata->i_state.dirty = false;
+    return 0;
+}
+
+/* drops an unreferenced copy that is not on the LRU list */
+static void icache_evict(struct inode *idata) {
+    if (idata->i_pages) {
+        pagecache_sync(idata->i_pages);
+        vfs_inode_drop_pages(idata);
+    }
+    icache_writeback(idata);
+    icache_unhash(idata);
+    kfree(idata);
+}
+
+/* an inode without links is freed by the filesystem */
+static void icache_free_unlinked(struct inode *idata) {
+    mountnode *sb = idata->i_sb;
+    vfs_inode_drop_pages(idata);
+    if (sb->sb_fs->ops->free_inode)
+        sb->sb_fs->ops->free_inode(sb, idata->i_no);
+}
+
+
+int vfs_iget(mountnode *sb, inode_t ino, struct inode **result) {
+    const char *funcname = __FUNCTION__;
+    int ret;
+    fs_ops *ops = sb->sb_fs->ops;
+    struct inode *idata;
+
+    if (ops->inode_incore) {
+        idata = ops->inode_incore(sb, ino);
+        if (!idata) return ENOENT;
+
+        idata->i_sb = sb;
+        idata->i_state.incore = true;
+        ++idata->i_refs;
+        *result = idata;
+        return 0;
+    }
+
+    idata = icache_find(sb, ino);
+    if (idata) {
+        if (idata->i_refs++ == 0)
+            icache_lru_unlink(idata);
+        *result = idata;
+        return 0;
+    }
+
+    return_dbg_if(!ops->inode_get, ENOSYS,
+            "%s: no %s.inode_get\n", funcname, sb->sb_fs->name);
+
+    idata = kmalloc(sizeof(struct inode));
+    return_err_if(!idata, ENOMEM, "%s: kmalloc failed", funcname);
+    memset(idata, 0, sizeof(struct inode));
+
+    ret = ops->inode_get(sb, ino, idata);
+    if (ret) {
+        kfree(idata);
+        return ret;
+    }
+
+    struct inode **bucket = icache_bucket(sb, ino);
+    idata->i_sb = sb;
+    idata->i_refs = 1;
+    idata->i_hnext = *bucket;
+    *bucket = idata;
+
+    *result = idata;
+    return 0;
+}
+
+void vfs_iput(struct inode *idata) {
+    mountnode *sb = idata->i_sb;
+    assertv(idata->i_refs > 0, "%s(ino=%d): no references\n", __func__, idata->i_no);
+    if (--idata->i_refs)
+        return;
+
+    bool unlinked = (idata->i_nlinks == 0) && (idata->i_nfds == 0);
+
+    if (idata->i_state.incore) {
+        if (unlinked)
+            icache_free_unlinked(idata);
+        return;
+    }
+
+    if (unlinked) {
+        icache_unhash(idata);
+        icache_free_unlinked(idata);
+        kfree(idata);
+        return;
+    }
+
+    /* the filesystem may change its inodes by itself, do not keep them */
+    if (sb->sb_flags.nodcache) {
+        icache_evict(idata);
+        return;
+    }
+
+    icache_lru_push(idata);
+    if (sb->sb_inode_lru_len > ICACHE_LRU_MAX) {
+        struct inode *oldest = sb->sb_inode_lru->i_lru_prev;
+        icache_lru_unlink(oldest);
+        icache_evict(oldest);
+    }
+}
+
+int vfs_sync_inodes(mountnode *sb) {
+    int ret = 0;
+    size_t i;
+    for (i = 0; i < ICACHE_BUCKETS; ++i) {
+        struct inode *idata = theInodes[i];
+        for (; idata; idata = idata->i_hnext) {
+            if (idata->i_sb != sb)
+                continue;
+            int err = (idata->i_pages ? pagecache_sync(idata->i_pages) : 0);
+            if (err) ret = err;
+            err = icache_writeback(idata);
+            if (err) ret = err;
+        }
+    }
+    return ret;
+}
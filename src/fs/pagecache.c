@@ -0,0 +1,629 @@
+/*
+ *  The page cache
+ *
+ *  A page_mapping is a radix tree of RADIX_SLOTS-wide nodes indexed by
+ *  page number, so finding a page is pm_height array lookups.
+ *  All cached pages are also linked into one CLOCK ring that is
+ *  used for reclaim, sync and truncation: it is never longer than
+ *  PAGECACHE_MAX_PAGES and the pinned pages.
+ *
+ *  A writeback may need pages itself (e.g. a bitmap to allocate blocks),
+ *  so a reclaim inside a writeback takes only clean pages, and writers
+ *  keep the dirty pages under PAGECACHE_DIRTY_MAX to leave some.
+ *
+ *  There is no locking: a mapping must not be used from interrupts.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+
+#include <cosec/log.h>
+
+#include "attrs.h"
+#include "mem/pmem.h"
+#include "mem/kheap.h"
+#include "fs/pagecache.h"
+
+#define RADIX_MASK      (RADIX_SLOTS - 1)
+#define RADIX_MAX_HEIGHT    ((32 + RADIX_SHIFT - 1) / RADIX_SHIFT)
+
+static cached_page *theClockHand = NULL;
+
+/* recycled frames, linked through their first word */
+static char *theFreeFrames = NULL;
+static count_t theNFrames = 0;
+
+/* writebacks in progress, nested ones included */
+static count_t theWritebacks = 0;
+
+static struct pagecache_stats thePagecacheStats;
+
+
+/*
+ *  Radix tree
+ */
+
+static inline bool radix_fits(uint height, index_t index) {
+    uint bits = height * RADIX_SHIFT;
+    return (bits >= 32) || ((index >> bits) == 0);
+}
+
+static inline uint radix_slot(index_t index, uint level) {
+    return (index >> (level * RADIX_SHIFT)) & RADIX_MASK;
+}
+
+static struct radix_node * radix_node_new(void) {
+    struct radix_node *node = kmalloc(sizeof(struct radix_node));
+    return_err_if(!node, NULL, "%s: kmalloc failed", __func__);
+    memset(node, 0, sizeof(struct radix_node));
+    return node;
+}
+
+static cached_page * radix_lookup(page_mapping *m, index_t index) {
+    if (!m->pm_root || !radix_fits(m->pm_height, index))
+        return NULL;
+
+    struct radix_node *node = m->pm_root;
+    uint level = m->pm_height - 1;
+    for (; level > 0; --level) {
+        node = node->rn_slots[ radix_slot(index, level) ];
+        if (!node) return NULL;
+    }
+    return node->rn_slots[ radix_slot(index, 0) ];
+}
+
+static int radix_insert(page_mapping *m, index_t index, cached_page *pg) {
+    if (!m->pm_root) {
+        m->pm_root = radix_node_new();
+        if (!m->pm_root) return ENOMEM;
+        m->pm_height = 1;
+    }
+
+    while (!radix_fits(m->pm_height, index)) {
+        struct radix_node *root = radix_node_new();
+        if (!root) return ENOMEM;
+        root->rn_slots[0] = m->pm_root;
+        root->rn_count = 1;
+        m->pm_root = root;
+        ++m->pm_height;
+    }
+
+    struct radix_node *node = m->pm_root;
+    uint level = m->pm_height - 1;
+    for (; level > 0; --level) {
+        void **slot = &node->rn_slots[ radix_slot(index, level) ];
+        if (!*slot) {
+            *slot = radix_node_new();
+            if (!*slot) return ENOMEM;
+            ++node->rn_count;
+        }
+        node = *slot;
+    }
+
+    node->rn_slots[ radix_slot(index, 0) ] = pg;
+    ++node->rn_count;
+    return 0;
+}
+
+/* also frees the nodes that become empty */
+static void radix_delete(page_mapping *m, index_t index) {
+    struct radix_node *path[RADIX_MAX_HEIGHT];
+    if (!m->pm_root || !radix_fits(m->pm_height, index))
+        return;
+
+    struct radix_node *node = m->pm_root;
+    uint level = m->pm_height - 1;
+    for (;;) {
+        path[level] = node;
+        if (level == 0)
+            break;
+        node = node->rn_slots[ radix_slot(index, level) ];
+        if (!node) return;
+        --level;
+    }
+
+    for (level = 0; level < m->pm_height; ++level) {
+        node = path[level];
+        node->rn_slots[ radix_slot(index, level) ] = NULL;
+        if (--node->rn_count)
+            return;
+        kfree(node);
+    }
+    m->pm_root = NULL;
+    m->pm_height = 0;
+}
+
+
+/*
+ *  The CLOCK ring
+ */
+
+/* a new page is put right behind the hand, it is examined last */
+static void clock_insert(cached_page *pg) {
+    if (!theClockHand) {
+        pg->cp_next = pg->cp_prev = pg;
+        theClockHand = pg;
+        return;
+    }
+    pg->cp_next = theClockHand;
+    pg->cp_prev = theClockHand->cp_prev;
+    theClockHand->cp_prev->cp_next = pg;
+    theClockHand->cp_prev = pg;
+}
+
+static void clock_unlink(cached_page *pg) {
+    if (pg->cp_next == pg) {
+        theClockHand = NULL;
+        return;
+    }
+    pg->cp_prev->cp_next = pg->cp_next;
+    pg->cp_next->cp_prev = pg->cp_prev;
+    if (theClockHand == pg)
+        theClockHand = pg->cp_next;
+}
+
+
+/*
+ *  Pages
+ */
+
+static inline void pagecache_pin(cached_page *pg) {
+    if (!pg->cp_refs++)
+        ++thePagecacheStats.pinned;
+}
+
+static inline void pagecache_unpin(cached_page *pg) {
+    if (!--pg->cp_refs)
+        --thePagecacheStats.pinned;
+}
+
+static int pagecache_writeback(cached_page *pg) {
+    page_mapping *m = pg->cp_mapping;
+    if (!pg->cp_flags.dirty)
+        return 0;
+
+    return_dbg_if(!m->pm_ops->writepage, ENOSYS,
+            "%s: no writepage for mapping *%x\n", __func__, (uint)m);
+    /* pinned, so that a nested reclaim does not take it */
+    pagecache_pin(pg);
+    ++theWritebacks;
+    int ret = m->pm_ops->writepage(m, pg->cp_index, pg->cp_data);
+    --theWritebacks;
+    pagecache_unpin(pg);
+    return_err_if(ret, ret, "%s: writepage(%d) failed(%d)", __func__, pg->cp_index, ret);
+
+    pg->cp_flags.dirty = false;
+    --m->pm_ndirty;
+    --thePagecacheStats.dirty;
+    ++thePagecacheStats.writebacks;
+    return 0;
+}
+
+/* forgets `pg`, returns its frame */
+static char * pagecache_remove(cached_page *pg) {
+    page_mapping *m = pg->cp_mapping;
+    char *frame = pg->cp_data;
+
+    radix_delete(m, pg->cp_index);
+    clock_unlink(pg);
+
+    --m->pm_npages;
+    if (pg->cp_flags.dirty) {
+        --m->pm_ndirty;
+        --thePagecacheStats.dirty;
+    }
+    --thePagecacheStats.pages;
+
+    kfree(pg);
+    return frame;
+}
+
+static void pagecache_frame_free(char *frame) {
+    *(char **)frame = theFreeFrames;
+    theFreeFrames = frame;
+}
+
+/* CLOCK: the first unpinned page that was not used since the last pass */
+static char * pagecache_reclaim(void) {
+    count_t n = 2 * thePagecacheStats.pages;
+    while (n-- > 0) {
+        cached_page *pg = theClockHand;
+        theClockHand = pg->cp_next;
+
+        if (pg->cp_refs)
+            continue;
+        if (pg->cp_flags.referenced) {
+            pg->cp_flags.referenced = false;
+            continue;
+        }
+        if (pg->cp_flags.dirty && theWritebacks)
+            continue;
+        if (pagecache_writeback(pg))
+            continue;
+
+        ++thePagecacheStats.reclaims;
+        return pagecache_remove(pg);
+    }
+    return NULL;
+}
+
+static char * pagecache_frame_alloc(void) {
+    char *frame = theFreeFrames;
+    if (frame) {
+        theFreeFrames = *(char **)frame;
+        return frame;
+    }
+
+    /* pinned frames can't be reclaimed, e.g. a large mapping's ones */
+    if (theNFrames < PAGECACHE_MAX_PAGES + thePagecacheStats.pinned) {
+        void *paddr = pmem_alloc(1);
+        if (paddr) {
+            ++theNFrames;
+            return __va(paddr);
+        }
+    }
+    return pagecache_reclaim();
+}
+
+
+void pagecache_init_mapping(page_mapping *m, void *host, const struct page_mapping_ops *ops) {
+    memset(m, 0, sizeof(page_mapping));
+    m->pm_host = host;
+    m->pm_ops = ops;
+}
+
+/* caches the filled `frame` as page `index` of `m`, pinned */
+static int pagecache_insert(page_mapping *m, index_t index, char *frame, cached_page **result) {
+    int ret;
+    cached_page *pg = kmalloc(sizeof(cached_page));
+    if (!pg) return ENOMEM;
+
+    pg->cp_mapping = m;
+    pg->cp_index = index;
+    pg->cp_data = frame;
+    pg->cp_refs = 0;
+    pg->cp_flags.dirty = false;
+    pg->cp_flags.referenced = true;
+
+    ret = radix_insert(m, index, pg);
+    if (ret) {
+        kfree(pg);
+        return ret;
+    }
+    clock_insert(pg);
+    pagecache_pin(pg);
+    ++m->pm_npages;
+    ++thePagecacheStats.pages;
+
+    *result = pg;
+    return 0;
+}
+
+int pagecache_get(page_mapping *m, index_t index, bool fill, cached_page **result) {
+    int ret;
+    cached_page *pg = radix_lookup(m, index);
+    if (pg) {
+        ++thePagecacheStats.hits;
+        goto pin_page;
+    }
+    ++thePagecacheStats.misses;
+
+    char *frame = pagecache_frame_alloc();
+    return_err_if(!frame, ENOMEM, "%s: no frames to reclaim", __func__);
+
+    if (fill && m->pm_ops->readpage) {
+        ret = m->pm_ops->readpage(m, index, frame);
+        if (ret) goto free_frame;
+    } else {
+        memset(frame, 0, PAGE_BYTES);
+    }
+
+    /* a writeback from the reclaim may have cached (and changed) it meanwhile */
+    pg = radix_lookup(m, index);
+    if (pg) {
+        pagecache_frame_free(frame);
+        goto pin_page;
+    }
+
+    ret = pagecache_insert(m, index, frame, result);
+    if (ret) goto free_frame;
+    return 0;
+
+free_frame:
+    pagecache_frame_free(frame);
+    return ret;
+
+pin_page:
+    pg->cp_flags.referenced = true;
+    pagecache_pin(pg);
+    *result = pg;
+    return 0;
+}
+
+void pagecache_put(cached_page *pg) {
+    assertv(pg->cp_refs > 0, "%s(index=%d): no references\n", __func__, pg->cp_index);
+    pagecache_unpin(pg);
+}
+
+cached_page * pagecache_find(page_mapping *m, index_t index) {
+    return radix_lookup(m, index);
+}
+
+void pagecache_set_dirty(cached_page *pg) {
+    if (pg->cp_flags.dirty)
+        return;
+    pg->cp_flags.dirty = true;
+    ++pg->cp_mapping->pm_ndirty;
+    ++thePagecacheStats.dirty;
+}
+
+
+/* fills the frames of a run of missing pages */
+static int pagecache_fill_run(page_mapping *m, index_t index, char **frames, count_t n) {
+    count_t i;
+    if (m->pm_ops->readpages)
+        return m->pm_ops->readpages(m, index, frames, n);
+
+    for (i = 0; i < n; ++i) {
+        int ret = m->pm_ops->readpage(m, index + i, frames[i]);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+/*
+ *  Reads the missing pages of [index, index + npages) without pinning them,
+ *  each run of missing pages is read with one .readpages if there is one.
+ */
+static void pagecache_prefetch(page_mapping *m, index_t index, count_t npages) {
+    char *frames[READAHEAD_MAX];
+    count_t i;
+
+    if (!m->pm_ops->readpage)
+        return;
+
+    while (npages > 0) {
+        if (radix_lookup(m, index)) {
+            ++index; --npages;
+            continue;
+        }
+
+        count_t n = 0;
+        bool nomem = false;
+        while ((n < npages) && (n < READAHEAD_MAX) && !radix_lookup(m, index + n)) {
+            frames[n] = pagecache_frame_alloc();
+            if (!frames[n]) { nomem = true; break; }
+            ++n;
+        }
+        if (!n) return;
+
+        int ret = pagecache_fill_run(m, index, frames, n);
+        for (i = 0; i < n; ++i) {
+            cached_page *pg;
+            if (ret || radix_lookup(m, index + i)
+                || pagecache_insert(m, index + i, frames[i], &pg))
+            {
+                pagecache_frame_free(frames[i]);
+                continue;
+            }
+            ++thePagecacheStats.readahead;
+
+            /* not used yet: reclaimed first if it is never read */
+            pg->cp_flags.referenced = false;
+            pagecache_put(pg);
+        }
+        if (ret || nomem)
+            return;
+
+        index += n; npages -= n;
+    }
+}
+
+void pagecache_readahead(page_mapping *m, struct readahead *ra,
+                         off_t pos, size_t buflen, index_t maxindex)
+{
+    if (!buflen) return;
+    index_t index = pos / PAGE_BYTES;
+    index_t last = (pos + buflen - 1) / PAGE_BYTES;
+
+    /* a read may continue in the page the previous one ended in */
+    bool sequential = (index == ra->ra_next) || (index + 1 == ra->ra_next);
+    ra->ra_next = last + 1;
+
+    if (!sequential) {
+        ra->ra_size = 0;
+        return;
+    }
+
+    if (!ra->ra_size) {
+        /* the first window covers this read, so it is one request too */
+        ra->ra_start = index;
+        ra->ra_size = READAHEAD_MIN;
+        while ((ra->ra_size <= last - index) && (ra->ra_size < READAHEAD_MAX))
+            ra->ra_size *= 2;
+    } else if (last >= ra->ra_start + ra->ra_size / 2) {
+        /* the reader is in the second half: prefetch the next window */
+        ra->ra_start += ra->ra_size;
+        if (ra->ra_size < READAHEAD_MAX)
+            ra->ra_size *= 2;
+    } else {
+        return;
+    }
+
+    /* the window must cover this read even if it jumped far ahead */
+    if (ra->ra_start + ra->ra_size <= last)
+        ra->ra_start = last + 1 - ra->ra_size;
+
+    if (ra->ra_start > maxindex)
+        return;
+    count_t npages = ra->ra_size;
+    if (ra->ra_start + npages > maxindex + 1)
+        npages = maxindex + 1 - ra->ra_start;
+    pagecache_prefetch(m, ra->ra_start, npages);
+}
+
+int pagecache_read(page_mapping *m, off_t pos, char *buf, size_t buflen, size_t *done) {
+    int ret = 0;
+    size_t n = 0;
+
+    while (n < buflen) {
+        index_t index = (pos + n) / PAGE_BYTES;
+        size_t offset = (pos + n) % PAGE_BYTES;
+        size_t chunk = PAGE_BYTES - offset;
+        if (chunk > buflen - n)
+            chunk = buflen - n;
+
+        cached_page *pg;
+        ret = pagecache_get(m, index, true, &pg);
+        if (ret) break;
+
+        memcpy(buf + n, pg->cp_data + offset, chunk);
+        pagecache_put(pg);
+        n += chunk;
+    }
+
+    if (done) *done = n;
+    return ret;
+}
+
+int pagecache_write(page_mapping *m, off_t pos, const char *buf, size_t buflen, size_t *done) {
+    int ret = 0;
+    size_t n = 0;
+
+    while (n < buflen) {
+        index_t index = (pos + n) / PAGE_BYTES;
+        size_t offset = (pos + n) % PAGE_BYTES;
+        size_t chunk = PAGE_BYTES - offset;
+        if (chunk > buflen - n)
+            chunk = buflen - n;
+
+        /* a page that is overwritten completely is not read */
+        cached_page *pg;
+        ret = pagecache_get(m, index, (chunk < PAGE_BYTES), &pg);
+        if (ret) break;
+
+        memcpy(pg->cp_data + offset, buf + n, chunk);
+        pagecache_set_dirty(pg);
+        pagecache_put(pg);
+        n += chunk;
+
+        /* leaves clean pages for the frames writebacks need, see above */
+        if ((thePagecacheStats.dirty > PAGECACHE_DIRTY_MAX) && !theWritebacks)
+            pagecache_sync_all();
+    }
+
+    if (done) *done = n;
+    return ret;
+}
+
+
+/* writes the pinned `pages` of `m` back with .writepages, unpins them */
+static int pagecache_writeback_batch(page_mapping *m, cached_page **pages, count_t npages) {
+    count_t i;
+    /* a reclaim nested in .writepages must not start writebacks too */
+    ++theWritebacks;
+    int ret = m->pm_ops->writepages(m, pages, npages);
+    --theWritebacks;
+
+    for (i = 0; i < npages; ++i) {
+        cached_page *pg = pages[i];
+        if (!ret && pg->cp_flags.dirty) {
+            pg->cp_flags.dirty = false;
+            --m->pm_ndirty;
+            --thePagecacheStats.dirty;
+            ++thePagecacheStats.writebacks;
+        }
+        pagecache_put(pg);
+    }
+    return_err_if(ret, ret, "%s: writepages(%d) failed(%d)", __func__, npages, ret);
+    return 0;
+}
+
+int pagecache_sync(page_mapping *m) {
+    int ret = 0;
+    cached_page *pg = theClockHand;
+    count_t n = thePagecacheStats.pages;
+
+    if (m->pm_ops->writepages) {
+        cached_page *batch[WRITEBACK_BATCH];
+        count_t nbatch = 0;
+
+        for (; n > 0; --n, pg = pg->cp_next) {
+            if ((pg->cp_mapping != m) || !pg->cp_flags.dirty)
+                continue;
+
+            pagecache_pin(pg);
+            batch[nbatch++] = pg;
+            if (nbatch == WRITEBACK_BATCH) {
+                int err = pagecache_writeback_batch(m, batch, nbatch);
+                if (err) ret = err;
+                nbatch = 0;
+            }
+        }
+        if (nbatch) {
+            int err = pagecache_writeback_batch(m, batch, nbatch);
+            if (err) ret = err;
+        }
+        return ret;
+    }
+
+    /* a writeback may insert and reclaim pages and move the hand,
+     * so the ring is walked again while that writes something */
+    count_t written;
+    do {
+        written = 0;
+        pg = theClockHand;
+        n = thePagecacheStats.pages;
+        for (; m->pm_ndirty && (n > 0); --n, pg = pg->cp_next) {
+            if ((pg->cp_mapping != m) || !pg->cp_flags.dirty)
+                continue;
+            int err = pagecache_writeback(pg);
+            if (err) ret = err;
+            else ++written;
+        }
+    } while (m->pm_ndirty && written);
+    return ret;
+}
+
+int pagecache_sync_all(void) {
+    int ret = 0;
+    count_t dirty;
+
+    /* walked again as in pagecache_sync() */
+    do {
+        cached_page *pg = theClockHand;
+        count_t n = thePagecacheStats.pages;
+        dirty = thePagecacheStats.dirty;
+
+        for (; n > 0; --n, pg = pg->cp_next) {
+            if (!pg->cp_flags.dirty)
+                continue;
+            /* the whole mapping at once, the next pages of it are clean then */
+            page_mapping *m = pg->cp_mapping;
+            int err = (m->pm_ops->writepages ? pagecache_sync(m) : pagecache_writeback(pg));
+            if (err) ret = err;
+        }
+    } while (thePagecacheStats.dirty && (thePagecacheStats.dirty < dirty));
+    return ret;
+}
+
+void pagecache_truncate(page_mapping *m, index_t start) {
+    cached_page *pg = theClockHand;
+    count_t n = thePagecacheStats.pages;
+
+    while (m->pm_npages && (n-- > 0)) {
+        cached_page *next = pg->cp_next;
+        if ((pg->cp_mapping == m) && (pg->cp_index >= start)) {
+            if (pg->cp_refs)
+                logmsgef("%s: page %d is pinned", __func__, pg->cp_index);
+            else
+                pagecache_frame_free(pagecache_remove(pg));
+        }
+        pg = next;
+    }
+}
+
+void pagecache_get_stats(struct pagecache_stats *stats) {
+    *stats = thePagecacheStats;
+}
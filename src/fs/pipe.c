@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+
+#include <cosec/log.h>
+
+#include "attrs.h"
+#include "mem/kheap.h"
+#include "fs/file.h"
+#include "fs/pipe.h"
+
+
+/* named FIFOs that are currently open */
+static pipe_t *theFifos = NULL;
+
+
+/*
+ *  The ring
+ */
+
+pipe_t * pipe_new(void) {
+    pipe_t *p = kmalloc(sizeof(pipe_t));
+    return_err_if(!p, NULL, "%s: kmalloc(pipe) failed", __func__);
+    memset(p, 0, sizeof(pipe_t));
+
+    p->p_buf = kmalloc(PIPE_BUF_SIZE);
+    if (!p->p_buf) {
+        logmsgef("%s: kmalloc(buf) failed", __func__);
+        kfree(p);
+        return NULL;
+    }
+    return p;
+}
+
+void pipe_free(pipe_t *p) {
+    kfree(p->p_buf);
+    kfree(p);
+}
+
+static inline uint32_t pipe_used(pipe_t *p) {
+    return p->p_tail - p->p_head;
+}
+
+/*
+ *  Serializes the tasks on one end of the pipe. Whether an end is shared
+ *  may change during a call (a FIFO opened meanwhile), so it is always
+ *  taken; without contention it is just a flag set with interrupts off.
+ */
+static void pipe_lock(bool *locked, wait_queue_t *wq) {
+    intrs_disable();
+    while (*locked)
+        wait_queue_sleep(wq);
+    *locked = true;
+    intrs_enable();
+}
+
+static void pipe_unlock(bool *locked, wait_queue_t *wq) {
+    *locked = false;
+    if (wq->wq_head)
+        wait_queue_wake_all(wq);
+}
+
+int pipe_read(pipe_t *p, char *buf, size_t buflen, size_t *done) {
+    size_t nread = 0;
+    if (!buflen)
+        goto fun_exit;
+
+    pipe_lock(&p->p_rlocked, &p->p_rlockq);
+    if (!pipe_used(p))
+        wait_event(&p->p_rwait, pipe_used(p) || !p->p_writers);
+
+    uint32_t head = p->p_head;
+    nread = p->p_tail - head;
+    barrier();  /* see the data before the new p_tail */
+    if (nread > buflen)
+        nread = buflen;
+
+    size_t off = head % PIPE_BUF_SIZE;
+    size_t first = PIPE_BUF_SIZE - off;
+    if (first > nread)
+        first = nread;
+    memcpy(buf, p->p_buf + off, first);
+    memcpy(buf + first, p->p_buf, nread - first);
+
+    barrier();  /* the writer may reuse the space after this */
+    p->p_head = head + nread;
+    pipe_unlock(&p->p_rlocked, &p->p_rlockq);
+
+    if (p->p_wwait.wq_head)
+        wait_queue_wake_all(&p->p_wwait);
+
+fun_exit:
+    if (done) *done = nread;
+    return 0;
+}
+
+int pipe_write(pipe_t *p, const char *buf, size_t buflen, size_t *done) {
+    int ret = 0;
+    size_t nwritten = 0;
+
+    pipe_lock(&p->p_wlocked, &p->p_wlockq);
+    while (nwritten < buflen) {
+        if (!p->p_readers) {
+            ret = EPIPE;
+            break;
+        }
+
+        uint32_t tail = p->p_tail;
+        size_t space = PIPE_BUF_SIZE - (tail - p->p_head);
+        if (!space) {
+            wait_event(&p->p_wwait,
+                    (pipe_used(p) < PIPE_BUF_SIZE) || !p->p_readers);
+            continue;
+        }
+
+        size_t chunk = buflen - nwritten;
+        if (chunk > space)
+            chunk = space;
+
+        size_t off = tail % PIPE_BUF_SIZE;
+        size_t first = PIPE_BUF_SIZE - off;
+        if (first > chunk)
+            first = chunk;
+        memcpy(p->p_buf + off, buf + nwritten, first);
+        memcpy(p->p_buf, buf + nwritten + first, chunk - first);
+
+        barrier();  /* the data must be there before the reader sees p_tail */
+        p->p_tail = tail + chunk;
+        nwritten += chunk;
+
+        if (p->p_rwait.wq_head)
+            wait_queue_wake_all(&p->p_rwait);
+    }
+    pipe_unlock(&p->p_wlocked, &p->p_wlockq);
+
+    if (done) *done = nwritten;
+    /* a partial write is still a success */
+    return (nwritten ? 0 : ret);
+}
+
+
+/*
+ *  Pipe files
+ */
+
+static void pipe_attach(pipe_t *p, uint flags) {
+    if (flags & (O_RDONLY | O_RDWR))
+        ++p->p_readers;
+    if (flags & (O_WRONLY | O_RDWR))
+        ++p->p_writers;
+
+    /* a FIFO may be waiting to be opened on this end */
+    wait_queue_wake_all(&p->p_rwait);
+    wait_queue_wake_all(&p->p_wwait);
+}
+
+static int pipe_file_read(file_t *f, char *buf, size_t buflen, size_t *done) {
+    return pipe_read(f->f_data, buf, buflen, done);
+}
+
+static int pipe_file_write(file_t *f, const char *buf, size_t buflen, size_t *done) {
+    return pipe_write(f->f_data, buf, buflen, done);
+}
+
+/* the readable data up to the end of the ring buffer, reading until unmapped */
+static int pipe_file_map_data(file_t *f, const char **data, size_t *len, void **cookie) {
+    pipe_t *p = f->f_data;
+    UNUSED(cookie);
+
+    pipe_lock(&p->p_rlocked, &p->p_rlockq);
+    if (!pipe_used(p))
+        wait_event(&p->p_rwait, pipe_used(p) || !p->p_writers);
+
+    uint32_t head = p->p_head;
+    size_t avail = p->p_tail - head;
+    barrier();  /* see the data before the new p_tail */
+
+    size_t off = head % PIPE_BUF_SIZE;
+    if (avail > PIPE_BUF_SIZE - off)
+        avail = PIPE_BUF_SIZE - off;
+    if (*len > avail)
+        *len = avail;
+
+    *data = p->p_buf + off;
+    return 0;
+}
+
+static void pipe_file_unmap_data(file_t *f, void *cookie, size_t consumed) {
+    pipe_t *p = f->f_data;
+    UNUSED(cookie);
+    if (!consumed) {
+        pipe_unlock(&p->p_rlocked, &p->p_rlockq);
+        return;
+    }
+
+    barrier();  /* the writer may reuse the space after this */
+    p->p_head += consumed;
+    pipe_unlock(&p->p_rlocked, &p->p_rlockq);
+
+    if (p->p_wwait.wq_head)
+        wait_queue_wake_all(&p->p_wwait);
+}
+
+static void pipe_file_release(file_t *f) {
+    pipe_t *p = f->f_data;
+
+    if (f->f_flags & (O_RDONLY | O_RDWR))
+        --p->p_readers;
+    if (f->f_flags & (O_WRONLY | O_RDWR))
+        --p->p_writers;
+
+    /* let the other end see EOF/EPIPE */
+    wait_queue_wake_all(&p->p_rwait);
+    wait_queue_wake_all(&p->p_wwait);
+
+    if (p->p_readers || p->p_writers)
+        return;
+
+    if (p->p_sb) {
+        pipe_t **link = &theFifos;
+        while (*link && (*link != p))
+            link = &(*link)->p_next;
+        if (*link)
+            *link = p->p_next;
+    }
+    pipe_free(p);
+}
+
+const file_ops pipe_file_ops = {
+    .read = pipe_file_read,
+    .write = pipe_file_write,
+    .map_data = pipe_file_map_data,
+    .unmap_data = pipe_file_unmap_data,
+    .release = pipe_file_release,
+};
+
+int pipe_fifo_open(file_t *f) {
+    pipe_t *p = theFifos;
+    while (p && !((p->p_sb == f->f_sb) && (p->p_ino == f->f_ino)))
+        p = p->p_next;
+
+    if (!p) {
+        p = pipe_new();
+        if (!p) return ENOMEM;
+
+        p->p_sb = f->f_sb;
+        p->p_ino = f->f_ino;
+        p->p_next = theFifos;
+        theFifos = p;
+    }
+
+    pipe_attach(p, f->f_flags);
+    f->f_data = p;
+
+    /* one end waits for the other, unless it is both or O_NONBLOCK */
+    if (f->f_flags & (O_RDWR | O_NONBLOCK))
+        return 0;
+    if (f->f_flags & O_RDONLY)
+        wait_event(&p->p_rwait, p->p_writers);
+    else if (f->f_flags & O_WRONLY)
+        wait_event(&p->p_wwait, p->p_readers);
+    return 0;
+}
+
+static file_t * pipe_file_new(pipe_t *p, uint flags) {
+    file_t *f = kmalloc(sizeof(file_t));
+    return_err_if(!f, NULL, "%s: kmalloc failed", __func__);
+    memset(f, 0, sizeof(file_t));
+
+    f->f_refs = 1;
+    f->f_flags = flags;
+    f->f_pos = -1;
+    f->f_mode = S_IFIFO | 0600;
+    f->f_data = p;
+    f->f_ops = &pipe_file_ops;
+
+    pipe_attach(p, flags);
+    return f;
+}
+
+/*
+ *  An anonymous pipe: `*rf` reads what is written to `*wf`
+ */
+int pipe_open_files(file_t **rf, file_t **wf) {
+    pipe_t *p = pipe_new();
+    if (!p) return ENOMEM;
+
+    *rf = pipe_file_new(p, O_RDONLY);
+    if (!*rf) {
+        pipe_free(p);
+        return ENOMEM;
+    }
+
+    *wf = pipe_file_new(p, O_WRONLY);
+    if (!*wf) {
+        file_put(*rf);  /* frees the pipe too */
+        return ENOMEM;
+    }
+    return 0;
+}
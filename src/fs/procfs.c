@@ -0,0 +1,376 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+
+#include <cosec/log.h>
+
+#include "conf.h"
+#include "mem/kheap.h"
+#include "mem/mmap.h"
+#include "dev/timer.h"
+#include "fs/procfs.h"
+#include "process.h"
+
+/*
+ *  Inode indices are (pid << PROCFS_FILE_BITS | file),
+ *  pid 0 is the root directory.
+ */
+#define PROCFS_FILE_BITS    4
+#define PROCFS_INO(pid, file)   (((inode_t)(pid) << PROCFS_FILE_BITS) | (file))
+#define PROCFS_INO_PID(ino)     ((pid_t)((ino) >> PROCFS_FILE_BITS))
+#define PROCFS_INO_FILE(ino)    ((ino) & ((1 << PROCFS_FILE_BITS) - 1))
+
+#define PROCFS_DIR          1   /* the root or /proc/<pid> */
+#define PROCFS_FIRST_FILE   2   /* the first entry of a *_entries[] table */
+
+#define PROCFS_ROOT_INO     PROCFS_INO(0, PROCFS_DIR)
+
+/* get_direntry positions: ".", "..", files, then PROCFS_POS_PIDS + pid */
+#define PROCFS_POS_PIDS     0x100
+
+/* generated contents are cut at this size */
+#define PROCFS_BUF_SIZE     PAGE_BYTES
+
+struct procfs_buf {
+    char   *pb_buf;
+    size_t  pb_len;
+};
+
+struct procfs_entry {
+    const char *name;
+    /* process_t is NULL for the root entries */
+    void (*show)(struct procfs_buf *pb, process_t *proc);
+};
+
+
+static void procfs_printf(struct procfs_buf *pb, const char *fmt, ...) {
+    size_t left = PROCFS_BUF_SIZE - pb->pb_len;
+    if (left <= 1)
+        return;     /* vsnprintf() treats 0 as "unlimited" */
+
+    va_list ap;
+    va_start(ap, fmt);
+    pb->pb_len += vsnprintf(pb->pb_buf + pb->pb_len, left, fmt, ap);
+    va_end(ap);
+}
+
+/*
+ *  Contents
+ */
+
+static void procfs_show_uptime(struct procfs_buf *pb, process_t *proc) {
+    procfs_printf(pb, "%u %u\n", (uint)timer_ticks(), timer_frequency());
+}
+
+static const char * procfs_state_name(enum taskstate state) {
+    switch (state) {
+      case TS_READY:    return "R";
+      case TS_BLOCKED:  return "S";
+      case TS_STOPPED:  return "T";
+      case TS_EXITED:   return "Z";
+      default:          return "?";
+    }
+}
+
+static void procfs_show_stat(struct procfs_buf *pb, process_t *proc) {
+    const struct task_stats *ts = &proc->ps_task.stats;
+
+    uint nsyscalls = 0;
+    size_t i;
+    for (i = 0; i < N_SYSCALLS; ++i)
+        nsyscalls += proc->ps_nsyscalls[i];
+
+    uint stack = 0;
+    if (proc->ps_task.tss.cs != SEL_KERN_CS)
+        stack = USER_STACK_TOP - (uintptr_t)proc->ps_userstack;
+
+    procfs_printf(pb, "pid %d\n", proc->ps_pid);
+    procfs_printf(pb, "ppid %d\n", proc->ps_ppid);
+    procfs_printf(pb, "state %s\n", procfs_state_name(proc->ps_task.state));
+    procfs_printf(pb, "utime %u\n", ts->utime);
+    procfs_printf(pb, "stime %u\n", ts->stime);
+    procfs_printf(pb, "nvcsw %u\n", ts->nvcsw);
+    procfs_printf(pb, "nivcsw %u\n", ts->nivcsw);
+    procfs_printf(pb, "faults %u\n", proc->ps_nfaults);
+    procfs_printf(pb, "syscalls %u\n", nsyscalls);
+    procfs_printf(pb, "rchar %u\n", proc->ps_rchar);
+    procfs_printf(pb, "wchar %u\n", proc->ps_wchar);
+    procfs_printf(pb, "brk 0x%x\n", (uint)proc->ps_heap_end);
+    procfs_printf(pb, "stack %u\n", stack);
+}
+
+static void procfs_show_syscalls(struct procfs_buf *pb, process_t *proc) {
+    size_t i;
+    for (i = 0; i < N_SYSCALLS; ++i)
+        if (proc->ps_nsyscalls[i])
+            procfs_printf(pb, "%u %u\n", (uint)i, proc->ps_nsyscalls[i]);
+}
+
+/* one line per vm_area: start-end, protection, sharing, inode, file page */
+static void procfs_show_maps(struct procfs_buf *pb, process_t *proc) {
+    vm_area_t *vma;
+    for (vma = proc->ps_vmas; vma; vma = vma->va_next) {
+        procfs_printf(pb, "%08x-%08x %c%c%c%c %d %d\n",
+                vma->va_start, vma->va_end,
+                (vma->va_prot & PROT_READ ? 'r' : '-'),
+                (vma->va_prot & PROT_WRITE ? 'w' : '-'),
+                (vma->va_prot & PROT_EXEC ? 'x' : '-'),
+                (vma->va_flags & MAP_SHARED ? 's' : 'p'),
+                (vma->va_file ? (int)vma->va_file->f_ino : 0),
+                vma->va_pgoff);
+    }
+}
+
+static const struct procfs_entry procfs_root_entries[] = {
+    { .name = "uptime",     .show = procfs_show_uptime },
+};
+
+static const struct procfs_entry procfs_pid_entries[] = {
+    { .name = "stat",       .show = procfs_show_stat },
+    { .name = "syscalls",   .show = procfs_show_syscalls },
+    { .name = "maps",       .show = procfs_show_maps },
+};
+
+#define N_ROOT_ENTRIES  (sizeof(procfs_root_entries) / sizeof(struct procfs_entry))
+#define N_PID_ENTRIES   (sizeof(procfs_pid_entries) / sizeof(struct procfs_entry))
+
+
+/* resolves `ino` to its process (NULL for the root) and entry (NULL for dirs) */
+static int procfs_resolve(inode_t ino, process_t **proc, const struct procfs_entry **entry) {
+    pid_t pid = PROCFS_INO_PID(ino);
+    size_t file = PROCFS_INO_FILE(ino);
+
+    *proc = NULL;
+    if (pid) {
+        *proc = proc_by_pid(pid);
+        if (!*proc) return ENOENT;
+    }
+
+    *entry = NULL;
+    if (file == PROCFS_DIR)
+        return 0;
+    if (file < PROCFS_FIRST_FILE)
+        return ENOENT;
+
+    file -= PROCFS_FIRST_FILE;
+    if (pid) {
+        if (file >= N_PID_ENTRIES) return ENOENT;
+        *entry = procfs_pid_entries + file;
+    } else {
+        if (file >= N_ROOT_ENTRIES) return ENOENT;
+        *entry = procfs_root_entries + file;
+    }
+    return 0;
+}
+
+static int procfs_render(inode_t ino, struct procfs_buf *pb) {
+    process_t *proc;
+    const struct procfs_entry *entry;
+    int ret = procfs_resolve(ino, &proc, &entry);
+    if (ret) return ret;
+    if (!entry) return EISDIR;
+
+    pb->pb_buf = kmalloc(PROCFS_BUF_SIZE);
+    return_err_if(!pb->pb_buf, ENOMEM, "%s: kmalloc failed", __func__);
+    pb->pb_len = 0;
+
+    entry->show(pb, proc);
+    return 0;
+}
+
+
+/*
+ *  Filesystem operations
+ */
+
+static int procfs_read_superblock(mountnode *sb, const mount_opts_t *opts) {
+    UNUSED(opts);
+    sb->sb_blksz = PAGE_BYTES;
+    sb->sb_fs = procfs_fs_driver();
+    sb->sb_root_ino = PROCFS_ROOT_INO;
+    sb->sb_data = NULL;
+    sb->sb_flags.ro = true;
+    sb->sb_flags.nodcache = true;
+    return 0;
+}
+
+static int procfs_inode_get(mountnode *sb, inode_t ino, struct inode *idata) {
+    process_t *proc;
+    const struct procfs_entry *entry;
+    int ret = procfs_resolve(ino, &proc, &entry);
+    if (ret) return ret;
+
+    memset(idata, 0, sizeof(struct inode));
+    idata->i_no = ino;
+    if (!entry) {
+        idata->i_mode = S_IFDIR | 0555;
+        idata->i_nlinks = 2;
+        return 0;
+    }
+
+    idata->i_mode = S_IFREG | 0444;
+    idata->i_nlinks = 1;
+
+    /* the size is known only after generating the contents */
+    struct procfs_buf pb;
+    ret = procfs_render(ino, &pb);
+    if (ret) return ret;
+    idata->i_size = pb.pb_len;
+    kfree(pb.pb_buf);
+    return 0;
+}
+
+static int procfs_read_inode(mountnode *sb, inode_t ino, off_t pos,
+                             char *buf, size_t buflen, size_t *written)
+{
+    struct procfs_buf pb;
+    int ret = procfs_render(ino, &pb);
+    if (ret) return ret;
+
+    size_t nread = 0;
+    if ((pos >= 0) && ((size_t)pos < pb.pb_len)) {
+        nread = pb.pb_len - pos;
+        if (nread > buflen)
+            nread = buflen;
+        memcpy(buf, pb.pb_buf + pos, nread);
+    }
+    kfree(pb.pb_buf);
+
+    if (written) *written = nread;
+    return 0;
+}
+
+static int procfs_lookup_inode(mountnode *sb, inode_t *result, const char *path, size_t pathlen) {
+    const char *end = path;
+    while (((size_t)(end - path) < pathlen) && *end && (*end != FS_SEP))
+        ++end;
+    size_t len = end - path;
+
+    if (len == 0) {
+        if (result) *result = PROCFS_ROOT_INO;
+        return 0;
+    }
+
+    const struct procfs_entry *entries = procfs_root_entries;
+    size_t n_entries = N_ROOT_ENTRIES;
+    pid_t pid = 0;
+    size_t i;
+
+    if (('0' <= path[0]) && (path[0] <= '9')) {
+        for (i = 0; i < len; ++i) {
+            if (!(('0' <= path[i]) && (path[i] <= '9')))
+                return ENOENT;
+            pid = pid * 10 + (path[i] - '0');
+            if (pid > PID_MAX)
+                return ENOENT;
+        }
+        if (!proc_by_pid(pid))
+            return ENOENT;
+
+        /* skip separators */
+        while (((size_t)(end - path) < pathlen) && (*end == FS_SEP))
+            ++end;
+        pathlen -= (end - path);
+        path = end;
+
+        end = path;
+        while (((size_t)(end - path) < pathlen) && *end && (*end != FS_SEP))
+            ++end;
+        len = end - path;
+
+        if (len == 0) {
+            if (result) *result = PROCFS_INO(pid, PROCFS_DIR);
+            return 0;
+        }
+        entries = procfs_pid_entries;
+        n_entries = N_PID_ENTRIES;
+    }
+
+    for (i = 0; i < n_entries; ++i) {
+        if (strlen(entries[i].name) != len)
+            continue;
+        if (strncmp(entries[i].name, path, len))
+            continue;
+
+        /* a file cannot have children */
+        if (((size_t)(end - path) < pathlen) && (*end == FS_SEP) && end[1])
+            return ENOTDIR;
+
+        if (result) *result = PROCFS_INO(pid, PROCFS_FIRST_FILE + i);
+        return 0;
+    }
+    return ENOENT;
+}
+
+static void procfs_fill_dirent(struct dirent *de, inode_t ino, const char *name, uint8_t type) {
+    de->d_ino = ino;
+    de->d_type = type;
+    de->d_namlen = strlen(name);
+    strncpy(de->d_name, name, UCHAR_MAX);
+    de->d_reclen = sizeof(struct dirent) - UCHAR_MAX + de->d_namlen + 1;
+}
+
+static int procfs_get_direntry(mountnode *sb, inode_t ino, void **iter, struct dirent *de) {
+    process_t *proc;
+    const struct procfs_entry *entry;
+    int ret = procfs_resolve(ino, &proc, &entry);
+    if (ret) return ret;
+    if (entry) return ENOTDIR;
+
+    pid_t pid = PROCFS_INO_PID(ino);
+    const struct procfs_entry *entries = (pid ? procfs_pid_entries : procfs_root_entries);
+    size_t n_entries = (pid ? N_PID_ENTRIES : N_ROOT_ENTRIES);
+
+    size_t pos = (size_t)*iter;
+    if (pos == 0) {
+        procfs_fill_dirent(de, ino, ".", DT_DIR);
+    } else if (pos == 1) {
+        procfs_fill_dirent(de, PROCFS_ROOT_INO, "..", DT_DIR);
+    } else if (pos < 2 + n_entries) {
+        size_t i = pos - 2;
+        procfs_fill_dirent(de, PROCFS_INO(pid, PROCFS_FIRST_FILE + i),
+                           entries[i].name, DT_REG);
+    } else if (pos >= PROCFS_POS_PIDS) {
+        char name[16];
+        pid_t dirpid = pos - PROCFS_POS_PIDS;
+        snprintf(name, sizeof(name), "%d", dirpid);
+        procfs_fill_dirent(de, PROCFS_INO(dirpid, PROCFS_DIR), name, DT_DIR);
+    } else {
+        return ENOENT;
+    }
+
+    /* the next position */
+    if (pos + 1 < 2 + n_entries) {
+        ++pos;
+    } else if (pid) {
+        pos = 0;
+    } else {
+        pid_t next = proc_next_pid((pos >= PROCFS_POS_PIDS) ? (pid_t)(pos - PROCFS_POS_PIDS) : 0);
+        pos = (next ? PROCFS_POS_PIDS + next : 0);
+    }
+    *iter = (void *)pos;
+    return 0;
+}
+
+
+struct filesystem_operations  procfs_fsops = {
+    .read_superblock    = procfs_read_superblock,
+    .lookup_inode       = procfs_lookup_inode,
+    .get_direntry       = procfs_get_direntry,
+    .inode_get          = procfs_inode_get,
+    .read_inode         = procfs_read_inode,
+};
+
+struct filesystem_driver  procfs_driver = {
+    .name = "procfs",
+    .fs_id = PROCFS_ID,
+    .ops = &procfs_fsops,
+    .lst = { 0 },
+};
+
+fsdriver * procfs_fs_driver(void) {
+    return &procfs_driver;
+}
@@ -8,195 +8,198 @@
 #include "conf.h"
 #include "mem/kheap.h"
 #include "mem/pmem.h"
+#include "misc/bitmap.h"
 #include "fs/ramfs.h"
 
-typedef void (*btree_leaf_free_f)(void *);
+typedef void (*idtree_leaf_free_f)(void *arg, void *leaf);
 
-/* this structure is a "hierarchical" lookup table from any large index to some pointer */
-struct btree_node {
-    int     bt_level;       /* if 0, bt_children are leaves */
-    size_t  bt_fanout;      /* how many children for a node */
-    size_t  bt_used;        /* how many non-NULL children are there */
-    void *  bt_children[0]; /* child BTree nodes or leaves */
+/*
+ *  An ID allocator: a radix tree from an index to a pointer.
+ *  Every node has a bitmap of its slots that are full: a used leaf slot
+ *  or a subtree without free indexes, so the lowest free index is found
+ *  in `it_height` steps. Empty nodes are freed, the tree shrinks back
+ *  when only its first subtree is used.
+ */
+#define IDTREE_SHIFT    6
+#define IDTREE_SLOTS    (1 << IDTREE_SHIFT)
+#define IDTREE_MASK     (IDTREE_SLOTS - 1)
+#define IDTREE_MAX_HEIGHT   5       /* 2^30 indexes */
+
+struct idtree_node {
+    bitmap_word_t it_full[ BITMAP_WORDS(IDTREE_SLOTS) ];
+    count_t it_count;           /* how many non-NULL slots are there */
+    void *  it_slots[ IDTREE_SLOTS ];   /* child nodes or leaves */
 };
 
-/* mallocs and initializes a btree_node with bt_level = 0 */
-static struct btree_node * btree_new(size_t fanout);
-
-/* frees a bnode and all its children */
-static void btree_free(struct btree_node *bnode, btree_leaf_free_f free_leaf);
-
-/* look up a value by index */
-static void * btree_get_index(struct btree_node *bnode, size_t index);
-
-/* sets an existing index to `idata` */
-static inode_t btree_set_leaf(struct btree_node *bnode, struct inode *idata);
-
+struct idtree {
+    struct idtree_node *it_root;
+    uint    it_height;          /* 0 if there is no it_root */
+};
 
-static struct btree_node * btree_new(size_t fanout) {
-    size_t bchildren_len = sizeof(void *) * fanout;
-    struct btree_node *bnode = kmalloc(sizeof(struct btree_node) + bchildren_len);
-    if (!bnode) return NULL;
+static inline uint idtree_slot(index_t index, uint level) {
+    return (index >> (level * IDTREE_SHIFT)) & IDTREE_MASK;
+}
 
-    bnode->bt_level = 0;
-    bnode->bt_used = 0;
-    bnode->bt_fanout = fanout;
-    memset(&(bnode->bt_children), 0, bchildren_len);
+static inline bool idtree_node_full(const struct idtree_node *node) {
+    return bitmap_find_zero(node->it_full, IDTREE_SLOTS, 0) == IDTREE_SLOTS;
+}
 
-    logmsgdf("btree_new(%d) -> *%x\n", fanout, (uint)bnode);
-    return bnode;
+static struct idtree_node * idtree_node_new(void) {
+    struct idtree_node *node = kmalloc(sizeof(struct idtree_node));
+    if (!node) return NULL;
+    memset(node, 0, sizeof(struct idtree_node));
+    return node;
 }
 
-static void btree_free(struct btree_node *bnode, btree_leaf_free_f free_leaf) {
+/* frees the nodes of the subtree and its leaves with `free_leaf` */
+static void idtree_node_free(struct idtree_node *node, uint height,
+                             idtree_leaf_free_f free_leaf, void *arg)
+{
     size_t i;
-    for (i = 0; i < bnode->bt_fanout; ++i) {
-        if (bnode->bt_level == 0) {
-            struct inode *idata = bnode->bt_children[i];
-            if (idata && (idata != &theInvalidInode))
-                if (free_leaf) free_leaf(idata);
-        } else {
-            struct btree_node *bchild = bnode->bt_children[i];
-            if (bchild)
-                btree_free(bchild, free_leaf);
-        }
+    for (i = 0; i < IDTREE_SLOTS; ++i) {
+        void *child = node->it_slots[i];
+        if (!child) continue;
+
+        if (height > 1)
+            idtree_node_free(child, height - 1, free_leaf, arg);
+        else if (free_leaf)
+            free_leaf(arg, child);
     }
+    kfree(node);
 }
 
-/* get leaf or NULL for index */
-static void * btree_get_index(struct btree_node *bnode, size_t index) {
-    int i;
-    int btree_lvl = bnode->bt_level;
-    size_t fanout = bnode->bt_fanout;
-    size_t btsize = fanout;
+static void idtree_free(struct idtree *tree, idtree_leaf_free_f free_leaf, void *arg) {
+    if (tree->it_root)
+        idtree_node_free(tree->it_root, tree->it_height, free_leaf, arg);
+    tree->it_root = NULL;
+    tree->it_height = 0;
+}
 
-    for (i = 0; i < btree_lvl; ++i)
-        btsize *= fanout;
+/* look up a value by index */
+static void * idtree_find(const struct idtree *tree, index_t index) {
+    struct idtree_node *node = tree->it_root;
+    if (!node) return NULL;
 
-    if (btsize <= index)
+    if (index >> (tree->it_height * IDTREE_SHIFT))
         return NULL;
 
-    /* get btree item */
-    while (btree_lvl-- > 0) {
-        btsize /= fanout;
-        size_t this_node_index = index / btsize;
-        index %= btsize;
-
-        struct btree_node *subnode = bnode->bt_children[ this_node_index ];
-        if (!subnode) return NULL;
-        bnode = subnode;
+    uint level = tree->it_height - 1;
+    for (; level > 0; --level) {
+        node = node->it_slots[ idtree_slot(index, level) ];
+        if (!node) return NULL;
     }
-    return bnode->bt_children[ index ];
+    return node->it_slots[ idtree_slot(index, 0) ];
 }
 
 /*
- *      Searches B-tree for a free leaf,
- *      returns 0 if no free leaves found.
- *      0 index must be taken by an "invalid" entry.
+ *      Stores `leaf` at the lowest free index.
  */
-static inode_t btree_set_leaf(struct btree_node *bnode, struct inode *idata) {
-    const char *funcname = "btree_set_leaf";
+static int idtree_alloc(struct idtree *tree, void *leaf, index_t *result) {
+    struct idtree_node *path[IDTREE_MAX_HEIGHT];
 
-    size_t i;
-    size_t fanout = bnode->bt_fanout;
-    if (bnode->bt_level == 0) {
-        if (bnode->bt_used < fanout) {
-            for (i = 0; i < fanout; ++i)
-                if (bnode->bt_children[i] == NULL) {
-                    ++bnode->bt_used;
-                    bnode->bt_children[i] = idata;
-
-                    logmsgdf("%s(%d) to *%x, bnode=*%x, bt_used=%d\n",
-                             funcname, i, (uint)idata, (uint)bnode, bnode->bt_used);
-                    return i;
-                }
-        } else {
-            /* no free leaves here */
-            logmsgdf("no free leaves here\n");
-            return 0;
-        }
-    } else {
-        /* search in subnodes */
-        for (i = 0; i < fanout; ++i) {
-            struct btree_node *bchild = bnode->bt_children[i];
-            if (!bchild) continue;
-
-            int res = btree_set_leaf(bchild, idata);
-            if (res > 0) {
-                int j = bnode->bt_level;
-                size_t index_offset = 1;
-                while (j-- > 0)
-                    index_offset *= fanout;
-                res += i * index_offset;
-                return res;
-            }
+    if (!tree->it_root) {
+        tree->it_root = idtree_node_new();
+        if (!tree->it_root) return ENOMEM;
+        tree->it_height = 1;
+    }
+
+    if (idtree_node_full(tree->it_root)) {
+        /* grow up a level, the old root becomes the first subtree */
+        if (tree->it_height >= IDTREE_MAX_HEIGHT)
+            return ENOSPC;
+
+        struct idtree_node *root = idtree_node_new();
+        if (!root) return ENOMEM;
+        root->it_slots[0] = tree->it_root;
+        root->it_count = 1;
+        bitmap_set(root->it_full, 0);
+
+        tree->it_root = root;
+        ++tree->it_height;
+    }
+
+    struct idtree_node *node = tree->it_root;
+    index_t index = 0;
+    uint level = tree->it_height - 1;
+    for (;;) {
+        size_t slot = bitmap_find_zero(node->it_full, IDTREE_SLOTS, 0);
+        index |= slot << (level * IDTREE_SHIFT);
+        path[level] = node;
+        if (level == 0)
+            break;
+
+        struct idtree_node *child = node->it_slots[slot];
+        if (!child) {
+            child = idtree_node_new();
+            if (!child) return ENOMEM;
+            node->it_slots[slot] = child;
+            ++node->it_count;
         }
+        node = child;
+        --level;
     }
+
+    node->it_slots[ idtree_slot(index, 0) ] = leaf;
+    ++node->it_count;
+
+    /* mark the full subtrees */
+    for (level = 0; level < tree->it_height; ++level) {
+        node = path[level];
+        bitmap_set(node->it_full, idtree_slot(index, level));
+        if (!idtree_node_full(node))
+            break;
+    }
+
+    *result = index;
     return 0;
 }
 
-/*
- *      Searches for a place for a new leaf with btree_set_leaf()
- *      if no free leaves:
- *          grows up a node level,
- *          old root becomes new_root[0],
- *          grows down to level 0 from new_root[1] and inserts idata there.
- *          *btree_root redirected to new_root.
- *
- *      Do not use with an empty btree, since index 0 must be invalid!
- */
-static inode_t btree_new_leaf(struct btree_node **btree_root, struct inode *idata) {
-    logmsgdf("btree_new_leaf(idata=*%x)\n", (uint)idata);
-
-    int res = btree_set_leaf(*btree_root, idata);
-    if (res > 0) return res;
-
-    logmsgdf("btree_new_leaf: adding a new level\n");
-    struct btree_node *old_root = *btree_root;
-    int lvl = old_root->bt_level + 1;
-    size_t fanout = old_root->bt_fanout;
-
-    struct btree_node *new_root = NULL;
-    struct btree_node *new_node = NULL;
-
-    new_root = btree_new(fanout);
-    if (!new_root) return 0;
-    new_root->bt_level = old_root->bt_level + 1;
-
-    new_root->bt_children[0] = old_root;
-    ++new_root->bt_used;
-
-    old_root = NULL;
-    res = 1;
-    while (lvl-- > 0) {
-        new_node = btree_new(fanout);
-        if (!new_root) {
-            /* unwind new_root[1] and free all its subnodes */
-            if (new_root->bt_children[1])
-                /* newly created bnode do not need free_leaf() */
-                btree_free(new_root->bt_children[1], NULL);
-            return 0;
-        }
+static int idtree_remove(struct idtree *tree, index_t index) {
+    struct idtree_node *path[IDTREE_MAX_HEIGHT];
+    struct idtree_node *node = tree->it_root;
+    if (!node || !idtree_find(tree, index))
+        return ENOENT;
 
-        if (old_root) {
-            old_root->bt_children[0] = new_node;
-            ++old_root->bt_used;
-        } else {
-            new_root->bt_children[1] = new_node;
-            ++new_root->bt_used;
-        }
-        old_root = new_node;
-        res *= fanout;
+    uint level = tree->it_height - 1;
+    for (;;) {
+        path[level] = node;
+        if (level == 0)
+            break;
+        node = node->it_slots[ idtree_slot(index, level) ];
+        --level;
     }
 
-    *btree_root = new_root;
-    return res;
-}
+    /* every node on the path has a free slot now; empty ones are freed */
+    bool empty = false;
+    for (level = 0; level < tree->it_height; ++level) {
+        node = path[level];
+        uint slot = idtree_slot(index, level);
+        bitmap_clear(node->it_full, slot);
+        if ((level == 0) || empty) {
+            node->it_slots[slot] = NULL;
+            --node->it_count;
+        }
+
+        empty = (node->it_count == 0) && (level + 1 < tree->it_height);
+        if (empty)
+            kfree(node);
+    }
 
-static int btree_free_leaf(struct btree_node *bnode, inode_t index) {
-    /* find the 0 level bnode */
-    /* set index to NULL */
-    /* if bt_used drops to 0, delete the bnode */
-    return ETODO;
+    /* shrink while only the first subtree is used */
+    while ((tree->it_height > 1)
+           && (tree->it_root->it_count == 1) && tree->it_root->it_slots[0])
+    {
+        struct idtree_node *root = tree->it_root;
+        tree->it_root = root->it_slots[0];
+        --tree->it_height;
+        kfree(root);
+    }
+    if (tree->it_root->it_count == 0) {
+        kfree(tree->it_root);
+        tree->it_root = NULL;
+        tree->it_height = 0;
+    }
+    return 0;
 }
 
 
@@ -204,7 +207,8 @@ static int btree_free_leaf(struct btree_node *bnode, inode_t index) {
  *  ramfs
  */
 
-static int ramfs_read_superblock(mountnode *sb);
+static int ramfs_read_superblock(mountnode *sb, const mount_opts_t *opts);
+static int ramfs_get_usage(mountnode *sb, struct fs_usage *usage);
 static int ramfs_lookup_inode(mountnode *sb, inode_t *ino, const char *path, size_t pathlen);
 static int ramfs_make_directory(mountnode *sb, inode_t *ino, const char *path, mode_t mode);
 static int ramfs_get_direntry(mountnode *sb, inode_t dirnode, void **iter, struct dirent *dirent);
@@ -214,29 +218,36 @@ static int ramfs_link_inode(mountnode *sb, inode_t ino, inode_t dirino, const ch
 static int ramfs_unlink_inode(mountnode *sb, const char *path, size_t pathlen);
 static int ramfs_inode_get(mountnode *sb, inode_t ino, struct inode *idata);
 static int ramfs_inode_set(mountnode *sb, inode_t ino, struct inode *idata);
+static struct inode * ramfs_inode_incore(mountnode *sb, inode_t ino);
 static int ramfs_read_inode(mountnode *sb, inode_t ino, off_t pos,
                             char *buf, size_t buflen, size_t *written);
 static int ramfs_write_inode(mountnode *sb, inode_t ino, off_t pos,
                              const char *buf, size_t buflen, size_t *written);
-static int ramfs_trunc_inode(/*mountnode *sb, inode_t ino, off_t length*/);
+static int ramfs_trunc_inode(mountnode *sb, inode_t ino, off_t length);
+static int ramfs_inode_page(mountnode *sb, struct inode *idata, index_t index,
+                            bool create, char **page);
 
-static void ramfs_inode_free(struct inode *idata);
-static void ramfs_free_inode_blocks(struct inode *idata);
+static void ramfs_inode_free(mountnode *sb, struct inode *idata);
+static void ramfs_free_inode_blocks(mountnode *sb, struct inode *idata);
 
 
 struct filesystem_operations  ramfs_fsops = {
     .read_superblock    = ramfs_read_superblock,
+    .get_usage          = ramfs_get_usage,
     .lookup_inode       = ramfs_lookup_inode,
     .make_directory     = ramfs_make_directory,
     .get_direntry       = ramfs_get_direntry,
     .make_inode         = ramfs_make_node,
+    .free_inode         = ramfs_free_inode,
     .link_inode         = ramfs_link_inode,
     .unlink_inode       = ramfs_unlink_inode,
     .inode_get          = ramfs_inode_get,
     .inode_set          = ramfs_inode_set,
+    .inode_incore       = ramfs_inode_incore,
     .read_inode         = ramfs_read_inode,
     .write_inode        = ramfs_write_inode,
     .trunc_inode        = ramfs_trunc_inode,
+    .inode_page         = ramfs_inode_page,
 };
 
 struct filesystem_driver  ramfs_driver = {
@@ -252,32 +263,67 @@ fsdriver * ramfs_fs_driver(void) {
 
 
 
+/*
+ *  ramfs directories
+ *
+ *  A directory is a hashtable of its entries. When it has more than
+ *  RAMFS_DIR_LOAD entries per bucket, a twice larger table is allocated
+ *  and every following operation moves RAMFS_DIR_REHASH_STEP buckets of
+ *  the old table into it, so no single insert rehashes the whole
+ *  directory. Lookups check both tables meanwhile.
+ *  Entries are also listed in creation order: ramfs_get_direntry()
+ *  follows that list, so rehashing does not change the iteration order.
+ *  Its cursor is the creation number of the next entry: names may share
+ *  a hash, these numbers do not.
+ */
+#define RAMFS_DIR_INITIAL_CAP   8       /* a power of 2 */
+#define RAMFS_DIR_LOAD          2
+#define RAMFS_DIR_REHASH_STEP   4
+
 /* this is a directory hashtable array entry */
 /* it is an intrusive list */
 struct ramfs_direntry {
     uint32_t  de_hash;
     char     *de_name;          /* its length should be a power of 2 */
     inode_t   de_ino;           /* the actual value, inode_t */
+    uint32_t  de_seq;           /* creation number in the directory, from 1 */
 
     struct ramfs_direntry *htnext;  /* next in hashtable collision list */
+    struct ramfs_direntry *de_prev; /* the list in creation order */
+    struct ramfs_direntry *de_next;
 };
 
 /* this is a container for directory hashtable */
 struct ramfs_directory {
     size_t size;                /* number of values in the hashtable */
-    size_t htcap;               /* hashtable capacity */
+    size_t htcap;               /* hashtable capacity, a power of 2 */
     struct ramfs_direntry **ht; /* hashtable array */
+
+    size_t oldcap;
+    struct ramfs_direntry **oldht;  /* being moved to ht if not NULL */
+    size_t rehash_index;        /* the next oldht bucket to move */
+
+    struct ramfs_direntry *first;   /* the oldest entry */
+    struct ramfs_direntry *last;
+    uint32_t last_seq;          /* de_seq of the newest entry ever */
+
+    struct ramfs_direntry *cursor;  /* where the last readdir stopped */
 };
 
+static inline struct ramfs_direntry **
+ramfs_directory_bucket(struct ramfs_direntry **ht, size_t htcap, uint32_t hash) {
+    return &ht[ hash & (htcap - 1) ];
+}
+
 
 static int ramfs_directory_new(struct ramfs_directory **dir) {
     const char *funcname = "ramfs_directory_new";
 
     struct ramfs_directory *d = kmalloc(sizeof(struct ramfs_directory));
     if (!d) goto enomem_exit;
+    memset(d, 0, sizeof(struct ramfs_directory));
 
-    d->size = 0;
-    d->htcap = 8;
+    d->htcap = RAMFS_DIR_INITIAL_CAP;
     size_t htlen = d->htcap * sizeof(void *);
     d->ht = kmalloc(htlen);
     if (!d->ht) goto enomem_exit;
@@ -293,33 +339,101 @@ enomem_exit:
     return ENOMEM;
 }
 
-static int ramfs_directory_insert(struct ramfs_directory *dir,
-                                  struct ramfs_direntry *de)
-{
-    size_t ht_index = de->de_hash % dir->htcap;
-    struct ramfs_direntry *bucket = dir->ht[ ht_index ];
-    /* TODO: possibly rebalance */
-    if (bucket) {
-        while (true) {
-            if (bucket->de_hash == de->de_hash) {
-                if (!strcmp(bucket->de_name, de->de_name))
-                    return EEXIST;
-                else
-                    logmsgef("hash collision detected: '%s'/'%s' both hash to 0x%x\n",
-                              bucket->de_name, de->de_name, de->de_hash);
-            }
+/* moves up to `nbuckets` buckets of dir->oldht to dir->ht */
+static void ramfs_directory_rehash(struct ramfs_directory *dir, size_t nbuckets) {
+    if (!dir->oldht)
+        return;
+
+    while (nbuckets-- > 0) {
+        if (dir->rehash_index >= dir->oldcap) {
+            kfree(dir->oldht);
+            dir->oldht = NULL;
+            dir->oldcap = 0;
+            return;
+        }
 
-            if (!bucket->htnext)
-                break;
-            bucket = bucket->htnext;
+        struct ramfs_direntry *de = dir->oldht[ dir->rehash_index ];
+        dir->oldht[ dir->rehash_index++ ] = NULL;
+        while (de) {
+            struct ramfs_direntry *next = de->htnext;
+            struct ramfs_direntry **bucket =
+                    ramfs_directory_bucket(dir->ht, dir->htcap, de->de_hash);
+            de->htnext = *bucket;
+            *bucket = de;
+            de = next;
         }
-        bucket->htnext = de;
-    } else {
-        dir->ht[ ht_index ] = de;
     }
-    de->htnext = NULL;
+}
+
+/* starts moving to a twice larger table if the load is too high */
+static void ramfs_directory_grow(struct ramfs_directory *dir) {
+    const char *funcname = __FUNCTION__;
+    if (dir->oldht || (dir->size < RAMFS_DIR_LOAD * dir->htcap))
+        return;
+
+    size_t htcap = 2 * dir->htcap;
+    struct ramfs_direntry **ht = kmalloc(htcap * sizeof(void *));
+    returnv_err_if(!ht, "%s: kmalloc failed, size=%d", funcname, dir->size);
+    memset(ht, 0, htcap * sizeof(void *));
+
+    dir->oldht = dir->ht;
+    dir->oldcap = dir->htcap;
+    dir->rehash_index = 0;
+    dir->ht = ht;
+    dir->htcap = htcap;
+    logmsgdf("%s(*%x): %d entries, htcap=%d\n", funcname, (uint)dir, dir->size, htcap);
+}
+
+/* the link to the entry, or to the end of its bucket if there is none */
+static struct ramfs_direntry ** ramfs_directory_link(
+        struct ramfs_directory *dir, uint32_t hash, const char *name, size_t namelen)
+{
+    struct ramfs_direntry **link = NULL;
+
+    if (dir->oldht) {
+        link = ramfs_directory_bucket(dir->oldht, dir->oldcap, hash);
+        for (; *link; link = &(*link)->htnext)
+            if (((*link)->de_hash == hash)
+                && !strncmp(name, (*link)->de_name, namelen)
+                && ((*link)->de_name[namelen] == '\0'))
+                return link;
+    }
+
+    link = ramfs_directory_bucket(dir->ht, dir->htcap, hash);
+    for (; *link; link = &(*link)->htnext)
+        if (((*link)->de_hash == hash)
+            && !strncmp(name, (*link)->de_name, namelen)
+            && ((*link)->de_name[namelen] == '\0'))
+            return link;
+    return link;
+}
+
+static int ramfs_directory_insert(struct ramfs_directory *dir,
+                                  struct ramfs_direntry *de)
+{
+    ramfs_directory_rehash(dir, RAMFS_DIR_REHASH_STEP);
+
+    struct ramfs_direntry **link =
+            ramfs_directory_link(dir, de->de_hash, de->de_name, strlen(de->de_name));
+    if (*link)
+        return EEXIST;
+
+    /* new entries always go to the new table */
+    struct ramfs_direntry **bucket = ramfs_directory_bucket(dir->ht, dir->htcap, de->de_hash);
+    de->htnext = *bucket;
+    *bucket = de;
+
+    de->de_seq = ++dir->last_seq;
+    de->de_next = NULL;
+    de->de_prev = dir->last;
+    if (dir->last)
+        dir->last->de_next = de;
+    else
+        dir->first = de;
+    dir->last = de;
 
     ++dir->size;
+    ramfs_directory_grow(dir);
     return 0;
 }
 
@@ -358,39 +472,32 @@ static int ramfs_directory_delete_entry(
 {
     UNUSED(sb);
     const char *funcname = "ramfs_directory_delete_entry";
-    int ret;
 
-    struct ramfs_direntry *de, *prev_de;
+    namelen = strnlen(name, namelen);
+    uint32_t hash = strhash(name, namelen);
 
-    uint32_t hash = strhash(name, strnlen(name, namelen));
+    ramfs_directory_rehash(dir, RAMFS_DIR_REHASH_STEP);
 
-    de = dir->ht[ hash % dir->htcap ];
+    struct ramfs_direntry **link = ramfs_directory_link(dir, hash, name, namelen);
+    struct ramfs_direntry *de = *link;
     return_dbg_if(!de, ENOENT, "%s(%s): ENOENT\n", funcname, name);
 
-    if ((de->de_hash == hash) && !strcmp(de->de_name, name)) {
-        dir->ht[ hash % dir->htcap ] = de->htnext;
-        -- dir->size;
-        /* TODO : possibly rebalance */
-
-        ramfs_direntry_free(de);
-        return 0;
-    }
-
-    while (de->htnext) {
-        prev_de = de;
-        de = de->htnext;
-
-        if (de->de_hash == hash && !strcmp(name, de->de_name)) {
-            prev_de->htnext = de->htnext;
-            -- dir->size;
-            /* TODO: possibly rebalance */
-
-            ramfs_direntry_free(de);
-            return 0;
-        }
-    }
-
-    return ENOENT;
+    *link = de->htnext;
+
+    if (dir->cursor == de)
+        dir->cursor = de->de_next;
+    if (de->de_prev)
+        de->de_prev->de_next = de->de_next;
+    else
+        dir->first = de->de_next;
+    if (de->de_next)
+        de->de_next->de_prev = de->de_prev;
+    else
+        dir->last = de->de_prev;
+
+    -- dir->size;
+    ramfs_direntry_free(de);
+    return 0;
 }
 
 /*
@@ -403,43 +510,51 @@ static int ramfs_directory_search(
     logmsgdf("%s(dir=*%x, basename='%s'[:%d]\n",
              funcname, (uint)dir, basename, basename_len);
 
-    uint32_t hash = strhash(basename, strnlen(basename, basename_len));
+    basename_len = strnlen(basename, basename_len);
+    uint32_t hash = strhash(basename, basename_len);
 
-    /* directory hashtable: get direntry */
-    struct ramfs_direntry *de = dir->ht[ hash % dir->htcap ];
+    ramfs_directory_rehash(dir, RAMFS_DIR_REHASH_STEP);
 
-    while (de) {
-        if ((de->de_hash == hash)
-            && !strncmp(basename, de->de_name, basename_len))
-        {
-            if (ino) *ino = de->de_ino;
-            return 0;
-        }
-        de = de->htnext;
+    struct ramfs_direntry *de = *ramfs_directory_link(dir, hash, basename, basename_len);
+    if (de) {
+        if (ino) *ino = de->de_ino;
+        return 0;
     }
 
     if (ino) *ino = 0;
     return ENOENT;
 }
 
+/*
+ *  Finds the oldest entry created not before `seq`, for ramfs_get_direntry()
+ *  iterators. Sequential listings find it at dir->cursor, others walk the
+ *  list; an entry deleted meanwhile is skipped, not an error.
+ */
+static struct ramfs_direntry *
+ramfs_directory_by_seq(struct ramfs_directory *dir, uint32_t seq) {
+    struct ramfs_direntry *de = dir->cursor;
+    if (de && (de->de_seq == seq))
+        return de;
+
+    for (de = dir->first; de; de = de->de_next)
+        if (de->de_seq >= seq)
+            return de;
+    return NULL;
+}
+
 static void ramfs_directory_free(struct ramfs_directory *dir) {
     const char *funcname = "ramfs_directory_free";
     logmsgdf("%s(*%x)\n", funcname, (uint)dir);
-    size_t i;
 
-    for (i = 0; i < dir->htcap; ++i) {
-        struct ramfs_direntry *bucket = dir->ht[ i ];
-        if (!bucket) continue;
-
-        struct ramfs_direntry *nextbucket = NULL;
-        while (bucket) {
-            nextbucket = bucket->htnext;
-            kfree(bucket->de_name);
-            kfree(bucket);
-            bucket = nextbucket;
-        }
+    struct ramfs_direntry *de = dir->first;
+    while (de) {
+        struct ramfs_direntry *next = de->de_next;
+        ramfs_direntry_free(de);
+        de = next;
     }
 
+    if (dir->oldht)
+        kfree(dir->oldht);
     kfree(dir->ht);
     kfree(dir);
 }
@@ -447,33 +562,42 @@ static void ramfs_directory_free(struct ramfs_directory *dir) {
 
 /* used by struct superblock as `data` pointer to store FS-specific state */
 struct ramfs_data {
-    struct btree_node *inodes_btree;  /* map from inode_t to struct inode */
+    struct idtree inodes;       /* map from inode_t to struct inode */
+
+    count_t rd_pages;           /* data and block map pages taken */
+    count_t rd_max_pages;       /* 0 if not limited */
+    count_t rd_inodes;
+    count_t rd_max_inodes;      /* 0 if not limited */
 };
 
 static int ramfs_data_new(mountnode *sb) {
+    int ret;
     struct ramfs_data *data = kmalloc(sizeof(struct ramfs_data));
     if (!data) return ENOMEM;
+    memset(data, 0, sizeof(struct ramfs_data));
 
-    /* a B-tree that maps inode indexes to actual inodes */
-    struct btree_node *bnode = btree_new(64);
-    if (!bnode) {
-        kfree(data);
-        return ENOMEM;
-    }
     /* fill inode 0 */
+    inode_t ino;
     theInvalidInode.i_no = 0;
-    btree_set_leaf(bnode, &theInvalidInode);
-
-    data->inodes_btree = bnode;
+    ret = idtree_alloc(&data->inodes, &theInvalidInode, &ino);
+    if (ret) {
+        kfree(data);
+        return ret;
+    }
 
     sb->sb_data = data;
     return 0;
 }
 
+static void ramfs_inode_free_leaf(void *sb, void *idata) {
+    if (idata != &theInvalidInode)
+        ramfs_inode_free(sb, idata);
+}
+
 static void ramfs_data_free(mountnode *sb) {
     struct ramfs_data *data = sb->sb_data;
 
-    btree_free(data->inodes_btree, (btree_leaf_free_f)ramfs_inode_free);
+    idtree_free(&data->inodes, ramfs_inode_free_leaf, sb);
 
     kfree(sb->sb_data);
     sb->sb_data = NULL;
@@ -484,6 +608,11 @@ static void ramfs_data_free(mountnode *sb) {
 static int ramfs_inode_new(mountnode *sb, struct inode **iref, mode_t mode) {
     int ret = 0;
     struct ramfs_data *data = sb->sb_data;
+    if (data->rd_max_inodes && (data->rd_inodes >= data->rd_max_inodes)) {
+        ret = ENOSPC;
+        goto error_exit;
+    }
+
     struct inode *idata = kmalloc(sizeof(struct inode));
     if (!idata) {
         ret = ENOMEM;
@@ -491,8 +620,13 @@ static int ramfs_inode_new(mountnode *sb, struct inode **iref, mode_t mode) {
     }
     memset(idata, 0, sizeof(struct inode));
 
-    idata->i_no = btree_new_leaf(&data->inodes_btree, idata);
+    ret = idtree_alloc(&data->inodes, idata, &idata->i_no);
+    if (ret) {
+        kfree(idata);
+        goto error_exit;
+    }
     idata->i_mode = mode;
+    ++data->rd_inodes;
 
     if (iref) *iref = idata;
     return 0;
@@ -502,7 +636,8 @@ error_exit:
     return ret;
 }
 
-static void ramfs_inode_free(struct inode *idata) {
+static void ramfs_inode_free(mountnode *sb, struct inode *idata) {
+    struct ramfs_data *data = sb->sb_data;
     const char *funcname = "ramfs_inode_free";
     logmsgdf("%s(idata=*%x, ino=%d)\n", funcname, idata, idata->i_no);
 
@@ -513,39 +648,16 @@ static void ramfs_inode_free(struct inode *idata) {
             ramfs_directory_free(idata->i_data);
         break;
       case S_IFREG:
-        ramfs_free_inode_blocks(idata);
+        ramfs_free_inode_blocks(sb, idata);
         break;
     }
     kfree(idata);
+    --data->rd_inodes;
 }
 
 static inode * ramfs_idata_by_inode(mountnode *sb, inode_t ino) {
     struct ramfs_data *data = sb->sb_data;
-
-    return btree_get_index(data->inodes_btree, ino);
-    int i;
-
-    struct btree_node *btnode = data->inodes_btree;
-    int btree_lvl = btnode->bt_level;
-    size_t btree_blksz = btnode->bt_fanout;
-
-    size_t last_ind = btree_blksz;
-    for (i = 0; i < btree_lvl; ++i) {
-        last_ind *= btree_blksz;
-    }
-
-    if (last_ind - 1 < ino)
-        return NULL; // ENOENT
-
-    /* get btree item */
-    while (btree_lvl > 0) {
-        size_t this_node_index = ino / last_ind;
-        ino = ino % last_ind;
-        struct btree_node *subnode = btnode->bt_children[ this_node_index ];
-        if (!subnode) return NULL;
-        btnode = subnode;
-    }
-    return btnode->bt_children[ ino ];
+    return idtree_find(&data->inodes, ino);
 }
 
 static int ramfs_inode_get(mountnode *sb, inode_t ino, struct inode *inobuf) {
@@ -555,7 +667,7 @@ static int ramfs_inode_get(mountnode *sb, inode_t ino, struct inode *inobuf) {
     idata = ramfs_idata_by_inode(sb, ino);
     if (!idata) return ENOENT;
 
-    memcpy(inobuf, idata, sizeof(struct inode));
+    inode_copy(inobuf, idata);
     return 0;
 }
 
@@ -566,14 +678,21 @@ static int ramfs_inode_set(mountnode *sb, inode_t ino, struct inode *inobuf) {
     idata = ramfs_idata_by_inode(sb, ino);
     if (!idata) return ENOENT;
 
-    memcpy(idata, inobuf, sizeof(struct inode));
+    inode_copy(idata, inobuf);
 
-    if ((inobuf->i_nlinks == 0) && (inobuf->i_nfds == 0))
+    if ((idata->i_nlinks == 0) && (idata->i_nfds == 0) && (idata->i_refs == 0))
         return ramfs_free_inode(sb, ino);
 
     return 0;
 }
 
+/* ramfs inodes live in memory, the inode cache pins them in place */
+static struct inode * ramfs_inode_incore(mountnode *sb, inode_t ino) {
+    if (ino == 0)
+        return NULL;
+    return ramfs_idata_by_inode(sb, ino);
+}
+
 
 static int ramfs_lookup_inode(mountnode *sb, inode_t *result, const char *path, size_t pathlen)
 {
@@ -713,7 +832,8 @@ static int ramfs_unlink_inode(mountnode *sb, const char *path, size_t pathlen) {
 
     -- idata->i_nlinks;
     logmsgdf("%s(%s): success, nlinks=%d\n", funcname, path, idata->i_nlinks);
-    if ((idata->i_nlinks > 0) || (idata->i_nfds > 0))
+    /* still in use: the last vfs_iput() frees it through .free_inode */
+    if ((idata->i_nlinks > 0) || (idata->i_nfds > 0) || (idata->i_refs > 0))
         return 0;
 
     /* delete the inode */
@@ -734,22 +854,17 @@ static int ramfs_make_directory(mountnode *sb, inode_t *ino, const char *path, m
     return_err_if(!path, EINVAL, "ramfs_make_directory(NULL)");
 
     ret = ramfs_inode_new(sb, &idata, S_IFDIR | mode);
-    logmsgdf("%s: ramfs_inode_new(), ino=%d, ret=%d\n", funcname, idata->i_no, ret);
     if (ret) return ret;
+    logmsgdf("%s: ramfs_inode_new(), ino=%d\n", funcname, idata->i_no);
 
     ret = ramfs_directory_new(&dir);
     if (ret) goto error_exit;
 
     if (path[0] == '\0') {
-        if (sb->sb_parent == NULL) {
-            /* it's a root mountpoint, '..' points to '.' */
-            ret = ramfs_directory_new_entry(sb, dir, "..", idata);
-            if (ret) goto error_exit;
-            ++idata->i_nlinks;
-        } else {
-            /* look up the parent directory inode */
-            logmsge("%s: TODO: lookup parent inode", funcname);
-        }
+        /* it's a mount root, '..' points to '.', the vfs crosses mountpoints */
+        ret = ramfs_directory_new_entry(sb, dir, "..", idata);
+        if (ret) goto error_exit;
+        ++idata->i_nlinks;
     } else {
         /* it's a subdirectory of a directory on the same device */
         if (!basename) /* it's a subdirectory of top directory */
@@ -794,7 +909,7 @@ static int ramfs_make_directory(mountnode *sb, inode_t *ino, const char *path, m
 
 error_exit:
     if (dir)    ramfs_directory_free(dir);
-    if (idata)  ramfs_inode_free(idata);
+    if (idata)  ramfs_free_inode(sb, idata->i_no);
 
     if (ino) *ino = 0;
     return ret;
@@ -829,15 +944,14 @@ static int ramfs_free_inode(mountnode *sb, inode_t ino) {
     idata = ramfs_idata_by_inode(sb, ino);
     if (!idata) return ENOENT;
 
-    ramfs_inode_free(idata);
+    ramfs_inode_free(sb, idata);
 
-    /* remove it from B-tree */
-    btree_free_leaf(fsdata->inodes_btree, ino);
-    return 0;
+    /* its index may be reused now */
+    return idtree_remove(&fsdata->inodes, ino);
 }
 
 
-static int ramfs_read_superblock(mountnode *sb) {
+static int ramfs_read_superblock(mountnode *sb, const mount_opts_t *opts) {
     const char *funcname = "ramfs_read_superblock";
     logmsgdf("%s()\n", funcname);
     int ret;
@@ -850,6 +964,11 @@ static int ramfs_read_superblock(mountnode *sb) {
 
     inode_t root_ino;
     struct ramfs_data *data = sb->sb_data;
+    if (opts) {
+        data->rd_max_pages = pagealign_up(opts->size) / PAGE_BYTES;
+        /* inode 0 is not counted */
+        data->rd_max_inodes = opts->nr_inodes;
+    }
 
     ret = ramfs_make_directory(sb, &root_ino, "", S_IFDIR | 0755);
     if (ret) {
@@ -866,6 +985,15 @@ enomem_exit:
     return ret;
 }
 
+static int ramfs_get_usage(mountnode *sb, struct fs_usage *usage) {
+    struct ramfs_data *data = sb->sb_data;
+    usage->fu_blocks = data->rd_pages;
+    usage->fu_max_blocks = data->rd_max_pages;
+    usage->fu_inodes = data->rd_inodes;
+    usage->fu_max_inodes = data->rd_max_inodes;
+    return 0;
+}
+
 
 static int ramfs_get_direntry(mountnode *sb, inode_t dirnode, void **iter, struct dirent *dirent) {
     const char *funcname = "ramfs_get_direntry";
@@ -881,21 +1009,16 @@ static int ramfs_get_direntry(mountnode *sb, inode_t dirnode, void **iter, struc
 
     struct ramfs_directory *dir = dir_idata->i_data;
 
-    uint32_t hash = (uint32_t)*iter;
-    size_t htindex = hash % dir->htcap;
-    struct ramfs_direntry *de = dir->ht[ htindex ];
+    uint32_t seq = (uint32_t)*iter;
+    struct ramfs_direntry *de;
 
-    if (hash) { /* search through bucket for the current hash */
-        while (de->de_hash != hash) {
-            return_err_if(!de->htnext, EKERN, "%s: no hash 0x%x in its bucket", funcname, hash);
-            de = de->htnext;
-        }
-    } else { /* start enumerating dirhashtable entries */
-        htindex = 0;
-        /* the directory must have at least . and .. entries,
-         * so the hashtable may not be empty: */
-        while (!(de = dir->ht[ htindex ]))
-            ++htindex;
+    if (seq) { /* continue from the entry created as `seq` */
+        de = ramfs_directory_by_seq(dir, seq);
+        return_dbg_if(!de, ENOENT, "%s: no entries since %d\n", funcname, seq);
+    } else { /* start enumerating from the oldest entry */
+        /* the directory must have at least . and .. entries */
+        de = dir->first;
+        return_err_if(!de, EKERN, "%s: an empty directory", funcname);
     }
 
     /* fill in the dirent */
@@ -923,21 +1046,13 @@ static int ramfs_get_direntry(mountnode *sb, inode_t dirnode, void **iter, struc
     } else logmsgef("%s: no idata for inode %d", funcname, dirent->d_ino);
 
     /* search next */
-    de = de->htnext;
+    de = de->de_next;
+    dir->cursor = de;
     if (de) {
-        *iter = (void *)de->de_hash;
+        *iter = (void *)de->de_seq;
         return 0;
     }
 
-    /* search for the next non-empty bucket */
-    while (++htindex < dir->htcap) {
-        de = dir->ht[ htindex ];
-        if (de) {
-            *iter = (void *)de->de_hash;
-            return 0;
-        }
-    }
-
     *iter = NULL; /* signal the end of the directory list */
     return 0;
 }
@@ -945,109 +1060,175 @@ static int ramfs_get_direntry(mountnode *sb, inode_t dirnode, void **iter, struc
 
 /*
  *  ramfs block management
+ *
+ *  Data pages of a regular file are leaves of a radix tree in i_data,
+ *  each node is a page of RAMFS_MAP_SLOTS pointers: a lookup takes
+ *  bm_height steps, a file may have holes and be as large as off_t allows.
  */
-inline static char * ramfs_new_block() {
-    return kmem_alloc(1);
+#define RAMFS_MAP_SHIFT     10
+#define RAMFS_MAP_SLOTS     (1 << RAMFS_MAP_SHIFT)     /* a page of pointers */
+#define RAMFS_MAP_MASK      (RAMFS_MAP_SLOTS - 1)
+
+struct ramfs_blockmap {
+    void      **bm_root;        /* a data page if bm_height is 0 */
+    uint        bm_height;
+};
+
+static inline bool ramfs_map_fits(uint height, index_t index) {
+    uint bits = height * RAMFS_MAP_SHIFT;
+    return (bits >= 32) || ((index >> bits) == 0);
 }
 
-static char * ramfs_block_by_index(struct inode *idata, off_t index) {
-    const char *funcname = __FUNCTION__;
+/* pmem cannot take most pages back, freed pages are kept here for all mounts */
+static char *theRamfsFreePages = NULL;
 
-    if (index < N_DIRECT_BLOCKS) {
-        return (char *)idata->as.reg.directblock[index];
-    }
+/* a zeroed page charged to `sb` or NULL if its limit is reached */
+static char * ramfs_new_block(mountnode *sb) {
+    struct ramfs_data *data = sb->sb_data;
+    char *blk;
 
-    const char *ind1blk = (const char *)idata->as.reg.indir1st_block;
-    if (!ind1blk)
+    if (data->rd_max_pages && (data->rd_pages >= data->rd_max_pages))
         return NULL;
 
-    if ((size_t)(index - N_DIRECT_BLOCKS) < PAGE_BYTES/sizeof(off_t)) {
-        return (char *)(size_t)ind1blk[index - N_DIRECT_BLOCKS];
+    if (theRamfsFreePages) {
+        blk = theRamfsFreePages;
+        theRamfsFreePages = *(char **)blk;
+    } else {
+        void *paddr = pmem_alloc(1);
+        if (!paddr) return NULL;
+        blk = __va(paddr);
     }
 
-    logmsgef("%s: index > N_DIRECT_BLOCKS+PAGE_BYTES/sizeof(off_t)", funcname);
-    return NULL;
+    memset(blk, 0, PAGE_BYTES);
+    ++data->rd_pages;
+    return blk;
+}
+
+static void ramfs_free_block(mountnode *sb, void *blk) {
+    struct ramfs_data *data = sb->sb_data;
+    --data->rd_pages;
+
+    *(char **)blk = theRamfsFreePages;
+    theRamfsFreePages = blk;
+}
+
+static char * ramfs_block_by_index(struct inode *idata, off_t index) {
+    struct ramfs_blockmap *map = idata->i_data;
+    if (!(map && map->bm_root && ramfs_map_fits(map->bm_height, index)))
+        return NULL;
+
+    void **node = map->bm_root;
+    uint level = map->bm_height;
+    while (node && (level-- > 0))
+        node = node[ (index >> (level * RAMFS_MAP_SHIFT)) & RAMFS_MAP_MASK ];
+    return (char *)node;
 }
 
-static char * ramfs_block_by_index_or_new(struct inode *idata, off_t index) {
+static char * ramfs_block_by_index_or_new(mountnode *sb, struct inode *idata, off_t index) {
     const char *funcname = __FUNCTION__;
-    char *blkdata;
-    off_t n_indblocks = PAGE_BYTES/sizeof(off_t);
-
-    if (index < N_DIRECT_BLOCKS) {
-        blkdata = (char *)idata->as.reg.directblock[index];
-        if (!blkdata) {
-            blkdata = ramfs_new_block();
-            idata->as.reg.directblock[index] = (off_t)blkdata;
-            ++idata->as.reg.block_count;
-
-            logmsgdf("%s: ino=%d, block %d set to *%x\n",
-                    funcname, idata->i_no, index, (uint)blkdata);
-        }
-        return blkdata;
+    struct ramfs_blockmap *map = idata->i_data;
+
+    if (!map) {
+        map = kmalloc(sizeof(struct ramfs_blockmap));
+        return_err_if(!map, NULL, "%s: kmalloc failed", funcname);
+        map->bm_root = NULL;
+        map->bm_height = 0;
+        idata->i_data = map;
     }
 
-    index -= N_DIRECT_BLOCKS;
-    if (index < n_indblocks) {
-        off_t *ind1blk = (off_t *)idata->as.reg.indir1st_block;
-        if (!ind1blk) {
-            ind1blk = (off_t *)ramfs_new_block();
-            idata->as.reg.indir1st_block = (off_t)ind1blk;
-            logmsgdf("%s: ino=%d, ind1st block set to *%x\n",
-                    funcname, idata->i_no, (uint)ind1blk);
+    /* grow the tree until `index` fits */
+    while (!ramfs_map_fits(map->bm_height, index)) {
+        void **root = NULL;
+        if (map->bm_root) {
+            root = (void **)ramfs_new_block(sb);
+            return_dbg_if(!root, NULL, "%s: no space for a map node\n", funcname);
+            root[0] = map->bm_root;
         }
+        map->bm_root = root;
+        ++map->bm_height;
+    }
 
-        blkdata = (char *)ind1blk[ index ];
-        if (!blkdata) {
-            blkdata = ramfs_new_block();
-            ind1blk[ index ] = (off_t)blkdata;
-
-            ++idata->as.reg.block_count;
-            logmsgdf("%s: ino=%d, block %d set to *%x\n", funcname,
-                    idata->i_no, N_DIRECT_BLOCKS + index, (uint)blkdata);
+    void **slot = (void **)&map->bm_root;
+    uint level = map->bm_height;
+    for (;;) {
+        if (!*slot) {
+            char *blk = ramfs_new_block(sb);
+            return_dbg_if(!blk, NULL, "%s: no space left\n", funcname);
+            *slot = blk;
+
+            if (level == 0) {
+                ++idata->as.reg.block_count;
+                logmsgdf("%s: ino=%d, block %d set to *%x\n",
+                        funcname, idata->i_no, index, (uint)blk);
+            }
         }
-        return blkdata;
-    }
+        if (level == 0)
+            return *slot;
 
-    logmsgef("%s: ETODO: who on earth needs the second level of indirection?", funcname);
-    return NULL;
+        --level;
+        void **node = *slot;
+        slot = &node[ (index >> (level * RAMFS_MAP_SHIFT)) & RAMFS_MAP_MASK ];
+    }
 }
 
-static void ramfs_free_blocks_in_list(off_t *blklst) {
-    if (!blklst) return;
+/*
+ *  Frees the pages of the subtree `node` of `height` from its page `start`.
+ *  Returns true if the whole subtree is freed.
+ */
+static bool ramfs_free_blocks_from(
+        mountnode *sb, struct inode *idata, void **node, uint height, index_t start)
+{
+    if (height == 0) {
+        ramfs_free_block(sb, node);
+        --idata->as.reg.block_count;
+        return true;
+    }
 
+    uint shift = (height - 1) * RAMFS_MAP_SHIFT;
+    size_t first = start >> shift;
     size_t i;
-    for (i = 0; i < PAGE_BYTES / sizeof(off_t); ++i) {
-        char *blkdata = (char *)(size_t)blklst[i];
-        if (!blkdata) continue;
+    bool keep = false;
 
-        pmem_free((uint)blkdata, 1);
-    }
-}
+    for (i = 0; i < first; ++i)
+        if (node[i]) keep = true;
 
-static void ramfs_free_blocks_2ndlvl(off_t *ind2lst) {
-    if (!ind2lst) return;
-    size_t i;
+    for (; i < RAMFS_MAP_SLOTS; ++i) {
+        if (!node[i]) continue;
+
+        /* only the first subtree is freed partially */
+        index_t substart = 0;
+        if (i == first)
+            substart = start & ((1u << shift) - 1);
 
-    for (i = 0; i < PAGE_BYTES / sizeof(off_t); ++i) {
-        off_t *ind1lst = (off_t *)(size_t)ind2lst[i];
-        ramfs_free_blocks_in_list(ind1lst);
+        if (ramfs_free_blocks_from(sb, idata, node[i], height - 1, substart))
+            node[i] = NULL;
+        else
+            keep = true;
     }
-}
 
-static void ramfs_free_inode_blocks(struct inode *idata) {
-    const char *funcname = __FUNCTION__;
-    int i;
+    if (keep)
+        return false;
+    ramfs_free_block(sb, node);
+    return true;
+}
 
-    returnv_log_if(idata->as.reg.indir3rd_block, "%s: TODO: indir3rd_block\n");
-    ramfs_free_blocks_2ndlvl((off_t *)(size_t)idata->as.reg.indir2nd_block);
-    ramfs_free_blocks_in_list((off_t *)(size_t)idata->as.reg.indir1st_block);
+/* frees data pages from `start` on */
+static void ramfs_free_blocks(mountnode *sb, struct inode *idata, index_t start) {
+    struct ramfs_blockmap *map = idata->i_data;
+    if (!(map && map->bm_root) || !ramfs_map_fits(map->bm_height, start))
+        return;
 
-    for (i = 0; i < N_DIRECT_BLOCKS; ++i) {
-        uint blkind = (uint)idata->as.reg.directblock[i];
-        if (!blkind) continue;
+    if (ramfs_free_blocks_from(sb, idata, map->bm_root, map->bm_height, start)) {
+        map->bm_root = NULL;
+        map->bm_height = 0;
+    }
+}
 
-        pmem_free(blkind, 1);
+static void ramfs_free_inode_blocks(mountnode *sb, struct inode *idata) {
+    ramfs_free_blocks(sb, idata, 0);
+    if (idata->i_data) {
+        kfree(idata->i_data);
+        idata->i_data = NULL;
     }
 }
 
@@ -1137,8 +1318,8 @@ static int ramfs_write_inode(
     size_t offset = pos % PAGE_BYTES;
     if (offset) {
         /* copy initial partial block */
-        char *blkdata = ramfs_block_by_index_or_new(idata, blkindex);
-        if (!blkdata) { ret = EIO; goto fun_exit; }
+        char *blkdata = ramfs_block_by_index_or_new(sb, idata, blkindex);
+        if (!blkdata) { ret = ENOSPC; goto fun_exit; }
 
         nwrite = PAGE_BYTES - offset;
         if (nwrite > buflen)
@@ -1150,8 +1331,8 @@ static int ramfs_write_inode(
 
     while ((nwrite + PAGE_BYTES) <= buflen) {
         /* copy full blocks while possible */
-        char *blkdata = ramfs_block_by_index_or_new(idata, blkindex);
-        if (!blkdata) { ret = EIO; goto fun_exit; }
+        char *blkdata = ramfs_block_by_index_or_new(sb, idata, blkindex);
+        if (!blkdata) { ret = ENOSPC; goto fun_exit; }
 
         memcpy(blkdata, buf + nwrite, PAGE_BYTES);
         nwrite += PAGE_BYTES;
@@ -1160,16 +1341,16 @@ static int ramfs_write_inode(
 
     if (nwrite < buflen) {
         /* copy the partial tail */
-        char *blkdata = ramfs_block_by_index_or_new(idata, blkindex);
-        if (!blkdata) { ret = EIO; goto fun_exit; }
+        char *blkdata = ramfs_block_by_index_or_new(sb, idata, blkindex);
+        if (!blkdata) { ret = ENOSPC; goto fun_exit; }
 
         memcpy(blkdata, buf + nwrite, buflen - nwrite);
         nwrite = buflen;
     }
 
 fun_exit:
-    if ((int)(pos + buflen) > idata->i_size) {
-        idata->i_size = pos + buflen;
+    if ((int)(pos + nwrite) > idata->i_size) {
+        idata->i_size = pos + nwrite;
         logmsgdf("%s: i_size=%d\n", funcname, idata->i_size);
     }
     if (written) *written = nwrite;
@@ -1177,6 +1358,39 @@ fun_exit:
 }
 
 
-static int ramfs_trunc_inode(/*mountnode *sb, inode_t ino, off_t length*/) {
-    return ETODO;
+/* file pages are in memory already, they can be used in place */
+static int ramfs_inode_page(mountnode *sb, struct inode *idata, index_t index,
+                            bool create, char **page)
+{
+    if (!create) {
+        *page = ramfs_block_by_index(idata, index);
+        return 0;
+    }
+
+    *page = ramfs_block_by_index_or_new(sb, idata, index);
+    return (*page ? 0 : ENOSPC);
+}
+
+static int ramfs_trunc_inode(mountnode *sb, inode_t ino, off_t length) {
+    const char *funcname = __FUNCTION__;
+
+    struct inode *idata = ramfs_idata_by_inode(sb, ino);
+    return_dbg_if(!idata, ENOENT, "%s(ino = %d): ENOENT\n", funcname, ino);
+    return_dbg_if(!S_ISREG(idata->i_mode), EINVAL,
+            "%s(ino = %d): not a regular file\n", funcname, ino);
+    return_dbg_if(length < 0, EINVAL, "%s: length=%d\n", funcname, length);
+
+    if (length < idata->i_size) {
+        ramfs_free_blocks(sb, idata, pagealign_up(length) / PAGE_BYTES);
+
+        /* the tail of the last page must read as zeroes if it grows again */
+        size_t offset = length % PAGE_BYTES;
+        char *blkdata = ramfs_block_by_index(idata, length / PAGE_BYTES);
+        if (offset && blkdata)
+            memset(blkdata + offset, 0, PAGE_BYTES - offset);
+    }
+
+    /* growing leaves a hole */
+    idata->i_size = length;
+    return 0;
 }
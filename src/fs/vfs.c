@@ -17,8 +17,17 @@
 #include "arch/multiboot.h"
 #include "mem/kheap.h"
 #include "dev/screen.h"
+#include "dev/ide.h"
+#include "dev/ramdisk.h"
+#include "dev/loop.h"
 #include "fs/vfs.h"
+#include "fs/dcache.h"
+#include "fs/icache.h"
+#include "fs/pagecache.h"
 #include "fs/ramfs.h"
+#include "fs/procfs.h"
+#include "fs/ext2.h"
+#include "fs/fat.h"
 #include "fs/devices.h"
 
 static const char *
@@ -125,11 +134,11 @@ static const char * vfs_match_mountpath(mountnode *parent_mnt, mountnode **match
     while (child_mnt) {
         const char *mountpath = child_mnt->sb_mntpath;
         size_t mountpath_len = strlen(mountpath);
-        if (!strncmp(path, mountpath, mountpath_len)) {
-            const char *nextpath = path + mountpath_len;
-            if (nextpath[0] == '\0')
-                break;
-
+        const char *nextpath = path + mountpath_len;
+        /* "/procfoo" is not on "/proc" */
+        if (!strncmp(path, mountpath, mountpath_len)
+            && ((nextpath[0] == FS_SEP) || (nextpath[0] == '\0')))
+        {
             while (nextpath[0] == FS_SEP)
                 ++nextpath;
 
@@ -185,24 +194,72 @@ int vfs_path_dirname_len(const char *path, size_t pathlen) {
 }
 
 int vfs_lookup(const char *path, mountnode **mntnode, inode_t *ino) {
+    return dcache_lookup(path, mntnode, ino);
+}
+
+
+/*
+ *  Mounts a filesystem on an existing directory `target`
+ */
+static int vfs_mount_child(dev_t source, const char *target, const mount_opts_t *opts) {
     const char *funcname = __FUNCTION__;
-    int ret = 0;
-    mountnode *sb = NULL;
-    const char *fspath = NULL;
+    int ret;
 
-    ret = vfs_mountnode_by_path(path, &sb, &fspath);
-    return_dbg_if(ret, ret, "%s: no mountnode for path '%s' (%d)\n", funcname, path, ret);
+    mountnode *parent = NULL;
+    const char *relpath = NULL;
+    ret = vfs_mountnode_by_path(target, &parent, &relpath);
+    return_dbg_if(ret, ret, "%s: no mountnode for '%s'\n", funcname, target);
+    return_dbg_if(relpath[0] == '\0', EBUSY,
+            "%s: '%s' is a mountpoint already\n", funcname, target);
 
-    return_dbg_if(!sb->sb_fs->ops->lookup_inode, ENOSYS,
-            "%s; no %s.lookup_inode\n", funcname, sb->sb_fs->name);
+    inode_t ino = 0;
+    struct stat st;
+    return_dbg_if(!parent->sb_fs->ops->lookup_inode, ENOSYS,
+            "%s: no %s.lookup_inode\n", funcname, parent->sb_fs->name);
+    ret = parent->sb_fs->ops->lookup_inode(parent, &ino, relpath, SIZE_MAX);
+    return_dbg_if(ret, ret, "%s: no '%s'\n", funcname, target);
+    ret = vfs_inode_stat(parent, ino, &st);
+    return_dbg_if(ret, ret, "%s: stat('%s') failed\n", funcname, target);
+    return_dbg_if(!S_ISDIR(st.st_mode), ENOTDIR,
+            "%s: '%s' is not a directory\n", funcname, target);
+
+    fsdriver *fs = vfs_filesystem_by_id(opts->fs_id);
+    return_dbg_if(!fs, ENODEV, "%s: no fs_id=0x%x\n", funcname, opts->fs_id);
+
+    size_t pathlen = strlen(relpath);
+    while (pathlen && (relpath[pathlen - 1] == FS_SEP))
+        --pathlen;
+
+    struct superblock *sb = kmalloc(sizeof(struct superblock) + pathlen + 1);
+    return_err_if(!sb, ENOMEM, "%s: kmalloc(superblock) failed", funcname);
+    memset(sb, 0, sizeof(struct superblock));
+
+    /* the mount path is stored right after the superblock */
+    char *mntpath = (char *)(sb + 1);
+    memcpy(mntpath, relpath, pathlen);
+    mntpath[pathlen] = '\0';
+
+    sb->sb_mntpath = mntpath;
+    sb->sb_dev = source;
+    sb->sb_fs = fs;
+    sb->sb_flags.ro = opts->readonly;
+
+    ret = fs->ops->read_superblock(sb, opts);
+    if (ret) {
+        logmsgef("%s: %s.read_superblock failed (%d)", funcname, fs->name, ret);
+        kfree(sb);
+        return ret;
+    }
 
-    ret = sb->sb_fs->ops->lookup_inode(sb, ino, fspath, SIZE_MAX);
+    sb->sb_parent = parent;
+    sb->sb_brother = parent->sb_children;
+    parent->sb_children = sb;
 
-    if (mntnode) *mntnode = sb;
-    return ret;
+    /* cached dentries under `target` are on the parent filesystem */
+    dcache_flush();
+    return 0;
 }
 
-
 int vfs_mount(dev_t source, const char *target, const mount_opts_t *opts) {
     if (theRootMnt == NULL) {
         if ((target[0] != '/') || (target[1] != '\0')) {
@@ -215,6 +272,7 @@ int vfs_mount(dev_t source, const char *target, const mount_opts_t *opts) {
 
         struct superblock *sb = kmalloc(sizeof(struct superblock));
         return_err_if(!sb, -3, "vfs_mount: kmalloc(superblock) failed");
+        memset(sb, 0, sizeof(struct superblock));
 
         sb->sb_parent = NULL;
         sb->sb_brother = NULL;
@@ -224,15 +282,14 @@ int vfs_mount(dev_t source, const char *target, const mount_opts_t *opts) {
         sb->sb_dev = source;
         sb->sb_fs = fs;
 
-        int ret = fs->ops->read_superblock(sb);
+        int ret = fs->ops->read_superblock(sb, opts);
         return_err_if(ret, -4, "vfs_mount: read_superblock failed (%d)", ret);
 
         theRootMnt = sb;
         return 0;
     }
 
-    logmsge("vfs_mount: TODO: non-root");
-    return ETODO;
+    return vfs_mount_child(source, target, opts);
 }
 
 
@@ -254,6 +311,7 @@ int vfs_mkdir(const char *path, mode_t mode) {
     ret = sb->sb_fs->ops->make_directory(sb, NULL, localpath, mode);
     return_err_if(ret, ret, "mkdir: failed (%d)\n", ret);
 
+    dcache_invalidate(path);
     return 0;
 }
 
@@ -262,12 +320,13 @@ int vfs_inode_get(mountnode *sb, inode_t ino, struct inode *idata) {
     const char *funcname = __FUNCTION__;
     int ret;
     return_log_if(!idata, EINVAL, "%s(NULL", funcname);
-    return_dbg_if(!sb->sb_fs->ops->inode_get, ENOSYS,
-                  "%s: no %s.inode_get()\n", funcname, sb->sb_fs->name);
 
-    ret = sb->sb_fs->ops->inode_get(sb, ino, idata);
-    return_dbg_if(ret, ret, "%s: %s.inode_get failed\n", funcname, sb->sb_fs->name);
+    struct inode *icore;
+    ret = vfs_iget(sb, ino, &icore);
+    return_dbg_if(ret, ret, "%s: vfs_iget(%d) failed(%d)\n", funcname, ino, ret);
 
+    inode_copy(idata, icore);
+    vfs_iput(icore);
     return 0;
 }
 
@@ -275,24 +334,23 @@ int vfs_inode_set(mountnode *sb, inode_t ino, struct inode *inobuf) {
     const char *funcname = __FUNCTION__;
     int ret;
 
-    return_dbg_if(!sb->sb_fs->ops->inode_get, ENOSYS,
-            "%s: no %s.inode_get()\n", funcname, sb->sb_fs->name);
-    return_dbg_if(!sb->sb_fs->ops->inode_set, ENOSYS,
-            "%s: no %s.inode_set()\n", funcname, sb->sb_fs->name);
-
-    struct inode idata;
-    ret = sb->sb_fs->ops->inode_get(sb, ino, &idata);
-    return_dbg_if(ret, ret,
-            "%s: %s.inode_get() failed(%d)\n", funcname, sb->sb_fs->name, ret);
+    struct inode *idata;
+    ret = vfs_iget(sb, ino, &idata);
+    return_dbg_if(ret, ret, "%s: vfs_iget(%d) failed(%d)\n", funcname, ino, ret);
 
     /* inode_set can't change type of file */
-    if ((idata.i_mode & S_IFMT) != (inobuf->i_mode & S_IFMT)) return EINVAL;
+    if ((idata->i_mode & S_IFMT) != (inobuf->i_mode & S_IFMT)) ret = EINVAL;
     /* inode index cannot be changed */
-    if (idata.i_no != inobuf->i_no) return EINVAL;
+    if (idata->i_no != inobuf->i_no) ret = EINVAL;
     /* only fs code may change i_data */
-    if (idata.i_data != inobuf->i_data) return EINVAL;
+    if (idata->i_data != inobuf->i_data) ret = EINVAL;
 
-    return sb->sb_fs->ops->inode_set(sb, ino, &idata);
+    if (!ret) {
+        inode_copy(idata, inobuf);
+        vfs_inode_dirty(idata);
+    }
+    vfs_iput(idata);
+    return ret;
 }
 
 
@@ -324,9 +382,12 @@ int vfs_mknod(const char *path, mode_t mode, dev_t dev) {
     ret = sb->sb_fs->ops->lookup_inode(sb, &dirino, fspath, dirnamelen);
     return_dbg_if(ret, ret, "%s: no dirino for %s\n", funcname, fspath);
 
-    struct inode idata;
-    vfs_inode_get(sb, dirino, &idata);
-    return_dbg_if(!S_ISDIR(idata.i_mode), ENOTDIR,
+    struct inode *dir;
+    ret = vfs_iget(sb, dirino, &dir);
+    return_dbg_if(ret, ret, "%s: no inode for dirino=%d\n", funcname, dirino);
+    bool isdir = S_ISDIR(dir->i_mode);
+    vfs_iput(dir);
+    return_dbg_if(!isdir, ENOTDIR,
                  "%s: dirino=%d is not a directory\n", funcname, dirino);
 
     /* create the inode */
@@ -351,6 +412,7 @@ int vfs_mknod(const char *path, mode_t mode, dev_t dev) {
         return ret;
     }
 
+    dcache_invalidate(path);
     return 0;
 }
 
@@ -363,28 +425,27 @@ int vfs_inode_read(
     int ret;
     return_err_if(!buf, EINVAL, "%s(NULL)", funcname);
 
-    struct inode idata;
+    struct inode *idata;
 
-    return_dbg_if(!sb->sb_fs->ops->inode_get, ENOSYS,
-            "%s: no %s.inode_get\n", funcname, sb->sb_fs->name);
-    return_dbg_if(!sb->sb_fs->ops->read_inode, ENOSYS,
-            "%s: no %s.read_inode\n", funcname, sb->sb_fs->name);
-
-    ret = sb->sb_fs->ops->inode_get(sb, ino, &idata);
+    ret = vfs_iget(sb, ino, &idata);
     return_dbg_if(ret, ret,
-            "%s: %s.inode_get(%d) failed(%d)\n", funcname, sb->sb_fs->name, ino, ret);
+            "%s: vfs_iget(%d) failed(%d)\n", funcname, ino, ret);
+    mode_t mode = idata->i_mode;
+    dev_t devno = inode_devno(idata);
+    off_t size = idata->i_size;
+    vfs_iput(idata);
 
     device *dev;
-    switch (idata.i_mode & S_IFMT) {
+    switch (mode & S_IFMT) {
         case S_IFCHR:
-            dev = device_by_devno(DEV_CHR, inode_devno(&idata));
+            dev = device_by_devno(DEV_CHR, devno);
             if (!dev) return ENODEV;
             if (!dev->dev_ops->dev_read_buf) return ENOSYS;
             return dev->dev_ops->dev_read_buf(dev, buf, buflen, written, pos);
         case S_IFBLK:
-            dev = device_by_devno(DEV_BLK, inode_devno(&idata));
+            dev = device_by_devno(DEV_BLK, devno);
             if (!dev) return ENODEV;
-            return bdev_blocking_read(dev, pos, buf, buflen, written);
+            return bdev_blocking_read(dev, NULL, pos, buf, buflen, written);
         case S_IFSOCK:
             logmsgef("%s(ino=%d -- SOCK): ETODO", funcname, ino);
             return ETODO;
@@ -398,13 +459,22 @@ int vfs_inode_read(
             logmsgdf("%s(ino=%d): EISDIR\n", funcname, ino);
             return EISDIR;
         case S_IFREG:
-            if (pos >= idata.i_size) {
+            if (pos >= size) {
                 if (written) *written = 0;
                 return 0;
             }
+            if (sb->sb_fs->ops->readpage) {
+                ret = vfs_iget(sb, ino, &idata);
+                if (ret) return ret;
+                ret = vfs_pagecache_read(idata, NULL, pos, buf, buflen, written);
+                vfs_iput(idata);
+                return ret;
+            }
+            return_dbg_if(!sb->sb_fs->ops->read_inode, ENOSYS,
+                    "%s: no %s.read_inode\n", funcname, sb->sb_fs->name);
             return sb->sb_fs->ops->read_inode(sb, ino, pos, buf, buflen, written);
         default:
-            logmsgef("%s: unknown mode & S_IFMT = 0x%x", idata.i_mode & S_IFMT);
+            logmsgef("%s: unknown mode & S_IFMT = 0x%x", mode & S_IFMT);
             return EKERN;
    }
 }
@@ -417,20 +487,27 @@ int vfs_inode_write(
     int ret;
     return_err_if(!buf, EINVAL, "%s(NULL)", funcname);
 
-    struct inode idata;
+    struct inode *idata;
 
-    return_dbg_if(!sb->sb_fs->ops->inode_get, ENOSYS,
-            "%s: no %s.inode_get\n", funcname, sb->sb_fs->name);
-    return_dbg_if(!sb->sb_fs->ops->write_inode, ENOSYS,
-            "%s: no %s.write_inode\n", funcname, sb->sb_fs->name);
-
-    ret = sb->sb_fs->ops->inode_get(sb, ino, &idata);
+    ret = vfs_iget(sb, ino, &idata);
     return_dbg_if(ret, ret,
-            "%s; %s.inode_get(%d) failed(%d)\n", funcname, sb->sb_fs->name, ino, ret);
+            "%s; vfs_iget(%d) failed(%d)\n", funcname, ino, ret);
+    mode_t mode = idata->i_mode;
+    dev_t devno = inode_devno(idata);
+    vfs_iput(idata);
 
     device *dev;
-    switch (idata.i_mode & S_IFMT) {
+    switch (mode & S_IFMT) {
         case S_IFREG:
+            if (sb->sb_fs->ops->readpage) {
+                ret = vfs_iget(sb, ino, &idata);
+                if (ret) return ret;
+                ret = vfs_pagecache_write(idata, pos, buf, buflen, written);
+                vfs_iput(idata);
+                return ret;
+            }
+            return_dbg_if(!sb->sb_fs->ops->write_inode, ENOSYS,
+                    "%s: no %s.write_inode\n", funcname, sb->sb_fs->name);
             return sb->sb_fs->ops->write_inode(sb, ino, pos, buf, buflen, written);
         case S_IFDIR:
             logmsgdf("%s(inode=%d): EISDIR\n", funcname, ino);
@@ -438,7 +515,7 @@ int vfs_inode_write(
         case S_IFBLK:
             return ETODO;
         case S_IFCHR:
-            dev = device_by_devno(DEV_CHR, inode_devno(&idata));
+            dev = device_by_devno(DEV_CHR, devno);
             return_dbg_if(!dev, ENODEV, "%s: ENODEV\n");
             return_dbg_if(!dev->dev_ops->dev_write_buf, ENOSYS,
                     "%s: no device.dev_write_buf\n", funcname);
@@ -447,7 +524,7 @@ int vfs_inode_write(
             logmsgef("%s(inode.mode=LNK|FIFO|SOCK): ETODO", funcname);
             return ETODO;
         default:
-            logmsgef("%s(mode=0x%x)", funcname, idata.i_mode & S_IFMT);
+            logmsgef("%s(mode=0x%x)", funcname, mode & S_IFMT);
             return EKERN;
     }
 }
@@ -455,33 +532,198 @@ int vfs_inode_write(
 
 int vfs_inode_trunc(mountnode *sb, inode_t ino, off_t length) {
     const char *funcname = __FUNCTION__;
+    int ret;
 
     return_dbg_if(!sb->sb_fs->ops->trunc_inode, ENOSYS,
             "%s: no %s.trunc_inode\n", funcname, sb->sb_fs->name);
+
+    struct inode *idata;
+    ret = vfs_iget(sb, ino, &idata);
+    return_dbg_if(ret, ret, "%s: vfs_iget(%d) failed(%d)\n", funcname, ino, ret);
+
+    /* the partial page is read again from the filesystem */
+    page_mapping *m = idata->i_pages;
+    if (m) {
+        pagecache_sync(m);
+        pagecache_truncate(m, length / PAGE_BYTES);
+    }
+    vfs_iput(idata);
+
     return sb->sb_fs->ops->trunc_inode(sb, ino, length);
 }
 
+
+/*
+ *  Regular files in the page cache
+ */
+
+static int vfs_readpage(page_mapping *m, index_t index, char *page) {
+    struct inode *idata = m->pm_host;
+    mountnode *sb = idata->i_sb;
+    return sb->sb_fs->ops->readpage(sb, idata, index, page);
+}
+
+static int vfs_writepage(page_mapping *m, index_t index, const char *page) {
+    struct inode *idata = m->pm_host;
+    mountnode *sb = idata->i_sb;
+    if (!sb->sb_fs->ops->writepage)
+        return EROFS;
+    return sb->sb_fs->ops->writepage(sb, idata, index, page);
+}
+
+static const struct page_mapping_ops vfs_inode_mapping_ops = {
+    .readpage = vfs_readpage,
+    .writepage = vfs_writepage,
+};
+
+static page_mapping * vfs_inode_pages(struct inode *idata) {
+    if (!idata->i_pages) {
+        idata->i_pages = kmalloc(sizeof(page_mapping));
+        return_err_if(!idata->i_pages, NULL, "%s: kmalloc failed", __func__);
+        pagecache_init_mapping(idata->i_pages, idata, &vfs_inode_mapping_ops);
+    }
+    return idata->i_pages;
+}
+
+int vfs_pagecache_read(
+        struct inode *idata, struct readahead *ra, off_t pos,
+        char *buf, size_t buflen, size_t *written)
+{
+    if (written) *written = 0;
+    if (pos >= idata->i_size)
+        return 0;
+    if ((off_t)buflen > idata->i_size - pos)
+        buflen = idata->i_size - pos;
+
+    page_mapping *m = vfs_inode_pages(idata);
+    if (!m) return ENOMEM;
+
+    if (ra)
+        pagecache_readahead(m, ra, pos, buflen, (idata->i_size - 1) / PAGE_BYTES);
+    return pagecache_read(m, pos, buf, buflen, written);
+}
+
+int vfs_pagecache_write(
+        struct inode *idata, off_t pos,
+        const char *buf, size_t buflen, size_t *written)
+{
+    size_t done = 0;
+    page_mapping *m = vfs_inode_pages(idata);
+    if (!m) return ENOMEM;
+
+    /* the size grows first: pages past it are not written back,
+     * and a reclaim may write back the new ones during the copy */
+    off_t oldsize = idata->i_size;
+    if ((off_t)(pos + buflen) > oldsize)
+        idata->i_size = pos + buflen;
+
+    int ret = pagecache_write(m, pos, buf, buflen, &done);
+    if ((done < buflen) && (idata->i_size > oldsize)) {
+        off_t end = pos + done;
+        idata->i_size = (end > oldsize ? end : oldsize);
+    }
+    if (idata->i_size != oldsize)
+        vfs_inode_dirty(idata);
+    if (written) *written = done;
+    return ret;
+}
+
+void vfs_inode_drop_pages(struct inode *idata) {
+    page_mapping *m = idata->i_pages;
+    if (!m) return;
+
+    pagecache_truncate(m, 0);
+    if (m->pm_npages) {
+        logmsgef("%s(ino=%d): pinned pages left", __func__, idata->i_no);
+        return;
+    }
+    kfree(m);
+    idata->i_pages = NULL;
+}
+
+/* holes are read from here, it may be mapped into processes */
+static const char theZeroPage[PAGE_BYTES] __attribute__((aligned(PAGE_BYTES)));
+
+int vfs_inode_map_page(struct inode *idata, index_t index, bool create,
+                       char **page, void **cookie)
+{
+    int ret;
+    mountnode *sb = idata->i_sb;
+    fs_ops *ops = sb->sb_fs->ops;
+
+    *cookie = NULL;
+    if (ops->readpage) {
+        page_mapping *m = vfs_inode_pages(idata);
+        if (!m) return ENOMEM;
+
+        cached_page *pg;
+        ret = pagecache_get(m, index, true, &pg);
+        if (ret) return ret;
+
+        *page = pg->cp_data;
+        *cookie = pg;
+        return 0;
+    }
+
+    return_dbg_if(!ops->inode_page, ENOSYS,
+            "%s: no %s.inode_page\n", __func__, sb->sb_fs->name);
+    ret = ops->inode_page(sb, idata, index, create, page);
+    if (ret) return ret;
+    if (!*page)
+        *page = (char *)theZeroPage;
+    return 0;
+}
+
+void vfs_inode_unmap_page(void *cookie) {
+    if (cookie)
+        pagecache_put(cookie);
+}
+
+void vfs_inode_dirty_page(struct inode *idata, index_t index) {
+    if (!idata->i_pages)
+        return;     /* the filesystem keeps the page itself */
+
+    cached_page *pg = pagecache_find(idata->i_pages, index);
+    if (pg)
+        pagecache_set_dirty(pg);
+}
+
+void vfs_inode_release_page(struct inode *idata, index_t index) {
+    if (!idata->i_pages)
+        return;
+
+    cached_page *pg = pagecache_find(idata->i_pages, index);
+    returnv_err_if(!pg, "%s(ino=%d, index=%d): not cached", __func__, idata->i_no, index);
+    pagecache_put(pg);
+}
+
+int vfs_inode_sync_pages(struct inode *idata) {
+    if (!idata->i_pages)
+        return 0;
+    return pagecache_sync(idata->i_pages);
+}
+
 int vfs_inode_stat(mountnode *sb, inode_t ino, struct stat *stat) {
     const char *funcname = __FUNCTION__;
     int ret;
     return_log_if(!stat, EINVAL, "%s(NULL)\n", funcname);
 
-    struct inode idata;
+    struct inode *idata;
 
-    return_dbg_if(!sb->sb_fs->ops->inode_get, ENOSYS,
-             "%s: no %s.inode_get\n", funcname, sb->sb_fs->name);
-    ret = sb->sb_fs->ops->inode_get(sb, ino, &idata);
+    ret = vfs_iget(sb, ino, &idata);
     return_dbg_if(ret, ret,
-            "%s: %s.inode_get() failed(%d)\n", funcname, sb->sb_fs->name, ret);
+            "%s: vfs_iget(%d) failed(%d)\n", funcname, ino, ret);
 
     memset(stat, 0, sizeof(struct stat));
     stat->st_dev = sb->sb_dev;
     stat->st_ino = ino;
-    stat->st_mode = idata.i_mode;
-    stat->st_nlink = idata.i_nlinks;
-    stat->st_rdev = (S_ISCHR(idata.i_mode) || S_ISBLK(idata.i_mode) ?
-                        inode_devno(&idata) : 0);
-    stat->st_size = idata.i_size;
+    stat->st_mode = idata->i_mode;
+    stat->st_nlink = idata->i_nlinks;
+    stat->st_rdev = (S_ISCHR(idata->i_mode) || S_ISBLK(idata->i_mode) ?
+                        inode_devno(idata) : 0);
+    stat->st_size = idata->i_size;
+
+    vfs_iput(idata);
     return 0;
 }
 
@@ -490,18 +732,10 @@ int vfs_stat(const char *path, struct stat *stat) {
     int ret;
 
     mountnode *sb = NULL;
-    const char *fspath;
     inode_t ino = 0;
 
-    ret = vfs_mountnode_by_path(path, &sb, &fspath);
-    return_dbg_if(ret, ret,
-            "%s: no localpath and superblock for path '%s'\n", funcname, path);
-
-    return_dbg_if(!sb->sb_fs->ops->lookup_inode, ENOSYS,
-            "%s: no %s.lookup_inode\n", funcname, sb->sb_fs->name);
-    ret = sb->sb_fs->ops->lookup_inode(sb, &ino, fspath, SIZE_MAX);
-    return_dbg_if(ret, ret,
-            "%s: %s.lookup_inode failed(%d)\n", funcname, sb->sb_fs->name, ret);
+    ret = dcache_lookup(path, &sb, &ino);
+    return_dbg_if(ret, ret, "%s: no inode for path '%s'\n", funcname, path);
 
     return vfs_inode_stat(sb, ino, stat);
 }
@@ -543,7 +777,11 @@ int vfs_hardlink(const char *path, const char *newpath) {
     const char *basename = new_fspath + dirlen;
     while (basename[0] == FS_SEP) ++basename;
 
-    return sb->sb_fs->ops->link_inode(sb, ino, dirino, basename, SIZE_MAX);
+    ret = sb->sb_fs->ops->link_inode(sb, ino, dirino, basename, SIZE_MAX);
+    if (ret) return ret;
+
+    dcache_invalidate(newpath);
+    return 0;
 }
 
 int vfs_unlink(const char *path) {
@@ -560,7 +798,11 @@ int vfs_unlink(const char *path) {
     return_dbg_if(!sb->sb_fs->ops->unlink_inode, ENOSYS,
             "%s: no %s.unlink_inode\n", funcname, sb->sb_fs->name);
 
-    return sb->sb_fs->ops->unlink_inode(sb, fspath, SIZE_MAX);
+    ret = sb->sb_fs->ops->unlink_inode(sb, fspath, SIZE_MAX);
+    if (ret) return ret;
+
+    dcache_invalidate(path);
+    return 0;
 }
 
 int vfs_rename(const char *oldpath, const char *newpath) {
@@ -602,14 +844,80 @@ void print_ls(const char *path) {
     k_printf("\n");
 }
 
+static void print_mount_usage(mountnode *sb) {
+    struct fs_usage st;
+    if (!(sb->sb_fs->ops->get_usage && !sb->sb_fs->ops->get_usage(sb, &st))) {
+        k_printf("\n");
+        return;
+    }
+
+    uint kb = sb->sb_blksz / 1024;
+    k_printf(" (%d KB", st.fu_blocks * kb);
+    if (st.fu_max_blocks)
+        k_printf(" of %d KB", st.fu_max_blocks * kb);
+    k_printf(", %d inodes", st.fu_inodes);
+    if (st.fu_max_inodes)
+        k_printf(" of %d", st.fu_max_inodes);
+    k_printf(")\n");
+}
+
+static void print_mount_children(mountnode *parent, char *path, size_t pathlen, size_t bufsize) {
+    mountnode *sb;
+    for (sb = parent->sb_children; sb; sb = sb->sb_brother) {
+        size_t len = snprintf(path + pathlen, bufsize - pathlen, "/%s", sb->sb_mntpath);
+        if (pathlen + len >= bufsize)
+            len = bufsize - pathlen - 1;
+
+        k_printf("%s on %s", sb->sb_fs->name, path);
+        print_mount_usage(sb);
+        print_mount_children(sb, path, pathlen + len, bufsize);
+        path[pathlen] = '\0';
+    }
+}
+
 void print_mount(void) {
     struct superblock *sb = theRootMnt;
     if (!sb) return;
 
-    k_printf("%s on /\n", sb->sb_fs->name);
-    if (sb->sb_children) {
-        logmsge("TODO: print child mounts");
+    k_printf("%s on /", sb->sb_fs->name);
+    print_mount_usage(sb);
+
+    char path[256] = "";
+    print_mount_children(sb, path, 0, sizeof(path));
+}
+
+static int vfs_sync_mount(mountnode *sb) {
+    int ret = vfs_sync_inodes(sb);
+    mountnode *child;
+    for (child = sb->sb_children; child; child = child->sb_brother) {
+        int err = vfs_sync_mount(child);
+        if (err) ret = err;
     }
+    return ret;
+}
+
+static bool vfs_mount_uses(mountnode *sb, dev_t dev) {
+    if (sb->sb_dev == dev)
+        return true;
+    mountnode *child;
+    for (child = sb->sb_children; child; child = child->sb_brother)
+        if (vfs_mount_uses(child, dev))
+            return true;
+    return false;
+}
+
+bool vfs_device_mounted(dev_t dev) {
+    return theRootMnt && vfs_mount_uses(theRootMnt, dev);
+}
+
+int vfs_sync(void) {
+    int ret = 0;
+    if (theRootMnt)
+        ret = vfs_sync_mount(theRootMnt);
+
+    /* the metadata written into device pages by the inode writeback */
+    int err = pagecache_sync_all();
+    return (err ? err : ret);
 }
 
 static void build_file_from_string(const char *path, const char *s, size_t size) {
@@ -726,11 +1034,15 @@ static void build_boot_dir() {
             name[10] = '\0';
         }
 
+        /* disk images are used in place, see ramdisk_setup_modules() */
+        size_t namelen = strlen(name);
+        if (0 == strcmp(name + namelen - 4, ".img"))
+            continue;
+
         const char *modstart = (const char *)mods[i].mod_start;
         size_t size = mods[i].mod_end - mods[i].mod_start;
         k_printf(" module *%x (len=0x%x) :\t%s\n", mods[i].mod_start, size, name);
 
-        size_t namelen = strlen(name);
         if (0 == strcmp(name + namelen - 4, ".tar")) {
             build_dir_from_tar("/", modstart, size);
         } else {
@@ -744,6 +1056,9 @@ void vfs_setup(void) {
 
     /* register filesystems here */
     vfs_register_filesystem(ramfs_fs_driver());
+    vfs_register_filesystem(procfs_fs_driver());
+    vfs_register_filesystem(ext2_fs_driver());
+    vfs_register_filesystem(fat_fs_driver());
 
     /* mount actual filesystems */
     dev_t fsdev = gnu_dev_makedev(CHR_MEMDEV, CHRMEM_MEM);
@@ -757,6 +1072,12 @@ void vfs_setup(void) {
     ret = vfs_mkdir("/tmp", 0777);
     returnv_err_if(ret, "mkdir /tmp: %s", strerror(ret));
 
+    ret = vfs_mkdir("/proc", 0555);
+    returnv_err_if(ret, "mkdir /proc: %s", strerror(ret));
+    mount_opts_t procopts = { .fs_id = PROCFS_ID, .readonly = true };
+    ret = vfs_mount(gnu_dev_makedev(CHR_VIRT, CHR0_PROCFS), "/proc", &procopts);
+    if (ret) logmsgef("mount procfs on /proc: %s", strerror(ret));
+
     build_file_from_string("/BUILD",
         build_date, strlen(build_date));
 #if COSEC_SECD
@@ -776,4 +1097,23 @@ void vfs_setup(void) {
         ret = vfs_mknod(ttyname, S_IFCHR | 0755, gnu_dev_makedev(CHR_TTY, i));
         if (ret) logmsgef("mkdev c 4:0 /dev/tty0: %s", strerror(ret));
     }
+
+    char hdname[] = "/dev/hda";
+    for (i = 0; i < IDE_NDRIVES; ++i) {
+        dev_t devno = gnu_dev_makedev(BLK_IDE, i);
+        if (!device_by_devno(DEV_BLK, devno))
+            continue;
+        hdname[7] = (char)(i + 'a');
+        ret = vfs_mknod(hdname, S_IFBLK | 0660, devno);
+        if (ret) logmsgef("mkdev b 3:%d %s: %s", i, hdname, strerror(ret));
+    }
+
+    char loopname[] = "/dev/loop0";
+    for (i = 0; i < LOOP_MAX; ++i) {
+        loopname[9] = (char)(i + '0');
+        ret = vfs_mknod(loopname, S_IFBLK | 0660, gnu_dev_makedev(BLK_LOOPBACK, i));
+        if (ret) logmsgef("mkdev b 7:%d %s: %s", i, loopname, strerror(ret));
+    }
+
+    ramdisk_setup_modules();
 }
@@ -0,0 +1,402 @@
+/*
+ *  Memory mappings of processes
+ *
+ *  A process keeps its mmap()'ed regions in a list of vm_areas sorted
+ *  by address, their pages are mapped in lazily by the page fault handler.
+ *
+ *  File pages of shared mappings, and of private ones that cannot be
+ *  written, are the page cache (or ramfs) pages themselves: they stay
+ *  pinned while mapped (not counted against PAGECACHE_MAX_PAGES), the
+ *  dirty bits of their PTEs are passed to the page cache on msync()/munmap().
+ *  A private writable mapping gets a copy of a file page on the first
+ *  access, anonymous memory gets zeroed frames.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <cosec/log.h>
+
+#include "arch/i386.h"
+#include "mem/pmem.h"
+#include "mem/paging.h"
+#include "mem/kheap.h"
+#include "mem/mmap.h"
+#include "fs/vfs.h"
+#include "fs/file.h"
+#include "process.h"
+
+/* page fault error code bits */
+#define PF_PRESENT      0x1
+#define PF_WRITE        0x2
+
+/* private and anonymous frames, recycled through their first word */
+static char *theFreeFrames = NULL;
+
+
+static inline pde_t * vma_pagedir(process_t *proc) {
+    return (pde_t *)proc->ps_task.tss.cr3;
+}
+
+static inline index_t vma_index(vm_area_t *vma, uintptr_t vaddr) {
+    return vma->va_pgoff + (vaddr - vma->va_start) / PAGE_BYTES;
+}
+
+/* the pages are the file pages, not copies */
+static inline bool vma_shares_file(vm_area_t *vma) {
+    return vma->va_file
+        && ((vma->va_flags & MAP_SHARED) || !(vma->va_prot & PROT_WRITE));
+}
+
+static char * vma_frame_alloc(void) {
+    char *frame = theFreeFrames;
+    if (frame) {
+        theFreeFrames = *(char **)frame;
+    } else {
+        void *paddr = pmem_alloc(1);
+        if (!paddr) return NULL;
+        frame = __va(paddr);
+    }
+    memset(frame, 0, PAGE_BYTES);
+    return frame;
+}
+
+static void vma_frame_free(char *frame) {
+    *(char **)frame = theFreeFrames;
+    theFreeFrames = frame;
+}
+
+static void vma_free(vm_area_t *vma) {
+    if (vma->va_file)
+        file_put(vma->va_file);
+    kfree(vma);
+}
+
+/* unmaps one page and drops whatever was behind it */
+static void vma_release_page(process_t *proc, vm_area_t *vma, uintptr_t vaddr) {
+    pte_t pte = pagedir_unmap(vma_pagedir(proc), (void *)vaddr);
+    if (!pte.bit.present)
+        return;
+
+    if (vma_shares_file(vma)) {
+        struct inode *idata = vma->va_file->f_inode;
+        index_t index = vma_index(vma, vaddr);
+        if (pte.bit.dirty)
+            vfs_inode_dirty_page(idata, index);
+        vfs_inode_release_page(idata, index);
+        return;
+    }
+    vma_frame_free(__va((void *)(pte.word & PG31_12_MASK)));
+}
+
+
+vm_area_t * process_find_vma(process_t *proc, uintptr_t addr) {
+    vm_area_t *vma = proc->ps_vmas;
+    while (vma && (vma->va_end <= addr))
+        vma = vma->va_next;
+    if (vma && (vma->va_start <= addr))
+        return vma;
+    return NULL;
+}
+
+bool process_vm_range_free(process_t *proc, uintptr_t start, uintptr_t end) {
+    vm_area_t *vma = proc->ps_vmas;
+    while (vma && (vma->va_end <= start))
+        vma = vma->va_next;
+    return !(vma && (vma->va_start < end));
+}
+
+/* the highest free range of `size` bytes below USER_MMAP_TOP, 0 if none */
+static uintptr_t vma_find_free(process_t *proc, size_t size) {
+    uintptr_t found = 0;
+    uintptr_t prev_end = pagealign_up((uintptr_t)proc->ps_heap_end);
+    vm_area_t *vma = proc->ps_vmas;
+
+    for (;; vma = vma->va_next) {
+        uintptr_t gap_end = (vma && (vma->va_start < USER_MMAP_TOP))
+                          ? vma->va_start : USER_MMAP_TOP;
+        if ((gap_end >= prev_end) && (gap_end - prev_end >= size))
+            found = gap_end - size;
+        if (!vma || (vma->va_start >= USER_MMAP_TOP))
+            break;
+        prev_end = vma->va_end;
+    }
+    return found;
+}
+
+static void vma_insert(process_t *proc, vm_area_t *vma) {
+    vm_area_t **link = &proc->ps_vmas;
+    while (*link && ((*link)->va_start < vma->va_start))
+        link = &(*link)->va_next;
+    vma->va_next = *link;
+    *link = vma;
+}
+
+int process_mmap(process_t *proc, uintptr_t addr, size_t len, int prot, int flags,
+                 file_t *file, off_t offset, uintptr_t *result)
+{
+    int ret;
+    const int sharing = flags & (MAP_SHARED | MAP_PRIVATE);
+    return_dbg_if(!len || (sharing == 0) || (sharing == (MAP_SHARED | MAP_PRIVATE)),
+            EINVAL, "%s(len=%d, flags=0x%x): EINVAL\n", __func__, len, flags);
+    return_dbg_if((offset < 0) || (offset % PAGE_BYTES), EINVAL,
+            "%s: offset=%d is not page-aligned\n", __func__, offset);
+
+    size_t size = pagealign_up(len);
+    return_dbg_if(!size || (size > USER_MMAP_TOP), ENOMEM,
+            "%s: len=0x%x is too large\n", __func__, len);
+
+    if (flags & MAP_ANONYMOUS) {
+        file = NULL;
+    } else {
+        return_dbg_if(!file, EBADF, "%s: no file\n", __func__);
+        return_dbg_if(!(S_ISREG(file->f_mode) && file->f_inode), ENODEV,
+                "%s: mode=0x%x cannot be mapped\n", __func__, file->f_mode);
+        fs_ops *ops = file->f_sb->sb_fs->ops;
+        return_dbg_if(!(ops->readpage || ops->inode_page), ENODEV,
+                "%s: %s files cannot be mapped\n", __func__, file->f_sb->sb_fs->name);
+
+        return_dbg_if(file->f_flags & O_WRONLY, EACCES,
+                "%s: the file is write-only\n", __func__);
+        return_dbg_if((sharing == MAP_SHARED) && (prot & PROT_WRITE)
+                      && !(file->f_flags & O_RDWR),
+                EACCES, "%s: the file is not writable\n", __func__);
+    }
+
+    uintptr_t heap_end = pagealign_up((uintptr_t)proc->ps_heap_end);
+    if (flags & MAP_FIXED) {
+        return_dbg_if((addr % PAGE_BYTES) || (addr < heap_end)
+                      || (addr > USER_MMAP_TOP) || (USER_MMAP_TOP - addr < size),
+                EINVAL, "%s: cannot map at *%x\n", __func__, addr);
+        ret = process_munmap(proc, addr, size);
+        if (ret) return ret;
+    } else if (!((addr % PAGE_BYTES == 0) && (addr >= heap_end)
+                 && (addr <= USER_MMAP_TOP) && (USER_MMAP_TOP - addr >= size)
+                 && process_vm_range_free(proc, addr, addr + size)))
+    {
+        addr = vma_find_free(proc, size);
+        return_dbg_if(!addr, ENOMEM, "%s: no room for 0x%x bytes\n", __func__, size);
+    }
+
+    vm_area_t *vma = kmalloc(sizeof(vm_area_t));
+    return_err_if(!vma, ENOMEM, "%s: kmalloc failed", __func__);
+
+    vma->va_start = addr;
+    vma->va_end = addr + size;
+    vma->va_prot = prot;
+    vma->va_flags = flags & (MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS);
+    vma->va_file = (file ? file_get(file) : NULL);
+    vma->va_pgoff = offset / PAGE_BYTES;
+    vma_insert(proc, vma);
+
+    logmsgdf("%s: [*%x, *%x) prot=%x flags=%x\n", __func__,
+            vma->va_start, vma->va_end, prot, flags);
+    *result = addr;
+    return 0;
+}
+
+int process_munmap(process_t *proc, uintptr_t addr, size_t len) {
+    return_dbg_if((addr % PAGE_BYTES) || !len, EINVAL,
+            "%s(*%x, %d): EINVAL\n", __func__, addr, len);
+
+    uintptr_t start = addr;
+    uintptr_t end = addr + pagealign_up(len);
+    return_dbg_if((end <= start) || (end > KERN_OFF), EINVAL,
+            "%s(*%x, %d): out of range\n", __func__, addr, len);
+
+    vm_area_t **link = &proc->ps_vmas;
+    while (*link) {
+        vm_area_t *vma = *link;
+        if (vma->va_end <= start) {
+            link = &vma->va_next;
+            continue;
+        }
+        if (vma->va_start >= end)
+            break;
+
+        if ((vma->va_start < start) && (end < vma->va_end)) {
+            /* a hole in the middle: the tail becomes a vm_area of its own */
+            vm_area_t *tail = kmalloc(sizeof(vm_area_t));
+            return_err_if(!tail, ENOMEM, "%s: kmalloc failed", __func__);
+
+            *tail = *vma;
+            tail->va_start = end;
+            tail->va_pgoff = vma_index(vma, end);
+            if (tail->va_file)
+                file_get(tail->va_file);
+
+            vma->va_end = end;
+            vma->va_next = tail;
+        }
+
+        uintptr_t from = (start > vma->va_start ? start : vma->va_start);
+        uintptr_t to = (end < vma->va_end ? end : vma->va_end);
+        uintptr_t vaddr;
+        for (vaddr = from; vaddr < to; vaddr += PAGE_BYTES)
+            vma_release_page(proc, vma, vaddr);
+
+        if ((from == vma->va_start) && (to == vma->va_end)) {
+            *link = vma->va_next;
+            vma_free(vma);
+            continue;
+        }
+
+        if (from == vma->va_start) {
+            vma->va_pgoff = vma_index(vma, to);
+            vma->va_start = to;
+        } else {
+            vma->va_end = from;
+        }
+        link = &vma->va_next;
+    }
+    return 0;
+}
+
+int process_msync(process_t *proc, uintptr_t addr, size_t len, int flags) {
+    int ret = 0;
+    return_dbg_if((addr % PAGE_BYTES) || ((flags & MS_SYNC) && (flags & MS_ASYNC)),
+            EINVAL, "%s(*%x, flags=%x): EINVAL\n", __func__, addr, flags);
+
+    uintptr_t start = addr;
+    uintptr_t end = addr + pagealign_up(len);
+    return_dbg_if((end < start) || (end > KERN_OFF), ENOMEM,
+            "%s(*%x, %d): out of range\n", __func__, addr, len);
+
+    uintptr_t covered = start;
+    vm_area_t *vma;
+    for (vma = proc->ps_vmas; vma && (vma->va_start < end); vma = vma->va_next) {
+        if (vma->va_end <= start)
+            continue;
+        if (vma->va_start > covered)
+            ret = ENOMEM;   /* POSIX: the range has unmapped pages */
+        covered = vma->va_end;
+
+        if (!(vma_shares_file(vma) && (vma->va_flags & MAP_SHARED)))
+            continue;
+
+        struct inode *idata = vma->va_file->f_inode;
+        uintptr_t from = (start > vma->va_start ? start : vma->va_start);
+        uintptr_t to = (end < vma->va_end ? end : vma->va_end);
+        uintptr_t vaddr;
+        for (vaddr = from; vaddr < to; vaddr += PAGE_BYTES) {
+            pte_t *pte = pagedir_lookup(vma_pagedir(proc), (void *)vaddr);
+            if (!(pte && pte->bit.present && pte->bit.dirty))
+                continue;
+
+            pte->bit.dirty = false;
+            i386_invlpg((void *)vaddr);
+            vfs_inode_dirty_page(idata, vma_index(vma, vaddr));
+        }
+
+        if (flags & MS_SYNC) {
+            int err = vfs_inode_sync_pages(idata);
+            if (err) ret = err;
+        }
+    }
+    if (covered < end)
+        ret = ENOMEM;
+    return ret;
+}
+
+int process_vm_fault(process_t *proc, uintptr_t addr, err_t err) {
+    int ret;
+    vm_area_t *vma = process_find_vma(proc, addr);
+    if (!vma)
+        return ENOENT;
+
+    /* there is no copy-on-write, a fault on a present page is a violation */
+    return_dbg_if(err & PF_PRESENT, EACCES, "%s(*%x): err=%x\n", __func__, addr, err);
+    return_dbg_if(!(vma->va_prot & (PROT_READ | PROT_WRITE | PROT_EXEC)), EACCES,
+            "%s(*%x): PROT_NONE\n", __func__, addr);
+    return_dbg_if((err & PF_WRITE) && !(vma->va_prot & PROT_WRITE), EACCES,
+            "%s(*%x): not writable\n", __func__, addr);
+
+    void *vaddr = (void *)pagealign_down(addr);
+    uint32_t mask = PTE_USER | ((vma->va_prot & PROT_WRITE) ? PTE_WRITABLE : 0);
+
+    if (!vma->va_file) {
+        char *frame = vma_frame_alloc();
+        return_err_if(!frame, ENOMEM, "%s: no memory", __func__);
+
+        ret = pagedir_map(vma_pagedir(proc), vaddr, __pa(frame), mask);
+        if (ret) vma_frame_free(frame);
+        return ret;
+    }
+
+    struct inode *idata = vma->va_file->f_inode;
+    index_t index = vma_index(vma, (uintptr_t)vaddr);
+    if (!idata->i_size || (index > (index_t)(idata->i_size - 1) / PAGE_BYTES))
+        return ENXIO;
+
+    char *page;
+    void *cookie;
+    if (vma_shares_file(vma)) {
+        /* a shared hole gets its own page, so that all mappings see writes */
+        bool create = vma->va_flags & MAP_SHARED;
+        ret = vfs_inode_map_page(idata, index, create, &page, &cookie);
+        if (ret) return ret;
+
+        /* the pin stays until vma_release_page() */
+        ret = pagedir_map(vma_pagedir(proc), vaddr, __pa(page), mask);
+        if (ret) vfs_inode_unmap_page(cookie);
+        return ret;
+    }
+
+    char *frame = vma_frame_alloc();
+    return_err_if(!frame, ENOMEM, "%s: no memory", __func__);
+
+    ret = vfs_inode_map_page(idata, index, false, &page, &cookie);
+    if (ret) goto free_frame;
+
+    size_t avail = PAGE_BYTES;
+    if ((off_t)(idata->i_size - index * PAGE_BYTES) < PAGE_BYTES)
+        avail = idata->i_size - index * PAGE_BYTES;
+    memcpy(frame, page, avail);
+    vfs_inode_unmap_page(cookie);
+
+    ret = pagedir_map(vma_pagedir(proc), vaddr, __pa(frame), mask);
+    if (ret) goto free_frame;
+    return 0;
+
+free_frame:
+    vma_frame_free(frame);
+    return ret;
+}
+
+
+/*
+ *  Syscalls
+ */
+
+intptr_t sys_mmap(const struct mmap_args *args) {
+    logmsgdf("%s(*%x, %d, %x, %x, %d, %d)\n", __func__, args->addr,
+            args->length, args->prot, args->flags, args->fd, args->offset);
+    process_t *proc = current_proc();
+    file_t *file = NULL;
+
+    if (!(args->flags & MAP_ANONYMOUS)) {
+        filedescr *filedes = get_filedescr_for_pid(proc->ps_pid, args->fd);
+        return_dbg_if(!filedes, -EBADF, "%s(fd=%d): EBADF\n", __func__, args->fd);
+        file = filedes->fd_file;
+    }
+
+    uintptr_t addr = 0;
+    int ret = process_mmap(proc, args->addr, args->length, args->prot,
+                           args->flags, file, args->offset, &addr);
+    if (ret) return -ret;
+    return (intptr_t)addr;
+}
+
+int sys_munmap(void *addr, size_t length) {
+    logmsgdf("%s(*%x, %d)\n", __func__, addr, length);
+    return -process_munmap(current_proc(), (uintptr_t)addr, length);
+}
+
+int sys_msync(void *addr, size_t length, int flags) {
+    logmsgdf("%s(*%x, %d, %x)\n", __func__, addr, length, flags);
+    return -process_msync(current_proc(), (uintptr_t)addr, length, flags);
+}
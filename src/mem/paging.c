@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <string.h>
+#include <sys/errno.h>
 
 #define __DEBUG
 #include <cosec/log.h>
@@ -8,7 +9,9 @@
 #include "arch/mboot.h"
 #include "mem/pmem.h"
 #include "mem/paging.h"
+#include "mem/mmap.h"
 #include "process.h"
+#include "signals.h"
 #include "tasks.h"
 
 
@@ -22,21 +25,37 @@ void pg_fault(uint32_t *context, err_t err) {
     uint32_t eip = context[1];
     uint32_t cs = context[2];
 
-    process_t *proc = (process_t *)task_current();
+    int sig = SIGSEGV;
+    process_t *proc = task_process(task_current());
+    if (proc)
+        ++proc->ps_nfaults;
+
+    /* mmap()'ed pages, also when the kernel touches them in a syscall */
+    if (proc && (proc->ps_task.tss.cs != SEL_KERN_CS) && (fault_addr < KERN_OFF)) {
+        int ret = process_vm_fault(proc, fault_addr, fault_error);
+        if (!ret)
+            return;
+        if (ret == ENXIO)
+            sig = SIGBUS;
+    }
+
     if (proc && fault_error == 6
-        && ((uintptr_t)(proc->ps_userstack - 10 * PAGE_BYTES) <= fault_addr)
+        && ((uintptr_t)(proc->ps_userstack - USER_STACK_GROW_MAX) <= fault_addr)
         && (fault_addr < (uintptr_t)proc->ps_userstack))
     {
         logmsgf("%s: err=0x%x from %x:%x accessing *%x, grow stack for pid=%d\n",
                  __func__, fault_error, cs, eip, fault_addr, proc->ps_pid);
-        process_grow_stack(proc, (void*)fault_addr);
-        return; // TODO: send SIGSEGV if failed to grow
+        if (process_grow_stack(proc, (void*)fault_addr) == 0)
+            return;
     }
 
     logmsgef("%s: err=0x%x from %x:%x accessing *%x\n",
              __func__, fault_error, cs, eip, fault_addr);
 
-    // TODO: send SIGSEGV to the current process
+    if (cs == SEL_USER_CS) {
+        signal_fault(sig, context + 1);
+        return;
+    }
     cpu_hang();
 }
 
@@ -114,14 +133,10 @@ void pagedir_free(pde_t *pagedir) {
 }
 
 /*
- * allocates a pageframe,
- * adds it to the page directory at vaddr
- * returns its physical address
+ * returns the page table entry for vaddr,
+ * allocates a page table if there is none
  */
-void* pagedir_get_or_new(pde_t *pagedir, void *vaddr, uint32_t pte_mask) {
-    assert((uintptr_t)vaddr < KERN_OFF, NULL,
-            "%s: cannot allocate kernel memory at *%x", __func__, vaddr);
-
+static pte_t * pagedir_pte(pde_t *pagedir, void *vaddr) {
     const uint32_t pte_index = ((uint32_t)vaddr >> PTE_SHIFT) & 0x3ff;
     const uint32_t pde_index = (uint32_t)vaddr >> PDE_SHIFT;
     //logmsgdf("%s(*%x): pde=0x%x, pte=0x%x\n", __func__, vaddr, pde_index, pte_index);
@@ -154,7 +169,22 @@ void* pagedir_get_or_new(pde_t *pagedir, void *vaddr, uint32_t pte_mask) {
         vpde[pde_index] = pde;
     }
 
-    pte_t pte = vpte[pte_index];
+    return vpte + pte_index;
+}
+
+/*
+ * allocates a pageframe,
+ * adds it to the page directory at vaddr
+ * returns its physical address
+ */
+void* pagedir_get_or_new(pde_t *pagedir, void *vaddr, uint32_t pte_mask) {
+    assert((uintptr_t)vaddr < KERN_OFF, NULL,
+            "%s: cannot allocate kernel memory at *%x", __func__, vaddr);
+
+    pte_t *vpte = pagedir_pte(pagedir, vaddr);
+    if (!vpte) return NULL;
+
+    pte_t pte = *vpte;
     if (!pte.word) {
         void *page = pmem_alloc(1);
         assert(page, NULL, "%s: cannot allocate a page", __func__);
@@ -165,8 +195,90 @@ void* pagedir_get_or_new(pde_t *pagedir, void *vaddr, uint32_t pte_mask) {
         pte.bit.user = 1;
         pte.bit.index = (uint32_t)page >> 12;
 
-        vpte[pte_index] = pte;
+        *vpte = pte;
     }
 
     return (void *)(pte.word & 0xFFFFF000);
 }
+
+/*
+ * maps an existing pageframe at vaddr, e.g. a page shared by all processes
+ */
+int pagedir_map(pde_t *pagedir, void *vaddr, void *paddr, uint32_t pte_mask) {
+    assert((uintptr_t)vaddr < KERN_OFF, EINVAL,
+            "%s: cannot map kernel memory at *%x", __func__, vaddr);
+
+    pte_t *vpte = pagedir_pte(pagedir, vaddr);
+    if (!vpte) return ENOMEM;
+
+    pte_t pte;
+    pte.word = pte_mask;
+    pte.bit.present = 1;
+    pte.bit.index = (uint32_t)paddr >> 12;
+
+    *vpte = pte;
+    i386_invlpg(vaddr);
+    return 0;
+}
+
+/*
+ * maps device memory [paddr, paddr + len) uncached at the same address
+ * in the kernel space, returns it or NULL
+ */
+void * iomem_map(uintptr_t paddr, size_t len) {
+    uintptr_t p = pagealign_down(paddr);
+    uintptr_t end = pagealign_up(paddr + len);
+    assert(p >= KERN_OFF, NULL, "%s: @%x is below the kernel space", __func__, paddr);
+
+    for (; p < end; p += PAGE_BYTES) {
+        pde_t pde = thePageDirectory[p >> PDE_SHIFT];
+        assert(!(pde.bit.present && pde.bit.hugepage), NULL,
+               "%s: @%x is taken by kernel memory", __func__, p);
+
+        pte_t *vpte = pagedir_pte(__pa(thePageDirectory), (void *)p);
+        if (!vpte) return NULL;
+
+        pte_t pte = { .word = PTE_WRITABLE };
+        pte.bit.present = 1;
+        pte.bit.writethrough = 1;
+        pte.bit.dontcache = 1;
+        pte.bit.index = p >> PTE_SHIFT;
+
+        *vpte = pte;
+        i386_invlpg((void *)p);
+    }
+    return (void *)paddr;
+}
+
+/*
+ * returns the page table entry for vaddr or NULL if there is no page table
+ */
+pte_t * pagedir_lookup(pde_t *pagedir, void *vaddr) {
+    const uint32_t pte_index = ((uint32_t)vaddr >> PTE_SHIFT) & 0x3ff;
+    const uint32_t pde_index = (uint32_t)vaddr >> PDE_SHIFT;
+
+    pde_t *vpde = __va(pagedir);
+    pde_t pde = vpde[pde_index];
+    if (!pde.bit.present || pde.bit.hugepage)
+        return NULL;
+
+    pte_t *vpte = __va((void *)(pde.bit.index << PTE_SHIFT));
+    return vpte + pte_index;
+}
+
+/*
+ * removes the mapping at vaddr, returns the old entry;
+ * the pageframe is not freed, it is up to the caller
+ */
+pte_t pagedir_unmap(pde_t *pagedir, void *vaddr) {
+    pte_t pte = { .word = 0 };
+    pte_t *vpte = pagedir_lookup(pagedir, vaddr);
+    if (!vpte) return pte;
+
+    pte = *vpte;
+    if (pte.word) {
+        vpte->word = 0;
+        i386_invlpg(vaddr);
+    }
+    return pte;
+}